@@ -4,6 +4,7 @@ $(BUILD_DIR_ZIP)/chuni.zip:
 	$(V)mkdir -p $(BUILD_DIR_ZIP)/chuni/DEVICE
 	$(V)cp $(BUILD_DIR_32)/subprojects/capnhook/inject/inject.exe \
 		$(BUILD_DIR_32)/chunihook/chunihook.dll \
+		$(BUILD_DIR_32)/platform/vfspack-pack.exe \
 		$(DIST_DIR)/chuni/segatools.ini \
 		$(DIST_DIR)/chuni/start.bat \
 		$(BUILD_DIR_ZIP)/chuni
@@ -19,6 +20,7 @@ $(BUILD_DIR_ZIP)/idz.zip:
 	$(V)mkdir -p $(BUILD_DIR_ZIP)/idz/DEVICE
 	$(V)cp $(BUILD_DIR_64)/subprojects/capnhook/inject/inject.exe \
 		$(BUILD_DIR_64)/idzhook/idzhook.dll \
+		$(BUILD_DIR_64)/platform/vfspack-pack.exe \
 		$(DIST_DIR)/idz/segatools.ini \
 		$(DIST_DIR)/idz/start.bat \
     	$(BUILD_DIR_ZIP)/idz
@@ -12,6 +12,7 @@
 
 #include "util/crc.h"
 #include "util/dprintf.h"
+#include "util/ini.h"
 
 struct aime_io_config {
     wchar_t aime_path[MAX_PATH];
@@ -47,7 +48,7 @@ static void aime_io_config_read(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"aime",
             L"aimePath",
             L"DEVICE\\aime.txt",
@@ -55,7 +56,7 @@ static void aime_io_config_read(
             _countof(cfg->aime_path),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"aime",
             L"felicaPath",
             L"DEVICE\\felica.txt",
@@ -63,13 +64,13 @@ static void aime_io_config_read(
             _countof(cfg->felica_path),
             filename);
 
-    cfg->felica_gen = GetPrivateProfileIntW(
+    cfg->felica_gen = ini_get_int(
             L"aime",
             L"felicaGen",
             1,
             filename);
 
-    cfg->vk_scan = GetPrivateProfileIntW(
+    cfg->vk_scan = ini_get_int(
             L"aime",
             L"scan",
             VK_RETURN,
@@ -14,15 +14,17 @@
 #include "amex/jvs.h"
 #include "amex/sram.h"
 
+#include "util/ini.h"
+
 void ds_config_load(struct ds_config *cfg, const wchar_t *filename)
 {
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"ds", L"enable", 1, filename);
-    cfg->region = GetPrivateProfileIntW(L"ds", L"region", 1, filename);
+    cfg->enable = ini_get_int(L"ds", L"enable", 1, filename);
+    cfg->region = ini_get_int(L"ds", L"region", 1, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"ds",
             L"serialNo",
             L"AAVE-01A99999999",
@@ -36,9 +38,9 @@ void eeprom_config_load(struct eeprom_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"eeprom", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"eeprom", L"enable", 1, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"eeprom",
             L"path",
             L"DEVICE\\eeprom.bin",
@@ -55,15 +57,15 @@ void gpio_config_load(struct gpio_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"gpio", L"enable", 1, filename);
-    cfg->vk_sw1 = GetPrivateProfileIntW(L"gpio", L"sw1", VK_F1, filename);
-    cfg->vk_sw2 = GetPrivateProfileIntW(L"gpio", L"sw2", VK_F2, filename);
+    cfg->enable = ini_get_int(L"gpio", L"enable", 1, filename);
+    cfg->vk_sw1 = ini_get_int(L"gpio", L"sw1", VK_F1, filename);
+    cfg->vk_sw2 = ini_get_int(L"gpio", L"sw2", VK_F2, filename);
 
     wcscpy_s(name, _countof(name), L"dipsw0");
 
     for (i = 0 ; i < 8 ; i++) {
         name[5] = L'1' + i;
-        cfg->dipsw[i] = GetPrivateProfileIntW(L"gpio", name, 0, filename);
+        cfg->dipsw[i] = ini_get_int(L"gpio", name, 0, filename);
     }
 }
 
@@ -72,7 +74,7 @@ void jvs_config_load(struct jvs_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"jvs", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"jvs", L"enable", 1, filename);
 }
 
 void sram_config_load(struct sram_config *cfg, const wchar_t *filename)
@@ -80,9 +82,9 @@ void sram_config_load(struct sram_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"sram", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"sram", L"enable", 1, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"sram",
             L"path",
             L"DEVICE\\sram.bin",
@@ -192,23 +192,25 @@ static HRESULT ds_ioctl_setup(struct irp *irp)
 
 static HRESULT ds_ioctl_read_sector(struct irp *irp)
 {
-    struct const_iobuf src;
     uint32_t sector_no;
+    size_t nbytes;
     HRESULT hr;
 
+    /* Every sector reads back the same image, which was built at init. This
+       gets polled, so don't log anything here. A short buffer gets as much
+       of the image as fits. */
+
     hr = iobuf_read_le32(&irp->write, &sector_no);
 
     if (FAILED(hr)) {
         return hr;
     }
 
-    dprintf("DS: Read sector %08x\n", sector_no);
-
-    src.bytes = (const uint8_t *) &ds_eeprom;
-    src.nbytes = sizeof(ds_eeprom);
-    src.pos = 0;
+    nbytes = irp->read.nbytes - irp->read.pos;
 
-    iobuf_move(&irp->read, &src);
+    if (nbytes > sizeof(ds_eeprom)) {
+        nbytes = sizeof(ds_eeprom);
+    }
 
-    return S_OK;
+    return iobuf_write(&irp->read, &ds_eeprom, nbytes);
 }
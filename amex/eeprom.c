@@ -30,12 +30,14 @@ static HRESULT eeprom_handle_close(struct irp *irp);
 static HRESULT eeprom_handle_ioctl(struct irp *irp);
 static HRESULT eeprom_handle_read(struct irp *irp);
 static HRESULT eeprom_handle_write(struct irp *irp);
+static HRESULT eeprom_handle_seek(struct irp *irp);
+static HRESULT eeprom_handle_fsync(struct irp *irp);
 
 static HRESULT eeprom_ioctl_get_geometry(struct irp *irp);
 static HRESULT eeprom_ioctl_get_abi_version(struct irp *irp);
 
 static struct eeprom_config eeprom_config;
-static HANDLE eeprom_file;
+static struct nvram eeprom_nvram;
 
 HRESULT eeprom_hook_init(const struct eeprom_config *cfg)
 {
@@ -48,6 +50,7 @@ HRESULT eeprom_hook_init(const struct eeprom_config *cfg)
     }
 
     memcpy(&eeprom_config, cfg, sizeof(*cfg));
+    nvram_init(&eeprom_nvram, "EEPROM");
 
     hr = iohook_push_handler(eeprom_handle_irp);
 
@@ -68,7 +71,7 @@ static HRESULT eeprom_handle_irp(struct irp *irp)
 {
     assert(irp != NULL);
 
-    if (irp->op != IRP_OP_OPEN && irp->fd != eeprom_file) {
+    if (irp->op != IRP_OP_OPEN && irp->fd != eeprom_nvram.fd) {
         return iohook_invoke_next(irp);
     }
 
@@ -78,6 +81,8 @@ static HRESULT eeprom_handle_irp(struct irp *irp)
     case IRP_OP_IOCTL:  return eeprom_handle_ioctl(irp);
     case IRP_OP_READ:   return eeprom_handle_read(irp);
     case IRP_OP_WRITE:  return eeprom_handle_write(irp);
+    case IRP_OP_SEEK:   return eeprom_handle_seek(irp);
+    case IRP_OP_FSYNC:  return eeprom_handle_fsync(irp);
     default:            return iohook_invoke_next(irp);
     }
 }
@@ -90,20 +95,20 @@ static HRESULT eeprom_handle_open(struct irp *irp)
         return iohook_invoke_next(irp);
     }
 
-    if (eeprom_file != NULL) {
+    if (eeprom_nvram.open) {
         dprintf("EEPROM: Already open\n");
 
         return HRESULT_FROM_WIN32(ERROR_SHARING_VIOLATION);
     }
 
     dprintf("EEPROM: Open device\n");
-    hr = nvram_open_file(&eeprom_file, eeprom_config.path, 0x2000);
+    hr = nvram_open(&eeprom_nvram, eeprom_config.path, 0x2000);
 
     if (FAILED(hr)) {
         return hr;
     }
 
-    irp->fd = eeprom_file;
+    irp->fd = eeprom_nvram.fd;
 
     return S_OK;
 }
@@ -111,9 +116,10 @@ static HRESULT eeprom_handle_open(struct irp *irp)
 static HRESULT eeprom_handle_close(struct irp *irp)
 {
     dprintf("EEPROM: Close device\n");
-    eeprom_file = NULL;
 
-    return iohook_invoke_next(irp);
+    /* Our NUL fd gets reused if the device is opened again */
+
+    return nvram_close(&eeprom_nvram);
 }
 
 static HRESULT eeprom_handle_ioctl(struct irp *irp)
@@ -165,30 +171,32 @@ static HRESULT eeprom_ioctl_get_abi_version(struct irp *irp)
 
 static HRESULT eeprom_handle_read(struct irp *irp)
 {
-    if (irp->ovl == NULL) {
-        dprintf("EEPROM: Synchronous read..?\n");
-
-        return E_UNEXPECTED;
+    if (irp->ovl != NULL) {
+        dprintf("EEPROM: Read off %x len %x\n",
+                (int) irp->ovl->Offset,
+                (int) irp->read.nbytes);
     }
 
-    dprintf("EEPROM: Read off %x len %x\n",
-            (int) irp->ovl->Offset,
-            (int) irp->read.nbytes);
-
-    return iohook_invoke_next(irp);
+    return nvram_handle_read(&eeprom_nvram, irp);
 }
 
 static HRESULT eeprom_handle_write(struct irp *irp)
 {
-    if (irp->ovl == NULL) {
-        dprintf("EEPROM: Synchronous write..?\n");
-
-        return E_UNEXPECTED;
+    if (irp->ovl != NULL) {
+        dprintf("EEPROM: Write off %x len %x\n",
+                (int) irp->ovl->Offset,
+                (int) irp->write.nbytes);
     }
 
-    dprintf("EEPROM: Write off %x len %x\n",
-            (int) irp->ovl->Offset,
-            (int) irp->write.nbytes);
+    return nvram_handle_write(&eeprom_nvram, irp);
+}
 
-    return iohook_invoke_next(irp);
+static HRESULT eeprom_handle_seek(struct irp *irp)
+{
+    return nvram_handle_seek(&eeprom_nvram, irp);
+}
+
+static HRESULT eeprom_handle_fsync(struct irp *irp)
+{
+    return nvram_flush(&eeprom_nvram);
 }
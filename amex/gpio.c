@@ -2,6 +2,8 @@
 #include <ntstatus.h>
 
 #include <assert.h>
+#include <process.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "amex/gpio.h"
@@ -56,6 +58,10 @@ static HRESULT gpio_ioctl_get_dipsw(struct irp *irp);
 static HRESULT gpio_ioctl_describe(struct irp *irp);
 static HRESULT gpio_ioctl_set_leds(struct irp *irp);
 
+static uint32_t gpio_sample_psw(void);
+static unsigned int __stdcall gpio_sampler_proc(void *ctx);
+static void gpio_sampler_shutdown(void);
+
 static const struct gpio_ports gpio_ports = {
     .ports = {
         {
@@ -75,10 +81,16 @@ static_assert(sizeof(gpio_ports) == 129, "GPIO port map size");
 
 static HANDLE gpio_fd;
 static struct gpio_config gpio_config;
+static uint32_t gpio_dipsw;
+static volatile LONG gpio_psw;
+static volatile LONG gpio_psw_latch;
+static HANDLE gpio_sampler;
+static HANDLE gpio_sampler_stop;
 
 HRESULT gpio_hook_init(const struct gpio_config *cfg)
 {
     HRESULT hr;
+    size_t i;
 
     assert(cfg != NULL);
 
@@ -88,6 +100,16 @@ HRESULT gpio_hook_init(const struct gpio_config *cfg)
 
     memcpy(&gpio_config, cfg, sizeof(*cfg));
 
+    gpio_dipsw = 0;
+
+    for (i = 0 ; i < 8 ; i++) {
+        if (gpio_config.dipsw[i]) {
+            gpio_dipsw |= 1 << i;
+        }
+    }
+
+    dprintf("GPIO: DIP switches %08x\n", gpio_dipsw);
+
     hr = iohook_open_nul_fd(&gpio_fd);
 
     if (FAILED(hr)) {
@@ -106,9 +128,92 @@ HRESULT gpio_hook_init(const struct gpio_config *cfg)
         return hr;
     }
 
+    InterlockedExchange(&gpio_psw, gpio_sample_psw());
+
+    gpio_sampler_stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    if (gpio_sampler_stop != NULL) {
+        gpio_sampler = (HANDLE) _beginthreadex(
+                NULL,
+                0,
+                gpio_sampler_proc,
+                NULL,
+                0,
+                NULL);
+    }
+
+    if (gpio_sampler == NULL) {
+        /* Not fatal, the PSW ioctl samples the keys itself instead */
+        dprintf("GPIO: Failed to start PSW sampler thread\n");
+
+        if (gpio_sampler_stop != NULL) {
+            CloseHandle(gpio_sampler_stop);
+            gpio_sampler_stop = NULL;
+        }
+    } else {
+        atexit(gpio_sampler_shutdown);
+    }
+
     return S_OK;
 }
 
+static uint32_t gpio_sample_psw(void)
+{
+    uint32_t result;
+
+    result = 0;
+
+    /* Bit 0 == SW1 == Alt. Test */
+    /* Bit 1 == SW2 == Alt. Service */
+
+    if (GetAsyncKeyState(gpio_config.vk_sw1) & 0x8000) {
+        result |= 1 << 0;
+    }
+
+    if (GetAsyncKeyState(gpio_config.vk_sw2) & 0x8000) {
+        result |= 1 << 1;
+    }
+
+    return result;
+}
+
+static unsigned int __stdcall gpio_sampler_proc(void *ctx)
+{
+    uint32_t psw;
+
+    /* Besides the current state, remember every switch that was seen down
+       since the last poll, so that a press shorter than amdaemon's polling
+       interval still gets reported once. */
+
+    while (WaitForSingleObject(
+            gpio_sampler_stop,
+            GPIO_PSW_SAMPLE_INTERVAL_MS) == WAIT_TIMEOUT) {
+        psw = gpio_sample_psw();
+        InterlockedExchange(&gpio_psw, psw);
+        InterlockedOr(&gpio_psw_latch, psw);
+    }
+
+    return 0;
+}
+
+static void gpio_sampler_shutdown(void)
+{
+    HANDLE sampler;
+
+    sampler = gpio_sampler;
+    gpio_sampler = NULL;
+
+    /* If the process is already tearing down its threads then the wait
+       returns straight away. */
+
+    SetEvent(gpio_sampler_stop);
+    WaitForSingleObject(sampler, INFINITE);
+
+    CloseHandle(sampler);
+    CloseHandle(gpio_sampler_stop);
+    gpio_sampler_stop = NULL;
+}
+
 static HRESULT gpio_handle_irp(struct irp *irp)
 {
     assert(irp != NULL);
@@ -171,48 +276,27 @@ static HRESULT gpio_handle_ioctl(struct irp *irp)
 
 static HRESULT gpio_ioctl_get_dipsw(struct irp *irp)
 {
-    uint32_t dipsw;
-    size_t i;
-
-    dipsw = 0;
-
-    for (i = 0 ; i < 8 ; i++) {
-        if (gpio_config.dipsw[i]) {
-            dipsw |= 1 << i;
-        }
-    }
-
-    //dprintf("GPIO: Get dipsw %08x\n", dipsw);
-
-    return iobuf_write_le32(&irp->read, dipsw);
+    return iobuf_write_le32(&irp->read, gpio_dipsw);
 }
 
 static HRESULT gpio_ioctl_get_psw(struct irp *irp)
 {
-    uint32_t result;
+    uint32_t psw;
 
-    result = 0;
-
-    /* Bit 0 == SW1 == Alt. Test */
-    /* Bit 1 == SW2 == Alt. Service */
-
-    if (GetAsyncKeyState(gpio_config.vk_sw1) & 0x8000) {
-        result |= 1 << 0;
-    }
-
-    if (GetAsyncKeyState(gpio_config.vk_sw2) & 0x8000) {
-        result |= 1 << 1;
+    if (gpio_sampler != NULL) {
+        psw = (uint32_t) gpio_psw;
+        psw |= (uint32_t) InterlockedExchange(&gpio_psw_latch, 0);
+    } else {
+        psw = gpio_sample_psw();
     }
 
-    return iobuf_write_le32(&irp->read, result);
+    return iobuf_write_le32(&irp->read, psw);
 }
 
 static HRESULT gpio_ioctl_describe(struct irp *irp)
 {
     HRESULT hr;
 
-    dprintf("GPIO: Describe GPIO ports\n");
-
     hr = iobuf_write(&irp->read, &gpio_ports, sizeof(gpio_ports));
 
     if (FAILED(hr)) {
@@ -5,6 +5,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/* amdaemon polls the GPIO device continuously, so every ioctl it polls is
+   answered from memory. The DIP switch word is fixed at init and the push
+   switches are read from a snapshot that a background thread refreshes every
+   GPIO_PSW_SAMPLE_INTERVAL_MS, rather than calling GetAsyncKeyState for each
+   request. Presses are latched until the next poll, so short ones are not
+   missed. The thread is stopped at exit. */
+
+#define GPIO_PSW_SAMPLE_INTERVAL_MS 10
+
 struct gpio_config {
     bool enable;
     uint8_t vk_sw1;
@@ -0,0 +1,360 @@
+/* Standalone check that NVRAM journal replay is crash safe.
+
+   Builds up a journal one flush at a time, remembering the device image and
+   the journal length after each flush. Then for every byte offset into the
+   journal it restores the original image, truncates the journal at that
+   offset and loads the device again: replay has to give back exactly the
+   image as of the last flush that fits in the truncated journal.
+
+   This includes nvram.c itself to get at nvram_load() and nvram_unload(),
+   which load a device without starting the flush thread. */
+
+#include "amex/nvram.c"
+
+#include <stdio.h>
+
+enum {
+    TEST_NBYTES = 4096,
+    TEST_NFLUSHES = 20,
+    TEST_MAX_WRITE = 32,
+};
+
+static HRESULT test_build(
+        uint8_t **image,
+        size_t *image_size,
+        uint8_t **journal,
+        size_t *journal_size);
+static HRESULT test_write(
+        struct nvram *nv,
+        uint32_t offset,
+        const uint8_t *bytes,
+        size_t nbytes);
+static HRESULT test_check(
+        const uint8_t *image,
+        size_t image_size,
+        const uint8_t *journal,
+        size_t journal_size);
+static HRESULT test_read_file(const wchar_t *path, uint8_t **out, size_t *n);
+static HRESULT test_write_file(
+        const wchar_t *path,
+        const uint8_t *bytes,
+        size_t nbytes);
+static uint32_t test_rand(void);
+static void test_cleanup(void);
+
+static const wchar_t test_path[] = L"nvram-test.bin";
+static const wchar_t test_journal_path[] = L"nvram-test.bin.journal";
+static const wchar_t test_tmp_path[] = L"nvram-test.bin.tmp";
+
+static uint8_t test_states[TEST_NFLUSHES + 1][TEST_NBYTES];
+static uint64_t test_ends[TEST_NFLUSHES + 1];
+static uint32_t test_seed = 1;
+
+int main(void)
+{
+    uint8_t *journal;
+    uint8_t *image;
+    size_t journal_size;
+    size_t image_size;
+    HRESULT hr;
+
+    journal = NULL;
+    image = NULL;
+
+    test_cleanup();
+
+    hr = test_build(&image, &image_size, &journal, &journal_size);
+
+    if (FAILED(hr)) {
+        fprintf(stderr, "nvram-test: Building the journal failed: %x\n",
+                (int) hr);
+
+        goto end;
+    }
+
+    hr = test_check(image, image_size, journal, journal_size);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    printf("nvram-test: %u truncations of a %u byte journal replayed OK\n",
+            (unsigned int) journal_size + 1,
+            (unsigned int) journal_size);
+
+end:
+    test_cleanup();
+    free(journal);
+    free(image);
+
+    return FAILED(hr) ? 1 : 0;
+}
+
+static HRESULT test_build(
+        uint8_t **image,
+        size_t *image_size,
+        uint8_t **journal,
+        size_t *journal_size)
+{
+    uint8_t bytes[TEST_MAX_WRITE];
+    struct nvram nv;
+    uint32_t offset;
+    size_t nbytes;
+    size_t i;
+    size_t j;
+    size_t k;
+    HRESULT hr;
+
+    nvram_init(&nv, "nvram-test");
+    hr = nvram_load(&nv, test_path, TEST_NBYTES);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* Loading a missing device creates an empty image and a journal that
+       holds just its header, which is the state replay has to fall back to
+       when even the header is torn. */
+
+    hr = test_read_file(test_path, image, image_size);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    memcpy(test_states[0], nv.bytes, TEST_NBYTES);
+    test_ends[0] = nv.journal_size;
+
+    for (i = 1 ; i <= TEST_NFLUSHES ; i++) {
+        /* Later flushes sometimes hold several records */
+
+        for (j = 0 ; j <= i % 3 ; j++) {
+            nbytes = 1 + test_rand() % TEST_MAX_WRITE;
+            offset = test_rand() % (TEST_NBYTES - nbytes + 1);
+
+            for (k = 0 ; k < nbytes ; k++) {
+                bytes[k] = (uint8_t) test_rand();
+            }
+
+            hr = test_write(&nv, offset, bytes, nbytes);
+
+            if (FAILED(hr)) {
+                goto end;
+            }
+        }
+
+        hr = nvram_flush(&nv);
+
+        if (FAILED(hr)) {
+            goto end;
+        }
+
+        /* A checkpoint would start the journal over */
+
+        if (    nv.journal_size <= test_ends[i - 1] ||
+                nv.journal_size >= nv.nbytes) {
+            fprintf(stderr, "nvram-test: Unexpected checkpoint\n");
+            hr = E_UNEXPECTED;
+
+            goto end;
+        }
+
+        memcpy(test_states[i], nv.bytes, TEST_NBYTES);
+        test_ends[i] = nv.journal_size;
+    }
+
+    hr = test_read_file(test_journal_path, journal, journal_size);
+
+end:
+    nvram_unload(&nv);
+
+    return hr;
+}
+
+static HRESULT test_write(
+        struct nvram *nv,
+        uint32_t offset,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    struct irp irp;
+    HRESULT hr;
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_SEEK;
+    irp.seek_origin = FILE_BEGIN;
+    irp.seek_offset = offset;
+
+    hr = nvram_handle_seek(nv, &irp);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    memset(&irp, 0, sizeof(irp));
+    irp.op = IRP_OP_WRITE;
+    irp.write.bytes = bytes;
+    irp.write.nbytes = nbytes;
+
+    return nvram_handle_write(nv, &irp);
+}
+
+static HRESULT test_check(
+        const uint8_t *image,
+        size_t image_size,
+        const uint8_t *journal,
+        size_t journal_size)
+{
+    struct nvram nv;
+    size_t expect;
+    size_t cut;
+    HRESULT hr;
+
+    expect = 0;
+
+    for (cut = 0 ; cut <= journal_size ; cut++) {
+        while (expect < TEST_NFLUSHES && test_ends[expect + 1] <= cut) {
+            expect++;
+        }
+
+        /* Replaying a torn journal checkpoints over both files, so put both
+           of them back every time. */
+
+        hr = test_write_file(test_path, image, image_size);
+
+        if (SUCCEEDED(hr)) {
+            hr = test_write_file(test_journal_path, journal, cut);
+        }
+
+        if (FAILED(hr)) {
+            fprintf(stderr, "nvram-test: Restoring files failed: %x\n",
+                    (int) hr);
+
+            return hr;
+        }
+
+        nvram_init(&nv, "nvram-test");
+        hr = nvram_load(&nv, test_path, TEST_NBYTES);
+
+        if (FAILED(hr)) {
+            fprintf(stderr, "nvram-test: Load at %u bytes failed: %x\n",
+                    (unsigned int) cut,
+                    (int) hr);
+
+            return hr;
+        }
+
+        if (memcmp(nv.bytes, test_states[expect], TEST_NBYTES) != 0) {
+            fprintf(stderr,
+                    "nvram-test: Journal cut at %u bytes does not replay to "
+                    "flush %u\n",
+                    (unsigned int) cut,
+                    (unsigned int) expect);
+            nvram_unload(&nv);
+
+            return E_FAIL;
+        }
+
+        nvram_unload(&nv);
+    }
+
+    return S_OK;
+}
+
+static HRESULT test_read_file(const wchar_t *path, uint8_t **out, size_t *n)
+{
+    LARGE_INTEGER size;
+    uint8_t *bytes;
+    HANDLE file;
+    HRESULT hr;
+
+    *out = NULL;
+    *n = 0;
+    bytes = NULL;
+
+    file = CreateFileW(
+            path,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (!GetFileSizeEx(file, &size)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    bytes = malloc((size_t) size.QuadPart + 1);
+
+    if (bytes == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    hr = nvram_read_all(file, bytes, (size_t) size.QuadPart);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    *out = bytes;
+    *n = (size_t) size.QuadPart;
+    bytes = NULL;
+
+end:
+    CloseHandle(file);
+    free(bytes);
+
+    return hr;
+}
+
+static HRESULT test_write_file(
+        const wchar_t *path,
+        const uint8_t *bytes,
+        size_t nbytes)
+{
+    HANDLE file;
+    HRESULT hr;
+
+    file = CreateFileW(
+            path,
+            GENERIC_WRITE,
+            0,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    hr = nvram_write_all(file, bytes, nbytes);
+    CloseHandle(file);
+
+    return hr;
+}
+
+static uint32_t test_rand(void)
+{
+    /* Deterministic, so that a failure can be reproduced */
+
+    test_seed = test_seed * 1103515245 + 12345;
+
+    return test_seed >> 16;
+}
+
+static void test_cleanup(void)
+{
+    DeleteFileW(test_path);
+    DeleteFileW(test_journal_path);
+    DeleteFileW(test_tmp_path);
+}
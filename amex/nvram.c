@@ -1,13 +1,78 @@
 #include <windows.h>
 
 #include <assert.h>
+#include <process.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
 
 #include "amex/nvram.h"
 
+#include "hook/iohook.h"
+
+#include "util/crc.h"
 #include "util/dprintf.h"
 
+#define NVRAM_JOURNAL_MAGIC 0x4C4E524A /* "JRNL" */
+#define NVRAM_RECORD_MAGIC  0x4345524A /* "JREC" */
+
+/* Journal file layout: one header, then records back to back. Records carry
+   consecutive sequence numbers starting from the header's, and a CRC-32 that
+   covers the record header and its data. */
+
+struct nvram_journal_hdr {
+    uint32_t magic;
+    uint32_t nbytes;
+    uint32_t seq;
+    uint32_t crc;
+};
+
+struct nvram_record_hdr {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t offset;
+    uint32_t nbytes;
+    uint32_t crc;
+};
+
+static HRESULT nvram_load(struct nvram *nv, const wchar_t *path, size_t size);
+static void nvram_unload(struct nvram *nv);
+static HRESULT nvram_replay(struct nvram *nv);
+static HRESULT nvram_write_checkpoint(
+        struct nvram *nv,
+        const uint8_t *image,
+        uint32_t seq,
+        const uint8_t *pending,
+        size_t npending);
+static HRESULT nvram_seal_journal(
+        struct nvram *nv,
+        const uint8_t *pending,
+        size_t npending);
+static HRESULT nvram_flush_journal(struct nvram *nv, bool sync);
+static HRESULT nvram_reserve_locked(struct nvram *nv, size_t nbytes);
+static void nvram_queue_record_locked(
+        struct nvram *nv,
+        size_t offset,
+        size_t nbytes);
+static uint32_t nvram_journal_hdr_crc(const struct nvram_journal_hdr *hdr);
+static uint32_t nvram_record_crc(
+        const struct nvram_record_hdr *hdr,
+        const uint8_t *data);
+static uint64_t nvram_irp_offset(struct nvram *nv, const struct irp *irp);
+static HRESULT nvram_read_all(HANDLE file, void *bytes, size_t nbytes);
+static HRESULT nvram_write_all(HANDLE file, const void *bytes, size_t nbytes);
+static void nvram_flusher_add(struct nvram *nv);
+static unsigned int __stdcall nvram_flusher_proc(void *ctx);
+static void nvram_flush_at_exit(void);
+
+static SRWLOCK nvram_list_lock = SRWLOCK_INIT;
+static struct nvram *nvram_list;
+static HANDLE nvram_flusher;
+static bool nvram_atexit_registered;
+
 HRESULT nvram_open_file(HANDLE *out, const wchar_t *path, size_t size)
 {
     LARGE_INTEGER cur_size;
@@ -79,3 +144,889 @@ end:
 
     return hr;
 }
+
+void nvram_init(struct nvram *nv, const char *name)
+{
+    assert(nv != NULL);
+    assert(name != NULL);
+
+    memset(nv, 0, sizeof(*nv));
+    nv->name = name;
+    InitializeSRWLock(&nv->lock);
+    InitializeSRWLock(&nv->flush_lock);
+}
+
+HRESULT nvram_open(struct nvram *nv, const wchar_t *path, size_t size)
+{
+    HRESULT hr;
+
+    assert(nv != NULL);
+    assert(path != NULL);
+
+    /* Stays loaded after the first open */
+
+    if (nv->bytes == NULL) {
+        if (nv->fd == NULL) {
+            hr = iohook_open_nul_fd(&nv->fd);
+
+            if (FAILED(hr)) {
+                dprintf("%s: Error opening NUL fd: %x\n", nv->name, (int) hr);
+
+                return hr;
+            }
+        }
+
+        hr = nvram_load(nv, path, size);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        nvram_flusher_add(nv);
+    }
+
+    AcquireSRWLockExclusive(&nv->lock);
+    nv->pos = 0;
+    nv->open = true;
+    ReleaseSRWLockExclusive(&nv->lock);
+
+    return S_OK;
+}
+
+HRESULT nvram_close(struct nvram *nv)
+{
+    assert(nv != NULL);
+
+    AcquireSRWLockExclusive(&nv->lock);
+    nv->open = false;
+    ReleaseSRWLockExclusive(&nv->lock);
+
+    return nvram_flush(nv);
+}
+
+HRESULT nvram_flush(struct nvram *nv)
+{
+    assert(nv != NULL);
+
+    if (nv->bytes == NULL) {
+        return S_OK;
+    }
+
+    return nvram_flush_journal(nv, true);
+}
+
+HRESULT nvram_handle_read(struct nvram *nv, struct irp *irp)
+{
+    uint64_t offset;
+    size_t nbytes;
+    HRESULT hr;
+
+    assert(nv != NULL);
+    assert(irp != NULL);
+
+    AcquireSRWLockExclusive(&nv->lock);
+
+    offset = nvram_irp_offset(nv, irp);
+    nbytes = irp->read.nbytes - irp->read.pos;
+
+    /* Reads past the end come up short, same as they would for a file */
+
+    if (offset >= nv->nbytes) {
+        nbytes = 0;
+    } else if (nbytes > nv->nbytes - (size_t) offset) {
+        nbytes = nv->nbytes - (size_t) offset;
+    }
+
+    hr = iobuf_write(&irp->read, nv->bytes + (size_t) offset, nbytes);
+
+    if (SUCCEEDED(hr) && irp->ovl == NULL) {
+        nv->pos = offset + nbytes;
+    }
+
+    ReleaseSRWLockExclusive(&nv->lock);
+
+    return hr;
+}
+
+HRESULT nvram_handle_write(struct nvram *nv, struct irp *irp)
+{
+    uint64_t offset;
+    size_t nbytes;
+    HRESULT hr;
+
+    assert(nv != NULL);
+    assert(irp != NULL);
+
+    AcquireSRWLockExclusive(&nv->lock);
+
+    offset = nvram_irp_offset(nv, irp);
+    nbytes = irp->write.nbytes - irp->write.pos;
+
+    /* The device can't grow, so writes past the end get truncated */
+
+    if (offset >= nv->nbytes) {
+        if (nbytes > 0) {
+            hr = HRESULT_FROM_WIN32(ERROR_DISK_FULL);
+
+            goto end;
+        }
+    } else if (nbytes > nv->nbytes - (size_t) offset) {
+        nbytes = nv->nbytes - (size_t) offset;
+    }
+
+    /* Make room for the journal record first, so that a failed allocation
+       can't leave the image changed without a record of it. */
+
+    hr = nvram_reserve_locked(nv, sizeof(struct nvram_record_hdr) + nbytes);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    hr = iobuf_read(&irp->write, nv->bytes + (size_t) offset, nbytes);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    nvram_queue_record_locked(nv, (size_t) offset, nbytes);
+
+    if (irp->ovl == NULL) {
+        nv->pos = offset + nbytes;
+    }
+
+end:
+    ReleaseSRWLockExclusive(&nv->lock);
+
+    return hr;
+}
+
+HRESULT nvram_handle_seek(struct nvram *nv, struct irp *irp)
+{
+    int64_t base;
+    int64_t pos;
+    HRESULT hr;
+
+    assert(nv != NULL);
+    assert(irp != NULL);
+
+    AcquireSRWLockExclusive(&nv->lock);
+
+    switch (irp->seek_origin) {
+    case FILE_BEGIN:    base = 0; break;
+    case FILE_CURRENT:  base = (int64_t) nv->pos; break;
+    case FILE_END:      base = (int64_t) nv->nbytes; break;
+    default:
+        hr = E_INVALIDARG;
+
+        goto end;
+    }
+
+    pos = base + irp->seek_offset;
+
+    if (pos < 0) {
+        hr = HRESULT_FROM_WIN32(ERROR_NEGATIVE_SEEK);
+
+        goto end;
+    }
+
+    nv->pos = (uint64_t) pos;
+    irp->seek_pos = (uint64_t) pos;
+    hr = S_OK;
+
+end:
+    ReleaseSRWLockExclusive(&nv->lock);
+
+    return hr;
+}
+
+static HRESULT nvram_load(struct nvram *nv, const wchar_t *path, size_t size)
+{
+    wchar_t journal_path[MAX_PATH];
+    HANDLE file;
+    HRESULT hr;
+
+    file = NULL;
+
+    /* Leave room for the ".journal" and ".tmp" suffixes */
+
+    if (wcslen(path) + wcslen(L".journal") >= _countof(journal_path)) {
+        hr = HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+        dprintf("%s: Path is too long: %S\n", nv->name, path);
+
+        goto end;
+    }
+
+    wcscpy_s(nv->path, _countof(nv->path), path);
+    wcscpy_s(journal_path, _countof(journal_path), path);
+    wcscat_s(journal_path, _countof(journal_path), L".journal");
+
+    /* Creates the image if it doesn't exist yet */
+
+    hr = nvram_open_file(&file, path, size);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    nv->bytes = malloc(size);
+    nv->nbytes = size;
+
+    if (nv->bytes == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    hr = nvram_read_all(file, nv->bytes, size);
+
+    if (FAILED(hr)) {
+        dprintf("%s: Error reading %S: %x\n", nv->name, path, (int) hr);
+
+        goto end;
+    }
+
+    /* Checkpoints replace the image by renaming over it, so don't keep it
+       open. */
+
+    CloseHandle(file);
+    file = NULL;
+
+    nv->journal = CreateFileW(
+            journal_path,
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (nv->journal == INVALID_HANDLE_VALUE) {
+        nv->journal = NULL;
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("%s: Error opening %S: %x\n", nv->name, journal_path, (int) hr);
+
+        goto end;
+    }
+
+    hr = nvram_replay(nv);
+
+end:
+    if (file != NULL) {
+        CloseHandle(file);
+    }
+
+    if (FAILED(hr)) {
+        nvram_unload(nv);
+    }
+
+    return hr;
+}
+
+static void nvram_unload(struct nvram *nv)
+{
+    if (nv->journal != NULL) {
+        CloseHandle(nv->journal);
+        nv->journal = NULL;
+    }
+
+    free(nv->bytes);
+    nv->bytes = NULL;
+    nv->nbytes = 0;
+}
+
+static HRESULT nvram_replay(struct nvram *nv)
+{
+    struct nvram_journal_hdr jhdr;
+    struct nvram_record_hdr rhdr;
+    LARGE_INTEGER size;
+    LARGE_INTEGER zero;
+    uint8_t *journal;
+    size_t nbytes;
+    size_t pos;
+    unsigned int nrecords;
+    uint32_t seq;
+    HRESULT hr;
+    BOOL ok;
+
+    journal = NULL;
+    nbytes = 0;
+    pos = 0;
+    nrecords = 0;
+    seq = 0;
+
+    ok = GetFileSizeEx(nv->journal, &size);
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("%s: GetFileSizeEx failed: %x\n", nv->name, (int) hr);
+
+        goto end;
+    }
+
+    if (size.QuadPart >= 0x10000000) {
+        dprintf("%s: Journal is implausibly large, ignoring it\n", nv->name);
+        size.QuadPart = 0;
+    }
+
+    nbytes = (size_t) size.QuadPart;
+
+    if (nbytes >= sizeof(jhdr)) {
+        journal = malloc(nbytes);
+
+        if (journal == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        hr = nvram_read_all(nv->journal, journal, nbytes);
+
+        if (FAILED(hr)) {
+            dprintf("%s: Error reading journal: %x\n", nv->name, (int) hr);
+
+            goto end;
+        }
+
+        memcpy(&jhdr, journal, sizeof(jhdr));
+
+        if (    jhdr.magic == NVRAM_JOURNAL_MAGIC &&
+                jhdr.nbytes == nv->nbytes &&
+                jhdr.crc == nvram_journal_hdr_crc(&jhdr)) {
+            seq = jhdr.seq;
+            pos = sizeof(jhdr);
+        } else {
+            dprintf("%s: Journal header is invalid, ignoring it\n", nv->name);
+        }
+    }
+
+    /* Apply records until the first one that is truncated, out of sequence
+       or fails its CRC. Anything after that was torn by a crash. */
+
+    while (pos > 0 && nbytes - pos >= sizeof(rhdr)) {
+        memcpy(&rhdr, journal + pos, sizeof(rhdr));
+
+        if (    rhdr.magic != NVRAM_RECORD_MAGIC ||
+                rhdr.seq != seq ||
+                rhdr.offset > nv->nbytes ||
+                rhdr.nbytes > nv->nbytes - rhdr.offset ||
+                rhdr.nbytes > nbytes - pos - sizeof(rhdr) ||
+                rhdr.crc != nvram_record_crc(
+                    &rhdr,
+                    journal + pos + sizeof(rhdr))) {
+            break;
+        }
+
+        memcpy(nv->bytes + rhdr.offset,
+                journal + pos + sizeof(rhdr),
+                rhdr.nbytes);
+
+        pos += sizeof(rhdr) + rhdr.nbytes;
+        seq++;
+        nrecords++;
+    }
+
+    nv->seq = seq;
+
+    if (nrecords > 0 || pos != nbytes) {
+        dprintf("%s: Replayed %u journal records, discarded %u bytes\n",
+                nv->name,
+                nrecords,
+                (unsigned int) (nbytes - pos));
+    }
+
+    if (pos == sizeof(jhdr) && pos == nbytes) {
+        /* Clean journal with nothing in it, just carry on appending */
+        zero.QuadPart = 0;
+        ok = SetFilePointerEx(nv->journal, zero, NULL, FILE_END);
+
+        if (!ok) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            dprintf("%s: SetFilePointerEx failed: %x\n", nv->name, (int) hr);
+
+            goto end;
+        }
+
+        nv->journal_size = nbytes;
+        hr = S_OK;
+    } else {
+        /* Fold the replayed records into a new image and start a fresh
+           journal, which also gets rid of any torn tail. */
+        nv->journal_size = nbytes;
+        hr = nvram_write_checkpoint(nv, nv->bytes, seq, NULL, 0);
+    }
+
+end:
+    free(journal);
+
+    return hr;
+}
+
+static HRESULT nvram_write_checkpoint(
+        struct nvram *nv,
+        const uint8_t *image,
+        uint32_t seq,
+        const uint8_t *pending,
+        size_t npending)
+{
+    struct nvram_journal_hdr jhdr;
+    wchar_t tmp_path[MAX_PATH];
+    LARGE_INTEGER zero;
+    HANDLE file;
+    HRESULT hr;
+    BOOL ok;
+
+    wcscpy_s(tmp_path, _countof(tmp_path), nv->path);
+    wcscat_s(tmp_path, _countof(tmp_path), L".tmp");
+
+    /* Write the new image out in full before it replaces the old one, so
+       that the image on disk is always either the old or the new one. */
+
+    file = CreateFileW(
+            tmp_path,
+            GENERIC_WRITE,
+            0,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("%s: Error creating %S: %x\n", nv->name, tmp_path, (int) hr);
+
+        goto fail;
+    }
+
+    hr = nvram_write_all(file, image, nv->nbytes);
+
+    if (SUCCEEDED(hr) && !FlushFileBuffers(file)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    CloseHandle(file);
+
+    if (FAILED(hr)) {
+        dprintf("%s: Error writing checkpoint: %x\n", nv->name, (int) hr);
+
+        goto fail;
+    }
+
+    hr = nvram_seal_journal(nv, pending, npending);
+
+    if (FAILED(hr)) {
+        goto fail;
+    }
+
+    ok = MoveFileExW(
+            tmp_path,
+            nv->path,
+            MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("%s: MoveFileExW failed: %x\n", nv->name, (int) hr);
+
+        goto fail;
+    }
+
+    /* If we crash before the journal has been reset then the old journal
+       gets replayed on top of the new image. That is fine now that it has
+       been sealed: see nvram_seal_journal(). */
+
+    zero.QuadPart = 0;
+    ok = SetFilePointerEx(nv->journal, zero, NULL, FILE_BEGIN);
+
+    if (ok) {
+        ok = SetEndOfFile(nv->journal);
+    }
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("%s: Error truncating journal: %x\n", nv->name, (int) hr);
+
+        goto fail;
+    }
+
+    jhdr.magic = NVRAM_JOURNAL_MAGIC;
+    jhdr.nbytes = (uint32_t) nv->nbytes;
+    jhdr.seq = seq;
+    jhdr.crc = nvram_journal_hdr_crc(&jhdr);
+
+    hr = nvram_write_all(nv->journal, &jhdr, sizeof(jhdr));
+
+    if (SUCCEEDED(hr) && !FlushFileBuffers(nv->journal)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (FAILED(hr)) {
+        dprintf("%s: Error writing journal header: %x\n", nv->name, (int) hr);
+
+        goto fail;
+    }
+
+    nv->journal_size = sizeof(jhdr);
+
+    return S_OK;
+
+fail:
+    /* Records appended to a journal in an unknown state might never get
+       replayed, so make the next flush try another checkpoint instead. */
+    nv->journal_size = UINT64_MAX;
+
+    return hr;
+}
+
+static HRESULT nvram_seal_journal(
+        struct nvram *nv,
+        const uint8_t *pending,
+        size_t npending)
+{
+    LARGE_INTEGER zero;
+    HRESULT hr;
+    BOOL ok;
+
+    /* Called before a checkpoint renames its new image into place. Replaying
+       the old journal over the new image only gives back the new image if
+       the journal holds every record up to the checkpoint: the last record
+       to write each byte is then the one the image got its value from. A
+       journal that stops short of that would roll some bytes back to older
+       values and leave a mix of the two states.
+
+       So append the records that were queued since the last flush and make
+       sure that they, and any earlier appends that were never synced, are on
+       disk. If the journal is in an unknown state (a previous append failed)
+       or this append fails too, empty it instead. A crash before the rename
+       then loses the journal's records, but the old image on its own is
+       still a consistent state. */
+
+    if (nv->journal_size != UINT64_MAX) {
+        hr = npending > 0
+                ? nvram_write_all(nv->journal, pending, npending)
+                : S_OK;
+
+        if (SUCCEEDED(hr) && !FlushFileBuffers(nv->journal)) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        if (SUCCEEDED(hr)) {
+            return S_OK;
+        }
+
+        dprintf("%s: Error appending to journal: %x\n", nv->name, (int) hr);
+    }
+
+    zero.QuadPart = 0;
+    ok = SetFilePointerEx(nv->journal, zero, NULL, FILE_BEGIN);
+
+    if (ok) {
+        ok = SetEndOfFile(nv->journal);
+    }
+
+    if (ok) {
+        ok = FlushFileBuffers(nv->journal);
+    }
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("%s: Error truncating journal: %x\n", nv->name, (int) hr);
+
+        return hr;
+    }
+
+    return S_OK;
+}
+
+static HRESULT nvram_flush_journal(struct nvram *nv, bool sync)
+{
+    uint8_t *pending;
+    uint8_t *image;
+    size_t npending;
+    uint32_t seq;
+    HRESULT hr;
+
+    image = NULL;
+
+    /* Serializes the flush thread with close and fsync requests. Only code
+       holding this lock touches the journal file or journal_size. */
+
+    AcquireSRWLockExclusive(&nv->flush_lock);
+
+    if (nv->journal_size >= nv->nbytes) {
+        image = malloc(nv->nbytes);
+
+        if (image == NULL) {
+            /* Leave the pending records where they are and try again on
+               the next flush. */
+            ReleaseSRWLockExclusive(&nv->flush_lock);
+
+            return E_OUTOFMEMORY;
+        }
+    }
+
+    /* Steal the pending records. If we're checkpointing then snapshot the
+       image at the same time, at which point it includes every one of them.
+       They still go into the old journal before the new image replaces the
+       old one, see nvram_seal_journal(). */
+
+    AcquireSRWLockExclusive(&nv->lock);
+
+    pending = nv->pending;
+    npending = nv->npending;
+    seq = nv->seq;
+
+    nv->pending = NULL;
+    nv->npending = 0;
+    nv->pending_cap = 0;
+    nv->flushing = npending > 0 || image != NULL;
+
+    if (image != NULL) {
+        memcpy(image, nv->bytes, nv->nbytes);
+    }
+
+    ReleaseSRWLockExclusive(&nv->lock);
+
+    if (image != NULL) {
+        hr = nvram_write_checkpoint(nv, image, seq, pending, npending);
+    } else if (npending > 0) {
+        /* Routine appends are left to the OS to write back, which is enough
+           to survive the game crashing. Syncing the file every second would
+           cost far more than the records themselves, so that only happens
+           at checkpoints and when the game asks for it. */
+
+        hr = nvram_write_all(nv->journal, pending, npending);
+
+        if (SUCCEEDED(hr) && sync && !FlushFileBuffers(nv->journal)) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        if (SUCCEEDED(hr)) {
+            nv->journal_size += npending;
+        } else {
+            dprintf("%s: Error appending to journal: %x\n",
+                    nv->name,
+                    (int) hr);
+
+            /* Those records are gone, but the image in memory still has
+               them, so checkpoint it next time around. */
+            nv->journal_size = UINT64_MAX;
+        }
+    } else if (sync && nv->journal_size != UINT64_MAX) {
+        /* Earlier appends may still be waiting to be written back */
+
+        if (FlushFileBuffers(nv->journal)) {
+            hr = S_OK;
+        } else {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    } else {
+        hr = S_OK;
+    }
+
+    nv->flushing = false;
+    ReleaseSRWLockExclusive(&nv->flush_lock);
+
+    free(image);
+    free(pending);
+
+    return hr;
+}
+
+static HRESULT nvram_reserve_locked(struct nvram *nv, size_t nbytes)
+{
+    uint8_t *new_mem;
+    size_t new_cap;
+
+    if (nv->pending_cap - nv->npending >= nbytes) {
+        return S_OK;
+    }
+
+    new_cap = nv->pending_cap > 0 ? nv->pending_cap : 4096;
+
+    while (new_cap - nv->npending < nbytes) {
+        new_cap *= 2;
+    }
+
+    new_mem = realloc(nv->pending, new_cap);
+
+    if (new_mem == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    nv->pending = new_mem;
+    nv->pending_cap = new_cap;
+
+    return S_OK;
+}
+
+static void nvram_queue_record_locked(
+        struct nvram *nv,
+        size_t offset,
+        size_t nbytes)
+{
+    struct nvram_record_hdr hdr;
+
+    if (nbytes == 0) {
+        return;
+    }
+
+    hdr.magic = NVRAM_RECORD_MAGIC;
+    hdr.seq = nv->seq++;
+    hdr.offset = (uint32_t) offset;
+    hdr.nbytes = (uint32_t) nbytes;
+    hdr.crc = nvram_record_crc(&hdr, nv->bytes + offset);
+
+    memcpy(nv->pending + nv->npending, &hdr, sizeof(hdr));
+    nv->npending += sizeof(hdr);
+
+    memcpy(nv->pending + nv->npending, nv->bytes + offset, nbytes);
+    nv->npending += nbytes;
+}
+
+static uint32_t nvram_journal_hdr_crc(const struct nvram_journal_hdr *hdr)
+{
+    return crc32(hdr, offsetof(struct nvram_journal_hdr, crc), 0);
+}
+
+static uint32_t nvram_record_crc(
+        const struct nvram_record_hdr *hdr,
+        const uint8_t *data)
+{
+    uint32_t crc;
+
+    crc = crc32(hdr, offsetof(struct nvram_record_hdr, crc), 0);
+
+    return crc32(data, hdr->nbytes, crc);
+}
+
+static uint64_t nvram_irp_offset(struct nvram *nv, const struct irp *irp)
+{
+    /* Overlapped IO carries its own offset, everything else uses the
+       handle's file pointer. */
+
+    if (irp->ovl != NULL) {
+        return ((uint64_t) irp->ovl->OffsetHigh << 32) | irp->ovl->Offset;
+    } else {
+        return nv->pos;
+    }
+}
+
+static HRESULT nvram_read_all(HANDLE file, void *bytes, size_t nbytes)
+{
+    uint8_t *dest;
+    DWORD nread;
+    BOOL ok;
+
+    dest = bytes;
+
+    while (nbytes > 0) {
+        ok = ReadFile(file, dest, (DWORD) nbytes, &nread, NULL);
+
+        if (!ok) {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        if (nread == 0) {
+            return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+        }
+
+        dest += nread;
+        nbytes -= nread;
+    }
+
+    return S_OK;
+}
+
+static HRESULT nvram_write_all(HANDLE file, const void *bytes, size_t nbytes)
+{
+    const uint8_t *src;
+    DWORD nwritten;
+    BOOL ok;
+
+    src = bytes;
+
+    while (nbytes > 0) {
+        ok = WriteFile(file, src, (DWORD) nbytes, &nwritten, NULL);
+
+        if (!ok) {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        src += nwritten;
+        nbytes -= nwritten;
+    }
+
+    return S_OK;
+}
+
+static void nvram_flusher_add(struct nvram *nv)
+{
+    AcquireSRWLockExclusive(&nvram_list_lock);
+
+    nv->next = nvram_list;
+    nvram_list = nv;
+
+    if (!nvram_atexit_registered) {
+        nvram_atexit_registered = true;
+        atexit(nvram_flush_at_exit);
+    }
+
+    if (nvram_flusher == NULL) {
+        nvram_flusher = (HANDLE) _beginthreadex(
+                NULL,
+                0,
+                nvram_flusher_proc,
+                NULL,
+                0,
+                NULL);
+
+        if (nvram_flusher == NULL) {
+            /* Not fatal, everything still gets flushed on close and exit */
+            dprintf("NVRAM: Failed to start flush thread\n");
+        }
+    }
+
+    ReleaseSRWLockExclusive(&nvram_list_lock);
+}
+
+static unsigned int __stdcall nvram_flusher_proc(void *ctx)
+{
+    struct nvram *nv;
+
+    for (;;) {
+        Sleep(NVRAM_FLUSH_INTERVAL_MS);
+
+        AcquireSRWLockShared(&nvram_list_lock);
+
+        for (nv = nvram_list ; nv != NULL ; nv = nv->next) {
+            nvram_flush_journal(nv, false);
+        }
+
+        ReleaseSRWLockShared(&nvram_list_lock);
+    }
+
+    return 0;
+}
+
+static void nvram_flush_at_exit(void)
+{
+    struct nvram *nv;
+
+    /* The flush thread has been killed off by now, possibly while holding
+       one of our locks, so don't take any. If it was killed in the middle of
+       a flush then the records it had taken out of the pending buffer are
+       gone: they may be half written or not written at all. Replay stops at
+       the first missing record, so appending the newer records after them
+       would be useless. Write a checkpoint instead, since the image in
+       memory still has every write in it. */
+
+    for (nv = nvram_list ; nv != NULL ; nv = nv->next) {
+        if (nv->flushing || nv->journal_size == UINT64_MAX) {
+            nv->journal_size = UINT64_MAX;
+            nvram_write_checkpoint(nv, nv->bytes, nv->seq, NULL, 0);
+        } else if (nv->npending > 0) {
+            nvram_write_all(nv->journal, nv->pending, nv->npending);
+            FlushFileBuffers(nv->journal);
+        }
+    }
+}
@@ -2,6 +2,64 @@
 
 #include <windows.h>
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "hook/iohook.h"
+
+/* A fixed-size non-volatile memory device with a crash-safe backing store.
+
+   The device image lives in RAM and reads and writes are served straight out
+   of it, synchronous and overlapped alike, so the game's frequent small
+   accesses never turn into disk IO of their own. Each write also queues a
+   checksummed record for an append-only journal next to the image file
+   (<path>.journal), which a shared background thread appends to disk every
+   NVRAM_FLUSH_INTERVAL_MS. Once the journal outgrows the image a checkpoint
+   writes out a fresh image (via a temporary file and an atomic rename) and
+   starts a new journal.
+
+   On open the journal is replayed over the image, stopping at the first
+   record that fails its CRC, so a crash at any point loses at most the last
+   flush interval's worth of writes and never leaves a torn image behind. The
+   background appends are not synced to disk, so a power cut can also lose
+   whatever the OS had not written back yet, back to the last checkpoint or
+   fsync, but still leaves a consistent state. The device is also flushed
+   (and synced) when the game closes it, when it asks for an fsync and when
+   the process exits.
+
+   The game gets a NUL device handle, not the backing file. Once loaded a
+   device stays in memory until the process exits, closing it only flushes. */
+
+#define NVRAM_FLUSH_INTERVAL_MS 1000
+
+struct nvram {
+    const char *name;
+    HANDLE fd;
+    wchar_t path[MAX_PATH];
+    HANDLE journal;
+    uint64_t journal_size;
+    uint8_t *bytes;
+    size_t nbytes;
+    bool open;
+    SRWLOCK lock;
+    SRWLOCK flush_lock;
+    uint64_t pos;
+    uint32_t seq;
+    uint8_t *pending;
+    size_t npending;
+    size_t pending_cap;
+    bool flushing;
+    struct nvram *next;
+};
 
 HRESULT nvram_open_file(HANDLE *out, const wchar_t *path, size_t size);
+
+void nvram_init(struct nvram *nv, const char *name);
+HRESULT nvram_open(struct nvram *nv, const wchar_t *path, size_t size);
+HRESULT nvram_close(struct nvram *nv);
+HRESULT nvram_flush(struct nvram *nv);
+
+HRESULT nvram_handle_read(struct nvram *nv, struct irp *irp);
+HRESULT nvram_handle_write(struct nvram *nv, struct irp *irp);
+HRESULT nvram_handle_seek(struct nvram *nv, struct irp *irp);
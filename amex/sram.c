@@ -28,12 +28,16 @@ static HRESULT sram_handle_irp(struct irp *irp);
 static HRESULT sram_handle_open(struct irp *irp);
 static HRESULT sram_handle_close(struct irp *irp);
 static HRESULT sram_handle_ioctl(struct irp *irp);
+static HRESULT sram_handle_read(struct irp *irp);
+static HRESULT sram_handle_write(struct irp *irp);
+static HRESULT sram_handle_seek(struct irp *irp);
+static HRESULT sram_handle_fsync(struct irp *irp);
 
 static HRESULT sram_ioctl_get_geometry(struct irp *irp);
 static HRESULT sram_ioctl_get_abi_version(struct irp *irp);
 
 static struct sram_config sram_config;
-static HANDLE sram_file;
+static struct nvram sram_nvram;
 
 HRESULT sram_hook_init(const struct sram_config *cfg)
 {
@@ -46,6 +50,7 @@ HRESULT sram_hook_init(const struct sram_config *cfg)
     }
 
     memcpy(&sram_config, cfg, sizeof(*cfg));
+    nvram_init(&sram_nvram, "SRAM");
 
     hr = iohook_push_handler(sram_handle_irp);
 
@@ -66,7 +71,7 @@ static HRESULT sram_handle_irp(struct irp *irp)
 {
     assert(irp != NULL);
 
-    if (irp->op != IRP_OP_OPEN && irp->fd != sram_file) {
+    if (irp->op != IRP_OP_OPEN && irp->fd != sram_nvram.fd) {
         return iohook_invoke_next(irp);
     }
 
@@ -74,6 +79,10 @@ static HRESULT sram_handle_irp(struct irp *irp)
     case IRP_OP_OPEN:   return sram_handle_open(irp);
     case IRP_OP_CLOSE:  return sram_handle_close(irp);
     case IRP_OP_IOCTL:  return sram_handle_ioctl(irp);
+    case IRP_OP_READ:   return sram_handle_read(irp);
+    case IRP_OP_WRITE:  return sram_handle_write(irp);
+    case IRP_OP_SEEK:   return sram_handle_seek(irp);
+    case IRP_OP_FSYNC:  return sram_handle_fsync(irp);
     default:            return iohook_invoke_next(irp);
     }
 }
@@ -86,20 +95,20 @@ static HRESULT sram_handle_open(struct irp *irp)
         return iohook_invoke_next(irp);
     }
 
-    if (sram_file != NULL) {
+    if (sram_nvram.open) {
         dprintf("SRAM: Already open\n");
 
         return HRESULT_FROM_WIN32(ERROR_SHARING_VIOLATION);
     }
 
     dprintf("SRAM: Open device\n");
-    hr = nvram_open_file(&sram_file, sram_config.path, 0x80000);
+    hr = nvram_open(&sram_nvram, sram_config.path, 0x80000);
 
     if (FAILED(hr)) {
         return hr;
     }
 
-    irp->fd = sram_file;
+    irp->fd = sram_nvram.fd;
 
     return S_OK;
 }
@@ -107,9 +116,10 @@ static HRESULT sram_handle_open(struct irp *irp)
 static HRESULT sram_handle_close(struct irp *irp)
 {
     dprintf("SRAM: Close device\n");
-    sram_file = NULL;
 
-    return iohook_invoke_next(irp);
+    /* Our NUL fd gets reused if the device is opened again */
+
+    return nvram_close(&sram_nvram);
 }
 
 static HRESULT sram_handle_ioctl(struct irp *irp)
@@ -158,3 +168,23 @@ static HRESULT sram_ioctl_get_abi_version(struct irp *irp)
 {
     return iobuf_write_le16(&irp->read, 256);
 }
+
+static HRESULT sram_handle_read(struct irp *irp)
+{
+    return nvram_handle_read(&sram_nvram, irp);
+}
+
+static HRESULT sram_handle_write(struct irp *irp)
+{
+    return nvram_handle_write(&sram_nvram, irp);
+}
+
+static HRESULT sram_handle_seek(struct irp *irp)
+{
+    return nvram_handle_seek(&sram_nvram, irp);
+}
+
+static HRESULT sram_handle_fsync(struct irp *irp)
+{
+    return nvram_flush(&sram_nvram);
+}
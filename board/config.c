@@ -9,12 +9,14 @@
 #include "board/config.h"
 #include "board/sg-reader.h"
 
+#include "util/ini.h"
+
 static void aime_dll_config_load(struct aime_dll_config *cfg, const wchar_t *filename)
 {
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"aimeio",
             L"path",
             L"",
@@ -29,7 +31,21 @@ void aime_config_load(struct aime_config *cfg, const wchar_t *filename)
     assert(filename != NULL);
 
     aime_dll_config_load(&cfg->dll, filename);
-    cfg->enable = GetPrivateProfileIntW(L"aime", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"aime", L"enable", 1, filename);
+
+    ini_get_string(
+            L"aime",
+            L"cardDir",
+            L"",
+            cfg->card_dir,
+            _countof(cfg->card_dir),
+            filename);
+
+    cfg->stats_interval = ini_get_int(
+            L"aime",
+            L"statsInterval",
+            0,
+            filename);
 }
 
 void io4_config_load(struct io4_config *cfg, const wchar_t *filename)
@@ -37,5 +53,5 @@ void io4_config_load(struct io4_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"io4", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"io4", L"enable", 1, filename);
 }
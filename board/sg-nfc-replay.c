@@ -0,0 +1,216 @@
+/* Standalone driver for the NFC emulator's command path.
+
+   Replays a capture of everything the game wrote to the reader's UART (raw
+   bytes, i.e. escaped frames back to back, each starting with a 0xE0 sync
+   byte) through sg_nfc_transact and reports how fast the frames went
+   through. Frames for other addresses, such as the LED board's, are skipped
+   by the dispatcher exactly as they are in the hook.
+
+   The backend always reports the same Aime card, so that polls and block
+   reads do real work rather than answering "no card".
+
+   Usage: sg-nfc-replay <capture file> [passes] */
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board/sg-nfc.h"
+
+#include "hook/iobuf.h"
+
+static HRESULT replay_load(const char *path, uint8_t **out, size_t *nbytes);
+static HRESULT replay_poll(void *ctx);
+static HRESULT replay_get_aime_id(void *ctx, uint8_t *luid, size_t nbytes);
+
+static const struct sg_nfc_ops replay_nfc_ops = {
+    .poll           = replay_poll,
+    .get_aime_id    = replay_get_aime_id,
+};
+
+static const uint8_t replay_luid[10] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0x01, 0x23, 0x45, 0x67, 0x89,
+};
+
+int main(int argc, char **argv)
+{
+    struct sg_nfc nfc;
+    struct iobuf res;
+    uint8_t res_bytes[1024];
+    LARGE_INTEGER freq;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    uint8_t *capture;
+    size_t nbytes;
+    size_t pos;
+    size_t frame;
+    size_t next;
+    unsigned long passes;
+    unsigned long pass;
+    uint64_t nframes;
+    uint64_t nanswered;
+    double secs;
+    HRESULT hr;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <capture file> [passes]\n", argv[0]);
+
+        return 2;
+    }
+
+    passes = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+
+    if (passes == 0) {
+        fprintf(stderr, "Invalid pass count: %s\n", argv[2]);
+
+        return 2;
+    }
+
+    hr = replay_load(argv[1], &capture, &nbytes);
+
+    if (FAILED(hr)) {
+        fprintf(stderr, "Error reading %s: %x\n", argv[1], (int) hr);
+
+        return 1;
+    }
+
+    /* Anything in front of the first sync byte is a partial frame */
+
+    pos = 0;
+
+    while (pos < nbytes && capture[pos] != 0xE0) {
+        pos++;
+    }
+
+    if (pos == nbytes) {
+        fprintf(stderr, "%s: No frames found\n", argv[1]);
+        free(capture);
+
+        return 1;
+    }
+
+    memset(&nfc, 0, sizeof(nfc));
+    sg_nfc_init(&nfc, 0x00, &replay_nfc_ops, NULL, NULL);
+
+    res.bytes = res_bytes;
+    res.nbytes = sizeof(res_bytes);
+
+    nframes = 0;
+    nanswered = 0;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    for (pass = 0 ; pass < passes ; pass++) {
+        for (next = pos ; next < nbytes ; ) {
+            /* Sync bytes are always escaped inside a frame, so the next one
+               starts the next frame. */
+
+            frame = next++;
+
+            while (next < nbytes && capture[next] != 0xE0) {
+                next++;
+            }
+
+            res.pos = 0;
+            sg_nfc_transact(&nfc, &res, capture + frame, next - frame);
+
+            nframes++;
+
+            if (res.pos > 0) {
+                nanswered++;
+            }
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+
+    secs = (double) (end.QuadPart - start.QuadPart) / freq.QuadPart;
+
+    printf("%lu passes, %llu frames, %llu answered, %.3f ms\n",
+            passes,
+            (unsigned long long) nframes,
+            (unsigned long long) nanswered,
+            secs * 1000.0);
+
+    if (secs > 0) {
+        printf("%.0f frames/s, %.3f us/frame, %.2f MB/s\n",
+                nframes / secs,
+                secs * 1e6 / nframes,
+                (double) (nbytes - pos) * passes / secs / 1e6);
+    }
+
+    free(capture);
+
+    return 0;
+}
+
+static HRESULT replay_load(const char *path, uint8_t **out, size_t *nbytes)
+{
+    uint8_t *bytes;
+    FILE *f;
+    long size;
+    HRESULT hr;
+
+    *out = NULL;
+    *nbytes = 0;
+    bytes = NULL;
+
+    f = fopen(path, "rb");
+
+    if (f == NULL) {
+        return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0) {
+        hr = E_FAIL;
+
+        goto end;
+    }
+
+    rewind(f);
+    bytes = malloc(size > 0 ? size : 1);
+
+    if (bytes == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    if (fread(bytes, 1, size, f) != (size_t) size) {
+        hr = HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+
+        goto end;
+    }
+
+    *out = bytes;
+    *nbytes = size;
+    bytes = NULL;
+    hr = S_OK;
+
+end:
+    fclose(f);
+    free(bytes);
+
+    return hr;
+}
+
+static HRESULT replay_poll(void *ctx)
+{
+    return S_OK;
+}
+
+static HRESULT replay_get_aime_id(void *ctx, uint8_t *luid, size_t nbytes)
+{
+    if (nbytes < sizeof(replay_luid)) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    memcpy(luid, replay_luid, sizeof(replay_luid));
+
+    return S_OK;
+}
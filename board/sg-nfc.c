@@ -12,16 +12,50 @@
 #include "board/sg-nfc-cmd.h"
 
 #include "iccard/aime.h"
+#include "iccard/card-store.h"
 #include "iccard/felica.h"
 
 #include "util/dprintf.h"
 #include "util/dump.h"
 
+/* Latency histogram buckets are powers of two in microseconds */
+
+struct sg_nfc_cmd_stats {
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t buckets[24];
+};
+
+struct sg_nfc_stats {
+    LARGE_INTEGER freq;
+    LARGE_INTEGER epoch;
+    unsigned int interval;
+    unsigned int count;
+    struct sg_nfc_cmd_stats cmds[256];
+};
+
 static HRESULT sg_nfc_dispatch(
         void *ctx,
         const void *v_req,
         void *v_res);
 
+static HRESULT sg_nfc_dispatch_cmd(
+        struct sg_nfc *nfc,
+        const union sg_nfc_req_any *req,
+        union sg_nfc_res_any *res);
+
+static void sg_nfc_stats_record(
+        struct sg_nfc *nfc,
+        uint8_t cmd,
+        const LARGE_INTEGER *start,
+        const LARGE_INTEGER *end);
+
+static void sg_nfc_stats_report(struct sg_nfc *nfc);
+
+static uint32_t sg_nfc_stats_percentile(
+        const struct sg_nfc_cmd_stats *cmd_stats,
+        unsigned int pct);
+
 static HRESULT sg_nfc_cmd_reset(
         struct sg_nfc *nfc,
         const struct sg_req_header *req,
@@ -69,16 +103,41 @@ void sg_nfc_init(
         struct sg_nfc *nfc,
         uint8_t addr,
         const struct sg_nfc_ops *ops,
-        void *ops_ctx)
+        void *ops_ctx,
+        const struct card_store *cards)
 {
     assert(nfc != NULL);
     assert(ops != NULL);
 
     nfc->ops = ops;
     nfc->ops_ctx = ops_ctx;
+    nfc->cards = cards;
     nfc->addr = addr;
 }
 
+HRESULT sg_nfc_enable_stats(struct sg_nfc *nfc, unsigned int interval)
+{
+    struct sg_nfc_stats *stats;
+
+    assert(nfc != NULL);
+    assert(interval > 0);
+
+    stats = calloc(1, sizeof(*stats));
+
+    if (stats == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    stats->interval = interval;
+    QueryPerformanceFrequency(&stats->freq);
+    QueryPerformanceCounter(&stats->epoch);
+
+    free(nfc->stats);
+    nfc->stats = stats;
+
+    return S_OK;
+}
+
 #ifdef NDEBUG
 #define sg_nfc_dprintfv(nfc, fmt, ap)
 #define sg_nfc_dprintf(nfc, fmt, ...)
@@ -126,6 +185,9 @@ static HRESULT sg_nfc_dispatch(
     struct sg_nfc *nfc;
     const union sg_nfc_req_any *req;
     union sg_nfc_res_any *res;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    HRESULT hr;
 
     nfc = ctx;
     req = v_req;
@@ -136,6 +198,26 @@ static HRESULT sg_nfc_dispatch(
         return S_FALSE;
     }
 
+    if (nfc->stats == NULL) {
+        return sg_nfc_dispatch_cmd(nfc, req, res);
+    }
+
+    /* Timing includes the backend DLL calls made on behalf of the command */
+
+    QueryPerformanceCounter(&start);
+    hr = sg_nfc_dispatch_cmd(nfc, req, res);
+    QueryPerformanceCounter(&end);
+
+    sg_nfc_stats_record(nfc, req->simple.hdr.cmd, &start, &end);
+
+    return hr;
+}
+
+static HRESULT sg_nfc_dispatch_cmd(
+        struct sg_nfc *nfc,
+        const union sg_nfc_req_any *req,
+        union sg_nfc_res_any *res)
+{
     switch (req->simple.hdr.cmd) {
     case SG_NFC_CMD_RESET:
         return sg_nfc_cmd_reset(nfc, &req->simple, &res->simple);
@@ -185,6 +267,115 @@ static HRESULT sg_nfc_dispatch(
     }
 }
 
+static void sg_nfc_stats_record(
+        struct sg_nfc *nfc,
+        uint8_t cmd,
+        const LARGE_INTEGER *start,
+        const LARGE_INTEGER *end)
+{
+    struct sg_nfc_cmd_stats *cmd_stats;
+    uint64_t us;
+    size_t bucket;
+
+    us = (uint64_t) (end->QuadPart - start->QuadPart) * 1000000
+            / nfc->stats->freq.QuadPart;
+
+    for (bucket = 0 ; (us >> bucket) > 1 ; bucket++);
+
+    if (bucket >= _countof(cmd_stats->buckets)) {
+        bucket = _countof(cmd_stats->buckets) - 1;
+    }
+
+    cmd_stats = &nfc->stats->cmds[cmd];
+    cmd_stats->count++;
+    cmd_stats->total_us += us;
+    cmd_stats->buckets[bucket]++;
+
+    if (++nfc->stats->count >= nfc->stats->interval) {
+        sg_nfc_stats_report(nfc);
+    }
+}
+
+static void sg_nfc_stats_report(struct sg_nfc *nfc)
+{
+    const struct sg_nfc_cmd_stats *cmd_stats;
+    struct sg_nfc_stats *stats;
+    LARGE_INTEGER now;
+    uint64_t elapsed_ms;
+    unsigned int rate;
+    size_t i;
+
+    /* Stats are opt-in, so report them with dprintf rather than the NFC
+       trace macros, which compile to nothing in release builds. */
+
+    stats = nfc->stats;
+    QueryPerformanceCounter(&now);
+    elapsed_ms = (uint64_t) (now.QuadPart - stats->epoch.QuadPart) * 1000
+            / stats->freq.QuadPart;
+
+    if (elapsed_ms > 0) {
+        rate = (unsigned int) ((uint64_t) stats->count * 1000 / elapsed_ms);
+    } else {
+        rate = 0;
+    }
+
+    dprintf("NFC %02x: %u commands in %u ms (%u/s)\n",
+            nfc->addr,
+            stats->count,
+            (unsigned int) elapsed_ms,
+            rate);
+
+    for (i = 0 ; i < _countof(stats->cmds) ; i++) {
+        cmd_stats = &stats->cmds[i];
+
+        if (cmd_stats->count == 0) {
+            continue;
+        }
+
+        dprintf("NFC %02x:   cmd %02x: n=%u mean=%uus p50<%uus p90<%uus "
+                        "p99<%uus\n",
+                nfc->addr,
+                (unsigned int) i,
+                cmd_stats->count,
+                (unsigned int) (cmd_stats->total_us / cmd_stats->count),
+                sg_nfc_stats_percentile(cmd_stats, 50),
+                sg_nfc_stats_percentile(cmd_stats, 90),
+                sg_nfc_stats_percentile(cmd_stats, 99));
+    }
+
+    memset(stats->cmds, 0, sizeof(stats->cmds));
+    stats->count = 0;
+    stats->epoch = now;
+}
+
+static uint32_t sg_nfc_stats_percentile(
+        const struct sg_nfc_cmd_stats *cmd_stats,
+        unsigned int pct)
+{
+    uint64_t threshold;
+    uint64_t sum;
+    size_t i;
+
+    /* Returns the upper bound of the bucket containing the percentile */
+
+    threshold = ((uint64_t) cmd_stats->count * pct + 99) / 100;
+    sum = 0;
+
+    for (i = 0 ; i < _countof(cmd_stats->buckets) ; i++) {
+        sum += cmd_stats->buckets[i];
+
+        if (sum >= threshold) {
+            break;
+        }
+    }
+
+    if (i >= _countof(cmd_stats->buckets)) {
+        i = _countof(cmd_stats->buckets) - 1;
+    }
+
+    return 2u << i;
+}
+
 static HRESULT sg_nfc_cmd_reset(
         struct sg_nfc *nfc,
         const struct sg_req_header *req,
@@ -283,13 +474,33 @@ static HRESULT sg_nfc_poll_aime(
 
     sg_nfc_dprintf(nfc, "AiMe card is present\n");
 
-    /* Construct response (use an arbitrary UID) */
-
     mifare->type = 0x10;
     mifare->id_len = sizeof(mifare->uid);
-    mifare->uid = _byteswap_ulong(0x01020304);
 
-    /* Initialize MIFARE IC emulator */
+    /* Serve the card straight out of its image if we have one. The UID lives
+       in the first four bytes of the manufacturer block, in wire order. */
+
+    if (nfc->cards != NULL) {
+        nfc->mifare_image = card_store_find_mifare(
+                nfc->cards,
+                luid,
+                sizeof(luid));
+    } else {
+        nfc->mifare_image = NULL;
+    }
+
+    if (nfc->mifare_image != NULL) {
+        memcpy( &mifare->uid,
+                nfc->mifare_image->sectors[0].blocks[0].bytes,
+                sizeof(mifare->uid));
+
+        return S_OK;
+    }
+
+    /* Otherwise construct a response with an arbitrary UID and initialize the
+       MIFARE IC emulator */
+
+    mifare->uid = _byteswap_ulong(0x01020304);
 
     hr = aime_card_populate(&nfc->mifare, luid, sizeof(luid));
 
@@ -304,6 +515,7 @@ static HRESULT sg_nfc_poll_felica(
         struct sg_nfc *nfc,
         struct sg_nfc_poll_felica *felica)
 {
+    const struct card_store_felica *image;
     uint64_t IDm;
     HRESULT hr;
 
@@ -334,6 +546,20 @@ static HRESULT sg_nfc_poll_felica(
     nfc->felica.PMm = felica_get_generic_PMm();
     nfc->felica.system_code = 0x0000;
 
+    if (nfc->cards != NULL) {
+        image = card_store_find_felica(nfc->cards, IDm);
+    } else {
+        image = NULL;
+    }
+
+    if (image != NULL) {
+        nfc->felica.blocks = image->blocks;
+        nfc->felica.nblocks = image->nblocks;
+    } else {
+        nfc->felica.blocks = NULL;
+        nfc->felica.nblocks = 0;
+    }
+
     return S_OK;
 }
 
@@ -342,7 +568,10 @@ static HRESULT sg_nfc_cmd_mifare_read_block(
         const struct sg_nfc_req_mifare_read_block *req,
         struct sg_nfc_res_mifare_read_block *res)
 {
+    const struct mifare *card;
+    size_t nblocks;
     uint32_t uid;
+    uint8_t block_no;
 
     if (req->req.payload_len != sizeof(req->payload)) {
         sg_nfc_dprintf(nfc, "%s: Payload size is incorrect\n", __func__);
@@ -351,10 +580,30 @@ static HRESULT sg_nfc_cmd_mifare_read_block(
     }
 
     uid = _byteswap_ulong(req->payload.uid);
+    block_no = req->payload.block_no;
+
+    sg_nfc_dprintf(nfc, "Read uid %08x block %i\n", uid, block_no);
 
-    sg_nfc_dprintf(nfc, "Read uid %08x block %i\n", uid, req->payload.block_no);
+    /* A card image covers all sixteen sectors, whereas the Aime emulator only
+       populates the first one. */
+
+    if (nfc->mifare_image != NULL) {
+        card = nfc->mifare_image;
+        nblocks = _countof(card->sectors) * _countof(card->sectors[0].blocks);
+
+        if (memcmp( &req->payload.uid,
+                    card->sectors[0].blocks[0].bytes,
+                    sizeof(req->payload.uid)) != 0) {
+            sg_nfc_dprintf(nfc, "MIFARE UID does not match selected card\n");
+
+            return E_FAIL;
+        }
+    } else {
+        card = &nfc->mifare;
+        nblocks = _countof(card->sectors[0].blocks);
+    }
 
-    if (req->payload.block_no > 3) {
+    if (block_no >= nblocks) {
         sg_nfc_dprintf(nfc, "MIFARE block number out of range\n");
 
         return E_FAIL;
@@ -363,7 +612,7 @@ static HRESULT sg_nfc_cmd_mifare_read_block(
     sg_res_init(&res->res, &req->req, sizeof(res->block));
 
     memcpy( res->block,
-            nfc->mifare.sectors[0].blocks[req->payload.block_no].bytes,
+            card->sectors[block_no / 4].blocks[block_no % 4].bytes,
             sizeof(res->block));
 
     return S_OK;
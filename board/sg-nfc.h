@@ -7,6 +7,7 @@
 
 #include "hook/iobuf.h"
 
+#include "iccard/card-store.h"
 #include "iccard/felica.h"
 #include "iccard/mifare.h"
 
@@ -18,19 +19,27 @@ struct sg_nfc_ops {
     // TODO Banapass, AmuseIC
 };
 
+struct sg_nfc_stats;
+
 struct sg_nfc {
     const struct sg_nfc_ops *ops;
     void *ops_ctx;
+    const struct card_store *cards;
     uint8_t addr;
     struct felica felica;
     struct mifare mifare;
+    const struct mifare *mifare_image;
+    struct sg_nfc_stats *stats;
 };
 
 void sg_nfc_init(
         struct sg_nfc *nfc,
         uint8_t addr,
         const struct sg_nfc_ops *ops,
-        void *ops_ctx);
+        void *ops_ctx,
+        const struct card_store *cards);
+
+HRESULT sg_nfc_enable_stats(struct sg_nfc *nfc, unsigned int interval);
 
 void sg_nfc_transact(
         struct sg_nfc *nfc,
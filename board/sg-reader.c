@@ -13,6 +13,8 @@
 
 #include "hooklib/uart.h"
 
+#include "iccard/card-store.h"
+
 #include "util/dprintf.h"
 #include "util/dump.h"
 
@@ -42,6 +44,7 @@ static HRESULT sg_reader_start_hr;
 static struct uart sg_reader_uart;
 static uint8_t sg_reader_written_bytes[520];
 static uint8_t sg_reader_readable_bytes[520];
+static struct card_store sg_reader_cards;
 static struct sg_nfc sg_reader_nfc;
 static struct sg_led sg_reader_led;
 
@@ -65,7 +68,29 @@ HRESULT sg_reader_hook_init(
         return hr;
     }
 
-    sg_nfc_init(&sg_reader_nfc, 0x00, &sg_reader_nfc_ops, NULL);
+    if (cfg->card_dir[0] != L'\0') {
+        hr = card_store_open(&sg_reader_cards, cfg->card_dir);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    sg_nfc_init(
+            &sg_reader_nfc,
+            0x00,
+            &sg_reader_nfc_ops,
+            NULL,
+            &sg_reader_cards);
+
+    if (cfg->stats_interval > 0) {
+        hr = sg_nfc_enable_stats(&sg_reader_nfc, cfg->stats_interval);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
     sg_led_init(&sg_reader_led, 0x08, &sg_reader_led_ops, NULL);
 
     InitializeCriticalSection(&sg_reader_lock);
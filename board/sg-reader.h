@@ -9,6 +9,8 @@
 struct aime_config {
     struct aime_dll_config dll;
     bool enable;
+    wchar_t card_dir[MAX_PATH];
+    unsigned int stats_interval;
 };
 
 HRESULT sg_reader_hook_init(
@@ -18,6 +18,8 @@
 #include "platform/config.h"
 #include "platform/platform.h"
 
+#include "util/ini.h"
+
 void chuni_dll_config_load(
         struct chuni_dll_config *cfg,
         const wchar_t *filename)
@@ -25,7 +27,7 @@ void chuni_dll_config_load(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"chuniio",
             L"path",
             L"",
@@ -39,7 +41,7 @@ void slider_config_load(struct slider_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"slider", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"slider", L"enable", 1, filename);
 }
 
 void chuni_hook_config_load(
@@ -15,6 +15,7 @@
 #include "hook/process.h"
 
 #include "hooklib/gfx.h"
+#include "hooklib/iat.h"
 #include "hooklib/serial.h"
 #include "hooklib/spike.h"
 
@@ -58,6 +59,11 @@ static DWORD CALLBACK chuni_pre_startup(void)
 
     chuni_hook_config_load(&chuni_hook_cfg, L".\\segatools.ini");
 
+    /* Queue up import table patches so that each module's imports are only
+       walked once, when the batch ends */
+
+    iat_hook_begin_batch();
+
     /* Hook Win32 APIs */
 
     gfx_hook_init(&chuni_hook_cfg.gfx, chuni_hook_mod);
@@ -99,6 +105,8 @@ static DWORD CALLBACK chuni_pre_startup(void)
         goto fail;
     }
 
+    iat_hook_end_batch();
+
     /* Initialize debug helpers */
 
     spike_hook_init(L".\\segatools.ini");
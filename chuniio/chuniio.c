@@ -3,18 +3,25 @@
 #include <process.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "chuniio/chuniio.h"
 #include "chuniio/config.h"
 
+#include "util/dprintf.h"
+#include "util/ini.h"
+
 static unsigned int __stdcall chuni_io_slider_thread_proc(void *ctx);
+static void chuni_io_config_reload(void *ctx);
 
 static bool chuni_io_coin;
 static uint16_t chuni_io_coins;
 static uint8_t chuni_io_hand_pos;
 static HANDLE chuni_io_slider_thread;
 static bool chuni_io_slider_stop_flag;
-static struct chuni_io_config chuni_io_cfg;
+static struct chuni_io_config chuni_io_cfg_initial;
+static const struct chuni_io_config *volatile chuni_io_cfg =
+        &chuni_io_cfg_initial;
 
 uint16_t chuni_io_get_api_version(void)
 {
@@ -23,18 +30,47 @@ uint16_t chuni_io_get_api_version(void)
 
 HRESULT chuni_io_jvs_init(void)
 {
-    chuni_io_config_load(&chuni_io_cfg, L".\\segatools.ini");
+    HRESULT hr;
+
+    chuni_io_config_load(&chuni_io_cfg_initial, L".\\segatools.ini");
+    hr = ini_watch(L".\\segatools.ini", chuni_io_config_reload, NULL);
+
+    if (FAILED(hr)) {
+        dprintf("ChuniIO: Key bindings will not reload: %08x\n", (int) hr);
+    }
 
     return S_OK;
 }
 
+static void chuni_io_config_reload(void *ctx)
+{
+    struct chuni_io_config *cfg;
+
+    cfg = malloc(sizeof(*cfg));
+
+    if (cfg == NULL) {
+        return;
+    }
+
+    chuni_io_config_load(cfg, L".\\segatools.ini");
+
+    /* The old snapshot is leaked, see ini_watch_t */
+
+    InterlockedExchangePointer((PVOID volatile *) &chuni_io_cfg, cfg);
+    dprintf("ChuniIO: Reloaded key bindings\n");
+}
+
 void chuni_io_jvs_read_coin_counter(uint16_t *out)
 {
+    const struct chuni_io_config *cfg;
+
     if (out == NULL) {
         return;
     }
 
-    if (GetAsyncKeyState(chuni_io_cfg.vk_coin)) {
+    cfg = chuni_io_cfg;
+
+    if (GetAsyncKeyState(cfg->vk_coin)) {
         if (!chuni_io_coin) {
             chuni_io_coin = true;
             chuni_io_coins++;
@@ -48,17 +84,20 @@ void chuni_io_jvs_read_coin_counter(uint16_t *out)
 
 void chuni_io_jvs_poll(uint8_t *opbtn, uint8_t *beams)
 {
+    const struct chuni_io_config *cfg;
     size_t i;
 
-    if (GetAsyncKeyState(chuni_io_cfg.vk_test)) {
+    cfg = chuni_io_cfg;
+
+    if (GetAsyncKeyState(cfg->vk_test)) {
         *opbtn |= 0x01; /* Test */
     }
 
-    if (GetAsyncKeyState(chuni_io_cfg.vk_service)) {
+    if (GetAsyncKeyState(cfg->vk_service)) {
         *opbtn |= 0x02; /* Service */
     }
 
-    if (GetAsyncKeyState(chuni_io_cfg.vk_ir)) {
+    if (GetAsyncKeyState(cfg->vk_ir)) {
         if (chuni_io_hand_pos < 6) {
             chuni_io_hand_pos++;
         }
@@ -115,6 +154,7 @@ void chuni_io_slider_set_leds(const uint8_t *rgb)
 
 static unsigned int __stdcall chuni_io_slider_thread_proc(void *ctx)
 {
+    const struct chuni_io_config *cfg;
     chuni_io_slider_callback_t callback;
     uint8_t pressure[32];
     size_t i;
@@ -122,8 +162,10 @@ static unsigned int __stdcall chuni_io_slider_thread_proc(void *ctx)
     callback = ctx;
 
     while (!chuni_io_slider_stop_flag) {
+        cfg = chuni_io_cfg;
+
         for (i = 0 ; i < _countof(pressure) ; i++) {
-            if (GetAsyncKeyState(chuni_io_cfg.vk_cell[i]) & 0x8000) {
+            if (GetAsyncKeyState(cfg->vk_cell[i]) & 0x8000) {
                 pressure[i] = 128;
             } else {
                 pressure[i] = 0;
@@ -6,6 +6,8 @@
 
 #include "chuniio/config.h"
 
+#include "util/ini.h"
+
 static const int chuni_io_default_cells[] = {
     'L', 'L', 'L', 'L',
     'K', 'K', 'K', 'K',
@@ -27,14 +29,14 @@ void chuni_io_config_load(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->vk_test = GetPrivateProfileIntW(L"io3", L"test", '1', filename);
-    cfg->vk_service = GetPrivateProfileIntW(L"io3", L"service", '2', filename);
-    cfg->vk_coin = GetPrivateProfileIntW(L"io3", L"coin", '3', filename);
-    cfg->vk_ir = GetPrivateProfileIntW(L"io3", L"ir", VK_SPACE, filename);
+    cfg->vk_test = ini_get_int(L"io3", L"test", '1', filename);
+    cfg->vk_service = ini_get_int(L"io3", L"service", '2', filename);
+    cfg->vk_coin = ini_get_int(L"io3", L"coin", '3', filename);
+    cfg->vk_ir = ini_get_int(L"io3", L"ir", VK_SPACE, filename);
 
     for (i = 0 ; i < 32 ; i++) {
         swprintf_s(key, _countof(key), L"cell%i", i + 1);
-        cfg->vk_cell[i] = GetPrivateProfileIntW(
+        cfg->vk_cell[i] = ini_get_int(
                 L"slider",
                 key,
                 chuni_io_default_cells[i],
@@ -13,6 +13,8 @@
 #include "platform/config.h"
 #include "platform/platform.h"
 
+#include "util/ini.h"
+
 void diva_dll_config_load(
         struct diva_dll_config *cfg,
         const wchar_t *filename)
@@ -20,7 +22,7 @@ void diva_dll_config_load(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"divaio",
             L"path",
             L"",
@@ -34,7 +36,7 @@ void slider_config_load(struct slider_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"slider", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"slider", L"enable", 1, filename);
 }
 
 void diva_hook_config_load(
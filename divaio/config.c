@@ -7,6 +7,8 @@
 
 #include "divaio/config.h"
 
+#include "util/ini.h"
+
 static const int diva_io_default_buttons[] = {
     VK_RIGHT, VK_DOWN, VK_LEFT, VK_UP, VK_SPACE
 };
@@ -27,13 +29,13 @@ void diva_io_config_load(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->vk_test = GetPrivateProfileIntW(L"io3", L"test", '1', filename);
-    cfg->vk_service = GetPrivateProfileIntW(L"io3", L"service", '2', filename);
-    cfg->vk_coin = GetPrivateProfileIntW(L"io3", L"coin", '3', filename);
+    cfg->vk_test = ini_get_int(L"io3", L"test", '1', filename);
+    cfg->vk_service = ini_get_int(L"io3", L"service", '2', filename);
+    cfg->vk_coin = ini_get_int(L"io3", L"coin", '3', filename);
 
     for (i = 0 ; i < _countof(cfg->vk_buttons) ; i++) {
         swprintf_s(key, _countof(key), L"key%i", i + 1);
-        cfg->vk_buttons[i] = GetPrivateProfileIntW(
+        cfg->vk_buttons[i] = ini_get_int(
                 L"buttons",
                 key,
                 diva_io_default_buttons[i],
@@ -42,7 +44,7 @@ void diva_io_config_load(
 
     for (c = 0 ; c < _countof(cfg->vk_slider) ; c++) {
         swprintf_s(cell, _countof(cell), L"cell%i", c + 1);
-        cfg->vk_slider[c] = GetPrivateProfileIntW(
+        cfg->vk_slider[c] = ini_get_int(
                 L"slider",
                 cell,
                 diva_io_default_slider[c],
@@ -8,13 +8,19 @@
 #include "divaio/divaio.h"
 #include "divaio/config.h"
 
+#include "util/dprintf.h"
+#include "util/ini.h"
+
 static unsigned int __stdcall diva_io_slider_thread_proc(void *ctx);
+static void diva_io_config_reload(void *ctx);
 
 static bool diva_io_coin;
 static uint16_t diva_io_coins;
 static HANDLE diva_io_slider_thread;
 static bool diva_io_slider_stop_flag;
-static struct diva_io_config diva_io_cfg;
+static struct diva_io_config diva_io_cfg_initial;
+static const struct diva_io_config *volatile diva_io_cfg =
+        &diva_io_cfg_initial;
 
 uint16_t diva_io_get_api_version(void)
 {
@@ -23,29 +29,57 @@ uint16_t diva_io_get_api_version(void)
 
 HRESULT diva_io_jvs_init(void)
 {
-    diva_io_config_load(&diva_io_cfg, L".\\segatools.ini");
+    HRESULT hr;
+
+    diva_io_config_load(&diva_io_cfg_initial, L".\\segatools.ini");
+    hr = ini_watch(L".\\segatools.ini", diva_io_config_reload, NULL);
+
+    if (FAILED(hr)) {
+        dprintf("DivaIO: Key bindings will not reload: %08x\n", (int) hr);
+    }
 
     return S_OK;
 }
 
+static void diva_io_config_reload(void *ctx)
+{
+    struct diva_io_config *cfg;
+
+    cfg = malloc(sizeof(*cfg));
+
+    if (cfg == NULL) {
+        return;
+    }
+
+    diva_io_config_load(cfg, L".\\segatools.ini");
+
+    /* The old snapshot is leaked, see ini_watch_t */
+
+    InterlockedExchangePointer((PVOID volatile *) &diva_io_cfg, cfg);
+    dprintf("DivaIO: Reloaded key bindings\n");
+}
+
 void diva_io_jvs_poll(uint8_t *opbtn_out, uint8_t *gamebtn_out)
 {
+    const struct diva_io_config *cfg;
     uint8_t opbtn;
     uint8_t gamebtn;
     size_t i;
 
+    cfg = diva_io_cfg;
+
     opbtn = 0;
 
-    if (GetAsyncKeyState(diva_io_cfg.vk_test) & 0x8000) {
+    if (GetAsyncKeyState(cfg->vk_test) & 0x8000) {
         opbtn |= 1;
     }
 
-    if (GetAsyncKeyState(diva_io_cfg.vk_service) & 0x8000) {
+    if (GetAsyncKeyState(cfg->vk_service) & 0x8000) {
         opbtn |= 2;
     }
 
-    for (i = 0 ; i < _countof(diva_io_cfg.vk_buttons) ; i++) {
-        if (GetAsyncKeyState(diva_io_cfg.vk_buttons[i]) & 0x8000) {
+    for (i = 0 ; i < _countof(cfg->vk_buttons) ; i++) {
+        if (GetAsyncKeyState(cfg->vk_buttons[i]) & 0x8000) {
             gamebtn |= 1 << i;
         }
     }
@@ -56,11 +90,15 @@ void diva_io_jvs_poll(uint8_t *opbtn_out, uint8_t *gamebtn_out)
 
 void diva_io_jvs_read_coin_counter(uint16_t *out)
 {
+    const struct diva_io_config *cfg;
+
     if (out == NULL) {
         return;
     }
 
-    if (GetAsyncKeyState(diva_io_cfg.vk_coin) & 0x8000) {
+    cfg = diva_io_cfg;
+
+    if (GetAsyncKeyState(cfg->vk_coin) & 0x8000) {
         if (!diva_io_coin) {
             diva_io_coin = true;
             diva_io_coins++;
@@ -107,6 +145,7 @@ void diva_io_slider_set_leds(const uint8_t *rgb)
 
 static unsigned int __stdcall diva_io_slider_thread_proc(void *ctx)
 {
+    const struct diva_io_config *cfg;
     diva_io_slider_callback_t callback;
     uint8_t pressure_val;
     uint8_t pressure[32];
@@ -115,8 +154,10 @@ static unsigned int __stdcall diva_io_slider_thread_proc(void *ctx)
     callback = ctx;
 
     while (!diva_io_slider_stop_flag) {
+        cfg = diva_io_cfg;
+
         for (i = 0 ; i < 8 ; i++) {
-            if (GetAsyncKeyState(diva_io_cfg.vk_slider[i]) & 0x8000) {
+            if (GetAsyncKeyState(cfg->vk_slider[i]) & 0x8000) {
                 pressure_val = 20;
             } else {
                 pressure_val = 0;
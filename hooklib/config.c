@@ -7,16 +7,19 @@
 #include "hooklib/config.h"
 #include "hooklib/gfx.h"
 #include "hooklib/dvd.h"
+#include "hooklib/reg.h"
+
+#include "util/ini.h"
 
 void gfx_config_load(struct gfx_config *cfg, const wchar_t *filename)
 {
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"gfx", L"enable", 1, filename);
-    cfg->windowed = GetPrivateProfileIntW(L"gfx", L"windowed", 0, filename);
-    cfg->framed = GetPrivateProfileIntW(L"gfx", L"framed", 1, filename);
-    cfg->monitor = GetPrivateProfileIntW(L"gfx", L"monitor", 0, filename);
+    cfg->enable = ini_get_int(L"gfx", L"enable", 1, filename);
+    cfg->windowed = ini_get_int(L"gfx", L"windowed", 0, filename);
+    cfg->framed = ini_get_int(L"gfx", L"framed", 1, filename);
+    cfg->monitor = ini_get_int(L"gfx", L"monitor", 0, filename);
 }
 
 void dvd_config_load(struct dvd_config *cfg, const wchar_t *filename)
@@ -24,5 +27,29 @@ void dvd_config_load(struct dvd_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"dvd", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"dvd", L"enable", 1, filename);
+}
+
+void reg_config_load(struct reg_config *cfg, const wchar_t *filename)
+{
+    assert(cfg != NULL);
+    assert(filename != NULL);
+
+    cfg->enable = ini_get_int(L"reg", L"enable", 1, filename);
+
+    ini_get_string(
+            L"reg",
+            L"path",
+            L"",
+            cfg->path,
+            _countof(cfg->path),
+            filename);
+
+    ini_get_string(
+            L"reg",
+            L"journal",
+            L"",
+            cfg->journal,
+            _countof(cfg->journal),
+            filename);
 }
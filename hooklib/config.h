@@ -5,6 +5,8 @@
 
 #include "hooklib/gfx.h"
 #include "hooklib/dvd.h"
+#include "hooklib/reg.h"
 
 void gfx_config_load(struct gfx_config *cfg, const wchar_t *filename);
 void dvd_config_load(struct dvd_config *cfg, const wchar_t *filename);
+void reg_config_load(struct reg_config *cfg, const wchar_t *filename);
@@ -6,20 +6,57 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
 
 #include "hook/table.h"
 
 #include "hooklib/dll.h"
+#include "hooklib/iat.h"
+
+/* Registered module names are indexed by case-folded basename with any
+   ".dll" extension removed, so "d3d9", "D3D9.DLL" and "C:\foo\d3d9.dll" all
+   find the same entry. */
 
 struct dll_hook_reg {
     const wchar_t *name;
+    wchar_t *key;
+    size_t key_len;
     HMODULE redir_mod;
+    bool watch;
+};
+
+/* An immutable snapshot of every registration, published with a pointer swap
+   on each push so that the loader hooks can look names up without locking.
+   Both indexes are open-addressed tables of (reg index + 1), kept at most
+   half full; zero marks an empty slot. */
+
+struct dll_hook_table {
+    struct dll_hook_reg *regs;
+    size_t nregs;
+    uint32_t *name_index;
+    uint32_t *mod_index;
+    size_t index_size;
 };
 
 /* Helper functions */
 
 static void dll_hook_init(void);
+static void dll_hook_init_lock(void);
+static HRESULT dll_hook_push_reg(
+        HMODULE redir_mod,
+        const wchar_t *name,
+        bool watch);
+static HRESULT dll_hook_publish_locked(const struct dll_hook_reg *new_reg);
+static void dll_hook_basename(
+        const wchar_t *name,
+        const wchar_t **key,
+        size_t *key_len);
+static uint32_t dll_hook_hash_name(const wchar_t *key, size_t key_len);
+static uint32_t dll_hook_hash_mod(HMODULE mod);
+static const struct dll_hook_reg *dll_hook_find(const wchar_t *name);
 static HMODULE dll_hook_search_dll(const wchar_t *name);
 
 /* Hook functions */
@@ -75,48 +112,198 @@ static const struct hook_symbol dll_loader_syms[] = {
 };
 
 static bool dll_hook_initted;
+static bool dll_hook_lock_initted;
 static CRITICAL_SECTION dll_hook_lock;
-static struct dll_hook_reg *dll_hook_list;
-static size_t dll_hook_count;
+static struct dll_hook_table *volatile dll_hook_table;
 
 HRESULT dll_hook_push(
         HMODULE redir_mod,
         const wchar_t *name)
 {
-    struct dll_hook_reg *new_item;
-    struct dll_hook_reg *new_mem;
-    HRESULT hr;
-
     assert(name != NULL);
 
     dll_hook_init();
 
-    EnterCriticalSection(&dll_hook_lock);
+    return dll_hook_push_reg(redir_mod, name, false);
+}
+
+HRESULT dll_hook_push_watch(const wchar_t *name)
+{
+    assert(name != NULL);
+
+    /* Watched names only live in the index; they don't need the loader
+       hooks, so don't install them on this account. */
+
+    dll_hook_init_lock();
+
+    return dll_hook_push_reg(NULL, name, true);
+}
+
+bool dll_hook_is_watched(const wchar_t *name)
+{
+    const struct dll_hook_reg *reg;
+
+    if (name == NULL) {
+        return false;
+    }
+
+    reg = dll_hook_find(name);
+
+    return reg != NULL && reg->watch;
+}
+
+static HRESULT dll_hook_push_reg(
+        HMODULE redir_mod,
+        const wchar_t *name,
+        bool watch)
+{
+    struct dll_hook_reg reg;
+    const wchar_t *key;
+    size_t i;
+    HRESULT hr;
 
-    new_mem = realloc(
-            dll_hook_list,
-            (dll_hook_count + 1) * sizeof(struct dll_hook_reg));
+    dll_hook_basename(name, &key, &reg.key_len);
 
-    if (new_mem == NULL) {
-        hr = E_OUTOFMEMORY;
+    if (reg.key_len == 0) {
+        return E_INVALIDARG;
+    }
+
+    reg.key = malloc((reg.key_len + 1) * sizeof(wchar_t));
 
-        goto end;
+    if (reg.key == NULL) {
+        return E_OUTOFMEMORY;
     }
 
-    new_item = &new_mem[dll_hook_count];
-    new_item->name = name;
-    new_item->redir_mod = redir_mod;
+    for (i = 0 ; i < reg.key_len ; i++) {
+        reg.key[i] = towlower(key[i]);
+    }
 
-    dll_hook_list = new_mem;
-    dll_hook_count++;
-    hr = S_OK;
+    reg.key[reg.key_len] = L'\0';
+    reg.name = name; /* Expect this to be statically allocated */
+    reg.redir_mod = redir_mod;
+    reg.watch = watch;
 
-end:
+    EnterCriticalSection(&dll_hook_lock);
+    hr = dll_hook_publish_locked(&reg);
     LeaveCriticalSection(&dll_hook_lock);
 
+    if (FAILED(hr)) {
+        free(reg.key);
+    }
+
     return hr;
 }
 
+static HRESULT dll_hook_publish_locked(const struct dll_hook_reg *new_reg)
+{
+    const struct dll_hook_table *old;
+    struct dll_hook_table *table;
+    struct dll_hook_reg *reg;
+    uint32_t pos;
+    size_t mask;
+    size_t i;
+    size_t j;
+
+    old = dll_hook_table;
+    table = calloc(1, sizeof(*table));
+
+    if (table == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    table->nregs = (old != NULL ? old->nregs : 0) + 1;
+    table->regs = calloc(table->nregs, sizeof(*table->regs));
+    table->index_size = 16;
+
+    while (table->index_size < table->nregs * 2) {
+        table->index_size *= 2;
+    }
+
+    table->name_index = calloc(table->index_size, sizeof(uint32_t));
+    table->mod_index = calloc(table->index_size, sizeof(uint32_t));
+
+    if (    table->regs == NULL ||
+            table->name_index == NULL ||
+            table->mod_index == NULL) {
+        free(table->mod_index);
+        free(table->name_index);
+        free(table->regs);
+        free(table);
+
+        return E_OUTOFMEMORY;
+    }
+
+    /* Registration strings are shared between snapshots */
+
+    if (old != NULL) {
+        memcpy(table->regs, old->regs, old->nregs * sizeof(*old->regs));
+    }
+
+    table->regs[table->nregs - 1] = *new_reg;
+    mask = table->index_size - 1;
+
+    for (i = 0 ; i < table->nregs ; i++) {
+        reg = &table->regs[i];
+        j = dll_hook_hash_name(reg->key, reg->key_len) & mask;
+
+        /* If a name is registered twice then the first redirect wins, as it
+           did when this was a linear scan, but a later watch still applies. */
+
+        while ((pos = table->name_index[j]) != 0) {
+            if (wcscmp(table->regs[pos - 1].key, reg->key) == 0) {
+                break;
+            }
+
+            j = (j + 1) & mask;
+        }
+
+        if (pos == 0) {
+            table->name_index[j] = (uint32_t) (i + 1);
+        } else {
+            if (table->regs[pos - 1].redir_mod == NULL) {
+                table->regs[pos - 1].redir_mod = reg->redir_mod;
+            }
+
+            table->regs[pos - 1].watch |= reg->watch;
+        }
+
+        if (reg->redir_mod == NULL) {
+            continue;
+        }
+
+        j = dll_hook_hash_mod(reg->redir_mod) & mask;
+
+        while (table->mod_index[j] != 0) {
+            if (table->regs[table->mod_index[j] - 1].redir_mod ==
+                    reg->redir_mod) {
+                break;
+            }
+
+            j = (j + 1) & mask;
+        }
+
+        if (table->mod_index[j] == 0) {
+            table->mod_index[j] = (uint32_t) (i + 1);
+        }
+    }
+
+    /* The previous table is not freed, since lookups run without the lock */
+
+    InterlockedExchangePointer((PVOID volatile *) &dll_hook_table, table);
+
+    return S_OK;
+}
+
+static void dll_hook_init_lock(void)
+{
+    if (dll_hook_lock_initted) {
+        return;
+    }
+
+    dll_hook_lock_initted = true;
+    InitializeCriticalSection(&dll_hook_lock);
+}
+
 static void dll_hook_init(void)
 {
     HMODULE kernel32;
@@ -128,7 +315,7 @@ static void dll_hook_init(void)
     }
 
     dll_hook_initted = true;
-    InitializeCriticalSection(&dll_hook_lock);
+    dll_hook_init_lock();
 
     /* Protect against the (probably impossible) scenario where nothing in the
        process imports LoadLibraryW but something imports LoadLibraryA. Also
@@ -145,53 +332,142 @@ static void dll_hook_init(void)
 
     /* Now we can apply the hook table */
 
-    hook_table_apply(
+    iat_hook_push(
             NULL,
             "kernel32.dll",
             dll_loader_syms,
             _countof(dll_loader_syms));
 }
 
-static HMODULE dll_hook_search_dll(const wchar_t *name)
+static void dll_hook_basename(
+        const wchar_t *name,
+        const wchar_t **key,
+        size_t *key_len)
 {
-    HMODULE result;
+    const wchar_t *pos;
+    size_t len;
+
+    for (pos = name ; *name != L'\0' ; name++) {
+        if (*name == L'\\' || *name == L'/') {
+            pos = name + 1;
+        }
+    }
+
+    len = name - pos;
+
+    if (len > 4 && _wcsicmp(&pos[len - 4], L".dll") == 0) {
+        len -= 4;
+    }
+
+    *key = pos;
+    *key_len = len;
+}
+
+static uint32_t dll_hook_hash_name(const wchar_t *key, size_t key_len)
+{
+    uint32_t hash;
     size_t i;
 
-    result = NULL;
+    /* FNV-1a over the case-folded characters */
 
-    EnterCriticalSection(&dll_hook_lock);
+    hash = 0x811C9DC5;
 
-    for (i = 0 ; i < dll_hook_count ; i++) {
-        if (wcsicmp(name, dll_hook_list[i].name) == 0) {
-            result = dll_hook_list[i].redir_mod;
+    for (i = 0 ; i < key_len ; i++) {
+        hash ^= (uint32_t) towlower(key[i]);
+        hash *= 0x01000193;
+    }
 
-            break;
+    return hash;
+}
+
+static uint32_t dll_hook_hash_mod(HMODULE mod)
+{
+    uintptr_t value;
+
+    /* Module bases are 64K aligned, so discard the low bits before mixing */
+
+    value = (uintptr_t) mod >> 16;
+
+    return (uint32_t) (value * 0x9E3779B1u);
+}
+
+static const struct dll_hook_reg *dll_hook_find(const wchar_t *name)
+{
+    const struct dll_hook_table *table;
+    const struct dll_hook_reg *reg;
+    const wchar_t *key;
+    size_t key_len;
+    uint32_t pos;
+    size_t mask;
+    size_t i;
+    size_t j;
+
+    table = dll_hook_table;
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    dll_hook_basename(name, &key, &key_len);
+    mask = table->index_size - 1;
+    j = dll_hook_hash_name(key, key_len) & mask;
+
+    while ((pos = table->name_index[j]) != 0) {
+        reg = &table->regs[pos - 1];
+
+        if (reg->key_len == key_len) {
+            for (i = 0 ; i < key_len ; i++) {
+                if (reg->key[i] != towlower(key[i])) {
+                    break;
+                }
+            }
+
+            if (i == key_len) {
+                return reg;
+            }
         }
+
+        j = (j + 1) & mask;
     }
 
-    LeaveCriticalSection(&dll_hook_lock);
+    return NULL;
+}
 
-    return result;
+static HMODULE dll_hook_search_dll(const wchar_t *name)
+{
+    const struct dll_hook_reg *reg;
+
+    reg = dll_hook_find(name);
+
+    return reg != NULL ? reg->redir_mod : NULL;
 }
 
 static BOOL WINAPI hook_FreeLibrary(HMODULE mod)
 {
+    const struct dll_hook_table *table;
+    uint32_t pos;
+    size_t mask;
     bool match;
-    size_t i;
+    size_t j;
 
     match = false;
-    EnterCriticalSection(&dll_hook_lock);
+    table = dll_hook_table;
+
+    if (table != NULL && mod != NULL) {
+        mask = table->index_size - 1;
+        j = dll_hook_hash_mod(mod) & mask;
 
-    for (i = 0 ; i < dll_hook_count ; i++) {
-        if (mod == dll_hook_list[i].redir_mod) {
-            match = true;
+        while ((pos = table->mod_index[j]) != 0) {
+            if (table->regs[pos - 1].redir_mod == mod) {
+                match = true;
 
-            break;
+                break;
+            }
+
+            j = (j + 1) & mask;
         }
     }
 
-    LeaveCriticalSection(&dll_hook_lock);
-
     if (match) {
         /* Block attempts to unload redirected modules, since this could cause
            a hook DLL to unexpectedly vanish and crash the whole application.
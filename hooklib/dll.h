@@ -1,8 +1,16 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 HRESULT dll_hook_push(
         HMODULE redir_mod,
         const wchar_t *name);
+
+/* Add a module name to the shared basename index without redirecting it, so
+   that other hooks can cheaply recognise loads of that module. Names are
+   compared by case-folded basename with any ".dll" extension ignored. */
+
+HRESULT dll_hook_push_watch(const wchar_t *name);
+bool dll_hook_is_watched(const wchar_t *name);
@@ -6,6 +6,8 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,6 +15,7 @@
 #include "hook/table.h"
 
 #include "hooklib/dns.h"
+#include "hooklib/iat.h"
 
 /* Latest w32headers does not include DnsQueryEx, so we'll have to "polyfill"
    its associated data types here for the time being.
@@ -32,11 +35,184 @@ typedef struct POLYFILL_DNS_QUERY_REQUEST {
     PVOID pQueryContext;
 } POLYFILL_DNS_QUERY_REQUEST;
 
+/* Longest name that can appear in a DNS query, sans trailing dot */
+
+#define DNS_HOOK_MAX_NAME 253
+
+/* Answers synthesised from IP literal targets are given this TTL (seconds) */
+
+#define DNS_HOOK_LITERAL_TTL 3600
+
 struct dns_hook_entry {
     wchar_t *from;
+    size_t from_len;
+    bool wildcard;
     wchar_t *to;
+    char *to_a;
+    bool literal;
+    uint32_t addr;
 };
 
+/* Wildcard rules live in a trie keyed on DNS labels in reverse order, so
+   "*.naominet.jp" is stored under the path jp -> naominet. Siblings form a
+   singly linked list; the root is node 0, so a zero link means "none". */
+
+struct dns_hook_node {
+    const wchar_t *label;
+    size_t label_len;
+    int entry;
+    size_t child;
+    size_t next;
+};
+
+/* An immutable snapshot of every registered rule. A new table is built and
+   published with a pointer swap each time a rule is pushed, which lets the
+   hooks below look names up without taking any locks. */
+
+struct dns_hook_table {
+    struct dns_hook_entry *entries;
+    size_t nentries;
+    uint32_t *index;
+    size_t index_size;
+    struct dns_hook_node *nodes;
+    size_t nnodes;
+};
+
+/* Synthesised DNS_RECORDs are handed out from a fixed pool so that the
+   DnsFree hooks can recognise (and release) them with a range check. The
+   record layout is the same for DnsQuery_A and DnsQuery_W apart from the
+   character type of pName. */
+
+enum {
+    DNS_HOOK_NRECORDS = 64,
+};
+
+struct dns_hook_record {
+    DNS_RECORDA rec;
+    union {
+        char a[(DNS_HOOK_MAX_NAME + 2) * sizeof(wchar_t)];
+        wchar_t w[DNS_HOOK_MAX_NAME + 2];
+    } name;
+    volatile LONG in_use;
+};
+
+/* Resolver cache for names that get forwarded to the real resolver. This is
+   a small direct-mapped table of IPv4 answers (or "no such name") keyed on
+   the case-folded name. getaddrinfo does not report TTLs, so its answers get
+   a fixed lifetime; DnsQuery answers keep their own TTL up to the same
+   limit. Only DnsQuery's NXDOMAIN gets cached as "no such name": getaddrinfo
+   reports a resolver that is unreachable the same way as a name that does
+   not exist, and that must not stick for the negative TTL. */
+
+enum {
+    DNS_CACHE_SIZE = 128,
+    DNS_CACHE_MAX_TTL_MS = 300000,
+    DNS_CACHE_NEGATIVE_TTL_MS = 30000,
+};
+
+enum dns_cache_result {
+    DNS_CACHE_MISS,
+    DNS_CACHE_HIT,
+    DNS_CACHE_NEGATIVE,
+};
+
+struct dns_cache_key {
+    char name[DNS_HOOK_MAX_NAME + 1];
+    uint32_t hash;
+    bool valid;
+};
+
+struct dns_cache_entry {
+    char name[DNS_HOOK_MAX_NAME + 1];
+    uint32_t addr;
+    ULONGLONG expiry;
+    bool negative;
+};
+
+/* A name being looked up, which may be either narrow or wide */
+
+struct dns_hook_name {
+    const char *a;
+    const wchar_t *w;
+    size_t len;
+};
+
+/* Helpers */
+
+static void dns_hook_init(void);
+
+static HRESULT dns_hook_publish_locked(const struct dns_hook_entry *new_entry);
+
+static void dns_hook_trie_insert(struct dns_hook_table *table, int entry);
+
+static size_t dns_hook_trie_child(
+        const struct dns_hook_table *table,
+        size_t node,
+        const struct dns_hook_name *name,
+        size_t off,
+        size_t len);
+
+static const struct dns_hook_entry *dns_hook_match(
+        const struct dns_hook_name *name);
+
+static const struct dns_hook_entry *dns_hook_match_a(const char *name);
+
+static uint32_t dns_hook_hash(
+        const struct dns_hook_name *name,
+        size_t off,
+        size_t len);
+
+static bool dns_hook_name_eq(
+        const struct dns_hook_name *name,
+        size_t off,
+        size_t len,
+        const wchar_t *str,
+        size_t str_len);
+
+static bool dns_hook_parse_ipv4(const wchar_t *str, uint32_t *addr);
+
+static DNS_STATUS dns_hook_synth_a(
+        const struct dns_hook_name *name,
+        uint32_t addr,
+        uint32_t ttl,
+        DNS_RECORD **out);
+
+static bool dns_hook_release_record(void *ptr);
+
+static bool dns_hook_query_from_cache(
+        const struct dns_hook_name *orig,
+        const struct dns_hook_name *fwd,
+        WORD type,
+        DWORD options,
+        DNS_RECORD **out,
+        DNS_STATUS *status,
+        struct dns_cache_key *key);
+
+static void dns_hook_query_to_cache(
+        const struct dns_cache_key *key,
+        DNS_STATUS status,
+        const DNS_RECORDA *results);
+
+static int dns_hook_getaddrinfo_numeric(
+        uint32_t addr,
+        const char *service,
+        const ADDRINFOA *hints,
+        ADDRINFOA **result);
+
+static bool dns_cache_make_key(
+        const struct dns_hook_name *name,
+        struct dns_cache_key *key);
+
+static enum dns_cache_result dns_cache_lookup(
+        const struct dns_cache_key *key,
+        uint32_t *addr,
+        uint32_t *ttl_ms);
+
+static void dns_cache_insert(
+        const struct dns_cache_key *key,
+        const uint32_t *addr,
+        uint32_t ttl_ms);
+
 /* Hook funcs */
 
 static DNS_STATUS WINAPI hook_DnsQuery_A(
@@ -60,6 +236,12 @@ static DNS_STATUS WINAPI hook_DnsQueryEx(
         void *pQueryResults,
         void *pCancelHandle);
 
+static void WINAPI hook_DnsFree(void *pData, DNS_FREE_TYPE FreeType);
+
+static void WINAPI hook_DnsRecordListFree(
+        DNS_RECORD *pRecordList,
+        DNS_FREE_TYPE FreeType);
+
 static int WSAAPI hook_getaddrinfo(
         const char *pNodeName,
         const char *pServiceName,
@@ -89,6 +271,12 @@ static DNS_STATUS (WINAPI *next_DnsQueryEx)(
         void *pQueryResults,
         void *pCancelHandle);
 
+static void (WINAPI *next_DnsFree)(void *pData, DNS_FREE_TYPE FreeType);
+
+static void (WINAPI *next_DnsRecordListFree)(
+        DNS_RECORD *pRecordList,
+        DNS_FREE_TYPE FreeType);
+
 static int (WSAAPI *next_getaddrinfo)(
         const char *pNodeName,
         const char *pServiceName,
@@ -108,6 +296,14 @@ static const struct hook_symbol dns_hook_syms_dnsapi[] = {
         .name       = "DnsQueryEx",
         .patch      = hook_DnsQueryEx,
         .link       = (void **) &next_DnsQueryEx,
+    }, {
+        .name       = "DnsFree",
+        .patch      = hook_DnsFree,
+        .link       = (void **) &next_DnsFree,
+    }, {
+        .name       = "DnsRecordListFree",
+        .patch      = hook_DnsRecordListFree,
+        .link       = (void **) &next_DnsRecordListFree,
     }
 };
 
@@ -122,8 +318,26 @@ static const struct hook_symbol dns_hook_syms_ws2[] = {
 
 static bool dns_hook_initted;
 static CRITICAL_SECTION dns_hook_lock;
-static struct dns_hook_entry *dns_hook_entries;
-static size_t dns_hook_nentries;
+static struct dns_hook_table *volatile dns_hook_table;
+static struct dns_hook_record dns_hook_records[DNS_HOOK_NRECORDS];
+static SRWLOCK dns_cache_lock = SRWLOCK_INIT;
+static struct dns_cache_entry dns_cache[DNS_CACHE_SIZE];
+static volatile LONG dns_cache_hits;
+static volatile LONG dns_cache_misses;
+
+static inline unsigned int dns_hook_fold(unsigned int c)
+{
+    /* Host names are ASCII, so ASCII case folding is all we need */
+
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline unsigned int dns_hook_name_at(
+        const struct dns_hook_name *name,
+        size_t i)
+{
+    return name->w != NULL ? name->w[i] : (unsigned char) name->a[i];
+}
 
 static void dns_hook_init(void)
 {
@@ -134,13 +348,13 @@ static void dns_hook_init(void)
     dns_hook_initted = true;
     InitializeCriticalSection(&dns_hook_lock);
 
-    hook_table_apply(
+    iat_hook_push(
             NULL,
             "dnsapi.dll",
             dns_hook_syms_dnsapi,
             _countof(dns_hook_syms_dnsapi));
 
-    hook_table_apply(
+    iat_hook_push(
             NULL,
             "ws2_32.dll",
             dns_hook_syms_ws2,
@@ -149,133 +363,855 @@ static void dns_hook_init(void)
 
 HRESULT dns_hook_push(const wchar_t *from_src, const wchar_t *to_src)
 {
+    struct dns_hook_entry entry;
+    size_t to_c;
     HRESULT hr;
-    struct dns_hook_entry *newmem;
-    struct dns_hook_entry *newitem;
-    wchar_t *from;
-    wchar_t *to;
 
     assert(from_src != NULL);
 
-    to = NULL;
-    from = NULL;
-    dns_hook_init();
+    memset(&entry, 0, sizeof(entry));
 
-    EnterCriticalSection(&dns_hook_lock);
+    /* "*.example.com" matches any name strictly below example.com */
+
+    if (from_src[0] == L'*' && from_src[1] == L'.') {
+        entry.wildcard = true;
+        from_src += 2;
+    }
+
+    entry.from_len = wcslen(from_src);
+
+    if (entry.from_len > 0 && from_src[entry.from_len - 1] == L'.') {
+        entry.from_len--;
+    }
 
-    from = _wcsdup(from_src);
+    if (entry.from_len == 0 || entry.from_len > DNS_HOOK_MAX_NAME) {
+        return E_INVALIDARG;
+    }
+
+    entry.from = _wcsdup(from_src);
 
-    if (from == NULL) {
+    if (entry.from == NULL) {
         hr = E_OUTOFMEMORY;
 
         goto end;
     }
 
-    if(to_src != NULL) {
-        to = _wcsdup(to_src);
+    entry.from[entry.from_len] = L'\0';
+
+    if (    entry.wildcard &&
+            (entry.from[0] == L'.' || wcsstr(entry.from, L"..") != NULL)) {
+        hr = E_INVALIDARG;
+
+        goto end;
+    }
+
+    if (to_src != NULL) {
+        entry.to = _wcsdup(to_src);
 
-        if (to == NULL) {
+        if (entry.to == NULL) {
             hr = E_OUTOFMEMORY;
 
             goto end;
         }
-    }
 
-    newmem = realloc(
-            dns_hook_entries,
-            (dns_hook_nentries + 1) * sizeof(struct dns_hook_entry));
+        /* Pre-narrow the target so the ANSI hooks never have to */
 
-    if (newmem == NULL) {
-        hr = E_OUTOFMEMORY;
+        if (wcstombs_s(&to_c, NULL, 0, to_src, 0) != 0 || to_c == 0) {
+            hr = E_INVALIDARG;
 
-        goto end;
-    }
+            goto end;
+        }
+
+        entry.to_a = malloc(to_c);
 
-    dns_hook_entries = newmem;
-    newitem = &newmem[dns_hook_nentries++];
-    newitem->from = from;
-    newitem->to = to;
+        if (entry.to_a == NULL) {
+            hr = E_OUTOFMEMORY;
 
-    from = NULL;
-    to = NULL;
-    hr = S_OK;
+            goto end;
+        }
 
-end:
+        wcstombs_s(NULL, entry.to_a, to_c, to_src, to_c - 1);
+
+        /* IPv4 literal targets get answered without calling the resolver */
+
+        entry.literal = dns_hook_parse_ipv4(to_src, &entry.addr);
+    }
+
+    dns_hook_init();
+
+    EnterCriticalSection(&dns_hook_lock);
+    hr = dns_hook_publish_locked(&entry);
     LeaveCriticalSection(&dns_hook_lock);
 
-    free(to);
-    free(from);
+end:
+    if (FAILED(hr)) {
+        free(entry.to_a);
+        free(entry.to);
+        free(entry.from);
+    }
 
     return hr;
 }
 
-static DNS_STATUS WINAPI hook_DnsQuery_A(
-        const char *pszName,
-        WORD wType,
-        DWORD Options,
-        void *pExtra,
-        DNS_RECORD **ppQueryResults,
-        void *pReserved)
+static HRESULT dns_hook_publish_locked(const struct dns_hook_entry *new_entry)
 {
-    const struct dns_hook_entry *pos;
+    const struct dns_hook_table *old;
+    struct dns_hook_table *table;
+    struct dns_hook_name name;
+    const struct dns_hook_entry *entry;
+    size_t max_nodes;
     size_t i;
-    size_t wstr_c;
-    wchar_t *wstr;
-    size_t str_c;
-    char *str;
-    DNS_STATUS code;
-    HRESULT hr;
+    size_t j;
 
-    wstr = NULL;
-    str = NULL;
+    old = dns_hook_table;
+    table = calloc(1, sizeof(*table));
 
-    if (pszName == NULL) {
-        hr = HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+    if (table == NULL) {
+        return E_OUTOFMEMORY;
+    }
 
-        goto end;
+    /* Entry strings are shared between snapshots; only the arrays are new */
+
+    table->nentries = (old != NULL ? old->nentries : 0) + 1;
+    table->entries = calloc(table->nentries, sizeof(*table->entries));
+
+    if (table->entries == NULL) {
+        goto fail;
     }
 
-    mbstowcs_s(&wstr_c, NULL, 0, pszName, 0);
-    wstr = malloc(wstr_c * sizeof(wchar_t));
+    if (old != NULL) {
+        memcpy( table->entries,
+                old->entries,
+                old->nentries * sizeof(*old->entries));
+    }
 
-    if (wstr == NULL) {
-        hr = HRESULT_FROM_WIN32(ERROR_OUTOFMEMORY);
+    table->entries[table->nentries - 1] = *new_entry;
 
-        goto end;
+    /* Exact names: open-addressed hash table of (entry index + 1), kept at
+       most half full. Zero marks an empty slot. */
+
+    table->index_size = 16;
+
+    while (table->index_size < table->nentries * 2) {
+        table->index_size *= 2;
     }
 
-    mbstowcs_s(NULL, wstr, wstr_c, pszName, wstr_c - 1);
-    EnterCriticalSection(&dns_hook_lock);
+    table->index = calloc(table->index_size, sizeof(*table->index));
 
-    for (i = 0 ; i < dns_hook_nentries ; i++) {
-        pos = &dns_hook_entries[i];
+    if (table->index == NULL) {
+        goto fail;
+    }
 
-        if (_wcsicmp(wstr, pos->from) == 0) {
-            if(pos->to == NULL) {
-                LeaveCriticalSection(&dns_hook_lock);
-                hr = HRESULT_FROM_WIN32(DNS_ERROR_RCODE_NAME_ERROR);
+    /* Labels are at most one per character of the wildcard suffix, plus the
+       root. Size the array up front so that node indices stay stable. */
+
+    max_nodes = 1;
+
+    for (i = 0 ; i < table->nentries ; i++) {
+        if (table->entries[i].wildcard) {
+            max_nodes += table->entries[i].from_len;
+        }
+    }
+
+    table->nodes = calloc(max_nodes, sizeof(*table->nodes));
+
+    if (table->nodes == NULL) {
+        goto fail;
+    }
+
+    table->nodes[0].entry = -1;
+    table->nnodes = 1;
+
+    /* Insert in push order; if a name was pushed twice the first rule wins,
+       as it did when this was a linear scan. */
+
+    for (i = 0 ; i < table->nentries ; i++) {
+        entry = &table->entries[i];
+
+        if (entry->wildcard) {
+            dns_hook_trie_insert(table, (int) i);
+
+            continue;
+        }
 
-                goto end;
+        name.a = NULL;
+        name.w = entry->from;
+        name.len = entry->from_len;
+        j = dns_hook_hash(&name, 0, name.len) & (table->index_size - 1);
+
+        while (table->index[j] != 0) {
+            if (dns_hook_name_eq(
+                    &name,
+                    0,
+                    name.len,
+                    table->entries[table->index[j] - 1].from,
+                    table->entries[table->index[j] - 1].from_len)) {
+                break;
             }
 
-            wcstombs_s(&str_c, NULL, 0, pos->to, 0);
-            str = malloc(str_c * sizeof(char));
+            j = (j + 1) & (table->index_size - 1);
+        }
+
+        if (table->index[j] == 0) {
+            table->index[j] = (uint32_t) (i + 1);
+        }
+    }
+
+    /* Never freed: lookups don't take the lock, and this only runs at
+       startup */
+
+    InterlockedExchangePointer((PVOID volatile *) &dns_hook_table, table);
+
+    return S_OK;
+
+fail:
+    free(table->nodes);
+    free(table->index);
+    free(table->entries);
+    free(table);
+
+    return E_OUTOFMEMORY;
+}
+
+static void dns_hook_trie_insert(struct dns_hook_table *table, int entry)
+{
+    struct dns_hook_name name;
+    struct dns_hook_node *node;
+    size_t cur;
+    size_t child;
+    size_t start;
+    size_t end;
+
+    name.a = NULL;
+    name.w = table->entries[entry].from;
+    name.len = table->entries[entry].from_len;
+
+    cur = 0;
+    end = name.len;
 
-            if (str == NULL) {
-                LeaveCriticalSection(&dns_hook_lock);
-                hr = HRESULT_FROM_WIN32(ERROR_OUTOFMEMORY);
+    for (;;) {
+        start = end;
 
-                goto end;
+        while (start > 0 && name.w[start - 1] != L'.') {
+            start--;
+        }
+
+        child = dns_hook_trie_child(table, cur, &name, start, end - start);
+
+        if (child == 0) {
+            child = table->nnodes++;
+            node = &table->nodes[child];
+            node->label = &name.w[start];
+            node->label_len = end - start;
+            node->entry = -1;
+            node->child = 0;
+            node->next = table->nodes[cur].child;
+            table->nodes[cur].child = child;
+        }
+
+        cur = child;
+
+        if (start == 0) {
+            break;
+        }
+
+        end = start - 1;
+    }
+
+    if (table->nodes[cur].entry < 0) {
+        table->nodes[cur].entry = entry;
+    }
+}
+
+static size_t dns_hook_trie_child(
+        const struct dns_hook_table *table,
+        size_t node,
+        const struct dns_hook_name *name,
+        size_t off,
+        size_t len)
+{
+    const struct dns_hook_node *child;
+    size_t i;
+
+    for (i = table->nodes[node].child ; i != 0 ; i = child->next) {
+        child = &table->nodes[i];
+
+        if (dns_hook_name_eq(name, off, len, child->label, child->label_len)) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static const struct dns_hook_entry *dns_hook_match(
+        const struct dns_hook_name *name_in)
+{
+    const struct dns_hook_table *table;
+    const struct dns_hook_entry *entry;
+    const struct dns_hook_entry *best;
+    struct dns_hook_name name;
+    size_t node;
+    size_t start;
+    size_t end;
+    uint32_t pos;
+    size_t j;
+
+    table = dns_hook_table;
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    /* Fully qualified names may carry a trailing dot */
+
+    name = *name_in;
+
+    if (name.len > 0 && dns_hook_name_at(&name, name.len - 1) == '.') {
+        name.len--;
+    }
+
+    if (name.len == 0 || name.len > DNS_HOOK_MAX_NAME) {
+        return NULL;
+    }
+
+    /* Exact names take precedence over wildcards */
+
+    j = dns_hook_hash(&name, 0, name.len) & (table->index_size - 1);
+
+    for (;;) {
+        pos = table->index[j];
+
+        if (pos == 0) {
+            break;
+        }
+
+        entry = &table->entries[pos - 1];
+
+        if (dns_hook_name_eq(
+                &name,
+                0,
+                name.len,
+                entry->from,
+                entry->from_len)) {
+            return entry;
+        }
+
+        j = (j + 1) & (table->index_size - 1);
+    }
+
+    /* Walk the wildcard trie from the rightmost label, remembering the
+       deepest wildcard that still has at least one label to its left. */
+
+    if (table->nodes[0].child == 0) {
+        return NULL;
+    }
+
+    best = NULL;
+    node = 0;
+    end = name.len;
+
+    for (;;) {
+        start = end;
+
+        while (start > 0 && dns_hook_name_at(&name, start - 1) != '.') {
+            start--;
+        }
+
+        node = dns_hook_trie_child(table, node, &name, start, end - start);
+
+        if (node == 0 || start == 0) {
+            break;
+        }
+
+        if (table->nodes[node].entry >= 0) {
+            best = &table->entries[table->nodes[node].entry];
+        }
+
+        end = start - 1;
+    }
+
+    return best;
+}
+
+static const struct dns_hook_entry *dns_hook_match_a(const char *str)
+{
+    struct dns_hook_name name;
+    wchar_t wstr[DNS_HOOK_MAX_NAME + 2];
+    size_t wstr_c;
+    size_t i;
+
+    name.a = str;
+    name.w = NULL;
+    name.len = strlen(str);
+
+    if (name.len > DNS_HOOK_MAX_NAME + 1) {
+        return NULL;
+    }
+
+    /* Plain ASCII names are matched as-is. Anything else is widened first
+       (into a stack buffer) so that it compares the same way it always has. */
+
+    for (i = 0 ; i < name.len ; i++) {
+        if ((unsigned char) str[i] >= 0x80) {
+            if (mbstowcs_s(
+                    &wstr_c,
+                    wstr,
+                    _countof(wstr),
+                    str,
+                    _TRUNCATE) != 0) {
+                return NULL;
             }
 
-            wcstombs_s(NULL, str, str_c, pos->to, str_c - 1);
-            pszName = str;
+            name.a = NULL;
+            name.w = wstr;
+            name.len = wcslen(wstr);
 
             break;
         }
     }
 
-    LeaveCriticalSection(&dns_hook_lock);
+    return dns_hook_match(&name);
+}
+
+static uint32_t dns_hook_hash(
+        const struct dns_hook_name *name,
+        size_t off,
+        size_t len)
+{
+    uint32_t hash;
+    size_t i;
+
+    /* FNV-1a over the case-folded characters */
+
+    hash = 0x811C9DC5;
+
+    for (i = off ; i < off + len ; i++) {
+        hash ^= dns_hook_fold(dns_hook_name_at(name, i));
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static bool dns_hook_name_eq(
+        const struct dns_hook_name *name,
+        size_t off,
+        size_t len,
+        const wchar_t *str,
+        size_t str_len)
+{
+    size_t i;
+
+    if (len != str_len) {
+        return false;
+    }
+
+    for (i = 0 ; i < len ; i++) {
+        if (    dns_hook_fold(dns_hook_name_at(name, off + i)) !=
+                dns_hook_fold(str[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool dns_hook_parse_ipv4(const wchar_t *str, uint32_t *addr)
+{
+    uint8_t bytes[4];
+    unsigned int value;
+    size_t ndigits;
+    size_t i;
+
+    /* Strict dotted quad only; anything fancier goes to the resolver */
+
+    for (i = 0 ; i < 4 ; i++) {
+        if (i > 0) {
+            if (*str != L'.') {
+                return false;
+            }
+
+            str++;
+        }
+
+        value = 0;
+        ndigits = 0;
+
+        while (*str >= L'0' && *str <= L'9' && ndigits < 3) {
+            value = value * 10 + (*str - L'0');
+            str++;
+            ndigits++;
+        }
+
+        if (ndigits == 0 || value > 255) {
+            return false;
+        }
+
+        bytes[i] = (uint8_t) value;
+    }
+
+    if (*str != L'\0') {
+        return false;
+    }
+
+    memcpy(addr, bytes, sizeof(bytes));
+
+    return true;
+}
+
+static DNS_STATUS dns_hook_synth_a(
+        const struct dns_hook_name *name,
+        uint32_t addr,
+        uint32_t ttl,
+        DNS_RECORD **out)
+{
+    struct dns_hook_record *slot;
+    size_t i;
+
+    if (name->len > DNS_HOOK_MAX_NAME + 1) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    for (i = 0 ; i < _countof(dns_hook_records) ; i++) {
+        slot = &dns_hook_records[i];
+
+        if (InterlockedCompareExchange(&slot->in_use, 1, 0) == 0) {
+            break;
+        }
+    }
+
+    if (i >= _countof(dns_hook_records)) {
+        /* Pool exhausted: caller falls back to the real resolver */
+        return ERROR_OUTOFMEMORY;
+    }
+
+    memset(&slot->rec, 0, sizeof(slot->rec));
+
+    if (name->w != NULL) {
+        memcpy(slot->name.w, name->w, name->len * sizeof(wchar_t));
+        slot->name.w[name->len] = L'\0';
+        slot->rec.pName = (char *) slot->name.w;
+        slot->rec.Flags.S.CharSet = DnsCharSetUnicode;
+    } else {
+        memcpy(slot->name.a, name->a, name->len);
+        slot->name.a[name->len] = '\0';
+        slot->rec.pName = slot->name.a;
+        slot->rec.Flags.S.CharSet = DnsCharSetAnsi;
+    }
+
+    slot->rec.wType = DNS_TYPE_A;
+    slot->rec.wDataLength = sizeof(DNS_A_DATA);
+    slot->rec.Flags.S.Section = DnsSectionAnswer;
+    slot->rec.dwTtl = ttl;
+    slot->rec.Data.A.IpAddress = addr;
+
+    *out = (DNS_RECORD *) &slot->rec;
+
+    return ERROR_SUCCESS;
+}
+
+static bool dns_hook_release_record(void *ptr)
+{
+    uintptr_t base;
+    uintptr_t pos;
+    size_t i;
+
+    base = (uintptr_t) dns_hook_records;
+    pos = (uintptr_t) ptr;
+
+    if (pos < base || pos >= base + sizeof(dns_hook_records)) {
+        return false;
+    }
+
+    i = (pos - base) / sizeof(dns_hook_records[0]);
+    InterlockedExchange(&dns_hook_records[i].in_use, 0);
+
+    return true;
+}
+
+static bool dns_hook_query_from_cache(
+        const struct dns_hook_name *orig,
+        const struct dns_hook_name *fwd,
+        WORD type,
+        DWORD options,
+        DNS_RECORD **out,
+        DNS_STATUS *status,
+        struct dns_cache_key *key)
+{
+    enum dns_cache_result result;
+    uint32_t addr;
+    uint32_t ttl_ms;
+
+    key->valid = false;
+
+    if (    type != DNS_TYPE_A ||
+            out == NULL ||
+            (options & DNS_QUERY_BYPASS_CACHE) ||
+            !dns_cache_make_key(fwd, key)) {
+        return false;
+    }
+
+    result = dns_cache_lookup(key, &addr, &ttl_ms);
+
+    if (result == DNS_CACHE_NEGATIVE) {
+        *status = DNS_ERROR_RCODE_NAME_ERROR;
+
+        return true;
+    }
+
+    if (    result == DNS_CACHE_HIT &&
+            dns_hook_synth_a(orig, addr, ttl_ms / 1000, out) == ERROR_SUCCESS) {
+        *status = ERROR_SUCCESS;
+
+        return true;
+    }
+
+    return false;
+}
+
+static void dns_hook_query_to_cache(
+        const struct dns_cache_key *key,
+        DNS_STATUS status,
+        const DNS_RECORDA *results)
+{
+    const DNS_RECORDA *rec;
+    const DNS_RECORDA *found;
+
+    if (!key->valid) {
+        return;
+    }
+
+    if (status == DNS_ERROR_RCODE_NAME_ERROR) {
+        dns_cache_insert(key, NULL, DNS_CACHE_NEGATIVE_TTL_MS);
+
+        return;
+    }
+
+    if (status != ERROR_SUCCESS) {
+        return;
+    }
+
+    /* As with getaddrinfo, names with several addresses are not cached */
+
+    found = NULL;
+
+    for (rec = results ; rec != NULL ; rec = rec->pNext) {
+        if (    rec->wType == DNS_TYPE_A &&
+                rec->Flags.S.Section == DnsSectionAnswer) {
+            if (found != NULL) {
+                return;
+            }
+
+            found = rec;
+        }
+    }
+
+    if (found != NULL) {
+        dns_cache_insert(
+                key,
+                &found->Data.A.IpAddress,
+                found->dwTtl < DNS_CACHE_MAX_TTL_MS / 1000
+                        ? found->dwTtl * 1000
+                        : DNS_CACHE_MAX_TTL_MS);
+    }
+}
+
+static int dns_hook_getaddrinfo_numeric(
+        uint32_t addr,
+        const char *service,
+        const ADDRINFOA *hints,
+        ADDRINFOA **result)
+{
+    ADDRINFOA numeric_hints;
+    const uint8_t *bytes;
+    char str[16];
+
+    /* Let ws2_32 build the result itself so that the caller can release it
+       with freeaddrinfo as usual. AI_NUMERICHOST guarantees that this never
+       goes anywhere near the resolver. */
+
+    if (hints != NULL) {
+        numeric_hints = *hints;
+    } else {
+        memset(&numeric_hints, 0, sizeof(numeric_hints));
+    }
+
+    numeric_hints.ai_flags |= AI_NUMERICHOST;
+    bytes = (const uint8_t *) &addr;
+    sprintf_s(
+            str,
+            sizeof(str),
+            "%u.%u.%u.%u",
+            bytes[0],
+            bytes[1],
+            bytes[2],
+            bytes[3]);
+
+    return next_getaddrinfo(str, service, &numeric_hints, result);
+}
+
+static bool dns_cache_make_key(
+        const struct dns_hook_name *name,
+        struct dns_cache_key *key)
+{
+    unsigned int c;
+    size_t len;
+    size_t i;
+
+    key->valid = false;
+    len = name->len;
+
+    if (len > 0 && dns_hook_name_at(name, len - 1) == '.') {
+        len--;
+    }
+
+    if (len == 0 || len > DNS_HOOK_MAX_NAME) {
+        return false;
+    }
+
+    for (i = 0 ; i < len ; i++) {
+        c = dns_hook_fold(dns_hook_name_at(name, i));
+
+        if (c >= 0x80) {
+            return false;
+        }
+
+        key->name[i] = (char) c;
+    }
+
+    key->name[len] = '\0';
+    key->hash = dns_hook_hash(name, 0, len);
+    key->valid = true;
+
+    return true;
+}
+
+static enum dns_cache_result dns_cache_lookup(
+        const struct dns_cache_key *key,
+        uint32_t *addr,
+        uint32_t *ttl_ms)
+{
+    const struct dns_cache_entry *entry;
+    enum dns_cache_result result;
+    ULONGLONG now;
+
+    now = GetTickCount64();
+    entry = &dns_cache[key->hash & (DNS_CACHE_SIZE - 1)];
+    result = DNS_CACHE_MISS;
+
+    AcquireSRWLockShared(&dns_cache_lock);
+
+    if (entry->expiry > now && strcmp(entry->name, key->name) == 0) {
+        if (entry->negative) {
+            result = DNS_CACHE_NEGATIVE;
+        } else {
+            result = DNS_CACHE_HIT;
+            *addr = entry->addr;
+            *ttl_ms = (uint32_t) (entry->expiry - now);
+        }
+    }
+
+    ReleaseSRWLockShared(&dns_cache_lock);
+
+    if (result == DNS_CACHE_MISS) {
+        InterlockedIncrement(&dns_cache_misses);
+    } else {
+        InterlockedIncrement(&dns_cache_hits);
+    }
+
+    return result;
+}
+
+static void dns_cache_insert(
+        const struct dns_cache_key *key,
+        const uint32_t *addr,
+        uint32_t ttl_ms)
+{
+    struct dns_cache_entry *entry;
+
+    entry = &dns_cache[key->hash & (DNS_CACHE_SIZE - 1)];
+
+    AcquireSRWLockExclusive(&dns_cache_lock);
+
+    strcpy_s(entry->name, sizeof(entry->name), key->name);
+    entry->negative = addr == NULL;
+    entry->addr = addr != NULL ? *addr : 0;
+    entry->expiry = GetTickCount64() + ttl_ms;
+
+    ReleaseSRWLockExclusive(&dns_cache_lock);
+}
+
+void dns_hook_get_cache_stats(uint32_t *hits, uint32_t *misses)
+{
+    assert(hits != NULL);
+    assert(misses != NULL);
+
+    *hits = dns_cache_hits;
+    *misses = dns_cache_misses;
+}
+
+static DNS_STATUS WINAPI hook_DnsQuery_A(
+        const char *pszName,
+        WORD wType,
+        DWORD Options,
+        void *pExtra,
+        DNS_RECORD **ppQueryResults,
+        void *pReserved)
+{
+    const struct dns_hook_entry *pos;
+    struct dns_hook_name orig;
+    struct dns_hook_name fwd;
+    struct dns_cache_key key;
+    DNS_STATUS code;
+    HRESULT hr;
+
+    if (pszName == NULL) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+        goto end;
+    }
+
+    orig.a = pszName;
+    orig.w = NULL;
+    orig.len = strlen(pszName);
+    pos = dns_hook_match_a(pszName);
+
+    if (pos != NULL) {
+        if (pos->to == NULL) {
+            hr = HRESULT_FROM_WIN32(DNS_ERROR_RCODE_NAME_ERROR);
+
+            goto end;
+        }
+
+        if (    pos->literal &&
+                wType == DNS_TYPE_A &&
+                ppQueryResults != NULL &&
+                dns_hook_synth_a(
+                    &orig,
+                    pos->addr,
+                    DNS_HOOK_LITERAL_TTL,
+                    ppQueryResults) == ERROR_SUCCESS) {
+            return ERROR_SUCCESS;
+        }
+
+        pszName = pos->to_a;
+    }
+
+    fwd.a = pszName;
+    fwd.w = NULL;
+    fwd.len = strlen(pszName);
+
+    if (dns_hook_query_from_cache(
+            &orig,
+            &fwd,
+            wType,
+            Options,
+            ppQueryResults,
+            &code,
+            &key)) {
+        return code;
+    }
 
     code = next_DnsQuery_A(
             pszName,
@@ -285,12 +1221,14 @@ static DNS_STATUS WINAPI hook_DnsQuery_A(
             ppQueryResults,
             pReserved);
 
+    dns_hook_query_to_cache(
+            &key,
+            code,
+            ppQueryResults != NULL ? *ppQueryResults : NULL);
+
     hr = HRESULT_FROM_WIN32(code);
 
 end:
-    free(str);
-    free(wstr);
-
     return hr_to_win32_error(hr);
 }
 
@@ -303,32 +1241,55 @@ static DNS_STATUS WINAPI hook_DnsQuery_W(
         void *pReserved)
 {
     const struct dns_hook_entry *pos;
-    size_t i;
+    struct dns_hook_name orig;
+    struct dns_hook_name fwd;
+    struct dns_cache_key key;
+    DNS_STATUS code;
 
     if (pszName == NULL) {
         return ERROR_INVALID_PARAMETER;
     }
 
-    EnterCriticalSection(&dns_hook_lock);
-
-    for (i = 0 ; i < dns_hook_nentries ; i++) {
-        pos = &dns_hook_entries[i];
-
-        if (_wcsicmp(pszName, pos->from) == 0) {
-            if(pos->to == NULL) {
-                LeaveCriticalSection(&dns_hook_lock);
-                return HRESULT_FROM_WIN32(DNS_ERROR_RCODE_NAME_ERROR);
-            }
+    orig.a = NULL;
+    orig.w = pszName;
+    orig.len = wcslen(pszName);
+    pos = dns_hook_match(&orig);
 
-            pszName = pos->to;
+    if (pos != NULL) {
+        if(pos->to == NULL) {
+            return HRESULT_FROM_WIN32(DNS_ERROR_RCODE_NAME_ERROR);
+        }
 
-            break;
+        if (    pos->literal &&
+                wType == DNS_TYPE_A &&
+                ppQueryResults != NULL &&
+                dns_hook_synth_a(
+                    &orig,
+                    pos->addr,
+                    DNS_HOOK_LITERAL_TTL,
+                    ppQueryResults) == ERROR_SUCCESS) {
+            return ERROR_SUCCESS;
         }
+
+        pszName = pos->to;
     }
 
-    LeaveCriticalSection(&dns_hook_lock);
+    fwd.a = NULL;
+    fwd.w = pszName;
+    fwd.len = wcslen(pszName);
 
-    return next_DnsQuery_W(
+    if (dns_hook_query_from_cache(
+            &orig,
+            &fwd,
+            wType,
+            Options,
+            ppQueryResults,
+            &code,
+            &key)) {
+        return code;
+    }
+
+    code = next_DnsQuery_W(
             pszName,
             wType,
             Options,
@@ -336,6 +1297,16 @@ static DNS_STATUS WINAPI hook_DnsQuery_W(
             ppQueryResults,
             pReserved);
 
+    /* Only the character type of pName differs between the two layouts */
+
+    dns_hook_query_to_cache(
+            &key,
+            code,
+            ppQueryResults != NULL
+                    ? (const DNS_RECORDA *) *ppQueryResults
+                    : NULL);
+
+    return code;
 }
 
 static DNS_STATUS WINAPI hook_DnsQueryEx(
@@ -345,33 +1316,30 @@ static DNS_STATUS WINAPI hook_DnsQueryEx(
 {
     const wchar_t *orig;
     const struct dns_hook_entry *pos;
+    struct dns_hook_name name;
     DNS_STATUS code;
-    size_t i;
 
     if (pRequest == NULL) {
         return ERROR_INVALID_PARAMETER;
     }
 
     orig = pRequest->QueryName;
-    EnterCriticalSection(&dns_hook_lock);
 
-    for (i = 0 ; i < dns_hook_nentries ; i++) {
-        pos = &dns_hook_entries[i];
+    if (orig != NULL) {
+        name.a = NULL;
+        name.w = orig;
+        name.len = wcslen(orig);
+        pos = dns_hook_match(&name);
 
-        if (_wcsicmp(pRequest->QueryName, pos->from) == 0) {
+        if (pos != NULL) {
             if(pos->to == NULL) {
-                LeaveCriticalSection(&dns_hook_lock);
                 return HRESULT_FROM_WIN32(DNS_ERROR_RCODE_NAME_ERROR);
             }
 
             pRequest->QueryName = pos->to;
-
-            break;
         }
     }
 
-    LeaveCriticalSection(&dns_hook_lock);
-
     code = next_DnsQueryEx(pRequest, pQueryResults, pCancelHandle);
 
     /* Caller might not appreciate QueryName changing under its feet. It is
@@ -387,6 +1355,22 @@ static DNS_STATUS WINAPI hook_DnsQueryEx(
     return code;
 }
 
+static void WINAPI hook_DnsFree(void *pData, DNS_FREE_TYPE FreeType)
+{
+    if (!dns_hook_release_record(pData)) {
+        next_DnsFree(pData, FreeType);
+    }
+}
+
+static void WINAPI hook_DnsRecordListFree(
+        DNS_RECORD *pRecordList,
+        DNS_FREE_TYPE FreeType)
+{
+    if (!dns_hook_release_record(pRecordList)) {
+        next_DnsRecordListFree(pRecordList, FreeType);
+    }
+}
+
 static int WSAAPI hook_getaddrinfo(
         const char *pNodeName,
         const char *pServiceName,
@@ -394,69 +1378,97 @@ static int WSAAPI hook_getaddrinfo(
         ADDRINFOA **ppResult)
 {
     const struct dns_hook_entry *pos;
-    char *str;
-    size_t str_c;
-    wchar_t *wstr;
-    size_t wstr_c;
+    const struct sockaddr_in *sin;
+    const ADDRINFOA *ai;
+    struct dns_hook_name name;
+    struct dns_cache_key key;
+    enum dns_cache_result cached;
+    uint32_t addr;
+    uint32_t ttl_ms;
     int result;
-    size_t i;
-
-    str = NULL;
-    wstr = NULL;
 
     if (pNodeName == NULL) {
-        result = WSA_INVALID_PARAMETER;
-
-        goto end;
+        return WSA_INVALID_PARAMETER;
     }
 
-    mbstowcs_s(&wstr_c, NULL, 0, pNodeName, 0);
-    wstr = malloc(wstr_c * sizeof(wchar_t));
+    pos = dns_hook_match_a(pNodeName);
+
+    if (pos != NULL) {
+        if(pos->to == NULL) {
+            return EAI_NONAME;
+        }
 
-    if (wstr == NULL) {
-        result = WSA_NOT_ENOUGH_MEMORY;
+        if (pos->literal) {
+            return dns_hook_getaddrinfo_numeric(
+                    pos->addr,
+                    pServiceName,
+                    pHints,
+                    ppResult);
+        }
 
-        goto end;
+        pNodeName = pos->to_a;
     }
 
-    mbstowcs_s(NULL, wstr, wstr_c, pNodeName, wstr_c - 1);
-    EnterCriticalSection(&dns_hook_lock);
+    /* The cache only remembers a single IPv4 address per name, so only
+       lookups that ask for IPv4 alone use it. Anything else (including the
+       AF_UNSPEC default) could also be answered with IPv6 addresses. */
 
-    for (i = 0 ; i < dns_hook_nentries ; i++) {
-        pos = &dns_hook_entries[i];
+    name.a = pNodeName;
+    name.w = NULL;
+    name.len = strlen(pNodeName);
 
-        if (_wcsicmp(wstr, pos->from) == 0) {
-            if(pos->to == NULL) {
-                LeaveCriticalSection(&dns_hook_lock);
-                result = EAI_NONAME;
+    if (    pHints == NULL ||
+            pHints->ai_family != AF_INET ||
+            (pHints->ai_flags & (AI_CANONNAME | AI_NUMERICHOST))) {
+        key.valid = false;
+    } else {
+        dns_cache_make_key(&name, &key);
+    }
 
-                goto end;
-            }
+    if (key.valid) {
+        cached = dns_cache_lookup(&key, &addr, &ttl_ms);
+
+        if (cached == DNS_CACHE_NEGATIVE) {
+            /* (Only ever an NXDOMAIN seen by DnsQuery) */
+            return EAI_NONAME;
+        } else if (cached == DNS_CACHE_HIT) {
+            return dns_hook_getaddrinfo_numeric(
+                    addr,
+                    pServiceName,
+                    pHints,
+                    ppResult);
+        }
+    }
 
-            wcstombs_s(&str_c, NULL, 0, pos->to, 0);
-            str = malloc(str_c * sizeof(char));
+    result = next_getaddrinfo(pNodeName, pServiceName, pHints, ppResult);
 
-            if (str == NULL) {
-                LeaveCriticalSection(&dns_hook_lock);
-                result = WSA_NOT_ENOUGH_MEMORY;
+    if (!key.valid || result != 0 || ppResult == NULL) {
+        return result;
+    }
 
-                goto end;
-            }
+    /* Names with more than one address (one entry per socket type is normal)
+       are left uncached rather than losing the extra addresses. */
 
-            wcstombs_s(NULL, str, str_c, pos->to, str_c - 1);
-            pNodeName = str;
+    addr = 0;
 
-            break;
+    for (ai = *ppResult ; ai != NULL ; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET || ai->ai_addr == NULL) {
+            return result;
         }
-    }
 
-    LeaveCriticalSection(&dns_hook_lock);
+        sin = (const struct sockaddr_in *) ai->ai_addr;
 
-    result = next_getaddrinfo(pNodeName, pServiceName, pHints, ppResult);
+        if (    ai != *ppResult &&
+                memcmp(&addr, &sin->sin_addr, sizeof(addr)) != 0) {
+            return result;
+        }
 
-end:
-    free(wstr);
-    free(str);
+        memcpy(&addr, &sin->sin_addr, sizeof(addr));
+    }
+
+    if (*ppResult != NULL) {
+        dns_cache_insert(&key, &addr, DNS_CACHE_MAX_TTL_MS);
+    }
 
     return result;
 }
@@ -3,7 +3,14 @@
 #include <windows.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
-// if to_src is NULL, all lookups for from_src will fail
+// if to_src is NULL, all lookups for from_src will fail. from_src may be of
+// the form "*.example.com" to match every name below example.com; exact
+// names take precedence over wildcards, and longer wildcards over shorter.
+// If to_src is an IPv4 literal then A lookups are answered directly.
 HRESULT dns_hook_push(const wchar_t *from_src, const wchar_t *to_src);
 
+// Hit/miss counts for the cache of names forwarded to the real resolver,
+// reported by platform/dns.c when the process exits
+void dns_hook_get_cache_stats(uint32_t *hits, uint32_t *misses);
@@ -10,6 +10,7 @@
 #include "hooklib/config.h"
 #include "hooklib/dll.h"
 #include "hooklib/dvd.h"
+#include "hooklib/iat.h"
 
 #include "util/dprintf.h"
 
@@ -53,7 +54,7 @@ void dvd_hook_init(const struct dvd_config *cfg, HINSTANCE self)
     dvd_hook_initted = true;
 
     memcpy(&dvd_config, cfg, sizeof(*cfg));
-    hook_table_apply(NULL, "kernel32.dll", dvd_hooks, _countof(dvd_hooks));
+    iat_hook_push(NULL, "kernel32.dll", dvd_hooks, _countof(dvd_hooks));
     dprintf("DVD: hook enabled.\n");
 }
 
@@ -11,6 +11,7 @@
 #include "hooklib/config.h"
 #include "hooklib/dll.h"
 #include "hooklib/gfx.h"
+#include "hooklib/iat.h"
 
 #include "util/dprintf.h"
 
@@ -48,7 +49,7 @@ void gfx_hook_init(const struct gfx_config *cfg, HINSTANCE self)
     }
 
     memcpy(&gfx_config, cfg, sizeof(*cfg));
-    hook_table_apply(NULL, "d3d9.dll", gfx_hooks, _countof(gfx_hooks));
+    iat_hook_push(NULL, "d3d9.dll", gfx_hooks, _countof(gfx_hooks));
 
     if (next_Direct3DCreate9 == NULL) {
         d3d9 = LoadLibraryW(L"d3d9.dll");
@@ -0,0 +1,409 @@
+/* Might push this to capnhook, don't add any util dependencies. */
+
+#include <windows.h>
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hook/table.h"
+
+#include "hooklib/iat.h"
+
+struct iat_hook_table {
+    HMODULE target;
+    const char *dll;
+    const struct hook_symbol *syms;
+    size_t nsyms;
+    bool applied;
+    bool active;
+    unsigned int npatched;
+    LONGLONG ticks;
+};
+
+static void iat_hook_init(void);
+static void iat_hook_flush_locked(void);
+static LONGLONG iat_hook_apply_module(
+        struct iat_hook_table *tables,
+        size_t ntables,
+        HMODULE target);
+static void iat_hook_apply_entry(
+        struct iat_hook_table *table,
+        const char *name,
+        uint16_t ordinal,
+        void **slot);
+static void iat_hook_report(
+        const struct iat_hook_table *tables,
+        size_t ntables,
+        HMODULE target,
+        LONGLONG ticks);
+static unsigned int iat_hook_ticks_to_us(LONGLONG ticks);
+static void iat_hook_log(const char *fmt, ...);
+
+static bool iat_hook_initted;
+static CRITICAL_SECTION iat_hook_lock;
+static unsigned int iat_hook_depth;
+static struct iat_hook_table *iat_hook_queue;
+static size_t iat_hook_nqueued;
+static LARGE_INTEGER iat_hook_freq;
+
+HRESULT iat_hook_push(
+        HMODULE target,
+        const char *dll,
+        const struct hook_symbol *syms,
+        size_t nsyms)
+{
+    struct iat_hook_table *new_mem;
+    struct iat_hook_table table;
+    HRESULT hr;
+
+    assert(dll != NULL);
+    assert(syms != NULL);
+
+    iat_hook_init();
+
+    memset(&table, 0, sizeof(table));
+    table.target = target;
+    table.dll = dll;
+    table.syms = syms;
+    table.nsyms = nsyms;
+
+    /* Only the thread that opened a batch can get in here while it is open,
+       since the batch holds the (recursive) lock until it ends. */
+
+    EnterCriticalSection(&iat_hook_lock);
+
+    if (iat_hook_depth == 0) {
+        iat_hook_apply_module(&table, 1, target);
+        hr = S_OK;
+
+        goto end;
+    }
+
+    new_mem = realloc(
+            iat_hook_queue,
+            (iat_hook_nqueued + 1) * sizeof(struct iat_hook_table));
+
+    if (new_mem == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    new_mem[iat_hook_nqueued] = table;
+    iat_hook_queue = new_mem;
+    iat_hook_nqueued++;
+    hr = S_OK;
+
+end:
+    LeaveCriticalSection(&iat_hook_lock);
+
+    return hr;
+}
+
+void iat_hook_begin_batch(void)
+{
+    iat_hook_init();
+
+    /* Stays held until the matching iat_hook_end_batch() */
+
+    EnterCriticalSection(&iat_hook_lock);
+    iat_hook_depth++;
+}
+
+void iat_hook_end_batch(void)
+{
+    assert(iat_hook_depth > 0);
+
+    iat_hook_depth--;
+
+    if (iat_hook_depth == 0) {
+        iat_hook_flush_locked();
+    }
+
+    LeaveCriticalSection(&iat_hook_lock);
+}
+
+static void iat_hook_init(void)
+{
+    /* Init is not thread safe, because API hooking is not thread safe. */
+
+    if (iat_hook_initted) {
+        return;
+    }
+
+    iat_hook_initted = true;
+    InitializeCriticalSection(&iat_hook_lock);
+    QueryPerformanceFrequency(&iat_hook_freq);
+}
+
+static void iat_hook_flush_locked(void)
+{
+    HMODULE target;
+    LONGLONG ticks;
+    size_t i;
+    size_t j;
+
+    /* One pass per distinct target module, in order of first appearance.
+       Only batches get a timing report, single pushes would flood the log. */
+
+    for (i = 0 ; i < iat_hook_nqueued ; i++) {
+        if (iat_hook_queue[i].applied) {
+            continue;
+        }
+
+        target = iat_hook_queue[i].target;
+        ticks = iat_hook_apply_module(
+                iat_hook_queue,
+                iat_hook_nqueued,
+                target);
+        iat_hook_report(iat_hook_queue, iat_hook_nqueued, target, ticks);
+
+        for (j = i ; j < iat_hook_nqueued ; j++) {
+            if (iat_hook_queue[j].target == target) {
+                iat_hook_queue[j].applied = true;
+            }
+        }
+    }
+
+    free(iat_hook_queue);
+    iat_hook_queue = NULL;
+    iat_hook_nqueued = 0;
+}
+
+static LONGLONG iat_hook_apply_module(
+        struct iat_hook_table *tables,
+        size_t ntables,
+        HMODULE target)
+{
+    const IMAGE_DOS_HEADER *dos;
+    const IMAGE_NT_HEADERS *nt;
+    const IMAGE_DATA_DIRECTORY *dir;
+    const IMAGE_IMPORT_DESCRIPTOR *desc;
+    const IMAGE_THUNK_DATA *names;
+    const IMAGE_IMPORT_BY_NAME *by_name;
+    IMAGE_THUNK_DATA *iat;
+    LARGE_INTEGER start;
+    LARGE_INTEGER mid;
+    LARGE_INTEGER finish;
+    const char *name;
+    uint16_t ordinal;
+    uint8_t *base;
+    bool any;
+    size_t i;
+    size_t j;
+
+    QueryPerformanceCounter(&start);
+
+    base = (uint8_t *) (target != NULL ? target : GetModuleHandleW(NULL));
+    dos = (const IMAGE_DOS_HEADER *) base;
+    nt = (const IMAGE_NT_HEADERS *) (base + dos->e_lfanew);
+    dir = &nt->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+
+    if (dir->VirtualAddress == 0) {
+        goto end;
+    }
+
+    desc = (const IMAGE_IMPORT_DESCRIPTOR *) (base + dir->VirtualAddress);
+
+    for ( ; desc->Name != 0 ; desc++) {
+        name = (const char *) (base + desc->Name);
+        any = false;
+
+        for (i = 0 ; i < ntables ; i++) {
+            tables[i].active =
+                    tables[i].target == target &&
+                    !tables[i].applied &&
+                    _stricmp(tables[i].dll, name) == 0;
+            any |= tables[i].active;
+        }
+
+        if (!any) {
+            continue;
+        }
+
+        /* Modules bound by old linkers have no separate name table, in which
+           case the IAT still holds the names until the loader binds it. */
+
+        if (desc->OriginalFirstThunk != 0) {
+            names = (const IMAGE_THUNK_DATA *)
+                    (base + desc->OriginalFirstThunk);
+        } else {
+            names = (const IMAGE_THUNK_DATA *) (base + desc->FirstThunk);
+        }
+
+        iat = (IMAGE_THUNK_DATA *) (base + desc->FirstThunk);
+
+        /* Walk the thunks once per table rather than the tables once per
+           thunk, so that each table can be timed with one pair of counter
+           reads per DLL. Every slot still sees the tables in push order. */
+
+        for (i = 0 ; i < ntables ; i++) {
+            if (!tables[i].active) {
+                continue;
+            }
+
+            QueryPerformanceCounter(&mid);
+
+            for (j = 0 ; names[j].u1.AddressOfData != 0 ; j++) {
+                if (IMAGE_SNAP_BY_ORDINAL(names[j].u1.Ordinal)) {
+                    name = NULL;
+                    ordinal = (uint16_t) IMAGE_ORDINAL(names[j].u1.Ordinal);
+                } else {
+                    by_name = (const IMAGE_IMPORT_BY_NAME *)
+                            (base + names[j].u1.AddressOfData);
+                    name = (const char *) by_name->Name;
+                    ordinal = 0;
+                }
+
+                iat_hook_apply_entry(
+                        &tables[i],
+                        name,
+                        ordinal,
+                        (void **) &iat[j].u1.Function);
+            }
+
+            QueryPerformanceCounter(&finish);
+            tables[i].ticks += finish.QuadPart - mid.QuadPart;
+        }
+    }
+
+end:
+    QueryPerformanceCounter(&finish);
+
+    return finish.QuadPart - start.QuadPart;
+}
+
+static void iat_hook_apply_entry(
+        struct iat_hook_table *table,
+        const char *name,
+        uint16_t ordinal,
+        void **slot)
+{
+    const struct hook_symbol *sym;
+    DWORD old_protect;
+    size_t i;
+
+    for (i = 0 ; i < table->nsyms ; i++) {
+        sym = &table->syms[i];
+
+        if (name != NULL) {
+            if (sym->name == NULL || strcmp(sym->name, name) != 0) {
+                continue;
+            }
+        } else if (sym->ordinal == 0 || sym->ordinal != ordinal) {
+            continue;
+        }
+
+        if (!VirtualProtect(
+                slot,
+                sizeof(*slot),
+                PAGE_READWRITE,
+                &old_protect)) {
+            continue;
+        }
+
+        /* Whatever the slot points at now (maybe an earlier table's patch)
+           becomes this hook's link, so tables chain in push order. */
+
+        if (sym->link != NULL) {
+            *sym->link = *slot;
+        }
+
+        *slot = sym->patch;
+        VirtualProtect(slot, sizeof(*slot), old_protect, &old_protect);
+        table->npatched++;
+
+        return;
+    }
+}
+
+static void iat_hook_report(
+        const struct iat_hook_table *tables,
+        size_t ntables,
+        HMODULE target,
+        LONGLONG ticks)
+{
+    const struct iat_hook_table *table;
+    wchar_t path[MAX_PATH];
+    const wchar_t *base;
+    const char *first;
+    unsigned int ntarget;
+    unsigned int npatched;
+    size_t i;
+
+    ntarget = 0;
+    npatched = 0;
+
+    for (i = 0 ; i < ntables ; i++) {
+        if (tables[i].target == target && !tables[i].applied) {
+            ntarget++;
+            npatched += tables[i].npatched;
+        }
+    }
+
+    if (GetModuleFileNameW(target, path, _countof(path)) == 0) {
+        wcscpy_s(path, _countof(path), L"(unknown)");
+    }
+
+    base = wcsrchr(path, L'\\');
+    base = base != NULL ? base + 1 : path;
+
+    iat_hook_log(
+            "IAT: %S: %u tables, %u patches in %u us\n",
+            base,
+            ntarget,
+            npatched,
+            iat_hook_ticks_to_us(ticks));
+
+    /* A module that only got one table doesn't need the breakdown */
+
+    if (ntarget < 2) {
+        return;
+    }
+
+    for (i = 0 ; i < ntables ; i++) {
+        table = &tables[i];
+
+        if (table->target != target || table->applied) {
+            continue;
+        }
+
+        first = table->nsyms > 0 && table->syms[0].name != NULL
+                ? table->syms[0].name
+                : "(ordinal)";
+
+        iat_hook_log(
+                "IAT:     %s %s...: %u patches in %u us\n",
+                table->dll,
+                first,
+                table->npatched,
+                iat_hook_ticks_to_us(table->ticks));
+    }
+}
+
+static unsigned int iat_hook_ticks_to_us(LONGLONG ticks)
+{
+    if (iat_hook_freq.QuadPart == 0) {
+        return 0;
+    }
+
+    return (unsigned int) (ticks * 1000000 / iat_hook_freq.QuadPart);
+}
+
+static void iat_hook_log(const char *fmt, ...)
+{
+    char msg[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    _vsnprintf_s(msg, _countof(msg), _TRUNCATE, fmt, ap);
+    va_end(ap);
+
+    OutputDebugStringA(msg);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+
+#include "hook/table.h"
+
+/* Batched import address table patching.
+
+   iat_hook_push() takes the same arguments as capnhook's hook_table_apply().
+   Outside of a batch it patches the target module straight away. Between
+   iat_hook_begin_batch() and iat_hook_end_batch() tables pushed from the
+   batching thread are queued instead, and ending the outermost batch walks
+   each target module's import directory once, applying every queued table
+   to it in the order it was pushed (so later tables chain onto earlier ones
+   exactly as separate hook_table_apply() calls would). A timing report for
+   each module and table is logged when the batch is flushed; pushes outside
+   of a batch are not logged.
+
+   Hooks that capnhook installs itself (iohook's CreateFileW, ReadFile and so
+   on, installed by the first iohook_push_handler() call) are not batched.
+   They are patched straight away, so every table queued in the same batch
+   ends up chained on top of them and runs before them, however early it was
+   pushed. This keeps the usual order of path hooks first, then iohook no
+   matter which platform hooks (and hence which first iohook_push_handler()
+   call) are enabled.
+
+   Link pointers of queued tables are not written until the batch ends, so
+   code inside a batch must not rely on them being set by the push. Pushes
+   from other threads wait for an open batch to finish. */
+
+HRESULT iat_hook_push(
+        HMODULE target,
+        const char *dll,
+        const struct hook_symbol *syms,
+        size_t nsyms);
+
+void iat_hook_begin_batch(void);
+void iat_hook_end_batch(void);
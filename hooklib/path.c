@@ -3,19 +3,311 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
+#include <wctype.h>
 
 #include "hook/hr.h"
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
 #include "hooklib/path.h"
 
+#include "util/dprintf.h"
+
+/* Prefix redirect rules are compiled into a trie of case-folded path
+   characters. Each node's children are stored contiguously and sorted, so the
+   whole trie is a single flat array. */
+
+struct path_rule {
+    wchar_t *prefix;
+    size_t prefix_len;
+    wchar_t *target;
+    size_t target_len;
+    char *target_a;
+    size_t target_a_len;
+    path_resolver_t resolver;
+    path_lister_t lister;
+    void *ctx;
+    bool cached;
+    size_t seq;
+};
+
+struct path_trie_node {
+    wchar_t c;
+    int rule;
+    size_t child;
+    size_t nchildren;
+};
+
+/* An immutable snapshot of every registered redirect. A new table is built
+   and published with a pointer swap each time a rule or hook is pushed, which
+   lets path_transform_w run without taking any locks. */
+
+struct path_hook_table {
+    struct path_rule *rules;
+    size_t nrules;
+    struct path_trie_node *nodes;
+    size_t nnodes;
+    path_hook_t *hooks;
+    size_t nhooks;
+    size_t nresolvers;
+    size_t nlisters;
+};
+
+/* Memoised results of path_transform_w, including "no rewrite". Only used
+   while callback hooks are registered: a prefix trie walk on its own is
+   cheaper than hashing and locking a cache set. This is a small
+   set-associative cache with CLOCK replacement inside each set, an
+   approximation of LRU: a hit only sets the entry's referenced bit, so
+   lookups can share the set's lock. Entries remember which rule snapshot
+   they were computed against, so publishing a new snapshot invalidates the
+   whole cache at once. */
+
+enum {
+    PATH_CACHE_SETS = 256,
+    PATH_CACHE_WAYS = 4,
+    PATH_CACHE_MAX_LEN = MAX_PATH,
+};
+
+struct path_cache_entry {
+    const struct path_hook_table *table;
+    uint32_t hash;
+    volatile LONG referenced;
+    wchar_t *src;
+    const struct path_rule *rule;
+    size_t match_len;
+    wchar_t *result;
+};
+
+struct path_cache_set {
+    SRWLOCK lock;
+    size_t hand;
+    struct path_cache_entry ways[PATH_CACHE_WAYS];
+};
+
+/* A directory listing merged from several FindFirstFile patterns. The whole
+   listing is collected up front, and the find handle handed back to the
+   caller is really a pointer to one of these. Live finds are kept in a small
+   hash table keyed on that pointer. The table holds one reference and each
+   FindNextFile call holds another while it copies an entry out, so a
+   FindClose on another thread can't free the listing underneath it. */
+
+struct path_find_entry {
+    WIN32_FIND_DATAW data;
+    size_t layer;
+};
+
+struct path_find {
+    struct path_find *next;
+    struct path_find_entry *entries;
+    size_t nentries;
+    size_t pos;
+    volatile LONG refs;
+};
+
+/* Complete listings of directories under cached prefix rules, sorted by
+   name, from which attribute queries and simple finds are answered. Keyed by
+   the folded path of the (redirected) directory, with a trailing separator.
+
+   A listing goes stale when the hooks create or remove something in the
+   directory and is re-read on next use. Going stale also bumps the entry's
+   generation, so a read that was in progress at the time is thrown away.
+   Once a file in a directory has been opened for writing its size and times
+   can change behind our back, so that directory is never cached again. */
+
+enum {
+    PATH_FIND_BUCKETS = 64,
+};
+
+enum {
+    PATH_DIR_BUCKETS = 256,
+};
+
+struct path_dir {
+    struct path_dir *next;
+    uint32_t hash;
+    wchar_t *dir;
+    WIN32_FIND_DATAW *entries;
+    size_t nentries;
+    uint32_t generation;
+    bool exists;
+    bool stale;
+    bool written;
+};
+
+/* Extra details about a transformed path, for the hooks that need them */
+
+struct path_transform_info {
+    size_t nlayers;
+    bool cached;
+};
+
 /* Helpers */
 
 static void path_hook_init(void);
-static BOOL path_transform_a(char **out, const char *src);
-static BOOL path_transform_w(wchar_t **out, const wchar_t *src);
+static void path_hook_report_stats(void);
+static HRESULT path_hook_push_target(
+        struct path_rule *rule,
+        const wchar_t *prefix,
+        const wchar_t *target);
+static HRESULT path_hook_push_rule(
+        struct path_rule *rule,
+        const wchar_t *prefix);
+static HRESULT path_hook_publish_locked(
+        const struct path_rule *new_rule,
+        path_hook_t new_hook);
+static void path_trie_build(
+        struct path_hook_table *table,
+        size_t node,
+        size_t lo,
+        size_t hi,
+        size_t depth);
+static const struct path_trie_node *path_trie_child(
+        const struct path_hook_table *table,
+        const struct path_trie_node *node,
+        wchar_t c);
+static const struct path_rule *path_trie_match(
+        const struct path_hook_table *table,
+        const wchar_t *src,
+        size_t *match_len);
+static const struct path_rule *path_trie_match_a(
+        const struct path_hook_table *table,
+        const char *src,
+        size_t *match_len,
+        bool *complete);
+static int path_rule_cmp(const void *lhs, const void *rhs);
+static BOOL path_transform_a(
+        const char **out,
+        char *buf,
+        size_t buf_size,
+        const char *src,
+        enum path_access access,
+        struct path_transform_info *info);
+static BOOL path_transform_w(
+        wchar_t **out,
+        struct path_transform_info *info,
+        const wchar_t *src,
+        enum path_access access);
+static BOOL path_transform_uncached(
+        const struct path_hook_table *table,
+        const wchar_t *src,
+        const struct path_rule **rule,
+        size_t *match_len,
+        wchar_t **out);
+static BOOL path_rewrite_w(
+        wchar_t **out,
+        const struct path_rule *rule,
+        const wchar_t *src,
+        size_t match_len);
+static BOOL path_resolve_w(
+        wchar_t **out,
+        struct path_transform_info *info,
+        const struct path_rule *rule,
+        const wchar_t *src,
+        size_t match_len,
+        enum path_access access);
+static enum path_access path_access_for_create(
+        uint32_t dwDesiredAccess,
+        uint32_t dwCreationDisposition);
+static BOOL path_find_first_a(
+        const char **trans,
+        char *buf,
+        size_t buf_size,
+        const char *src,
+        FINDEX_INFO_LEVELS fInfoLevelId,
+        void *lpFindFileData,
+        FINDEX_SEARCH_OPS fSearchOp,
+        void *lpSearchFilter,
+        DWORD dwAdditionalFlags,
+        HANDLE *result,
+        bool *handled);
+static HANDLE path_find_first_merged(
+        const wchar_t *layers,
+        FINDEX_INFO_LEVELS fInfoLevelId,
+        WIN32_FIND_DATAW *lpFindFileData,
+        FINDEX_SEARCH_OPS fSearchOp,
+        void *lpSearchFilter,
+        DWORD dwAdditionalFlags);
+static int path_find_entry_cmp(const void *lhs, const void *rhs);
+static HANDLE path_find_register(struct path_find *find);
+static size_t path_find_bucket(HANDLE handle);
+static struct path_find *path_find_acquire(HANDLE handle);
+static void path_find_release(struct path_find *find);
+static void path_find_narrow(
+        WIN32_FIND_DATAA *out,
+        const WIN32_FIND_DATAW *src);
+static bool path_widen(wchar_t *out, size_t max_count, const char *src);
+static bool path_dir_split(
+        const wchar_t *path,
+        wchar_t *dir,
+        const wchar_t **name);
+static HRESULT path_dir_acquire(const wchar_t *dir, struct path_dir **out);
+static HRESULT path_dir_load(const wchar_t *dir, struct path_dir *out);
+static HRESULT path_dir_load_listed(
+        const struct path_rule *rule,
+        const wchar_t *rel,
+        struct path_dir *out);
+static const struct path_rule *path_dir_listed(
+        const wchar_t *path,
+        size_t *match_len);
+static HRESULT path_dir_reserve(
+        uint32_t hash,
+        const wchar_t *dir,
+        uint32_t *generation);
+static void path_dir_install(
+        uint32_t hash,
+        const wchar_t *dir,
+        uint32_t generation,
+        struct path_dir *fresh);
+static struct path_dir *path_dir_find_locked(
+        uint32_t hash,
+        const wchar_t *dir);
+static const WIN32_FIND_DATAW *path_dir_lookup_locked(
+        const struct path_dir *entry,
+        const wchar_t *name);
+static int path_dir_entry_cmp(const void *lhs, const void *rhs);
+static int path_name_cmp(const wchar_t *lhs, const wchar_t *rhs);
+static int path_name_rank(const wchar_t *name);
+static HRESULT path_dir_query(const wchar_t *path, WIN32_FIND_DATAW *out);
+static HRESULT path_dir_query_root(
+        const wchar_t *path,
+        WIN32_FIND_DATAW *out);
+static HRESULT path_dir_query_a(const char *path, WIN32_FIND_DATAW *out);
+static void path_dir_fill_attrs(
+        WIN32_FILE_ATTRIBUTE_DATA *out,
+        const WIN32_FIND_DATAW *src);
+static HANDLE path_dir_find_first(
+        const wchar_t *pattern,
+        WIN32_FIND_DATAW *lpFindFileData,
+        bool *handled);
+static bool path_dir_match_spec(const wchar_t *name, const wchar_t *spec);
+static void path_dir_invalidate(const wchar_t *path, bool written);
+static void path_dir_invalidate_a(const char *path, bool written);
+static void path_dir_invalidate_all(void);
+static bool path_dir_can_find(
+        FINDEX_SEARCH_OPS fSearchOp,
+        void *lpSearchFilter,
+        DWORD dwAdditionalFlags);
+static uint32_t path_cache_hash(const wchar_t *src, size_t len);
+static HRESULT path_cache_lookup_locked(
+        struct path_cache_set *set,
+        const struct path_hook_table *table,
+        uint32_t hash,
+        const wchar_t *src,
+        const struct path_rule **rule,
+        size_t *match_len,
+        wchar_t **out);
+static void path_cache_insert(
+        struct path_cache_set *set,
+        const struct path_hook_table *table,
+        uint32_t hash,
+        const wchar_t *src,
+        const struct path_rule *rule,
+        size_t match_len,
+        const wchar_t *result);
 
 /* API hooks */
 
@@ -79,6 +371,20 @@ static HANDLE WINAPI hook_FindFirstFileExW(
         void *lpSearchFilter,
         DWORD dwAdditionalFlags);
 
+static BOOL WINAPI hook_DeleteFileA(const char *lpFileName);
+
+static BOOL WINAPI hook_DeleteFileW(const wchar_t *lpFileName);
+
+static BOOL WINAPI hook_FindNextFileA(
+        HANDLE hFindFile,
+        LPWIN32_FIND_DATAA lpFindFileData);
+
+static BOOL WINAPI hook_FindNextFileW(
+        HANDLE hFindFile,
+        LPWIN32_FIND_DATAW lpFindFileData);
+
+static BOOL WINAPI hook_FindClose(HANDLE hFindFile);
+
 static DWORD WINAPI hook_GetFileAttributesA(const char *lpFileName);
 
 static DWORD WINAPI hook_GetFileAttributesW(const wchar_t *lpFileName);
@@ -159,6 +465,20 @@ static HANDLE (WINAPI *next_FindFirstFileExW)(
         void *lpSearchFilter,
         DWORD dwAdditionalFlags);
 
+static BOOL (WINAPI *next_DeleteFileA)(const char *lpFileName);
+
+static BOOL (WINAPI *next_DeleteFileW)(const wchar_t *lpFileName);
+
+static BOOL (WINAPI *next_FindNextFileA)(
+        HANDLE hFindFile,
+        LPWIN32_FIND_DATAA lpFindFileData);
+
+static BOOL (WINAPI *next_FindNextFileW)(
+        HANDLE hFindFile,
+        LPWIN32_FIND_DATAW lpFindFileData);
+
+static BOOL (WINAPI *next_FindClose)(HANDLE hFindFile);
+
 static DWORD (WINAPI *next_GetFileAttributesA)(const char *lpFileName);
 
 static DWORD (WINAPI *next_GetFileAttributesW)(const wchar_t *lpFileName);
@@ -204,6 +524,14 @@ static const struct hook_symbol path_hook_syms[] = {
         .name   = "CreateFileW",
         .patch  = hook_CreateFileW,
         .link   = (void **) &next_CreateFileW,
+    }, {
+        .name   = "DeleteFileA",
+        .patch  = hook_DeleteFileA,
+        .link   = (void **) &next_DeleteFileA,
+    }, {
+        .name   = "DeleteFileW",
+        .patch  = hook_DeleteFileW,
+        .link   = (void **) &next_DeleteFileW,
     }, {
         .name   = "FindFirstFileA",
         .patch  = hook_FindFirstFileA,
@@ -220,6 +548,18 @@ static const struct hook_symbol path_hook_syms[] = {
         .name   = "FindFirstFileExW",
         .patch  = hook_FindFirstFileExW,
         .link   = (void **) &next_FindFirstFileExW,
+    }, {
+        .name   = "FindNextFileA",
+        .patch  = hook_FindNextFileA,
+        .link   = (void **) &next_FindNextFileA,
+    }, {
+        .name   = "FindNextFileW",
+        .patch  = hook_FindNextFileW,
+        .link   = (void **) &next_FindNextFileW,
+    }, {
+        .name   = "FindClose",
+        .patch  = hook_FindClose,
+        .link   = (void **) &next_FindClose,
     }, {
         .name   = "GetFileAttributesA",
         .patch  = hook_GetFileAttributesA,
@@ -249,12 +589,25 @@ static const struct hook_symbol path_hook_syms[] = {
 
 static bool path_hook_initted;
 static CRITICAL_SECTION path_hook_lock;
-static path_hook_t *path_hook_list;
-static size_t path_hook_count;
+static size_t path_hook_seq;
+static struct path_hook_table *volatile path_hook_table;
+static struct path_cache_set path_cache[PATH_CACHE_SETS];
+static volatile LONG path_cache_hits;
+static volatile LONG path_cache_misses;
+static SRWLOCK path_find_lock = SRWLOCK_INIT;
+static struct path_find *path_find_buckets[PATH_FIND_BUCKETS];
+static SRWLOCK path_dir_lock = SRWLOCK_INIT;
+static struct path_dir *path_dir_buckets[PATH_DIR_BUCKETS];
+static volatile LONG path_dir_hits;
+static volatile LONG path_dir_misses;
+
+static inline wchar_t path_fold_w(wchar_t c)
+{
+    return c == L'/' ? L'\\' : towlower(c);
+}
 
 HRESULT path_hook_push(path_hook_t hook)
 {
-    path_hook_t *tmp;
     HRESULT hr;
 
     assert(hook != NULL);
@@ -262,179 +615,2125 @@ HRESULT path_hook_push(path_hook_t hook)
     path_hook_init();
 
     EnterCriticalSection(&path_hook_lock);
+    hr = path_hook_publish_locked(NULL, hook);
+    LeaveCriticalSection(&path_hook_lock);
+
+    return hr;
+}
+
+HRESULT path_hook_push_prefix(const wchar_t *prefix, const wchar_t *target)
+{
+    struct path_rule rule;
+
+    memset(&rule, 0, sizeof(rule));
+
+    return path_hook_push_target(&rule, prefix, target);
+}
+
+HRESULT path_hook_push_cached_prefix(
+        const wchar_t *prefix,
+        const wchar_t *target)
+{
+    struct path_rule rule;
+
+    memset(&rule, 0, sizeof(rule));
+    rule.cached = true;
+
+    return path_hook_push_target(&rule, prefix, target);
+}
+
+HRESULT path_hook_push_listed_prefix(
+        const wchar_t *prefix,
+        path_lister_t lister,
+        void *ctx)
+{
+    struct path_rule rule;
+
+    assert(lister != NULL);
+
+    /* Paths map onto themselves, so the prefix doubles as the target and
+       listings are keyed by the prefix's own directories. */
+
+    memset(&rule, 0, sizeof(rule));
+    rule.cached = true;
+    rule.lister = lister;
+    rule.ctx = ctx;
+
+    return path_hook_push_target(&rule, prefix, prefix);
+}
+
+static HRESULT path_hook_push_target(
+        struct path_rule *rule,
+        const wchar_t *prefix,
+        const wchar_t *target)
+{
+    size_t i;
+
+    assert(prefix != NULL);
+    assert(target != NULL);
+
+    /* Targets always get a trailing separator so that the remainder of the
+       path can be appended. */
+
+    rule->target_len = wcslen(target);
+    rule->target = malloc((rule->target_len + 2) * sizeof(wchar_t));
+
+    if (rule->target == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    memcpy(rule->target, target, rule->target_len * sizeof(wchar_t));
+
+    if (rule->target_len == 0 ||
+            !path_is_separator_w(target[rule->target_len - 1])) {
+        rule->target[rule->target_len++] = L'\\';
+    }
+
+    rule->target[rule->target_len] = L'\0';
+
+    /* Pre-narrow the target for the ANSI fast path. If it can't be
+       represented in the current code page then ANSI callers take the slow
+       path through the wide transform instead. Listed prefixes always do,
+       since the fast path doesn't check for writes. */
+
+    if (    rule->lister == NULL &&
+            wcstombs_s(&i, NULL, 0, rule->target, 0) == 0 &&
+            i > 0) {
+        rule->target_a = malloc(i);
+
+        if (rule->target_a != NULL &&
+                wcstombs_s(
+                    NULL,
+                    rule->target_a,
+                    i,
+                    rule->target,
+                    i - 1) == 0) {
+            rule->target_a_len = i - 1;
+        } else {
+            free(rule->target_a);
+            rule->target_a = NULL;
+        }
+    }
 
-    tmp = realloc(
-            path_hook_list,
-            (path_hook_count + 1) * sizeof(path_hook_t));
+    return path_hook_push_rule(rule, prefix);
+}
+
+HRESULT path_hook_push_resolver(
+        const wchar_t *prefix,
+        path_resolver_t resolver,
+        void *ctx)
+{
+    struct path_rule rule;
+
+    assert(prefix != NULL);
+    assert(resolver != NULL);
+
+    /* No static target, so the ANSI fast path never applies to these */
+
+    memset(&rule, 0, sizeof(rule));
+    rule.resolver = resolver;
+    rule.ctx = ctx;
+
+    return path_hook_push_rule(&rule, prefix);
+}
+
+static HRESULT path_hook_push_rule(
+        struct path_rule *rule,
+        const wchar_t *prefix)
+{
+    size_t i;
+    HRESULT hr;
+
+    /* Takes ownership of the rule's target strings. Prefixes are stored
+       folded and without a trailing separator. */
+
+    rule->prefix_len = wcslen(prefix);
+
+    while (rule->prefix_len > 0 &&
+            path_is_separator_w(prefix[rule->prefix_len - 1])) {
+        rule->prefix_len--;
+    }
 
-    if (tmp == NULL) {
+    if (rule->prefix_len == 0) {
+        hr = E_INVALIDARG;
+
+        goto fail;
+    }
+
+    rule->prefix = malloc((rule->prefix_len + 1) * sizeof(wchar_t));
+
+    if (rule->prefix == NULL) {
         hr = E_OUTOFMEMORY;
 
-        goto end;
+        goto fail;
     }
 
-    path_hook_list = tmp;
-    path_hook_list[path_hook_count++] = hook;
+    for (i = 0 ; i < rule->prefix_len ; i++) {
+        rule->prefix[i] = path_fold_w(prefix[i]);
+    }
 
-    hr = S_OK;
+    rule->prefix[rule->prefix_len] = L'\0';
 
-end:
+    path_hook_init();
+
+    EnterCriticalSection(&path_hook_lock);
+    hr = path_hook_publish_locked(rule, NULL);
     LeaveCriticalSection(&path_hook_lock);
 
+    if (FAILED(hr)) {
+        goto fail;
+    }
+
+    return S_OK;
+
+fail:
+    free(rule->prefix);
+    free(rule->target);
+    free(rule->target_a);
+
     return hr;
 }
 
+static HRESULT path_hook_publish_locked(
+        const struct path_rule *new_rule,
+        path_hook_t new_hook)
+{
+    const struct path_hook_table *old;
+    struct path_hook_table *table;
+    size_t max_nodes;
+    size_t i;
+
+    old = path_hook_table;
+    table = calloc(1, sizeof(*table));
+
+    if (table == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    table->nrules = (old != NULL ? old->nrules : 0) + (new_rule ? 1 : 0);
+    table->nhooks = (old != NULL ? old->nhooks : 0) + (new_hook ? 1 : 0);
+    table->rules = calloc(table->nrules + 1, sizeof(*table->rules));
+    table->hooks = calloc(table->nhooks + 1, sizeof(*table->hooks));
+
+    if (table->rules == NULL || table->hooks == NULL) {
+        goto fail;
+    }
+
+    /* Rule strings are shared between snapshots; only the arrays are new */
+
+    if (old != NULL) {
+        memcpy(table->rules, old->rules, old->nrules * sizeof(*old->rules));
+        memcpy(table->hooks, old->hooks, old->nhooks * sizeof(*old->hooks));
+    }
+
+    /* qsort isn't stable, so each rule remembers when it was pushed. That
+       keeps duplicate prefixes in push order. */
+
+    if (new_rule != NULL) {
+        table->rules[table->nrules - 1] = *new_rule;
+        table->rules[table->nrules - 1].seq = path_hook_seq++;
+    }
+
+    if (new_hook != NULL) {
+        table->hooks[table->nhooks - 1] = new_hook;
+    }
+
+    qsort(table->rules, table->nrules, sizeof(*table->rules), path_rule_cmp);
+
+    for (i = 0 ; i < table->nrules ; i++) {
+        if (table->rules[i].resolver != NULL) {
+            table->nresolvers++;
+        }
+
+        if (table->rules[i].lister != NULL) {
+            table->nlisters++;
+        }
+    }
+
+    /* A trie never has more nodes than there are prefix characters, plus the
+       root. Size the array up front so that node indices stay stable. */
+
+    max_nodes = 1;
+
+    for (i = 0 ; i < table->nrules ; i++) {
+        max_nodes += table->rules[i].prefix_len;
+    }
+
+    table->nodes = calloc(max_nodes, sizeof(*table->nodes));
+
+    if (table->nodes == NULL) {
+        goto fail;
+    }
+
+    table->nodes[0].rule = -1;
+    table->nnodes = 1;
+    path_trie_build(table, 0, 0, table->nrules, 0);
+
+    /* Lookups walk the table without the lock, so the old one stays */
+
+    InterlockedExchangePointer((PVOID volatile *) &path_hook_table, table);
+
+    return S_OK;
+
+fail:
+    free(table->nodes);
+    free(table->hooks);
+    free(table->rules);
+    free(table);
+
+    return E_OUTOFMEMORY;
+}
+
+static void path_trie_build(
+        struct path_hook_table *table,
+        size_t node,
+        size_t lo,
+        size_t hi,
+        size_t depth)
+{
+    const struct path_rule *rules;
+    size_t child;
+    size_t nchildren;
+    size_t i;
+    size_t j;
+
+    /* rules[lo, hi) all share the first `depth` prefix characters and are
+       sorted, so any rule ending exactly at this node comes first. If the
+       same prefix was pushed twice, the first one wins. */
+
+    rules = table->rules;
+
+    if (lo < hi && rules[lo].prefix_len == depth) {
+        table->nodes[node].rule = (int) lo;
+    }
+
+    while (lo < hi && rules[lo].prefix_len == depth) {
+        lo++;
+    }
+
+    /* Count distinct next characters and reserve a contiguous run of child
+       nodes for them before recursing. */
+
+    nchildren = 0;
+
+    for (i = lo ; i < hi ; i = j) {
+        for (j = i + 1 ;
+                j < hi && rules[j].prefix[depth] == rules[i].prefix[depth] ;
+                j++);
+
+        nchildren++;
+    }
+
+    table->nodes[node].child = table->nnodes;
+    table->nodes[node].nchildren = nchildren;
+    table->nnodes += nchildren;
+
+    child = table->nodes[node].child;
+
+    for (i = lo ; i < hi ; i = j) {
+        for (j = i + 1 ;
+                j < hi && rules[j].prefix[depth] == rules[i].prefix[depth] ;
+                j++);
+
+        table->nodes[child].c = rules[i].prefix[depth];
+        table->nodes[child].rule = -1;
+        path_trie_build(table, child, i, j, depth + 1);
+        child++;
+    }
+}
+
+static const struct path_trie_node *path_trie_child(
+        const struct path_hook_table *table,
+        const struct path_trie_node *node,
+        wchar_t c)
+{
+    const struct path_trie_node *children;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+
+    children = &table->nodes[node->child];
+    lo = 0;
+    hi = node->nchildren;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if (children[mid].c < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == node->nchildren || children[lo].c != c) {
+        return NULL;
+    }
+
+    return &children[lo];
+}
+
+static const struct path_rule *path_trie_match(
+        const struct path_hook_table *table,
+        const wchar_t *src,
+        size_t *match_len)
+{
+    const struct path_trie_node *node;
+    const struct path_rule *best;
+    size_t i;
+
+    /* Walk the trie one folded character at a time, remembering the longest
+       rule whose prefix ends on a path component boundary. */
+
+    best = NULL;
+    node = &table->nodes[0];
+
+    for (i = 0 ; node != NULL ; i++) {
+        if (node->rule >= 0 &&
+                (src[i] == L'\0' || path_is_separator_w(src[i]))) {
+            best = &table->rules[node->rule];
+            *match_len = i;
+        }
+
+        if (src[i] == L'\0' || node->nchildren == 0) {
+            break;
+        }
+
+        node = path_trie_child(table, node, path_fold_w(src[i]));
+    }
+
+    return best;
+}
+
+static const struct path_rule *path_trie_match_a(
+        const struct path_hook_table *table,
+        const char *src,
+        size_t *match_len,
+        bool *complete)
+{
+    const struct path_trie_node *node;
+    const struct path_rule *best;
+    unsigned char c;
+    size_t i;
+
+    /* Same walk as path_trie_match, but directly over ANSI bytes. This is only
+       valid while the bytes are plain ASCII: in a DBCS code page like
+       Shift-JIS a trail byte can look like a backslash, so give up as soon as
+       we see anything else and let the caller widen the path properly. */
+
+    best = NULL;
+    node = &table->nodes[0];
+    *complete = false;
+
+    for (i = 0 ; node != NULL ; i++) {
+        c = src[i];
+
+        if (c >= 0x80) {
+            return NULL;
+        }
+
+        if (node->rule >= 0 && (c == '\0' || c == '\\' || c == '/')) {
+            best = &table->rules[node->rule];
+            *match_len = i;
+        }
+
+        if (c == '\0' || node->nchildren == 0) {
+            break;
+        }
+
+        node = path_trie_child(table, node, path_fold_w(c));
+    }
+
+    *complete = true;
+
+    return best;
+}
+
+static int path_rule_cmp(const void *lhs, const void *rhs)
+{
+    const struct path_rule *l;
+    const struct path_rule *r;
+    int result;
+
+    l = lhs;
+    r = rhs;
+    result = wcscmp(l->prefix, r->prefix);
+
+    if (result != 0) {
+        return result;
+    }
+
+    if (l->seq != r->seq) {
+        return l->seq < r->seq ? -1 : 1;
+    }
+
+    return 0;
+}
+
 static void path_hook_init(void)
 {
     /* Init is not thread safe because API hook init is not thread safe blah
        blah blah you know the drill by now. */
 
-    if (path_hook_initted) {
-        return;
+    if (path_hook_initted) {
+        return;
+    }
+
+    path_hook_initted = true;
+    InitializeCriticalSection(&path_hook_lock);
+
+    path_hook_insert_hooks(NULL);
+    atexit(path_hook_report_stats);
+}
+
+void path_hook_insert_hooks(HMODULE target)
+{
+    iat_hook_push(
+            target,
+            "kernel32.dll",
+            path_hook_syms,
+            _countof(path_hook_syms));
+}
+
+static BOOL path_transform_a(
+        const char **out,
+        char *buf,
+        size_t buf_size,
+        const char *src,
+        enum path_access access,
+        struct path_transform_info *info)
+{
+    const struct path_hook_table *table;
+    const struct path_rule *rule;
+    const char *rest;
+    wchar_t src_w[MAX_PATH];
+    wchar_t *dest_w;
+    size_t match_len;
+    size_t rest_len;
+    bool complete;
+    BOOL ok;
+
+    assert(out != NULL);
+    assert(buf != NULL);
+
+    *out = src;
+    table = path_hook_table;
+
+    if (info != NULL) {
+        memset(info, 0, sizeof(*info));
+    }
+
+    if (src == NULL || table == NULL) {
+        return TRUE;
+    }
+
+    /* Fast path: match prefix rules against the ANSI path as-is. Most paths
+       don't match anything, and those get rejected here without converting
+       or allocating. Callback hooks need a wide path, so they rule this out. */
+
+    if (table->nhooks == 0) {
+        rule = path_trie_match_a(table, src, &match_len, &complete);
+
+        if (complete && rule == NULL) {
+            return TRUE;
+        }
+
+        if (complete && rule->target_a != NULL) {
+            rest = src + match_len;
+
+            if (*rest == '\\' || *rest == '/') {
+                rest++;
+            }
+
+            rest_len = strlen(rest);
+
+            if (rule->target_a_len + rest_len + 1 > buf_size) {
+                SetLastError(ERROR_FILENAME_EXCED_RANGE);
+
+                return FALSE;
+            }
+
+            memcpy(buf, rule->target_a, rule->target_a_len);
+            memcpy(buf + rule->target_a_len, rest, rest_len + 1);
+            *out = buf;
+
+            if (info != NULL) {
+                info->cached = rule->cached;
+            }
+
+            return TRUE;
+        }
+    }
+
+    /* Slow path: widen the path, apply the full transform, narrow the result
+       into the caller's buffer. The ANSI APIs don't accept paths longer than
+       MAX_PATH anyway, so leave anything longer to fail on its own. */
+
+    if (mbstowcs_s(NULL, src_w, _countof(src_w), src, _TRUNCATE) != 0) {
+        return TRUE;
+    }
+
+    /* Take ownership! */
+    ok = path_transform_w(&dest_w, info, src_w, access);
+
+    if (!ok || dest_w == NULL) {
+        return ok;
+    }
+
+    if (wcstombs_s(NULL, buf, buf_size, dest_w, _TRUNCATE) != 0) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        ok = FALSE;
+    } else {
+        *out = buf;
+    }
+
+    free(dest_w);
+
+    return ok;
+}
+
+static BOOL path_transform_w(
+        wchar_t **out,
+        struct path_transform_info *info,
+        const wchar_t *src,
+        enum path_access access)
+{
+    const struct path_hook_table *table;
+    const struct path_rule *rule;
+    struct path_cache_set *set;
+    wchar_t *dest;
+    size_t match_len;
+    size_t src_len;
+    uint32_t hash;
+    HRESULT hr;
+    BOOL ok;
+
+    assert(out != NULL);
+
+    *out = NULL;
+    table = path_hook_table;
+
+    if (info != NULL) {
+        memset(info, 0, sizeof(*info));
+    }
+
+    if (src == NULL || table == NULL) {
+        return TRUE;
+    }
+
+    if (table->nhooks == 0) {
+        ok = path_transform_uncached(table, src, &rule, &match_len, &dest);
+
+        goto build;
+    }
+
+    src_len = wcslen(src);
+
+    if (src_len >= PATH_CACHE_MAX_LEN) {
+        ok = path_transform_uncached(table, src, &rule, &match_len, &dest);
+
+        goto build;
+    }
+
+    hash = path_cache_hash(src, src_len);
+    set = &path_cache[hash % PATH_CACHE_SETS];
+
+    AcquireSRWLockShared(&set->lock);
+    hr = path_cache_lookup_locked(
+            set,
+            table,
+            hash,
+            src,
+            &rule,
+            &match_len,
+            &dest);
+    ReleaseSRWLockShared(&set->lock);
+
+    if (hr == S_OK) {
+        InterlockedIncrement(&path_cache_hits);
+        ok = TRUE;
+    } else if (hr == S_FALSE) {
+        InterlockedIncrement(&path_cache_misses);
+        ok = path_transform_uncached(table, src, &rule, &match_len, &dest);
+
+        if (ok) {
+            path_cache_insert(set, table, hash, src, rule, match_len, dest);
+        }
+    } else {
+        SetLastError(ERROR_OUTOFMEMORY);
+        ok = FALSE;
+    }
+
+build:
+    if (!ok) {
+        return FALSE;
+    }
+
+    if (rule != NULL && rule->resolver != NULL) {
+        return path_resolve_w(out, info, rule, src, match_len, access);
+    }
+
+    if (    rule != NULL &&
+            rule->lister != NULL &&
+            access != PATH_ACCESS_READ &&
+            access != PATH_ACCESS_LIST) {
+        SetLastError(ERROR_WRITE_PROTECT);
+
+        return FALSE;
+    }
+
+    if (rule != NULL) {
+        if (info != NULL) {
+            info->cached = rule->cached;
+        }
+
+        return path_rewrite_w(out, rule, src, match_len);
+    }
+
+    *out = dest; /* Relinquish ownership to caller! */
+
+    return TRUE;
+}
+
+static BOOL path_transform_uncached(
+        const struct path_hook_table *table,
+        const wchar_t *src,
+        const struct path_rule **rule,
+        size_t *match_len,
+        wchar_t **out)
+{
+    BOOL ok;
+    HRESULT hr;
+    wchar_t *dest;
+    size_t dest_c;
+    size_t i;
+
+    dest = NULL;
+    *out = NULL;
+
+    /* Prefix rules */
+
+    *rule = path_trie_match(table, src, match_len);
+
+    if (*rule != NULL) {
+        return TRUE;
+    }
+
+    /* Callback hooks */
+
+    for (i = 0 ; i < table->nhooks ; i++) {
+        hr = table->hooks[i](src, NULL, &dest_c);
+
+        if (FAILED(hr)) {
+            ok = hr_propagate_win32(hr, FALSE);
+
+            goto end;
+        }
+
+        if (hr == S_FALSE) {
+            continue;
+        }
+
+        dest = malloc(dest_c * sizeof(wchar_t));
+
+        if (dest == NULL) {
+            SetLastError(ERROR_OUTOFMEMORY);
+            ok = FALSE;
+
+            goto end;
+        }
+
+        hr = table->hooks[i](src, dest, &dest_c);
+
+        if (FAILED(hr)) {
+            ok = hr_propagate_win32(hr, FALSE);
+
+            goto end;
+        }
+
+        break;
+    }
+
+    *out = dest;
+    dest = NULL;
+    ok = TRUE;
+
+end:
+    free(dest);
+
+    return ok;
+}
+
+static BOOL path_rewrite_w(
+        wchar_t **out,
+        const struct path_rule *rule,
+        const wchar_t *src,
+        size_t match_len)
+{
+    const wchar_t *rest;
+    wchar_t *dest;
+    size_t rest_len;
+
+    /* The match already tells us exactly how long the output is, so build it
+       in a single pass. */
+
+    rest = src + match_len;
+
+    if (path_is_separator_w(*rest)) {
+        rest++;
+    }
+
+    rest_len = wcslen(rest);
+    dest = malloc((rule->target_len + rest_len + 1) * sizeof(wchar_t));
+
+    if (dest == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+
+        return FALSE;
+    }
+
+    memcpy(dest, rule->target, rule->target_len * sizeof(wchar_t));
+    memcpy(dest + rule->target_len, rest, (rest_len + 1) * sizeof(wchar_t));
+
+    *out = dest;
+
+    return TRUE;
+}
+
+static BOOL path_resolve_w(
+        wchar_t **out,
+        struct path_transform_info *info,
+        const struct path_rule *rule,
+        const wchar_t *src,
+        size_t match_len,
+        enum path_access access)
+{
+    const wchar_t *rest;
+    const wchar_t *pos;
+    HRESULT hr;
+
+    rest = src + match_len;
+
+    if (path_is_separator_w(*rest)) {
+        rest++;
+    }
+
+    hr = rule->resolver(rule->ctx, rest, access, out);
+
+    if (FAILED(hr)) {
+        *out = NULL;
+
+        return hr_propagate_win32(hr, FALSE);
+    }
+
+    /* Only listings come back as a list of patterns */
+
+    if (access == PATH_ACCESS_LIST && info != NULL) {
+        for (pos = *out ; *pos != L'\0' ; pos += wcslen(pos) + 1) {
+            info->nlayers++;
+        }
+    }
+
+    return TRUE;
+}
+
+static enum path_access path_access_for_create(
+        uint32_t dwDesiredAccess,
+        uint32_t dwCreationDisposition)
+{
+    if (dwDesiredAccess & (GENERIC_WRITE | GENERIC_ALL | FILE_WRITE_DATA |
+            FILE_APPEND_DATA | FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA |
+            DELETE)) {
+        return PATH_ACCESS_WRITE;
+    }
+
+    /* OPEN_ALWAYS only creates a file that isn't there at all, so a
+       read-only open of an existing file stays a read. */
+
+    switch (dwCreationDisposition) {
+    case CREATE_NEW:
+    case CREATE_ALWAYS:
+    case TRUNCATE_EXISTING:
+        return PATH_ACCESS_WRITE;
+
+    default:
+        return PATH_ACCESS_READ;
+    }
+}
+
+static BOOL path_find_first_a(
+        const char **trans,
+        char *buf,
+        size_t buf_size,
+        const char *src,
+        FINDEX_INFO_LEVELS fInfoLevelId,
+        void *lpFindFileData,
+        FINDEX_SEARCH_OPS fSearchOp,
+        void *lpSearchFilter,
+        DWORD dwAdditionalFlags,
+        HANDLE *result,
+        bool *handled)
+{
+    const struct path_hook_table *table;
+    struct path_transform_info info;
+    WIN32_FIND_DATAW data;
+    wchar_t pattern[MAX_PATH];
+    wchar_t *trans_w;
+    bool can_find;
+
+    /* Transforms an ANSI find pattern exactly once. Finds answered by the
+       merged or cached listing code set *handled, anything else is left for
+       the ANSI API with its transformed pattern in *trans. */
+
+    *trans = src;
+    *result = INVALID_HANDLE_VALUE;
+    *handled = false;
+    table = path_hook_table;
+    can_find = path_dir_can_find(fSearchOp, lpSearchFilter, dwAdditionalFlags);
+
+    if (src == NULL || table == NULL || table->nresolvers == 0) {
+        /* Merged listings are only ever produced by resolvers. Without any,
+           stay on the ANSI fast path and only widen the result if the
+           listing cache might answer it. */
+
+        if (!path_transform_a(
+                trans,
+                buf,
+                buf_size,
+                src,
+                PATH_ACCESS_LIST,
+                &info)) {
+            return FALSE;
+        }
+
+        if (    info.cached &&
+                can_find &&
+                path_widen(pattern, _countof(pattern), *trans)) {
+            *result = path_dir_find_first(pattern, &data, handled);
+        }
+    } else {
+        if (!path_widen(pattern, _countof(pattern), src)) {
+            return TRUE;
+        }
+
+        if (!path_transform_w(&trans_w, &info, pattern, PATH_ACCESS_LIST)) {
+            return FALSE;
+        }
+
+        if (info.nlayers > 0) {
+            *result = path_find_first_merged(
+                    trans_w,
+                    fInfoLevelId,
+                    &data,
+                    fSearchOp,
+                    lpSearchFilter,
+                    dwAdditionalFlags);
+            *handled = true;
+        } else if (info.cached && can_find) {
+            *result = path_dir_find_first(
+                    trans_w ? trans_w : pattern,
+                    &data,
+                    handled);
+        }
+
+        if (!*handled && trans_w != NULL) {
+            if (wcstombs_s(NULL, buf, buf_size, trans_w, _TRUNCATE) != 0) {
+                free(trans_w);
+                SetLastError(ERROR_FILENAME_EXCED_RANGE);
+
+                return FALSE;
+            }
+
+            *trans = buf;
+        }
+
+        free(trans_w);
+    }
+
+    if (*handled && *result != INVALID_HANDLE_VALUE) {
+        path_find_narrow(lpFindFileData, &data);
+    }
+
+    return TRUE;
+}
+
+static HANDLE path_find_first_merged(
+        const wchar_t *layers,
+        FINDEX_INFO_LEVELS fInfoLevelId,
+        WIN32_FIND_DATAW *lpFindFileData,
+        FINDEX_SEARCH_OPS fSearchOp,
+        void *lpSearchFilter,
+        DWORD dwAdditionalFlags)
+{
+    struct path_find_entry *new_mem;
+    struct path_find *find;
+    WIN32_FIND_DATAW data;
+    const wchar_t *layer;
+    HANDLE handle;
+    DWORD error;
+    size_t layer_no;
+    size_t cap;
+    size_t i;
+    size_t j;
+
+    find = calloc(1, sizeof(*find));
+
+    if (find == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+
+        return INVALID_HANDLE_VALUE;
+    }
+
+    /* A directory that is missing from every layer is a missing path, one
+       that exists somewhere but has no matches is a missing file. */
+
+    error = ERROR_PATH_NOT_FOUND;
+    cap = 0;
+    layer_no = 0;
+
+    for (layer = layers ; *layer != L'\0' ; layer += wcslen(layer) + 1) {
+        /* Our own imports aren't hooked, so these go straight to the OS */
+
+        handle = FindFirstFileExW(
+                layer,
+                fInfoLevelId,
+                &data,
+                fSearchOp,
+                lpSearchFilter,
+                dwAdditionalFlags);
+
+        if (handle == INVALID_HANDLE_VALUE) {
+            if (GetLastError() != ERROR_PATH_NOT_FOUND) {
+                error = GetLastError();
+            }
+
+            layer_no++;
+
+            continue;
+        }
+
+        do {
+            if (find->nentries == cap) {
+                cap = cap ? 2 * cap : 64;
+                new_mem = realloc(find->entries, cap * sizeof(*new_mem));
+
+                if (new_mem == NULL) {
+                    FindClose(handle);
+                    error = ERROR_OUTOFMEMORY;
+
+                    goto fail;
+                }
+
+                find->entries = new_mem;
+            }
+
+            find->entries[find->nentries].data = data;
+            find->entries[find->nentries].layer = layer_no;
+            find->nentries++;
+        } while (FindNextFileW(handle, &data));
+
+        FindClose(handle);
+        layer_no++;
+    }
+
+    if (find->nentries == 0) {
+        goto fail;
+    }
+
+    /* Sort by name and then by layer, so that the winning entry for each name
+       comes first and the rest can be squeezed out in one pass. The result
+       comes out in roughly the same order that NTFS lists things in. */
+
+    qsort(  find->entries,
+            find->nentries,
+            sizeof(*find->entries),
+            path_find_entry_cmp);
+
+    for (i = 1, j = 1 ; i < find->nentries ; i++) {
+        if (_wcsicmp(
+                find->entries[i].data.cFileName,
+                find->entries[j - 1].data.cFileName) != 0) {
+            find->entries[j++] = find->entries[i];
+        }
+    }
+
+    find->nentries = j;
+    *lpFindFileData = find->entries[0].data;
+
+    return path_find_register(find);
+
+fail:
+    free(find->entries);
+    free(find);
+    SetLastError(error);
+
+    return INVALID_HANDLE_VALUE;
+}
+
+static int path_find_entry_cmp(const void *lhs, const void *rhs)
+{
+    const struct path_find_entry *l;
+    const struct path_find_entry *r;
+    int result;
+
+    l = lhs;
+    r = rhs;
+    result = path_name_cmp(l->data.cFileName, r->data.cFileName);
+
+    if (result != 0) {
+        return result;
+    }
+
+    return l->layer < r->layer ? -1 : l->layer > r->layer;
+}
+
+static HANDLE path_find_register(struct path_find *find)
+{
+    size_t bucket;
+
+    /* The first entry has already been handed out by FindFirstFile */
+
+    find->pos = 1;
+    find->refs = 1;
+    bucket = path_find_bucket((HANDLE) find);
+
+    AcquireSRWLockExclusive(&path_find_lock);
+    find->next = path_find_buckets[bucket];
+    path_find_buckets[bucket] = find;
+    ReleaseSRWLockExclusive(&path_find_lock);
+
+    return (HANDLE) find;
+}
+
+static size_t path_find_bucket(HANDLE handle)
+{
+    /* Heap blocks are at least eight byte aligned */
+
+    return ((uintptr_t) handle >> 3) % PATH_FIND_BUCKETS;
+}
+
+static struct path_find *path_find_acquire(HANDLE handle)
+{
+    struct path_find *find;
+
+    AcquireSRWLockShared(&path_find_lock);
+
+    find = path_find_buckets[path_find_bucket(handle)];
+
+    for (; find != NULL ; find = find->next) {
+        if ((HANDLE) find == handle) {
+            InterlockedIncrement(&find->refs);
+
+            break;
+        }
+    }
+
+    ReleaseSRWLockShared(&path_find_lock);
+
+    return find;
+}
+
+static void path_find_release(struct path_find *find)
+{
+    if (InterlockedDecrement(&find->refs) == 0) {
+        free(find->entries);
+        free(find);
+    }
+}
+
+static void path_find_narrow(
+        WIN32_FIND_DATAA *out,
+        const WIN32_FIND_DATAW *src)
+{
+    memset(out, 0, sizeof(*out));
+    out->dwFileAttributes = src->dwFileAttributes;
+    out->ftCreationTime = src->ftCreationTime;
+    out->ftLastAccessTime = src->ftLastAccessTime;
+    out->ftLastWriteTime = src->ftLastWriteTime;
+    out->nFileSizeHigh = src->nFileSizeHigh;
+    out->nFileSizeLow = src->nFileSizeLow;
+    out->dwReserved0 = src->dwReserved0;
+    out->dwReserved1 = src->dwReserved1;
+
+    wcstombs_s(
+            NULL,
+            out->cFileName,
+            _countof(out->cFileName),
+            src->cFileName,
+            _TRUNCATE);
+
+    wcstombs_s(
+            NULL,
+            out->cAlternateFileName,
+            _countof(out->cAlternateFileName),
+            src->cAlternateFileName,
+            _TRUNCATE);
+}
+
+static bool path_widen(wchar_t *out, size_t max_count, const char *src)
+{
+    return mbstowcs_s(NULL, out, max_count, src, _TRUNCATE) == 0;
+}
+
+static bool path_dir_split(
+        const wchar_t *path,
+        wchar_t *dir,
+        const wchar_t **name)
+{
+    size_t dir_len;
+    size_t start;
+    size_t len;
+    size_t i;
+
+    /* Fold the directory part of `path` into `dir` (MAX_PATH long) and point
+       `name` at the final component. Paths with . or .. components could
+       reach the same directory under a different key, so don't cache them,
+       and neither paths that end in a separator. */
+
+    len = wcslen(path);
+
+    if (len >= MAX_PATH) {
+        return false;
+    }
+
+    dir_len = 0;
+    start = 0;
+
+    for (i = 0 ; i <= len ; i++) {
+        if (i < len && !path_is_separator_w(path[i])) {
+            dir[i] = path_fold_w(path[i]);
+
+            continue;
+        }
+
+        if (    (i - start == 1 && path[start] == L'.') ||
+                (i - start == 2 && path[start] == L'.' &&
+                    path[start + 1] == L'.')) {
+            return false;
+        }
+
+        if (i < len) {
+            dir[i] = L'\\';
+            dir_len = i + 1;
+        }
+
+        start = i + 1;
+    }
+
+    if (dir_len == 0 || dir_len == len) {
+        return false;
+    }
+
+    dir[dir_len] = L'\0';
+    *name = path + dir_len;
+
+    return true;
+}
+
+static HRESULT path_dir_acquire(const wchar_t *dir, struct path_dir **out)
+{
+    struct path_dir *entry;
+    struct path_dir fresh;
+    uint32_t generation;
+    uint32_t hash;
+    int attempt;
+
+    /* On S_OK the listing is returned with path_dir_lock held shared. On
+       S_FALSE the caller has to ask the file system itself. */
+
+    hash = path_cache_hash(dir, wcslen(dir));
+
+    for (attempt = 0 ; attempt < 2 ; attempt++) {
+        AcquireSRWLockShared(&path_dir_lock);
+        entry = path_dir_find_locked(hash, dir);
+
+        if (entry != NULL && !entry->written && !entry->stale) {
+            *out = entry;
+
+            return S_OK;
+        }
+
+        ReleaseSRWLockShared(&path_dir_lock);
+
+        if (entry != NULL && entry->written) {
+            return S_FALSE;
+        }
+
+        /* List the directory without holding the lock, then install it and
+           go round again to pick it up under a shared lock. */
+
+        if (path_dir_reserve(hash, dir, &generation) != S_OK) {
+            return S_FALSE;
+        }
+
+        if (path_dir_load(dir, &fresh) != S_OK) {
+            return S_FALSE;
+        }
+
+        path_dir_install(hash, dir, generation, &fresh);
+    }
+
+    return S_FALSE;
+}
+
+static HRESULT path_dir_load(const wchar_t *dir, struct path_dir *out)
+{
+    const struct path_rule *rule;
+    WIN32_FIND_DATAW *new_mem;
+    WIN32_FIND_DATAW data;
+    wchar_t pattern[MAX_PATH];
+    HANDLE find;
+    size_t dir_len;
+    size_t cap;
+
+    memset(out, 0, sizeof(*out));
+    InterlockedIncrement(&path_dir_misses);
+
+    rule = path_dir_listed(dir, &dir_len);
+
+    if (rule != NULL) {
+        return path_dir_load_listed(rule, dir + dir_len, out);
+    }
+
+    dir_len = wcslen(dir);
+
+    if (dir_len + 2 > _countof(pattern)) {
+        return S_FALSE;
+    }
+
+    memcpy(pattern, dir, dir_len * sizeof(wchar_t));
+    pattern[dir_len] = L'*';
+    pattern[dir_len + 1] = L'\0';
+
+    find = FindFirstFileW(pattern, &data);
+
+    if (find == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_PATH_NOT_FOUND) {
+            return S_OK;
+        }
+
+        if (GetLastError() == ERROR_FILE_NOT_FOUND) {
+            out->exists = true;
+
+            return S_OK;
+        }
+
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    out->exists = true;
+    cap = 0;
+
+    do {
+        if (out->nentries == cap) {
+            cap = cap ? 2 * cap : 32;
+            new_mem = realloc(out->entries, cap * sizeof(*new_mem));
+
+            if (new_mem == NULL) {
+                FindClose(find);
+                free(out->entries);
+                out->entries = NULL;
+
+                return E_OUTOFMEMORY;
+            }
+
+            out->entries = new_mem;
+        }
+
+        out->entries[out->nentries++] = data;
+    } while (FindNextFileW(find, &data));
+
+    FindClose(find);
+
+    qsort(  out->entries,
+            out->nentries,
+            sizeof(*out->entries),
+            path_dir_entry_cmp);
+
+    return S_OK;
+}
+
+static HRESULT path_dir_load_listed(
+        const struct path_rule *rule,
+        const wchar_t *rel,
+        struct path_dir *out)
+{
+    HRESULT hr;
+
+    /* Directories under a listed prefix only exist in its lister */
+
+    if (path_is_separator_w(*rel)) {
+        rel++;
+    }
+
+    hr = rule->lister(rule->ctx, rel, &out->entries, &out->nentries);
+
+    if (hr == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND)) {
+        out->entries = NULL;
+        out->nentries = 0;
+
+        return S_OK;
+    }
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    out->exists = true;
+
+    qsort(  out->entries,
+            out->nentries,
+            sizeof(*out->entries),
+            path_dir_entry_cmp);
+
+    return S_OK;
+}
+
+static const struct path_rule *path_dir_listed(
+        const wchar_t *path,
+        size_t *match_len)
+{
+    const struct path_hook_table *table;
+    const struct path_rule *rule;
+
+    /* Listed prefixes are their own targets, so a redirected path that is
+       under one still matches it. */
+
+    table = path_hook_table;
+
+    if (table == NULL || table->nlisters == 0) {
+        return NULL;
+    }
+
+    rule = path_trie_match(table, path, match_len);
+
+    if (rule == NULL || rule->lister == NULL) {
+        return NULL;
+    }
+
+    return rule;
+}
+
+static HRESULT path_dir_reserve(
+        uint32_t hash,
+        const wchar_t *dir,
+        uint32_t *generation)
+{
+    struct path_dir *entry;
+    HRESULT hr;
+
+    /* Make sure the directory has an entry before it is read, so that
+       anything that changes it in the meantime has a generation to bump.
+       Entries are never freed, so the new one starts out stale and empty. */
+
+    AcquireSRWLockExclusive(&path_dir_lock);
+    entry = path_dir_find_locked(hash, dir);
+
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(*entry));
+
+        if (entry == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        entry->dir = _wcsdup(dir);
+
+        if (entry->dir == NULL) {
+            free(entry);
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        entry->hash = hash;
+        entry->stale = true;
+        entry->next = path_dir_buckets[hash % PATH_DIR_BUCKETS];
+        path_dir_buckets[hash % PATH_DIR_BUCKETS] = entry;
+    } else if (entry->written) {
+        hr = S_FALSE;
+
+        goto end;
+    }
+
+    *generation = entry->generation;
+    hr = S_OK;
+
+end:
+    ReleaseSRWLockExclusive(&path_dir_lock);
+
+    return hr;
+}
+
+static void path_dir_install(
+        uint32_t hash,
+        const wchar_t *dir,
+        uint32_t generation,
+        struct path_dir *fresh)
+{
+    struct path_dir *entry;
+
+    AcquireSRWLockExclusive(&path_dir_lock);
+    entry = path_dir_find_locked(hash, dir);
+
+    /* Drop the listing if the directory changed while it was being read */
+
+    if (    entry == NULL ||
+            entry->written ||
+            entry->generation != generation) {
+        ReleaseSRWLockExclusive(&path_dir_lock);
+        free(fresh->entries);
+
+        return;
+    }
+
+    free(entry->entries);
+    entry->entries = fresh->entries;
+    entry->nentries = fresh->nentries;
+    entry->exists = fresh->exists;
+    entry->stale = false;
+    entry->generation++;
+
+    ReleaseSRWLockExclusive(&path_dir_lock);
+}
+
+static struct path_dir *path_dir_find_locked(
+        uint32_t hash,
+        const wchar_t *dir)
+{
+    struct path_dir *entry;
+
+    for (entry = path_dir_buckets[hash % PATH_DIR_BUCKETS] ;
+            entry != NULL ;
+            entry = entry->next) {
+        if (entry->hash == hash && wcscmp(entry->dir, dir) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static const WIN32_FIND_DATAW *path_dir_lookup_locked(
+        const struct path_dir *entry,
+        const wchar_t *name)
+{
+    size_t lo;
+    size_t hi;
+    size_t mid;
+    size_t i;
+    int result;
+
+    lo = 0;
+    hi = entry->nentries;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        result = path_name_cmp(entry->entries[mid].cFileName, name);
+
+        if (result == 0) {
+            return &entry->entries[mid];
+        } else if (result < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    /* The file system also accepts 8.3 names, which aren't sorted */
+
+    if (wcschr(name, L'~') != NULL) {
+        for (i = 0 ; i < entry->nentries ; i++) {
+            if (_wcsicmp(entry->entries[i].cAlternateFileName, name) == 0) {
+                return &entry->entries[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int path_dir_entry_cmp(const void *lhs, const void *rhs)
+{
+    const WIN32_FIND_DATAW *l;
+    const WIN32_FIND_DATAW *r;
+
+    l = lhs;
+    r = rhs;
+
+    return path_name_cmp(l->cFileName, r->cFileName);
+}
+
+static int path_name_cmp(const wchar_t *lhs, const wchar_t *rhs)
+{
+    int l;
+    int r;
+
+    /* Listings are sorted case-insensitively, except that "." and ".." always
+       come first the way NTFS returns them. Plenty of code skips the first
+       two entries of a listing without looking at their names, and
+       _wcsicmp() alone sorts names such as "!foo" or "-bar" ahead of them. */
+
+    l = path_name_rank(lhs);
+    r = path_name_rank(rhs);
+
+    if (l != r) {
+        return l < r ? -1 : 1;
+    }
+
+    return _wcsicmp(lhs, rhs);
+}
+
+static int path_name_rank(const wchar_t *name)
+{
+    if (name[0] != L'.') {
+        return 2;
+    } else if (name[1] == L'\0') {
+        return 0;
+    } else if (name[1] == L'.' && name[2] == L'\0') {
+        return 1;
+    } else {
+        return 2;
+    }
+}
+
+static HRESULT path_dir_query(const wchar_t *path, WIN32_FIND_DATAW *out)
+{
+    const WIN32_FIND_DATAW *match;
+    struct path_dir *entry;
+    const wchar_t *name;
+    wchar_t dir[MAX_PATH];
+    HRESULT hr;
+
+    /* S_OK and the entry if found, a Win32 error if the file system would
+       have failed the query, S_FALSE if it has to be asked instead. */
+
+    if (!path_dir_split(path, dir, &name)) {
+        return path_dir_query_root(path, out);
+    }
+
+    if (wcspbrk(name, L"*?") != NULL) {
+        return S_FALSE;
+    }
+
+    hr = path_dir_acquire(dir, &entry);
+
+    if (hr != S_OK) {
+        return hr;
+    }
+
+    if (!entry->exists) {
+        hr = HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND);
+    } else {
+        match = path_dir_lookup_locked(entry, name);
+
+        if (match != NULL) {
+            *out = *match;
+            hr = S_OK;
+        } else {
+            hr = HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+        }
+    }
+
+    ReleaseSRWLockShared(&path_dir_lock);
+    InterlockedIncrement(&path_dir_hits);
+
+    return hr;
+}
+
+static HANDLE path_dir_find_first(
+        const wchar_t *pattern,
+        WIN32_FIND_DATAW *lpFindFileData,
+        bool *handled)
+{
+    const WIN32_FIND_DATAW *match;
+    struct path_dir *entry;
+    struct path_find *find;
+    const wchar_t *name;
+    wchar_t dir[MAX_PATH];
+    size_t match_len;
+    DWORD error;
+    bool spec;
+    bool all;
+    size_t i;
+    size_t n;
+
+    *handled = false;
+
+    /* Only whole-directory listings and single names. Anything else would
+       need the file system's own wildcard matching rules, except under a
+       listed prefix where there is no file system to ask. */
+
+    if (!path_dir_split(pattern, dir, &name)) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    all = wcscmp(name, L"*") == 0 || wcscmp(name, L"*.*") == 0;
+    spec = !all && wcspbrk(name, L"*?") != NULL;
+
+    if (!all && wcspbrk(name, L"*?<>\"") != NULL &&
+            (!spec || path_dir_listed(dir, &match_len) == NULL)) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    find = calloc(1, sizeof(*find));
+
+    if (find == NULL) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (path_dir_acquire(dir, &entry) != S_OK) {
+        free(find);
+
+        return INVALID_HANDLE_VALUE;
+    }
+
+    *handled = true;
+    error = ERROR_SUCCESS;
+    match = NULL;
+
+    if (!entry->exists) {
+        error = ERROR_PATH_NOT_FOUND;
+    } else if (all || spec) {
+        find->nentries = entry->nentries;
+    } else {
+        match = path_dir_lookup_locked(entry, name);
+        find->nentries = match != NULL ? 1 : 0;
+    }
+
+    if (error == ERROR_SUCCESS && find->nentries == 0) {
+        error = ERROR_FILE_NOT_FOUND;
+    }
+
+    if (error == ERROR_SUCCESS) {
+        find->entries = calloc(find->nentries, sizeof(*find->entries));
+
+        if (find->entries == NULL) {
+            error = ERROR_OUTOFMEMORY;
+        }
+    }
+
+    if (error == ERROR_SUCCESS) {
+        for (i = 0, n = 0 ; i < find->nentries ; i++) {
+            if (all) {
+                find->entries[n++].data = entry->entries[i];
+            } else if (!spec) {
+                find->entries[n++].data = *match;
+            } else if (path_dir_match_spec(entry->entries[i].cFileName, name)) {
+                find->entries[n++].data = entry->entries[i];
+            }
+        }
+
+        find->nentries = n;
+
+        if (n == 0) {
+            error = ERROR_FILE_NOT_FOUND;
+        }
+    }
+
+    ReleaseSRWLockShared(&path_dir_lock);
+    InterlockedIncrement(&path_dir_hits);
+
+    if (error != ERROR_SUCCESS) {
+        free(find->entries);
+        free(find);
+        SetLastError(error);
+
+        return INVALID_HANDLE_VALUE;
+    }
+
+    *lpFindFileData = find->entries[0].data;
+
+    return path_find_register(find);
+}
+
+static bool path_dir_match_spec(const wchar_t *name, const wchar_t *spec)
+{
+    const wchar_t *star_spec;
+    const wchar_t *star_name;
+
+    /* Plain * and ? wildcards, without the special cases the file system has
+       for dots and 8.3 names. */
+
+    star_spec = NULL;
+    star_name = NULL;
+
+    while (*name != L'\0') {
+        if (*spec == L'*') {
+            star_spec = ++spec;
+            star_name = name;
+        } else if (*spec == L'?' || (*spec != L'\0' &&
+                path_fold_w(*spec) == path_fold_w(*name))) {
+            spec++;
+            name++;
+        } else if (star_spec != NULL) {
+            spec = star_spec;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+
+    while (*spec == L'*') {
+        spec++;
+    }
+
+    return *spec == L'\0';
+}
+
+static void path_dir_invalidate(const wchar_t *path, bool written)
+{
+    struct path_dir *entry;
+    const wchar_t *name;
+    wchar_t trimmed[MAX_PATH];
+    wchar_t dir[MAX_PATH];
+    size_t dir_len;
+    size_t len;
+    size_t i;
+    DWORD error;
+
+    /* Called after the hooks have changed something at `path`. That makes
+       the listing it is in stale, or uncacheable if it was opened for
+       writing, along with its own listing in case it is a directory. The
+       caller's last error is left alone. */
+
+    error = GetLastError();
+    len = wcslen(path);
+
+    while (len > 0 && path_is_separator_w(path[len - 1])) {
+        len--;
+    }
+
+    if (len >= _countof(trimmed)) {
+        path_dir_invalidate_all();
+
+        goto end;
+    }
+
+    memcpy(trimmed, path, len * sizeof(wchar_t));
+    trimmed[len] = L'\0';
+
+    if (!path_dir_split(trimmed, dir, &name)) {
+        path_dir_invalidate_all();
+
+        goto end;
+    }
+
+    dir_len = wcslen(dir);
+
+    AcquireSRWLockExclusive(&path_dir_lock);
+    entry = path_dir_find_locked(path_cache_hash(dir, dir_len), dir);
+
+    if (entry == NULL && written) {
+        entry = calloc(1, sizeof(*entry));
+
+        if (entry != NULL) {
+            entry->dir = _wcsdup(dir);
+
+            if (entry->dir != NULL) {
+                entry->hash = path_cache_hash(dir, dir_len);
+                i = entry->hash % PATH_DIR_BUCKETS;
+                entry->next = path_dir_buckets[i];
+                path_dir_buckets[i] = entry;
+            } else {
+                free(entry);
+                entry = NULL;
+            }
+        }
+    }
+
+    if (entry != NULL) {
+        entry->stale = true;
+        entry->written |= written;
+        entry->generation++;
+    }
+
+    for (len = dir_len ; *name != L'\0' && len + 2 < _countof(dir) ; name++) {
+        dir[len++] = path_fold_w(*name);
+    }
+
+    if (*name == L'\0') {
+        dir[len++] = L'\\';
+        dir[len] = L'\0';
+        entry = path_dir_find_locked(path_cache_hash(dir, len), dir);
+
+        if (entry != NULL) {
+            entry->stale = true;
+            entry->generation++;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&path_dir_lock);
+
+end:
+    SetLastError(error);
+}
+
+static HRESULT path_dir_query_root(
+        const wchar_t *path,
+        WIN32_FIND_DATAW *out)
+{
+    size_t match_len;
+    size_t i;
+
+    /* The root of a listed prefix isn't in any listing of its own */
+
+    if (path_dir_listed(path, &match_len) == NULL) {
+        return S_FALSE;
+    }
+
+    i = match_len;
+
+    while (path_is_separator_w(path[i])) {
+        i++;
+    }
+
+    if (path[i] != L'\0') {
+        return S_FALSE;
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->dwFileAttributes = FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_READONLY;
+    InterlockedIncrement(&path_dir_hits);
+
+    return S_OK;
+}
+
+static HRESULT path_dir_query_a(const char *path, WIN32_FIND_DATAW *out)
+{
+    wchar_t path_w[MAX_PATH];
+
+    if (!path_widen(path_w, _countof(path_w), path)) {
+        return S_FALSE;
     }
 
-    path_hook_initted = true;
-    InitializeCriticalSection(&path_hook_lock);
+    return path_dir_query(path_w, out);
+}
 
-    path_hook_insert_hooks(NULL);
+static void path_dir_fill_attrs(
+        WIN32_FILE_ATTRIBUTE_DATA *out,
+        const WIN32_FIND_DATAW *src)
+{
+    out->dwFileAttributes = src->dwFileAttributes;
+    out->ftCreationTime = src->ftCreationTime;
+    out->ftLastAccessTime = src->ftLastAccessTime;
+    out->ftLastWriteTime = src->ftLastWriteTime;
+    out->nFileSizeHigh = src->nFileSizeHigh;
+    out->nFileSizeLow = src->nFileSizeLow;
 }
 
-void path_hook_insert_hooks(HMODULE target)
+static void path_dir_invalidate_a(const char *path, bool written)
 {
-    hook_table_apply(
-            target,
-            "kernel32.dll",
-            path_hook_syms,
-            _countof(path_hook_syms));
+    wchar_t path_w[MAX_PATH];
+
+    if (path_widen(path_w, _countof(path_w), path)) {
+        path_dir_invalidate(path_w, written);
+    } else {
+        path_dir_invalidate_all();
+    }
 }
 
-static BOOL path_transform_a(char **out, const char *src)
+static bool path_dir_can_find(
+        FINDEX_SEARCH_OPS fSearchOp,
+        void *lpSearchFilter,
+        DWORD dwAdditionalFlags)
 {
-    wchar_t *src_w;
-    size_t src_c;
-    wchar_t *dest_w;
-    char *dest_a;
-    size_t dest_s;
-    BOOL ok;
+    return  fSearchOp != FindExSearchLimitToDevices &&
+            lpSearchFilter == NULL &&
+            !(dwAdditionalFlags & FIND_FIRST_EX_CASE_SENSITIVE);
+}
 
-    assert(out != NULL);
+static void path_dir_invalidate_all(void)
+{
+    struct path_dir *entry;
+    size_t i;
 
-    src_w = NULL;
-    dest_w = NULL;
-    dest_a = NULL;
-    *out = NULL;
+    AcquireSRWLockExclusive(&path_dir_lock);
 
-    if (src == NULL) {
-        SetLastError(ERROR_INVALID_PARAMETER);
-        ok = FALSE;
+    for (i = 0 ; i < PATH_DIR_BUCKETS ; i++) {
+        entry = path_dir_buckets[i];
 
-        goto end;
+        for ( ; entry != NULL ; entry = entry->next) {
+            entry->stale = true;
+            entry->generation++;
+        }
     }
 
-    /* Widen the path */
+    ReleaseSRWLockExclusive(&path_dir_lock);
+}
 
-    mbstowcs_s(&src_c, NULL, 0, src, 0);
-    src_w = malloc(src_c * sizeof(wchar_t));
+static uint32_t path_cache_hash(const wchar_t *src, size_t len)
+{
+    uint32_t hash;
+    size_t i;
 
-    if (src_w == NULL) {
-        SetLastError(ERROR_OUTOFMEMORY);
-        ok = FALSE;
+    /* FNV-1a. Paths are cached verbatim rather than case-folded, since the
+       unmatched remainder of a path is passed through unchanged. */
 
-        goto end;
+    hash = 0x811C9DC5;
+
+    for (i = 0 ; i < len ; i++) {
+        hash = (hash ^ src[i]) * 0x01000193;
     }
 
-    mbstowcs_s(NULL, src_w, src_c, src, src_c - 1);
+    return hash;
+}
 
-    /* Try applying a path transform */
+static HRESULT path_cache_lookup_locked(
+        struct path_cache_set *set,
+        const struct path_hook_table *table,
+        uint32_t hash,
+        const wchar_t *src,
+        const struct path_rule **rule,
+        size_t *match_len,
+        wchar_t **out)
+{
+    struct path_cache_entry *entry;
+    size_t i;
 
-    ok = path_transform_w(&dest_w, src_w); /* Take ownership! */
+    *rule = NULL;
+    *out = NULL;
 
-    if (!ok || dest_w == NULL) {
-        goto end;
-    }
+    for (i = 0 ; i < PATH_CACHE_WAYS ; i++) {
+        entry = &set->ways[i];
 
-    /* Narrow the transformed path */
+        /* Entries computed against an older rule set are dead */
 
-    wcstombs_s(&dest_s, NULL, 0, dest_w, 0);
-    dest_a = malloc(dest_s * sizeof(char));
+        if (    entry->table != table ||
+                entry->hash != hash ||
+                wcscmp(entry->src, src) != 0) {
+            continue;
+        }
 
-    if (dest_a == NULL) {
-        SetLastError(ERROR_OUTOFMEMORY);
-        ok = FALSE;
+        /* Only the shared lock is held here. Skip the store when the bit is
+           already set, so that hot entries don't bounce between cores. */
 
-        goto end;
-    }
+        if (!entry->referenced) {
+            InterlockedExchange(&entry->referenced, 1);
+        }
 
-    wcstombs_s(NULL, dest_a, dest_s, dest_w, dest_s - 1);
+        if (entry->result != NULL) {
+            *out = _wcsdup(entry->result);
 
-    *out = dest_a; /* Relinquish ownership to caller! */
-    ok = TRUE;
+            if (*out == NULL) {
+                return E_OUTOFMEMORY;
+            }
+        }
 
-end:
-    free(dest_w);
-    free(src_w);
+        *rule = entry->rule;
+        *match_len = entry->match_len;
 
-    return ok;
+        return S_OK;
+    }
+
+    return S_FALSE;
 }
 
-static BOOL path_transform_w(wchar_t **out, const wchar_t *src)
+static void path_cache_insert(
+        struct path_cache_set *set,
+        const struct path_hook_table *table,
+        uint32_t hash,
+        const wchar_t *src,
+        const struct path_rule *rule,
+        size_t match_len,
+        const wchar_t *result)
 {
-    BOOL ok;
-    HRESULT hr;
-    wchar_t *dest;
-    size_t dest_c;
+    struct path_cache_entry *entry;
+    struct path_cache_entry *victim;
+    wchar_t *block;
+    wchar_t *result_copy;
+    wchar_t *old;
+    size_t src_len;
+    size_t result_len;
     size_t i;
 
-    assert(out != NULL);
+    /* The source path and the result (if any) share one allocation, which
+       the entry's src owns. Copy before taking the lock, free after. */
 
-    dest = NULL;
-    *out = NULL;
+    src_len = wcslen(src) + 1;
+    result_len = result != NULL ? wcslen(result) + 1 : 0;
+    block = malloc((src_len + result_len) * sizeof(wchar_t));
 
-    EnterCriticalSection(&path_hook_lock);
+    if (block == NULL) {
+        return;
+    }
 
-    for (i = 0 ; i < path_hook_count ; i++) {
-        hr = path_hook_list[i](src, NULL, &dest_c);
+    memcpy(block, src, src_len * sizeof(wchar_t));
+    result_copy = NULL;
 
-        if (FAILED(hr)) {
-            ok = hr_propagate_win32(hr, FALSE);
+    if (result != NULL) {
+        result_copy = block + src_len;
+        memcpy(result_copy, result, result_len * sizeof(wchar_t));
+    }
 
-            goto end;
-        }
+    AcquireSRWLockExclusive(&set->lock);
 
-        if (hr == S_FALSE) {
-            continue;
-        }
+    /* Don't insert twice if another thread got here first. Otherwise evict
+       a dead entry if there is one. */
 
-        dest = malloc(dest_c * sizeof(wchar_t));
+    victim = NULL;
 
-        if (dest == NULL) {
-            SetLastError(ERROR_OUTOFMEMORY);
-            ok = FALSE;
+    for (i = 0 ; i < PATH_CACHE_WAYS ; i++) {
+        entry = &set->ways[i];
 
-            goto end;
+        if (    entry->table == table &&
+                entry->hash == hash &&
+                wcscmp(entry->src, src) == 0) {
+            ReleaseSRWLockExclusive(&set->lock);
+            free(block);
+
+            return;
+        }
+
+        if (entry->table != table) {
+            victim = entry;
         }
+    }
 
-        hr = path_hook_list[i](src, dest, &dest_c);
+    /* Failing that, sweep the clock hand past recently referenced entries,
+       clearing their bits, and evict the first one that wasn't. This takes
+       at most two trips round the set. */
 
-        if (FAILED(hr)) {
-            ok = hr_propagate_win32(hr, FALSE);
+    while (victim == NULL) {
+        entry = &set->ways[set->hand];
+        set->hand = (set->hand + 1) % PATH_CACHE_WAYS;
 
-            goto end;
+        if (entry->referenced) {
+            entry->referenced = 0;
+        } else {
+            victim = entry;
         }
-
-        break;
     }
 
-    *out = dest;
-    dest = NULL;
-    ok = TRUE;
+    old = victim->src;
 
-end:
-    LeaveCriticalSection(&path_hook_lock);
+    victim->table = table;
+    victim->hash = hash;
+    victim->referenced = 1;
+    victim->src = block;
+    victim->rule = rule;
+    victim->match_len = match_len;
+    victim->result = result_copy;
 
-    free(dest);
+    ReleaseSRWLockExclusive(&set->lock);
 
-    return ok;
+    free(old);
+}
+
+static void path_hook_report_stats(void)
+{
+    if (path_cache_hits + path_cache_misses > 0) {
+        dprintf("Path: Transform cache: %u hits, %u misses\n",
+                (unsigned int) path_cache_hits,
+                (unsigned int) path_cache_misses);
+    }
+
+    if (path_dir_hits + path_dir_misses > 0) {
+        dprintf("Path: Listing cache: %u hits, %u misses\n",
+                (unsigned int) path_dir_hits,
+                (unsigned int) path_dir_misses);
+    }
 }
 
 int path_compare_w(const wchar_t *string1, const wchar_t *string2, size_t count)
@@ -474,20 +2773,30 @@ static BOOL WINAPI hook_CreateDirectoryA(
         const char *lpFileName,
         SECURITY_ATTRIBUTES *lpSecurityAttributes)
 {
-    char *trans;
+    struct path_transform_info info;
+    const char *trans;
+    char buf[MAX_PATH];
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpFileName);
+    ok = path_transform_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            PATH_ACCESS_WRITE,
+            &info);
 
     if (!ok) {
         return FALSE;
     }
 
     ok = next_CreateDirectoryA(
-            trans ? trans : lpFileName,
+            trans,
             lpSecurityAttributes);
 
-    free(trans);
+    if (info.cached) {
+        path_dir_invalidate_a(trans, false);
+    }
 
     return ok;
 }
@@ -496,10 +2805,11 @@ static BOOL WINAPI hook_CreateDirectoryW(
         const wchar_t *lpFileName,
         SECURITY_ATTRIBUTES *lpSecurityAttributes)
 {
+    struct path_transform_info info;
     wchar_t *trans;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpFileName);
+    ok = path_transform_w(&trans, &info, lpFileName, PATH_ACCESS_WRITE);
 
     if (!ok) {
         return FALSE;
@@ -509,6 +2819,10 @@ static BOOL WINAPI hook_CreateDirectoryW(
             trans ? trans : lpFileName,
             lpSecurityAttributes);
 
+    if (info.cached) {
+        path_dir_invalidate(trans, false);
+    }
+
     free(trans);
 
     return ok;
@@ -519,10 +2833,18 @@ static BOOL WINAPI hook_CreateDirectoryExA(
         const char *lpNewDirectory,
         SECURITY_ATTRIBUTES *lpSecurityAttributes)
 {
-    char *trans;
+    struct path_transform_info info;
+    const char *trans;
+    char buf[MAX_PATH];
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpNewDirectory);
+    ok = path_transform_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpNewDirectory,
+            PATH_ACCESS_WRITE,
+            &info);
 
     if (!ok) {
         return FALSE;
@@ -530,10 +2852,12 @@ static BOOL WINAPI hook_CreateDirectoryExA(
 
     ok = next_CreateDirectoryExA(
             lpTemplateDirectory,
-            trans ? trans : lpNewDirectory,
+            trans,
             lpSecurityAttributes);
 
-    free(trans);
+    if (info.cached) {
+        path_dir_invalidate_a(trans, false);
+    }
 
     return ok;
 }
@@ -543,10 +2867,15 @@ static BOOL WINAPI hook_CreateDirectoryExW(
         const wchar_t *lpNewDirectory,
         SECURITY_ATTRIBUTES *lpSecurityAttributes)
 {
+    struct path_transform_info info;
     wchar_t *trans;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpNewDirectory);
+    ok = path_transform_w(
+            &trans,
+            &info,
+            lpNewDirectory,
+            PATH_ACCESS_WRITE);
 
     if (!ok) {
         return FALSE;
@@ -557,6 +2886,10 @@ static BOOL WINAPI hook_CreateDirectoryExW(
             trans ? trans : lpNewDirectory,
             lpSecurityAttributes);
 
+    if (info.cached) {
+        path_dir_invalidate(trans, false);
+    }
+
     free(trans);
 
     return ok;
@@ -573,18 +2906,28 @@ static HANDLE WINAPI hook_CreateFileA(
         uint32_t dwFlagsAndAttributes,
         HANDLE hTemplateFile)
 {
-    char *trans;
+    struct path_transform_info info;
+    enum path_access access;
+    const char *trans;
+    char buf[MAX_PATH];
     HANDLE result;
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpFileName);
+    access = path_access_for_create(dwDesiredAccess, dwCreationDisposition);
+    ok = path_transform_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            access,
+            &info);
 
     if (!ok) {
         return INVALID_HANDLE_VALUE;
     }
 
     result = next_CreateFileA(
-            trans ? trans : lpFileName,
+            trans,
             dwDesiredAccess,
             dwShareMode,
             lpSecurityAttributes,
@@ -592,7 +2935,10 @@ static HANDLE WINAPI hook_CreateFileA(
             dwFlagsAndAttributes,
             hTemplateFile);
 
-    free(trans);
+    if (info.cached && (dwCreationDisposition != OPEN_EXISTING ||
+            access == PATH_ACCESS_WRITE)) {
+        path_dir_invalidate_a(trans, access == PATH_ACCESS_WRITE);
+    }
 
     return result;
 }
@@ -606,11 +2952,14 @@ static HANDLE WINAPI hook_CreateFileW(
         uint32_t dwFlagsAndAttributes,
         HANDLE hTemplateFile)
 {
+    struct path_transform_info info;
+    enum path_access access;
     wchar_t *trans;
     HANDLE result;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpFileName);
+    access = path_access_for_create(dwDesiredAccess, dwCreationDisposition);
+    ok = path_transform_w(&trans, &info, lpFileName, access);
 
     if (!ok) {
         return INVALID_HANDLE_VALUE;
@@ -625,47 +2974,146 @@ static HANDLE WINAPI hook_CreateFileW(
             dwFlagsAndAttributes,
             hTemplateFile);
 
+    /* Anything that might have created a file makes the listing stale, and
+       anything opened for writing stops its directory from being cached. */
+
+    if (info.cached && (dwCreationDisposition != OPEN_EXISTING ||
+            access == PATH_ACCESS_WRITE)) {
+        path_dir_invalidate(trans, access == PATH_ACCESS_WRITE);
+    }
+
     free(trans);
 
     return result;
 }
 
+static BOOL WINAPI hook_DeleteFileA(const char *lpFileName)
+{
+    struct path_transform_info info;
+    const char *trans;
+    char buf[MAX_PATH];
+    BOOL ok;
+
+    ok = path_transform_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            PATH_ACCESS_DELETE,
+            &info);
+
+    if (!ok) {
+        return FALSE;
+    }
+
+    ok = next_DeleteFileA(trans);
+
+    if (info.cached) {
+        path_dir_invalidate_a(trans, false);
+    }
+
+    return ok;
+}
+
+static BOOL WINAPI hook_DeleteFileW(const wchar_t *lpFileName)
+{
+    struct path_transform_info info;
+    wchar_t *trans;
+    BOOL ok;
+
+    ok = path_transform_w(&trans, &info, lpFileName, PATH_ACCESS_DELETE);
+
+    if (!ok) {
+        return FALSE;
+    }
+
+    ok = next_DeleteFileW(trans ? trans : lpFileName);
+
+    if (info.cached) {
+        path_dir_invalidate(trans, false);
+    }
+
+    free(trans);
+
+    return ok;
+}
+
+/* Finds whose path is handed to a resolver may come back as several
+   patterns, in which case the listing is merged by path_find_first_merged().
+   Finds under a cached prefix may be answered from the listing cache. Either
+   way the FindNextFile/FindClose hooks below serve the rest of the listing,
+   and everything else goes straight through as before. */
+
 static HANDLE WINAPI hook_FindFirstFileA(
         const char *lpFileName,
         LPWIN32_FIND_DATAA lpFindFileData)
 {
-    char *trans;
+    const char *trans;
+    char buf[MAX_PATH];
     HANDLE result;
+    bool handled;
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpFileName);
+    ok = path_find_first_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            FindExInfoStandard,
+            lpFindFileData,
+            FindExSearchNameMatch,
+            NULL,
+            0,
+            &result,
+            &handled);
 
     if (!ok) {
         return INVALID_HANDLE_VALUE;
     }
 
-    result = next_FindFirstFileA(trans ? trans : lpFileName, lpFindFileData);
-
-    free(trans);
+    if (handled) {
+        return result;
+    }
 
-    return result;
+    return next_FindFirstFileA(trans, lpFindFileData);
 }
 
 static HANDLE WINAPI hook_FindFirstFileW(
         const wchar_t *lpFileName,
         LPWIN32_FIND_DATAW lpFindFileData)
 {
+    struct path_transform_info info;
     wchar_t *trans;
     HANDLE result;
+    bool handled;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpFileName);
+    ok = path_transform_w(&trans, &info, lpFileName, PATH_ACCESS_LIST);
 
     if (!ok) {
         return INVALID_HANDLE_VALUE;
     }
 
-    result = next_FindFirstFileW(trans ? trans : lpFileName, lpFindFileData);
+    handled = false;
+
+    if (info.nlayers > 0) {
+        result = path_find_first_merged(
+                trans,
+                FindExInfoStandard,
+                lpFindFileData,
+                FindExSearchNameMatch,
+                NULL,
+                0);
+        handled = true;
+    } else if (info.cached) {
+        result = path_dir_find_first(trans, lpFindFileData, &handled);
+    }
+
+    if (!handled) {
+        result = next_FindFirstFileW(
+                trans ? trans : lpFileName,
+                lpFindFileData);
+    }
 
     free(trans);
 
@@ -680,27 +3128,40 @@ static HANDLE WINAPI hook_FindFirstFileExA(
         void *lpSearchFilter,
         DWORD dwAdditionalFlags)
 {
-    char *trans;
+    const char *trans;
+    char buf[MAX_PATH];
     HANDLE result;
+    bool handled;
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpFileName);
+    ok = path_find_first_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            fInfoLevelId,
+            lpFindFileData,
+            fSearchOp,
+            lpSearchFilter,
+            dwAdditionalFlags,
+            &result,
+            &handled);
 
     if (!ok) {
         return INVALID_HANDLE_VALUE;
     }
 
-    result = next_FindFirstFileExA(
-            trans ? trans : lpFileName,
+    if (handled) {
+        return result;
+    }
+
+    return next_FindFirstFileExA(
+            trans,
             fInfoLevelId,
             lpFindFileData,
             fSearchOp,
             lpSearchFilter,
             dwAdditionalFlags);
-
-    free(trans);
-
-    return result;
 }
 
 static HANDLE WINAPI hook_FindFirstFileExW(
@@ -711,60 +3172,198 @@ static HANDLE WINAPI hook_FindFirstFileExW(
         void *lpSearchFilter,
         DWORD dwAdditionalFlags)
 {
+    struct path_transform_info info;
     wchar_t *trans;
     HANDLE result;
+    bool handled;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpFileName);
+    ok = path_transform_w(&trans, &info, lpFileName, PATH_ACCESS_LIST);
 
     if (!ok) {
         return INVALID_HANDLE_VALUE;
     }
 
-    result = next_FindFirstFileExW(
-            trans ? trans : lpFileName,
-            fInfoLevelId,
-            lpFindFileData,
-            fSearchOp,
-            lpSearchFilter,
-            dwAdditionalFlags);
+    handled = false;
+
+    if (info.nlayers > 0) {
+        result = path_find_first_merged(
+                trans,
+                fInfoLevelId,
+                lpFindFileData,
+                fSearchOp,
+                lpSearchFilter,
+                dwAdditionalFlags);
+        handled = true;
+    } else if (info.cached &&
+            path_dir_can_find(fSearchOp, lpSearchFilter, dwAdditionalFlags)) {
+        result = path_dir_find_first(trans, lpFindFileData, &handled);
+    }
+
+    if (!handled) {
+        result = next_FindFirstFileExW(
+                trans ? trans : lpFileName,
+                fInfoLevelId,
+                lpFindFileData,
+                fSearchOp,
+                lpSearchFilter,
+                dwAdditionalFlags);
+    }
 
     free(trans);
 
     return result;
 }
 
+static BOOL WINAPI hook_FindNextFileA(
+        HANDLE hFindFile,
+        LPWIN32_FIND_DATAA lpFindFileData)
+{
+    struct path_find *find;
+    BOOL ok;
+
+    find = path_find_acquire(hFindFile);
+
+    if (find == NULL) {
+        return next_FindNextFileA(hFindFile, lpFindFileData);
+    }
+
+    if (find->pos < find->nentries) {
+        path_find_narrow(lpFindFileData, &find->entries[find->pos++].data);
+        ok = TRUE;
+    } else {
+        SetLastError(ERROR_NO_MORE_FILES);
+        ok = FALSE;
+    }
+
+    path_find_release(find);
+
+    return ok;
+}
+
+static BOOL WINAPI hook_FindNextFileW(
+        HANDLE hFindFile,
+        LPWIN32_FIND_DATAW lpFindFileData)
+{
+    struct path_find *find;
+    BOOL ok;
+
+    find = path_find_acquire(hFindFile);
+
+    if (find == NULL) {
+        return next_FindNextFileW(hFindFile, lpFindFileData);
+    }
+
+    if (find->pos < find->nentries) {
+        *lpFindFileData = find->entries[find->pos++].data;
+        ok = TRUE;
+    } else {
+        SetLastError(ERROR_NO_MORE_FILES);
+        ok = FALSE;
+    }
+
+    path_find_release(find);
+
+    return ok;
+}
+
+static BOOL WINAPI hook_FindClose(HANDLE hFindFile)
+{
+    struct path_find **link;
+    struct path_find *find;
+
+    find = NULL;
+
+    AcquireSRWLockExclusive(&path_find_lock);
+
+    link = &path_find_buckets[path_find_bucket(hFindFile)];
+
+    for (; *link != NULL ; link = &(*link)->next) {
+        if ((HANDLE) *link == hFindFile) {
+            find = *link;
+            *link = find->next;
+
+            break;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&path_find_lock);
+
+    if (find == NULL) {
+        return next_FindClose(hFindFile);
+    }
+
+    /* Freed here unless a FindNextFile call is still using it */
+
+    path_find_release(find);
+
+    return TRUE;
+}
+
 static DWORD WINAPI hook_GetFileAttributesA(const char *lpFileName)
 {
-    char *trans;
+    struct path_transform_info info;
+    WIN32_FIND_DATAW data;
+    const char *trans;
+    char buf[MAX_PATH];
     DWORD result;
+    HRESULT hr;
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpFileName);
+    ok = path_transform_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            PATH_ACCESS_READ,
+            &info);
 
     if (!ok) {
         return INVALID_FILE_ATTRIBUTES;
     }
 
-    result = next_GetFileAttributesA(trans ? trans : lpFileName);
-    free(trans);
+    if (info.cached) {
+        hr = path_dir_query_a(trans, &data);
+
+        if (hr == S_OK) {
+            return data.dwFileAttributes;
+        } else if (FAILED(hr)) {
+            SetLastError(HRESULT_CODE(hr));
+
+            return INVALID_FILE_ATTRIBUTES;
+        }
+    }
+
+    result = next_GetFileAttributesA(trans);
 
     return result;
 }
 
 static DWORD WINAPI hook_GetFileAttributesW(const wchar_t *lpFileName)
 {
+    struct path_transform_info info;
+    WIN32_FIND_DATAW data;
     wchar_t *trans;
     DWORD result;
+    HRESULT hr;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpFileName);
+    ok = path_transform_w(&trans, &info, lpFileName, PATH_ACCESS_READ);
 
     if (!ok) {
         return INVALID_FILE_ATTRIBUTES;
     }
 
-    result = next_GetFileAttributesW(trans ? trans : lpFileName);
+    hr = info.cached ? path_dir_query(trans, &data) : S_FALSE;
+
+    if (hr == S_OK) {
+        result = data.dwFileAttributes;
+    } else if (FAILED(hr)) {
+        SetLastError(HRESULT_CODE(hr));
+        result = INVALID_FILE_ATTRIBUTES;
+    } else {
+        result = next_GetFileAttributesW(trans ? trans : lpFileName);
+    }
 
     free(trans);
 
@@ -776,22 +3375,42 @@ static BOOL WINAPI hook_GetFileAttributesExA(
         GET_FILEEX_INFO_LEVELS fInfoLevelId,
         void *lpFileInformation)
 {
-    char *trans;
+    struct path_transform_info info;
+    WIN32_FIND_DATAW data;
+    const char *trans;
+    char buf[MAX_PATH];
+    HRESULT hr;
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpFileName);
+    ok = path_transform_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            PATH_ACCESS_READ,
+            &info);
 
     if (!ok) {
-        return INVALID_FILE_ATTRIBUTES;
+        return FALSE;
+    }
+
+    if (info.cached && fInfoLevelId == GetFileExInfoStandard) {
+        hr = path_dir_query_a(trans, &data);
+
+        if (hr == S_OK) {
+            path_dir_fill_attrs(lpFileInformation, &data);
+
+            return TRUE;
+        } else if (FAILED(hr)) {
+            return hr_propagate_win32(hr, FALSE);
+        }
     }
 
     ok = next_GetFileAttributesExA(
-            trans ? trans : lpFileName,
+            trans,
             fInfoLevelId,
             lpFileInformation);
 
-    free(trans);
-
     return ok;
 }
 
@@ -800,19 +3419,35 @@ static BOOL WINAPI hook_GetFileAttributesExW(
         GET_FILEEX_INFO_LEVELS fInfoLevelId,
         void *lpFileInformation)
 {
+    struct path_transform_info info;
+    WIN32_FIND_DATAW data;
     wchar_t *trans;
+    HRESULT hr;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpFileName);
+    ok = path_transform_w(&trans, &info, lpFileName, PATH_ACCESS_READ);
 
     if (!ok) {
-        return INVALID_FILE_ATTRIBUTES;
+        return FALSE;
     }
 
-    ok = next_GetFileAttributesExW(
-            trans ? trans : lpFileName,
-            fInfoLevelId,
-            lpFileInformation);
+    hr = S_FALSE;
+
+    if (info.cached && fInfoLevelId == GetFileExInfoStandard) {
+        hr = path_dir_query(trans, &data);
+    }
+
+    if (hr == S_OK) {
+        path_dir_fill_attrs(lpFileInformation, &data);
+        ok = TRUE;
+    } else if (FAILED(hr)) {
+        ok = hr_propagate_win32(hr, FALSE);
+    } else {
+        ok = next_GetFileAttributesExW(
+                trans ? trans : lpFileName,
+                fInfoLevelId,
+                lpFileInformation);
+    }
 
     free(trans);
 
@@ -821,28 +3456,39 @@ static BOOL WINAPI hook_GetFileAttributesExW(
 
 static BOOL WINAPI hook_RemoveDirectoryA(const char *lpFileName)
 {
-    char *trans;
+    struct path_transform_info info;
+    const char *trans;
+    char buf[MAX_PATH];
     BOOL ok;
 
-    ok = path_transform_a(&trans, lpFileName);
+    ok = path_transform_a(
+            &trans,
+            buf,
+            _countof(buf),
+            lpFileName,
+            PATH_ACCESS_DELETE,
+            &info);
 
     if (!ok) {
         return FALSE;
     }
 
-    ok = next_RemoveDirectoryA(trans ? trans : lpFileName);
+    ok = next_RemoveDirectoryA(trans);
 
-    free(trans);
+    if (info.cached) {
+        path_dir_invalidate_a(trans, false);
+    }
 
     return ok;
 }
 
 static BOOL WINAPI hook_RemoveDirectoryW(const wchar_t *lpFileName)
 {
+    struct path_transform_info info;
     wchar_t *trans;
     BOOL ok;
 
-    ok = path_transform_w(&trans, lpFileName);
+    ok = path_transform_w(&trans, &info, lpFileName, PATH_ACCESS_DELETE);
 
     if (!ok) {
         return FALSE;
@@ -850,6 +3496,10 @@ static BOOL WINAPI hook_RemoveDirectoryW(const wchar_t *lpFileName)
 
     ok = next_RemoveDirectoryW(trans ? trans : lpFileName);
 
+    if (info.cached) {
+        path_dir_invalidate(trans, false);
+    }
+
     free(trans);
 
     return ok;
@@ -11,6 +11,86 @@ typedef HRESULT (*path_hook_t)(
         size_t *count);
 
 HRESULT path_hook_push(path_hook_t hook);
+
+/* Redirect any path that starts with `prefix` (compared case-insensitively,
+   treating / and \ alike, and ending on a path component boundary) to the
+   same relative path under `target`. The longest matching prefix wins, and
+   prefix rules take precedence over path_hook_t callbacks. Trailing
+   separators on `prefix` are ignored, so a prefix also matches the bare path
+   (e.g. "E:" as well as "E:\foo"). If the same prefix is pushed more than
+   once, the first push wins. */
+
+HRESULT path_hook_push_prefix(const wchar_t *prefix, const wchar_t *target);
+
+/* Like path_hook_push_prefix, but for mounts that are mostly read. The first
+   time the hooks look into a directory under `target` its whole listing is
+   read and kept, and GetFileAttributes* and whole-directory or single-name
+   FindFirstFile* calls are answered from that. Creating or removing anything
+   through the hooks refreshes the listing, and a directory that has had a
+   file opened for writing in it is no longer cached at all. Changes made by
+   anything other than the hooked APIs are not noticed. */
+
+HRESULT path_hook_push_cached_prefix(
+        const wchar_t *prefix,
+        const wchar_t *target);
+
+/* What a hooked API is about to do with a path. */
+
+enum path_access {
+    PATH_ACCESS_READ,
+    PATH_ACCESS_WRITE,
+    PATH_ACCESS_DELETE,
+    PATH_ACCESS_LIST,
+};
+
+/* Resolve `rel`, the remainder of a path under a resolver's prefix (without a
+   leading separator, possibly empty), into a malloc()ed path in `*out`.
+
+   Unlike path_hook_t results, resolved paths are never cached, so a resolver
+   is free to look at the file system. For PATH_ACCESS_LIST `rel` is a
+   FindFirstFile pattern and `*out` is a list of patterns instead, each one
+   NUL terminated and the whole list terminated by an empty string. Their
+   results are merged into a single listing, and where a name turns up under
+   more than one pattern the earliest pattern's entry wins. */
+
+typedef HRESULT (*path_resolver_t)(
+        void *ctx,
+        const wchar_t *rel,
+        enum path_access access,
+        wchar_t **out);
+
+/* Hand any path that starts with `prefix` (matched as for
+   path_hook_push_prefix) to `resolver`. */
+
+HRESULT path_hook_push_resolver(
+        const wchar_t *prefix,
+        path_resolver_t resolver,
+        void *ctx);
+
+/* Produce the complete listing of directory `rel` under a listed prefix. `rel`
+   is folded to lower case with \ separators, and is either empty for the
+   root of the prefix or ends in a separator. On success `*entries` is a
+   malloc()ed array, in no particular order, that the caller takes ownership
+   of. Fails with ERROR_PATH_NOT_FOUND if there is no such directory. */
+
+typedef HRESULT (*path_lister_t)(
+        void *ctx,
+        const wchar_t *rel,
+        WIN32_FIND_DATAW **entries,
+        size_t *nentries);
+
+/* Serve a read-only tree that exists only in memory at `prefix`. Paths under
+   it reach the next CreateFile hook unchanged (for an iohook handler to pick
+   up), while GetFileAttributes* and FindFirstFile* are answered from
+   listings kept as for a cached prefix but read from `lister`, never from
+   the file system. Finds may use * and ? anywhere in the final component.
+   Anything that would modify the tree fails with ERROR_WRITE_PROTECT. */
+
+HRESULT path_hook_push_listed_prefix(
+        const wchar_t *prefix,
+        path_lister_t lister,
+        void *ctx);
+
 void path_hook_insert_hooks(HMODULE target);
 int path_compare_w(const wchar_t *string1, const wchar_t *string2, size_t count);
 
@@ -0,0 +1,1832 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "hooklib/reg-hive.h"
+
+#include "util/crc.h"
+#include "util/dprintf.h"
+#include "util/str.h"
+
+#define REG_HIVE_MAX_DEPTH 64
+
+/* Every journal record is framed by a comment line holding the length and
+   CRC32 of the .reg text that follows it, so the journal is still a .reg
+   fragment but a torn or damaged record can be told apart from a good one.
+   The header is fixed-width so that it can be filled in after the record. */
+
+#define REG_HIVE_JOURNAL_HDR        "; rec %08x %08x\r\n"
+#define REG_HIVE_JOURNAL_HDR_LEN    25
+
+/* The journal is compacted once it is larger than this, and at least twice
+   as large as it was straight after the last compaction. */
+
+#define REG_HIVE_JOURNAL_COMPACT_SIZE (1024 * 1024)
+
+struct reg_hive_journal_rec {
+    const char *bytes;
+    size_t nbytes;
+    const char *id;
+    size_t id_len;
+    size_t index;
+};
+
+static struct reg_hive_key *reg_hive_root_by_name(const wchar_t *name);
+
+static struct reg_hive_key *reg_hive_find_child(
+        const struct reg_hive_key *key,
+        const wchar_t *name,
+        size_t name_len);
+
+static struct reg_hive_key *reg_hive_add_child(
+        struct reg_hive_key *key,
+        const wchar_t *name,
+        size_t name_len);
+
+static HRESULT reg_hive_read_text(const wchar_t *path, wchar_t **out);
+
+static HRESULT reg_hive_parse(const wchar_t *path, const wchar_t *text);
+
+static HRESULT reg_hive_parse_line(struct reg_hive_key **key, wchar_t *line);
+
+static HRESULT reg_hive_parse_key(struct reg_hive_key **key, wchar_t *line);
+
+static HRESULT reg_hive_parse_val(struct reg_hive_key *key, wchar_t *line);
+
+static HRESULT reg_hive_parse_hex(
+        struct reg_hive_key *key,
+        const wchar_t *name,
+        uint32_t type,
+        const wchar_t *pos);
+
+static wchar_t *reg_hive_unquote(wchar_t *str);
+
+static size_t reg_hive_journal_scan(
+        const char *bytes,
+        size_t nbytes,
+        struct reg_hive_journal_rec *recs,
+        size_t *nrecs);
+
+static HRESULT reg_hive_journal_read(char **out, size_t *nbytes);
+
+static HRESULT reg_hive_journal_replay(void);
+
+static HRESULT reg_hive_journal_compact(void);
+
+static void reg_hive_journal_rec_id(struct reg_hive_journal_rec *rec);
+
+static int reg_hive_journal_rec_cmp(const void *lhs, const void *rhs);
+
+static int reg_hive_journal_id_cmp(
+        const struct reg_hive_journal_rec *l,
+        const struct reg_hive_journal_rec *r);
+
+static HANDLE reg_hive_journal_create(const wchar_t *path, DWORD disposition);
+
+static HRESULT reg_hive_journal_begin(size_t *start);
+
+static void reg_hive_journal_end(size_t start, HRESULT hr);
+
+static HRESULT reg_hive_journal_put(const char *bytes, size_t nbytes);
+
+static HRESULT reg_hive_journal_put_w(const wchar_t *str, bool escape);
+
+static HRESULT reg_hive_journal_put_key(const struct reg_hive_key *key);
+
+static HRESULT reg_hive_journal_put_val_name(const wchar_t *name);
+
+static DWORD CALLBACK reg_hive_journal_thread(void *ctx);
+
+static void reg_hive_journal_write(const char *bytes, size_t nbytes);
+
+static void reg_hive_journal_flush_at_exit(void);
+
+static struct reg_hive_key reg_hive_roots[] = {
+    { .name = (wchar_t *) L"HKEY_CLASSES_ROOT" },
+    { .name = (wchar_t *) L"HKEY_CURRENT_USER" },
+    { .name = (wchar_t *) L"HKEY_LOCAL_MACHINE" },
+    { .name = (wchar_t *) L"HKEY_USERS" },
+    { .name = (wchar_t *) L"HKEY_CURRENT_CONFIG" },
+};
+
+static CRITICAL_SECTION reg_hive_journal_lock;
+static wchar_t reg_hive_journal_path[MAX_PATH];
+static HANDLE reg_hive_journal_file;
+static uint64_t reg_hive_journal_size;
+static uint64_t reg_hive_journal_compacted;
+static HANDLE reg_hive_journal_event;
+static char *reg_hive_journal_buf;
+static size_t reg_hive_journal_len;
+static size_t reg_hive_journal_cap;
+
+struct reg_hive_key *reg_hive_root(HKEY root)
+{
+    if (root == HKEY_CLASSES_ROOT) {
+        return &reg_hive_roots[0];
+    } else if (root == HKEY_CURRENT_USER) {
+        return &reg_hive_roots[1];
+    } else if (root == HKEY_LOCAL_MACHINE) {
+        return &reg_hive_roots[2];
+    } else if (root == HKEY_USERS) {
+        return &reg_hive_roots[3];
+    } else if (root == HKEY_CURRENT_CONFIG) {
+        return &reg_hive_roots[4];
+    } else {
+        return NULL;
+    }
+}
+
+static struct reg_hive_key *reg_hive_root_by_name(const wchar_t *name)
+{
+    size_t i;
+
+    for (i = 0 ; i < _countof(reg_hive_roots) ; i++) {
+        if (wstr_ieq(reg_hive_roots[i].name, name)) {
+            return &reg_hive_roots[i];
+        }
+    }
+
+    return NULL;
+}
+
+struct reg_hive_key *reg_hive_find(
+        struct reg_hive_key *base,
+        const wchar_t *path,
+        bool create,
+        size_t *matched)
+{
+    struct reg_hive_key *key;
+    struct reg_hive_key *child;
+    const wchar_t *end;
+    size_t nmatched;
+    bool creating;
+
+    assert(base != NULL);
+
+    key = base;
+    nmatched = 0;
+    creating = false;
+
+    if (path == NULL) {
+        path = L"";
+    }
+
+    for (;;) {
+        while (*path == L'\\') {
+            path++;
+        }
+
+        if (*path == L'\0') {
+            break;
+        }
+
+        end = path;
+
+        while (*end != L'\0' && *end != L'\\') {
+            end++;
+        }
+
+        child = creating ? NULL : reg_hive_find_child(key, path, end - path);
+
+        if (child != NULL) {
+            nmatched++;
+        } else {
+            if (!create) {
+                if (matched != NULL) {
+                    *matched = nmatched;
+                }
+
+                return NULL;
+            }
+
+            child = reg_hive_add_child(key, path, end - path);
+
+            if (child == NULL) {
+                return NULL;
+            }
+
+            creating = true;
+        }
+
+        key = child;
+        path = end;
+    }
+
+    if (matched != NULL) {
+        *matched = nmatched;
+    }
+
+    return key;
+}
+
+bool reg_hive_covers(struct reg_hive_key *base, const wchar_t *path)
+{
+    struct reg_hive_key *key;
+    const wchar_t *end;
+
+    assert(base != NULL);
+
+    key = base;
+
+    if (path == NULL) {
+        path = L"";
+    }
+
+    for (;;) {
+        if (key->defined) {
+            return true;
+        }
+
+        while (*path == L'\\') {
+            path++;
+        }
+
+        if (*path == L'\0') {
+            return false;
+        }
+
+        end = path;
+
+        while (*end != L'\0' && *end != L'\\') {
+            end++;
+        }
+
+        key = reg_hive_find_child(key, path, end - path);
+
+        if (key == NULL) {
+            return false;
+        }
+
+        path = end;
+    }
+}
+
+static struct reg_hive_key *reg_hive_find_child(
+        const struct reg_hive_key *key,
+        const wchar_t *name,
+        size_t name_len)
+{
+    struct reg_hive_key *child;
+    size_t i;
+
+    for (i = 0 ; i < key->nchildren ; i++) {
+        child = key->children[i];
+
+        if (    _wcsnicmp(child->name, name, name_len) == 0 &&
+                child->name[name_len] == L'\0') {
+            return child;
+        }
+    }
+
+    return NULL;
+}
+
+static struct reg_hive_key *reg_hive_add_child(
+        struct reg_hive_key *key,
+        const wchar_t *name,
+        size_t name_len)
+{
+    struct reg_hive_key **new_mem;
+    struct reg_hive_key *child;
+
+    child = calloc(1, sizeof(*child));
+
+    if (child == NULL) {
+        return NULL;
+    }
+
+    child->name = malloc((name_len + 1) * sizeof(wchar_t));
+
+    if (child->name == NULL) {
+        free(child);
+
+        return NULL;
+    }
+
+    memcpy(child->name, name, name_len * sizeof(wchar_t));
+    child->name[name_len] = L'\0';
+    child->parent = key;
+
+    new_mem = realloc(
+            key->children,
+            (key->nchildren + 1) * sizeof(*key->children));
+
+    if (new_mem == NULL) {
+        free(child->name);
+        free(child);
+
+        return NULL;
+    }
+
+    new_mem[key->nchildren] = child;
+    key->children = new_mem;
+    key->nchildren++;
+
+    return child;
+}
+
+struct reg_hive_val *reg_hive_find_val(
+        const struct reg_hive_key *key,
+        const wchar_t *name)
+{
+    size_t i;
+
+    assert(key != NULL);
+
+    if (name == NULL) {
+        name = L"";
+    }
+
+    for (i = 0 ; i < key->nvals ; i++) {
+        if (wstr_ieq(key->vals[i].name, name)) {
+            return &key->vals[i];
+        }
+    }
+
+    return NULL;
+}
+
+HRESULT reg_hive_set_val(
+        struct reg_hive_key *key,
+        const wchar_t *name,
+        uint32_t type,
+        const void *bytes,
+        uint32_t nbytes)
+{
+    struct reg_hive_val *new_mem;
+    struct reg_hive_val *val;
+    uint8_t *copy;
+
+    assert(key != NULL);
+    assert(bytes != NULL || nbytes == 0);
+
+    if (name == NULL) {
+        name = L"";
+    }
+
+    copy = malloc(nbytes != 0 ? nbytes : 1);
+
+    if (copy == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    memcpy(copy, bytes, nbytes);
+    val = reg_hive_find_val(key, name);
+
+    if (val == NULL) {
+        new_mem = realloc(key->vals, (key->nvals + 1) * sizeof(*key->vals));
+
+        if (new_mem == NULL) {
+            free(copy);
+
+            return E_OUTOFMEMORY;
+        }
+
+        key->vals = new_mem;
+        val = &new_mem[key->nvals];
+        val->name = _wcsdup(name);
+
+        if (val->name == NULL) {
+            free(copy);
+
+            return E_OUTOFMEMORY;
+        }
+
+        val->bytes = NULL;
+        key->nvals++;
+    }
+
+    free(val->bytes);
+    val->type = type;
+    val->bytes = copy;
+    val->nbytes = nbytes;
+
+    return S_OK;
+}
+
+void reg_hive_delete_val(struct reg_hive_key *key, const wchar_t *name)
+{
+    struct reg_hive_val *val;
+    size_t i;
+
+    val = reg_hive_find_val(key, name);
+
+    if (val == NULL) {
+        return;
+    }
+
+    i = val - key->vals;
+    free(val->name);
+    free(val->bytes);
+    memmove(&key->vals[i],
+            &key->vals[i + 1],
+            (key->nvals - i - 1) * sizeof(*key->vals));
+    key->nvals--;
+}
+
+HRESULT reg_hive_key_path(
+        const struct reg_hive_key *key,
+        wchar_t *path,
+        size_t path_count)
+{
+    const struct reg_hive_key *chain[REG_HIVE_MAX_DEPTH];
+    size_t depth;
+    size_t pos;
+    size_t len;
+
+    assert(key != NULL);
+    assert(path != NULL);
+
+    for (depth = 0 ; key != NULL ; key = key->parent) {
+        if (depth >= _countof(chain)) {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+
+        chain[depth++] = key;
+    }
+
+    pos = 0;
+
+    while (depth-- > 0) {
+        len = wcslen(chain[depth]->name);
+
+        if (pos + len + 2 > path_count) {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+
+        if (pos > 0) {
+            path[pos++] = L'\\';
+        }
+
+        memcpy(&path[pos], chain[depth]->name, len * sizeof(wchar_t));
+        pos += len;
+    }
+
+    path[pos] = L'\0';
+
+    return S_OK;
+}
+
+HRESULT reg_hive_load_file(const wchar_t *path)
+{
+    wchar_t *text;
+    HRESULT hr;
+
+    assert(path != NULL);
+
+    hr = reg_hive_read_text(path, &text);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = reg_hive_parse(path, text);
+    free(text);
+
+    return hr;
+}
+
+static HRESULT reg_hive_read_text(const wchar_t *path, wchar_t **out)
+{
+    LARGE_INTEGER size;
+    HANDLE file;
+    uint8_t *bytes;
+    wchar_t *text;
+    DWORD nread;
+    int nchars;
+    size_t skip;
+    HRESULT hr;
+
+    *out = NULL;
+    bytes = NULL;
+    text = NULL;
+
+    file = CreateFileW(
+            path,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    if (!GetFileSizeEx(file, &size)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    if (size.QuadPart > 0x4000000) {
+        hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+
+        goto end;
+    }
+
+    /* Two trailing NULs so that a UTF-16 file is NUL-terminated in place */
+
+    bytes = calloc((size_t) size.QuadPart + 2, 1);
+
+    if (bytes == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    if (!ReadFile(file, bytes, (DWORD) size.QuadPart, &nread, NULL)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    /* Regedit exports UTF-16LE with a BOM. Anything else (REGEDIT4 files,
+       hand-written files, our own journal) is treated as UTF-8. */
+
+    if (nread >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        text = malloc(nread);
+
+        if (text == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        memcpy(text, bytes + 2, nread - 2);
+        text[(nread - 2) / 2] = L'\0';
+    } else {
+        skip = 0;
+
+        if (    nread >= 3 &&
+                bytes[0] == 0xEF &&
+                bytes[1] == 0xBB &&
+                bytes[2] == 0xBF) {
+            skip = 3;
+        }
+
+        nchars = MultiByteToWideChar(
+                CP_UTF8,
+                0,
+                (const char *) bytes + skip,
+                -1,
+                NULL,
+                0);
+
+        text = malloc(nchars * sizeof(wchar_t));
+
+        if (nchars == 0 || text == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        MultiByteToWideChar(
+                CP_UTF8,
+                0,
+                (const char *) bytes + skip,
+                -1,
+                text,
+                nchars);
+    }
+
+    *out = text;
+    text = NULL;
+    hr = S_OK;
+
+end:
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    free(text);
+    free(bytes);
+
+    return hr;
+}
+
+static HRESULT reg_hive_parse(const wchar_t *path, const wchar_t *text)
+{
+    struct reg_hive_key *key;
+    const wchar_t *pos;
+    const wchar_t *end;
+    const wchar_t *next;
+    wchar_t *line;
+    wchar_t *new_mem;
+    size_t line_len;
+    size_t line_cap;
+    unsigned int lineno;
+    unsigned int nwarnings;
+    bool cont;
+    HRESULT hr;
+
+    key = NULL;
+    line = NULL;
+    line_len = 0;
+    line_cap = 0;
+    lineno = 0;
+    nwarnings = 0;
+    pos = text;
+    hr = S_OK;
+
+    while (*pos != L'\0') {
+        next = wcschr(pos, L'\n');
+
+        if (next != NULL) {
+            end = next++;
+        } else {
+            end = pos + wcslen(pos);
+            next = end;
+        }
+
+        lineno++;
+
+        while (end > pos && iswspace(end[-1])) {
+            end--;
+        }
+
+        /* Hex data may be split across several physical lines, each of which
+           except the last ends in a backslash. */
+
+        if (line_len > 0) {
+            while (pos < end && iswspace(*pos)) {
+                pos++;
+            }
+        }
+
+        cont = end > pos && end[-1] == L'\\';
+
+        if (cont) {
+            end--;
+        }
+
+        if (line_len + (end - pos) + 1 > line_cap) {
+            line_cap = (line_len + (end - pos) + 1) * 2;
+            new_mem = realloc(line, line_cap * sizeof(wchar_t));
+
+            if (new_mem == NULL) {
+                hr = E_OUTOFMEMORY;
+
+                goto end;
+            }
+
+            line = new_mem;
+        }
+
+        memcpy(&line[line_len], pos, (end - pos) * sizeof(wchar_t));
+        line_len += end - pos;
+        line[line_len] = L'\0';
+        pos = next;
+
+        if (cont && *pos != L'\0') {
+            continue;
+        }
+
+        hr = reg_hive_parse_line(&key, line);
+        line_len = 0;
+
+        if (FAILED(hr)) {
+            goto end;
+        }
+
+        if (hr == S_FALSE) {
+            dprintf("Registry: %S:%u: Unsupported or malformed line\n",
+                    path,
+                    lineno);
+            nwarnings++;
+        }
+    }
+
+    dprintf("Registry: Loaded %S (%u warnings)\n", path, nwarnings);
+    hr = S_OK;
+
+end:
+    free(line);
+
+    return hr;
+}
+
+static HRESULT reg_hive_parse_line(struct reg_hive_key **key, wchar_t *line)
+{
+    while (iswspace(*line)) {
+        line++;
+    }
+
+    if (*line == L'\0' || *line == L';') {
+        return S_OK;
+    } else if (*line == L'[') {
+        return reg_hive_parse_key(key, line + 1);
+    } else if (*line == L'@' || *line == L'"') {
+        return reg_hive_parse_val(*key, line);
+    } else if (
+            wcsncmp(line, L"Windows Registry Editor", 23) == 0 ||
+            wcscmp(line, L"REGEDIT4") == 0) {
+        return S_OK;
+    } else {
+        return S_FALSE;
+    }
+}
+
+static HRESULT reg_hive_parse_key(struct reg_hive_key **key, wchar_t *line)
+{
+    struct reg_hive_key *root;
+    wchar_t *end;
+    wchar_t *sep;
+    const wchar_t *rest;
+
+    /* Values following a key we can't represent get dropped */
+
+    *key = NULL;
+    end = wcsrchr(line, L']');
+
+    if (end == NULL || *line == L'-') {
+        /* (Key deletions are not supported) */
+        return S_FALSE;
+    }
+
+    *end = L'\0';
+    sep = wcschr(line, L'\\');
+
+    if (sep != NULL) {
+        *sep = L'\0';
+        rest = sep + 1;
+    } else {
+        rest = L"";
+    }
+
+    root = reg_hive_root_by_name(line);
+
+    if (root == NULL) {
+        return S_FALSE;
+    }
+
+    *key = reg_hive_find(root, rest, true, NULL);
+
+    if (*key == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    (*key)->defined = true;
+
+    return S_OK;
+}
+
+static HRESULT reg_hive_parse_val(struct reg_hive_key *key, wchar_t *line)
+{
+    const wchar_t *name;
+    wchar_t *pos;
+    wchar_t *str;
+    wchar_t *end;
+    uint32_t type;
+    uint32_t u32;
+
+    if (*line == L'@') {
+        name = L"";
+        pos = line + 1;
+    } else {
+        name = line + 1;
+        pos = reg_hive_unquote(line + 1);
+
+        if (pos == NULL) {
+            return S_FALSE;
+        }
+    }
+
+    while (iswspace(*pos)) {
+        pos++;
+    }
+
+    if (*pos != L'=') {
+        return S_FALSE;
+    }
+
+    pos++;
+
+    while (iswspace(*pos)) {
+        pos++;
+    }
+
+    if (key == NULL) {
+        return S_OK;
+    }
+
+    if (*pos == L'-') {
+        reg_hive_delete_val(key, name);
+
+        return S_OK;
+    } else if (*pos == L'"') {
+        str = pos + 1;
+
+        if (reg_hive_unquote(str) == NULL) {
+            return S_FALSE;
+        }
+
+        return reg_hive_set_val(
+                key,
+                name,
+                REG_SZ,
+                str,
+                (wcslen(str) + 1) * sizeof(wchar_t));
+    } else if (_wcsnicmp(pos, L"dword:", 6) == 0) {
+        u32 = wcstoul(pos + 6, &end, 16);
+
+        if (end == pos + 6 || *end != L'\0') {
+            return S_FALSE;
+        }
+
+        return reg_hive_set_val(key, name, REG_DWORD, &u32, sizeof(u32));
+    } else if (_wcsnicmp(pos, L"hex", 3) == 0) {
+        pos += 3;
+        type = REG_BINARY;
+
+        if (*pos == L'(') {
+            type = wcstoul(pos + 1, &end, 16);
+
+            if (*end != L')') {
+                return S_FALSE;
+            }
+
+            pos = end + 1;
+        }
+
+        if (*pos != L':') {
+            return S_FALSE;
+        }
+
+        return reg_hive_parse_hex(key, name, type, pos + 1);
+    } else {
+        return S_FALSE;
+    }
+}
+
+static HRESULT reg_hive_parse_hex(
+        struct reg_hive_key *key,
+        const wchar_t *name,
+        uint32_t type,
+        const wchar_t *pos)
+{
+    uint8_t *bytes;
+    wchar_t *end;
+    unsigned long byte;
+    uint32_t nbytes;
+    HRESULT hr;
+
+    bytes = malloc(wcslen(pos) / 2 + 1);
+
+    if (bytes == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    nbytes = 0;
+
+    for (;;) {
+        while (*pos == L',' || iswspace(*pos)) {
+            pos++;
+        }
+
+        if (*pos == L'\0') {
+            break;
+        }
+
+        byte = wcstoul(pos, &end, 16);
+
+        if (end == pos || end - pos > 2) {
+            free(bytes);
+
+            return S_FALSE;
+        }
+
+        bytes[nbytes++] = (uint8_t) byte;
+        pos = end;
+    }
+
+    hr = reg_hive_set_val(key, name, type, bytes, nbytes);
+    free(bytes);
+
+    return hr;
+}
+
+static wchar_t *reg_hive_unquote(wchar_t *str)
+{
+    const wchar_t *src;
+    wchar_t *dest;
+    wchar_t *after;
+
+    /* Unescape a quoted string in place, starting just past the opening quote.
+       Returns a pointer past the closing quote, or NULL if there isn't one. */
+
+    src = str;
+    dest = str;
+
+    while (*src != L'\0' && *src != L'"') {
+        if (*src == L'\\' && src[1] != L'\0') {
+            src++;
+        }
+
+        *dest++ = *src++;
+    }
+
+    if (*src != L'"') {
+        return NULL;
+    }
+
+    after = (wchar_t *) src + 1;
+    *dest = L'\0';
+
+    return after;
+}
+
+HRESULT reg_hive_journal_open(const wchar_t *path)
+{
+    HANDLE thread;
+    HRESULT hr;
+
+    assert(path != NULL);
+    assert(reg_hive_journal_file == NULL);
+
+    if (wcscpy_s(
+            reg_hive_journal_path,
+            _countof(reg_hive_journal_path),
+            path) != 0) {
+        return E_INVALIDARG;
+    }
+
+    reg_hive_journal_file = reg_hive_journal_create(path, OPEN_ALWAYS);
+
+    if (reg_hive_journal_file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Registry: %S: Error opening journal: %x\n", path, (int) hr);
+        reg_hive_journal_file = NULL;
+
+        return hr;
+    }
+
+    /* Replay writes from previous sessions first */
+
+    hr = reg_hive_journal_replay();
+
+    if (FAILED(hr)) {
+        dprintf("Registry: %S: Error replaying journal: %x\n", path, (int) hr);
+        CloseHandle(reg_hive_journal_file);
+        reg_hive_journal_file = NULL;
+
+        return hr;
+    }
+
+    if (    reg_hive_journal_size > REG_HIVE_JOURNAL_COMPACT_SIZE &&
+            reg_hive_journal_size > 2 * reg_hive_journal_compacted) {
+        reg_hive_journal_compact();
+    }
+
+    InitializeCriticalSection(&reg_hive_journal_lock);
+    reg_hive_journal_event = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+    if (reg_hive_journal_event == NULL) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    thread = CreateThread(NULL, 0, reg_hive_journal_thread, NULL, 0, NULL);
+
+    if (thread == NULL) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    CloseHandle(thread);
+    atexit(reg_hive_journal_flush_at_exit);
+
+    return S_OK;
+}
+
+static HANDLE reg_hive_journal_create(const wchar_t *path, DWORD disposition)
+{
+    /* FILE_SHARE_DELETE lets a compacted journal replace this one while it
+       is still open. */
+
+    return CreateFileW(
+            path,
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            NULL,
+            disposition,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+}
+
+static size_t reg_hive_journal_scan(
+        const char *bytes,
+        size_t nbytes,
+        struct reg_hive_journal_rec *recs,
+        size_t *nrecs)
+{
+    char hdr[REG_HIVE_JOURNAL_HDR_LEN + 1];
+    unsigned int len;
+    unsigned int crc;
+    size_t pos;
+    size_t n;
+
+    /* Returns the length of the run of good records at the start of the
+       journal, and optionally the records themselves. Anything after the
+       first bad record was written after a torn write and is not trusted. */
+
+    pos = 0;
+    n = 0;
+
+    while (nbytes - pos >= REG_HIVE_JOURNAL_HDR_LEN) {
+        memcpy(hdr, bytes + pos, REG_HIVE_JOURNAL_HDR_LEN);
+        hdr[REG_HIVE_JOURNAL_HDR_LEN] = '\0';
+
+        if (    memcmp(hdr, "; rec ", 6) != 0 ||
+                sscanf_s(hdr + 6, "%8x %8x", &len, &crc) != 2 ||
+                strcmp(hdr + REG_HIVE_JOURNAL_HDR_LEN - 2, "\r\n") != 0) {
+            break;
+        }
+
+        if (len > nbytes - pos - REG_HIVE_JOURNAL_HDR_LEN) {
+            break;
+        }
+
+        if (crc32(bytes + pos + REG_HIVE_JOURNAL_HDR_LEN, len, 0) != crc) {
+            break;
+        }
+
+        if (recs != NULL) {
+            recs[n].bytes = bytes + pos;
+            recs[n].nbytes = REG_HIVE_JOURNAL_HDR_LEN + len;
+            recs[n].index = n;
+        }
+
+        n++;
+        pos += REG_HIVE_JOURNAL_HDR_LEN + len;
+    }
+
+    if (nrecs != NULL) {
+        *nrecs = n;
+    }
+
+    return pos;
+}
+
+static HRESULT reg_hive_journal_read(char **out, size_t *nbytes)
+{
+    LARGE_INTEGER size;
+    LARGE_INTEGER zero;
+    DWORD nread;
+    char *bytes;
+    HRESULT hr;
+
+    /* Read the whole journal, leaving the file pointer at its end. Its size
+       is capped like that of any other .reg file we load. */
+
+    *out = NULL;
+    *nbytes = 0;
+    zero.QuadPart = 0;
+    bytes = NULL;
+
+    if (!GetFileSizeEx(reg_hive_journal_file, &size)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    if (size.QuadPart > 0x4000000) {
+        hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+
+        goto end;
+    }
+
+    bytes = malloc((size_t) size.QuadPart + 1);
+
+    if (bytes == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    if (    !SetFilePointerEx(reg_hive_journal_file, zero, NULL, FILE_BEGIN) ||
+            !ReadFile(
+                reg_hive_journal_file,
+                bytes,
+                (DWORD) size.QuadPart,
+                &nread,
+                NULL)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    *out = bytes;
+    *nbytes = nread;
+    bytes = NULL;
+    hr = S_OK;
+
+end:
+    SetFilePointerEx(reg_hive_journal_file, zero, NULL, FILE_END);
+    free(bytes);
+
+    return hr;
+}
+
+static HRESULT reg_hive_journal_replay(void)
+{
+    struct reg_hive_journal_rec *recs;
+    LARGE_INTEGER valid_li;
+    wchar_t *text;
+    char *bytes;
+    char *body;
+    size_t nbytes;
+    size_t nrecs;
+    size_t valid;
+    size_t len;
+    size_t i;
+    int nchars;
+    HRESULT hr;
+
+    recs = NULL;
+    text = NULL;
+    body = NULL;
+
+    hr = reg_hive_journal_read(&bytes, &nbytes);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    recs = malloc((nbytes / REG_HIVE_JOURNAL_HDR_LEN + 1) * sizeof(*recs));
+    body = malloc(nbytes + 1);
+
+    if (recs == NULL || body == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    valid = reg_hive_journal_scan(bytes, nbytes, recs, &nrecs);
+
+    /* Cut off a torn tail so that new records follow the last good one */
+
+    if (valid < nbytes) {
+        dprintf("Registry: %S: Discarding %u bytes of damaged journal\n",
+                reg_hive_journal_path,
+                (unsigned int) (nbytes - valid));
+
+        valid_li.QuadPart = valid;
+
+        if (    !SetFilePointerEx(
+                    reg_hive_journal_file,
+                    valid_li,
+                    NULL,
+                    FILE_BEGIN) ||
+                !SetEndOfFile(reg_hive_journal_file)) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+
+            goto end;
+        }
+    }
+
+    reg_hive_journal_size = valid;
+
+    /* Strip the framing and replay the rest as a single .reg file */
+
+    len = 0;
+
+    for (i = 0 ; i < nrecs ; i++) {
+        memcpy(&body[len],
+                recs[i].bytes + REG_HIVE_JOURNAL_HDR_LEN,
+                recs[i].nbytes - REG_HIVE_JOURNAL_HDR_LEN);
+        len += recs[i].nbytes - REG_HIVE_JOURNAL_HDR_LEN;
+    }
+
+    body[len] = '\0';
+
+    if (len == 0) {
+        hr = S_OK;
+
+        goto end;
+    }
+
+    nchars = MultiByteToWideChar(CP_UTF8, 0, body, -1, NULL, 0);
+    text = malloc(nchars * sizeof(wchar_t));
+
+    if (nchars == 0 || text == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    MultiByteToWideChar(CP_UTF8, 0, body, -1, text, nchars);
+    hr = reg_hive_parse(reg_hive_journal_path, text);
+
+end:
+    free(text);
+    free(body);
+    free(recs);
+    free(bytes);
+
+    return hr;
+}
+
+static HRESULT reg_hive_journal_compact(void)
+{
+    struct reg_hive_journal_rec *recs;
+    struct reg_hive_journal_rec *sorted;
+    wchar_t tmp_path[MAX_PATH];
+    HANDLE old_file;
+    HANDLE file;
+    uint64_t new_size;
+    DWORD nwritten;
+    bool *live;
+    char *bytes;
+    size_t nbytes;
+    size_t nrecs;
+    size_t i;
+    HRESULT hr;
+
+    /* Rewrite the journal keeping only the last record for each key and
+       value, then swap it in for the old one. Records that are kept stay in
+       the order they were written in, so replaying the compacted journal
+       gives the same result as replaying the whole thing. Only the journal
+       thread (or journal_open, before that thread exists) gets here. */
+
+    recs = NULL;
+    sorted = NULL;
+    live = NULL;
+    file = INVALID_HANDLE_VALUE;
+
+    hr = reg_hive_journal_read(&bytes, &nbytes);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    recs = malloc((nbytes / REG_HIVE_JOURNAL_HDR_LEN + 1) * sizeof(*recs));
+    sorted = malloc((nbytes / REG_HIVE_JOURNAL_HDR_LEN + 1) * sizeof(*recs));
+    live = calloc(nbytes / REG_HIVE_JOURNAL_HDR_LEN + 1, sizeof(*live));
+
+    if (recs == NULL || sorted == NULL || live == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    reg_hive_journal_scan(bytes, nbytes, recs, &nrecs);
+
+    for (i = 0 ; i < nrecs ; i++) {
+        reg_hive_journal_rec_id(&recs[i]);
+    }
+
+    memcpy(sorted, recs, nrecs * sizeof(*recs));
+    qsort(sorted, nrecs, sizeof(*sorted), reg_hive_journal_rec_cmp);
+
+    /* Records with equal IDs are sorted in the order they were written, so
+       the last of each run is the one to keep */
+
+    for (i = 0 ; i < nrecs ; i++) {
+        if (    i + 1 == nrecs ||
+                reg_hive_journal_id_cmp(&sorted[i], &sorted[i + 1]) != 0) {
+            live[sorted[i].index] = true;
+        }
+    }
+
+    if (swprintf_s(
+            tmp_path,
+            _countof(tmp_path),
+            L"%s.tmp",
+            reg_hive_journal_path) < 0) {
+        hr = HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+
+        goto end;
+    }
+
+    file = reg_hive_journal_create(tmp_path, CREATE_ALWAYS);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    new_size = 0;
+
+    for (i = 0 ; i < nrecs ; i++) {
+        if (!live[i]) {
+            continue;
+        }
+
+        if (    !WriteFile(
+                    file,
+                    recs[i].bytes,
+                    (DWORD) recs[i].nbytes,
+                    &nwritten,
+                    NULL) ||
+                nwritten != recs[i].nbytes) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+
+            goto end;
+        }
+
+        new_size += nwritten;
+    }
+
+    if (!FlushFileBuffers(file)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    if (!MoveFileExW(
+            tmp_path,
+            reg_hive_journal_path,
+            MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    /* The temporary handle now refers to the journal itself. Its file
+       pointer is already at the end, so carry on appending through it. */
+
+    dprintf("Registry: Compacted journal from %u to %u bytes\n",
+            (unsigned int) reg_hive_journal_size,
+            (unsigned int) new_size);
+
+    old_file = reg_hive_journal_file;
+    reg_hive_journal_file = file;
+    reg_hive_journal_size = new_size;
+    reg_hive_journal_compacted = new_size;
+    file = INVALID_HANDLE_VALUE;
+    CloseHandle(old_file);
+    hr = S_OK;
+
+end:
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+        DeleteFileW(tmp_path);
+    }
+
+    if (FAILED(hr)) {
+        dprintf("Registry: Journal compaction failed: %x\n", (int) hr);
+
+        /* Don't retry on every write */
+        reg_hive_journal_compacted = reg_hive_journal_size;
+    }
+
+    free(live);
+    free(sorted);
+    free(recs);
+    free(bytes);
+
+    return hr;
+}
+
+static void reg_hive_journal_rec_id(struct reg_hive_journal_rec *rec)
+{
+    const char *body;
+    const char *end;
+    const char *pos;
+    const char *eq;
+
+    /* A record is a key line, optionally followed by one value line, and
+       records with the same key and value name supersede each other. Value
+       data never contains an '=', so the name ends at the line's last one.
+       Key-only records are identified by the key line alone. */
+
+    body = rec->bytes + REG_HIVE_JOURNAL_HDR_LEN;
+    end = rec->bytes + rec->nbytes;
+    rec->id = body;
+    rec->id_len = end - body;
+
+    for (pos = body ; pos + 1 < end ; pos++) {
+        if (pos[0] == '\r' && pos[1] == '\n') {
+            break;
+        }
+    }
+
+    if (pos + 1 >= end) {
+        return;
+    }
+
+    pos += 2;
+    rec->id_len = pos - body;
+    eq = NULL;
+
+    for (; pos < end ; pos++) {
+        if (*pos == '=') {
+            eq = pos;
+        }
+    }
+
+    if (eq != NULL) {
+        rec->id_len = eq - body;
+    }
+}
+
+static int reg_hive_journal_rec_cmp(const void *lhs, const void *rhs)
+{
+    const struct reg_hive_journal_rec *l;
+    const struct reg_hive_journal_rec *r;
+    int result;
+
+    l = lhs;
+    r = rhs;
+    result = reg_hive_journal_id_cmp(l, r);
+
+    if (result != 0) {
+        return result;
+    }
+
+    return l->index < r->index ? -1 : l->index > r->index;
+}
+
+static int reg_hive_journal_id_cmp(
+        const struct reg_hive_journal_rec *l,
+        const struct reg_hive_journal_rec *r)
+{
+    size_t len;
+    int result;
+
+    /* Registry names are case-insensitive. Folding ASCII only means that
+       names differing in the case of other letters are not merged, which
+       is harmless: both records are kept, in order. */
+
+    len = l->id_len < r->id_len ? l->id_len : r->id_len;
+    result = _strnicmp(l->id, r->id, len);
+
+    if (result != 0) {
+        return result;
+    }
+
+    return l->id_len < r->id_len ? -1 : l->id_len > r->id_len;
+}
+
+void reg_hive_journal_append(
+        const struct reg_hive_key *key,
+        const struct reg_hive_val *val)
+{
+    char hex[8];
+    size_t start;
+    uint32_t i;
+    HRESULT hr;
+
+    assert(key != NULL);
+    assert(val != NULL);
+
+    if (reg_hive_journal_file == NULL) {
+        return;
+    }
+
+    /* Every value is journalled as hex(type) so that replay is lossless
+       regardless of type. */
+
+    EnterCriticalSection(&reg_hive_journal_lock);
+
+    hr = reg_hive_journal_begin(&start);
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put_key(key);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put_val_name(val->name);
+    }
+
+    if (SUCCEEDED(hr)) {
+        sprintf_s(hex, sizeof(hex), "=hex(%x):", (unsigned int) val->type);
+        hr = reg_hive_journal_put(hex, strlen(hex));
+    }
+
+    for (i = 0 ; SUCCEEDED(hr) && i < val->nbytes ; i++) {
+        sprintf_s(
+                hex,
+                sizeof(hex),
+                i + 1 < val->nbytes ? "%02x," : "%02x",
+                val->bytes[i]);
+        hr = reg_hive_journal_put(hex, strlen(hex));
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put("\r\n\r\n", 4);
+    }
+
+    reg_hive_journal_end(start, hr);
+    LeaveCriticalSection(&reg_hive_journal_lock);
+
+    if (FAILED(hr)) {
+        dprintf("Registry: Journal append failed: %x\n", (int) hr);
+    }
+
+    SetEvent(reg_hive_journal_event);
+}
+
+void reg_hive_journal_append_key(const struct reg_hive_key *key)
+{
+    size_t start;
+    HRESULT hr;
+
+    assert(key != NULL);
+
+    if (reg_hive_journal_file == NULL) {
+        return;
+    }
+
+    /* A key header with no values after it; replay marks it as defined */
+
+    EnterCriticalSection(&reg_hive_journal_lock);
+
+    hr = reg_hive_journal_begin(&start);
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put_key(key);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put("\r\n", 2);
+    }
+
+    reg_hive_journal_end(start, hr);
+    LeaveCriticalSection(&reg_hive_journal_lock);
+
+    if (FAILED(hr)) {
+        dprintf("Registry: Journal append failed: %x\n", (int) hr);
+    }
+
+    SetEvent(reg_hive_journal_event);
+}
+
+void reg_hive_journal_append_delete(
+        const struct reg_hive_key *key,
+        const wchar_t *name)
+{
+    size_t start;
+    HRESULT hr;
+
+    assert(key != NULL);
+
+    if (reg_hive_journal_file == NULL) {
+        return;
+    }
+
+    if (name == NULL) {
+        name = L"";
+    }
+
+    EnterCriticalSection(&reg_hive_journal_lock);
+
+    hr = reg_hive_journal_begin(&start);
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put_key(key);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put_val_name(name);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put("=-\r\n\r\n", 6);
+    }
+
+    reg_hive_journal_end(start, hr);
+    LeaveCriticalSection(&reg_hive_journal_lock);
+
+    if (FAILED(hr)) {
+        dprintf("Registry: Journal append failed: %x\n", (int) hr);
+    }
+
+    SetEvent(reg_hive_journal_event);
+}
+
+static HRESULT reg_hive_journal_put_key(const struct reg_hive_key *key)
+{
+    wchar_t path[512];
+    HRESULT hr;
+
+    hr = reg_hive_key_path(key, path, _countof(path));
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = reg_hive_journal_put("[", 1);
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put_w(path, false);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put("]\r\n", 3);
+    }
+
+    return hr;
+}
+
+static HRESULT reg_hive_journal_put_val_name(const wchar_t *name)
+{
+    HRESULT hr;
+
+    if (name[0] == L'\0') {
+        return reg_hive_journal_put("@", 1);
+    }
+
+    hr = reg_hive_journal_put("\"", 1);
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put_w(name, true);
+    }
+
+    if (SUCCEEDED(hr)) {
+        hr = reg_hive_journal_put("\"", 1);
+    }
+
+    return hr;
+}
+
+static HRESULT reg_hive_journal_begin(size_t *start)
+{
+    char hdr[REG_HIVE_JOURNAL_HDR_LEN + 1];
+
+    /* Reserve room for the record's header; reg_hive_journal_end() fills it
+       in once the record is complete. */
+
+    *start = reg_hive_journal_len;
+    memset(hdr, ' ', REG_HIVE_JOURNAL_HDR_LEN);
+
+    return reg_hive_journal_put(hdr, REG_HIVE_JOURNAL_HDR_LEN);
+}
+
+static void reg_hive_journal_end(size_t start, HRESULT hr)
+{
+    char hdr[REG_HIVE_JOURNAL_HDR_LEN + 1];
+    const char *body;
+    size_t len;
+
+    /* A record that could not be put together completely is dropped
+       altogether, rather than leaving half of one in the journal. */
+
+    if (FAILED(hr)) {
+        reg_hive_journal_len = start;
+
+        return;
+    }
+
+    body = &reg_hive_journal_buf[start + REG_HIVE_JOURNAL_HDR_LEN];
+    len = reg_hive_journal_len - start - REG_HIVE_JOURNAL_HDR_LEN;
+
+    sprintf_s(
+            hdr,
+            sizeof(hdr),
+            REG_HIVE_JOURNAL_HDR,
+            (unsigned int) len,
+            (unsigned int) crc32(body, len, 0));
+    memcpy(&reg_hive_journal_buf[start], hdr, REG_HIVE_JOURNAL_HDR_LEN);
+}
+
+static HRESULT reg_hive_journal_put(const char *bytes, size_t nbytes)
+{
+    char *new_mem;
+    size_t new_cap;
+
+    if (reg_hive_journal_len + nbytes > reg_hive_journal_cap) {
+        new_cap = (reg_hive_journal_len + nbytes) * 2;
+        new_mem = realloc(reg_hive_journal_buf, new_cap);
+
+        if (new_mem == NULL) {
+            return E_OUTOFMEMORY;
+        }
+
+        reg_hive_journal_buf = new_mem;
+        reg_hive_journal_cap = new_cap;
+    }
+
+    memcpy(&reg_hive_journal_buf[reg_hive_journal_len], bytes, nbytes);
+    reg_hive_journal_len += nbytes;
+
+    return S_OK;
+}
+
+static HRESULT reg_hive_journal_put_w(const wchar_t *str, bool escape)
+{
+    char utf8[8];
+    int nbytes;
+    HRESULT hr;
+
+    for (; *str != L'\0' ; str++) {
+        if (escape && (*str == L'\\' || *str == L'"')) {
+            hr = reg_hive_journal_put("\\", 1);
+
+            if (FAILED(hr)) {
+                return hr;
+            }
+        }
+
+        /* (Surrogate pairs get mangled here; value names don't contain any) */
+
+        nbytes = WideCharToMultiByte(
+                CP_UTF8,
+                0,
+                str,
+                1,
+                utf8,
+                sizeof(utf8),
+                NULL,
+                NULL);
+
+        hr = reg_hive_journal_put(utf8, nbytes);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    return S_OK;
+}
+
+static DWORD CALLBACK reg_hive_journal_thread(void *ctx)
+{
+    char *buf;
+    size_t len;
+
+    for (;;) {
+        WaitForSingleObject(reg_hive_journal_event, INFINITE);
+
+        /* Take ownership of whatever has accumulated and write it out without
+           holding the lock, so registry writes never wait on disk I/O. */
+
+        EnterCriticalSection(&reg_hive_journal_lock);
+        buf = reg_hive_journal_buf;
+        len = reg_hive_journal_len;
+        reg_hive_journal_buf = NULL;
+        reg_hive_journal_len = 0;
+        reg_hive_journal_cap = 0;
+        LeaveCriticalSection(&reg_hive_journal_lock);
+
+        if (len > 0) {
+            reg_hive_journal_write(buf, len);
+        }
+
+        free(buf);
+
+        if (    reg_hive_journal_size > REG_HIVE_JOURNAL_COMPACT_SIZE &&
+                reg_hive_journal_size > 2 * reg_hive_journal_compacted) {
+            reg_hive_journal_compact();
+        }
+    }
+
+    return 0;
+}
+
+static void reg_hive_journal_write(const char *bytes, size_t nbytes)
+{
+    LARGE_INTEGER size;
+    DWORD nwritten;
+    BOOL ok;
+
+    ok = WriteFile(
+            reg_hive_journal_file,
+            bytes,
+            (DWORD) nbytes,
+            &nwritten,
+            NULL);
+
+    if (ok && nwritten == nbytes) {
+        reg_hive_journal_size += nbytes;
+
+        return;
+    }
+
+    /* Cut off whatever part of the batch did make it to disk. Replay would
+       stop at the torn record anyway, but so would it for every record
+       appended after it. */
+
+    dprintf("Registry: Journal write failed: %x\n",
+            (int) HRESULT_FROM_WIN32(ok ? ERROR_DISK_FULL : GetLastError()));
+
+    size.QuadPart = reg_hive_journal_size;
+    SetFilePointerEx(reg_hive_journal_file, size, NULL, FILE_BEGIN);
+    SetEndOfFile(reg_hive_journal_file);
+}
+
+static void reg_hive_journal_flush_at_exit(void)
+{
+    /* By the time atexit handlers run every other thread has been killed, so
+       the lock is not taken: its owner may be gone. Anything still buffered
+       gets written out here. A batch that the journal thread had already
+       taken but not yet written when it was killed is lost. */
+
+    if (reg_hive_journal_len > 0) {
+        reg_hive_journal_write(reg_hive_journal_buf, reg_hive_journal_len);
+        reg_hive_journal_len = 0;
+    }
+
+    FlushFileBuffers(reg_hive_journal_file);
+}
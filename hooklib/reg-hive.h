@@ -0,0 +1,94 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* In-memory registry tree backing the virtual registry in hooklib/reg.c.
+
+   Keys and values are populated from .reg files at startup. Nodes are never
+   freed, so pointers to keys remain valid for the lifetime of the process.
+   None of these functions take any locks (apart from the journal's internal
+   buffer lock); callers serialize access to the tree themselves. */
+
+struct reg_hive_val {
+    wchar_t *name;
+    uint32_t type;
+    uint8_t *bytes;
+    uint32_t nbytes;
+};
+
+struct reg_hive_key {
+    wchar_t *name;
+    struct reg_hive_key *parent;
+    struct reg_hive_key **children;
+    size_t nchildren;
+    struct reg_hive_val *vals;
+    size_t nvals;
+
+    /* Set for keys named by a .reg file or the journal, as opposed to keys
+       that only exist as a path leading down to one of those. */
+    bool defined;
+};
+
+struct reg_hive_key *reg_hive_root(HKEY root);
+
+/* Walk a backslash-separated path down from base, creating missing keys if
+   create is set. Returns NULL if the path does not exist and create is false.
+   Either way *matched receives the number of leading path components that
+   already existed. */
+
+struct reg_hive_key *reg_hive_find(
+        struct reg_hive_key *base,
+        const wchar_t *path,
+        bool create,
+        size_t *matched);
+
+/* Returns true if base, or any key along the given path below it, is a
+   defined key. Everything underneath a defined key belongs to the hive,
+   whether or not it exists yet. */
+
+bool reg_hive_covers(struct reg_hive_key *base, const wchar_t *path);
+
+struct reg_hive_val *reg_hive_find_val(
+        const struct reg_hive_key *key,
+        const wchar_t *name);
+
+HRESULT reg_hive_set_val(
+        struct reg_hive_key *key,
+        const wchar_t *name,
+        uint32_t type,
+        const void *bytes,
+        uint32_t nbytes);
+
+void reg_hive_delete_val(struct reg_hive_key *key, const wchar_t *name);
+
+HRESULT reg_hive_key_path(
+        const struct reg_hive_key *key,
+        wchar_t *path,
+        size_t path_count);
+
+HRESULT reg_hive_load_file(const wchar_t *path);
+
+/* Replay an existing journal into the tree, then append every subsequent
+   reg_hive_journal_append*() to it from a background thread. The journal is
+   itself a .reg fragment, with a comment line in front of each record that
+   holds the record's length and CRC32. Replay stops at the first record that
+   doesn't match its header and cuts the journal off there. Once the journal
+   passes a size threshold it is rewritten with only the latest record for
+   each key and value. Records still buffered when the process exits are
+   written out by an atexit handler. */
+
+HRESULT reg_hive_journal_open(const wchar_t *path);
+
+void reg_hive_journal_append(
+        const struct reg_hive_key *key,
+        const struct reg_hive_val *val);
+
+void reg_hive_journal_append_key(const struct reg_hive_key *key);
+
+void reg_hive_journal_append_delete(
+        const struct reg_hive_key *key,
+        const wchar_t *name);
@@ -2,21 +2,53 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <wctype.h>
 
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
 #include "hooklib/reg.h"
+#include "hooklib/reg-hive.h"
 
 #include "util/dprintf.h"
 #include "util/str.h"
 
+#define REG_HOOK_HANDLE_BUCKETS 64
+#define REG_HOOK_HANDLE_BASE    ((uintptr_t) 0x40000000)
+#define REG_HOOK_HANDLE_END     ((uintptr_t) 0x7FFFFFFC)
+#define REG_HOOK_NO_KEY         ((size_t) -1)
+#define REG_HOOK_MAX_PATH       512
+
 struct reg_hook_key {
     HKEY root;
     const wchar_t *name;
     const struct reg_hook_val *vals;
     size_t nvals;
+    uint16_t *index;
+    size_t index_size;
+};
+
+/* An open virtual key may be backed by a callback key, a node of the
+   in-memory hive, or both (callback values take precedence).
+
+   The HKEY handed to the game is a synthetic value from a private range,
+   which the hooked functions look up in a small hash table. Kernel handles
+   stay far below REG_HOOK_HANDLE_BASE and the predefined root keys live at
+   0x80000000 and up, so nothing else can ever have the same value. Opening
+   a virtual key costs no kernel call at all. RegNotifyChangeKeyValue is the
+   only function that needs a real key behind the handle, and it opens one
+   the first time it is called on that handle. */
+
+struct reg_hook_handle {
+    struct reg_hook_handle *next;
     HKEY handle;
+    HKEY backing;
+    HKEY root;
+    wchar_t *path;
+    size_t key;
+    struct reg_hive_key *hive;
 };
 
 /* Helper functions */
@@ -25,26 +57,133 @@ static void reg_hook_init(void);
 
 static LRESULT reg_hook_propagate_hr(HRESULT hr);
 
-static struct reg_hook_key *reg_hook_match_key_locked(HKEY handle);
+static uint32_t reg_hook_hash_name(const wchar_t *name);
+
+static HRESULT reg_hook_index_key(struct reg_hook_key *key);
+
+static size_t reg_hook_handle_bucket(HKEY handle);
+
+static struct reg_hook_handle *reg_hook_match_handle_locked(HKEY handle);
+
+static LSTATUS reg_hook_backing(HKEY handle, HKEY *out);
+
+static struct reg_hook_key *reg_hook_handle_key(
+        const struct reg_hook_handle *h);
 
 static const struct reg_hook_val *reg_hook_match_val_locked(
         struct reg_hook_key *key,
         const wchar_t *name);
 
+static bool reg_hook_join_path(
+        wchar_t *path,
+        const wchar_t *dir,
+        const wchar_t *name);
+
 static LSTATUS reg_hook_open_locked(
         HKEY parent,
         const wchar_t *name,
+        bool create,
+        wchar_t *path,
+        HKEY *next_parent,
+        HKEY *out,
+        uint32_t *disposition);
+
+static LSTATUS reg_hook_alloc_handle_locked(
+        HKEY root,
+        const wchar_t *path,
+        size_t key,
+        struct reg_hive_key *hive,
         HKEY *out);
 
 static LSTATUS reg_hook_query_val_locked(
-        struct reg_hook_key *key,
+        const struct reg_hook_handle *h,
+        const wchar_t *name,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS reg_hook_set_val_locked(
+        const struct reg_hook_handle *h,
         const wchar_t *name,
+        uint32_t type,
+        const void *bytes,
+        uint32_t nbytes);
+
+static LSTATUS reg_hook_delete_val_locked(
+        const struct reg_hook_handle *h,
+        const wchar_t *name);
+
+static bool reg_hook_enum_val_locked(
+        const struct reg_hook_handle *h,
+        uint32_t index,
+        const struct reg_hook_val **val,
+        const struct reg_hive_val **hive_val);
+
+static HRESULT reg_hook_read_enum_val(
+        const struct reg_hook_val *val,
+        const struct reg_hive_val *hive_val,
+        void *bytes,
+        uint32_t *nbytes);
+
+static void reg_hook_query_info_locked(
+        const struct reg_hook_handle *h,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len);
+
+static LSTATUS reg_hook_copy_name(
+        const wchar_t *src,
+        wchar_t *dest,
+        uint32_t *ndest);
+
+static LSTATUS reg_hook_copy_name_a(
+        const wchar_t *src,
+        char *dest,
+        uint32_t *ndest);
+
+static LSTATUS reg_hook_widen(const char *src, wchar_t **out);
+
+static LSTATUS reg_hook_widen_data(
+        uint32_t type,
+        const void *src,
+        uint32_t src_nbytes,
+        void **out,
+        uint32_t *out_nbytes);
+
+static LSTATUS reg_hook_narrow_data(
+        uint32_t type,
+        const void *src,
+        uint32_t src_nbytes,
+        void *bytes,
+        uint32_t *nbytes);
+
+static bool reg_hook_is_string_type(uint32_t type);
+
+static LSTATUS reg_hook_get_val(
+        HKEY handle,
+        const void *name,
+        bool ansi,
+        uint32_t flags,
         uint32_t *type,
         void *bytes,
         uint32_t *nbytes);
 
+static LSTATUS reg_hook_check_get_type(
+        uint32_t type,
+        uint32_t nbytes,
+        uint32_t flags);
+
 /* API hooks */
 
+static LSTATUS WINAPI hook_RegOpenKeyExA(
+        HKEY parent,
+        const char *name,
+        uint32_t flags,
+        uint32_t access,
+        HKEY *out);
+
 static LSTATUS WINAPI hook_RegOpenKeyExW(
         HKEY parent,
         const wchar_t *name,
@@ -52,6 +191,17 @@ static LSTATUS WINAPI hook_RegOpenKeyExW(
         uint32_t access,
         HKEY *out);
 
+static LSTATUS WINAPI hook_RegCreateKeyExA(
+        HKEY parent,
+        const char *name,
+        uint32_t reserved,
+        const char *class_,
+        uint32_t options,
+        uint32_t access,
+        const SECURITY_ATTRIBUTES *sa,
+        HKEY *out,
+        uint32_t *disposition);
+
 static LSTATUS WINAPI hook_RegCreateKeyExW(
         HKEY parent,
         const wchar_t *name,
@@ -81,6 +231,14 @@ static LSTATUS WINAPI hook_RegQueryValueExW(
         void *bytes,
         uint32_t *nbytes);
 
+static LSTATUS WINAPI hook_RegSetValueExA(
+        HKEY handle,
+        const char *name,
+        uint32_t reserved,
+        uint32_t type,
+        const void *bytes,
+        uint32_t nbytes);
+
 static LSTATUS WINAPI hook_RegSetValueExW(
         HKEY handle,
         const wchar_t *name,
@@ -89,8 +247,112 @@ static LSTATUS WINAPI hook_RegSetValueExW(
         const void *bytes,
         uint32_t nbytes);
 
+static LSTATUS WINAPI hook_RegDeleteValueA(HKEY handle, const char *name);
+
+static LSTATUS WINAPI hook_RegDeleteValueW(HKEY handle, const wchar_t *name);
+
+static LSTATUS WINAPI hook_RegEnumKeyExA(
+        HKEY handle,
+        uint32_t index,
+        char *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        char *class_,
+        uint32_t *class_count,
+        FILETIME *last_write);
+
+static LSTATUS WINAPI hook_RegEnumKeyExW(
+        HKEY handle,
+        uint32_t index,
+        wchar_t *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        wchar_t *class_,
+        uint32_t *class_count,
+        FILETIME *last_write);
+
+static LSTATUS WINAPI hook_RegEnumValueA(
+        HKEY handle,
+        uint32_t index,
+        char *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS WINAPI hook_RegEnumValueW(
+        HKEY handle,
+        uint32_t index,
+        wchar_t *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS WINAPI hook_RegQueryInfoKeyA(
+        HKEY handle,
+        char *class_,
+        uint32_t *class_count,
+        uint32_t *reserved,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *max_class_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len,
+        uint32_t *security_desc_len,
+        FILETIME *last_write);
+
+static LSTATUS WINAPI hook_RegQueryInfoKeyW(
+        HKEY handle,
+        wchar_t *class_,
+        uint32_t *class_count,
+        uint32_t *reserved,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *max_class_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len,
+        uint32_t *security_desc_len,
+        FILETIME *last_write);
+
+static LSTATUS WINAPI hook_RegGetValueA(
+        HKEY handle,
+        const char *subkey,
+        const char *name,
+        uint32_t flags,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS WINAPI hook_RegGetValueW(
+        HKEY handle,
+        const wchar_t *subkey,
+        const wchar_t *name,
+        uint32_t flags,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS WINAPI hook_RegNotifyChangeKeyValue(
+        HKEY handle,
+        BOOL subtree,
+        uint32_t filter,
+        HANDLE event,
+        BOOL async);
+
 /* Link pointers */
 
+static LSTATUS (WINAPI *next_RegOpenKeyExA)(
+        HKEY parent,
+        const char *name,
+        uint32_t flags,
+        uint32_t access,
+        HKEY *out);
+
 static LSTATUS (WINAPI *next_RegOpenKeyExW)(
         HKEY parent,
         const wchar_t *name,
@@ -98,6 +360,17 @@ static LSTATUS (WINAPI *next_RegOpenKeyExW)(
         uint32_t access,
         HKEY *out);
 
+static LSTATUS (WINAPI *next_RegCreateKeyExA)(
+        HKEY parent,
+        const char *name,
+        uint32_t reserved,
+        const char *class_,
+        uint32_t options,
+        uint32_t access,
+        const SECURITY_ATTRIBUTES *sa,
+        HKEY *out,
+        uint32_t *disposition);
+
 static LSTATUS (WINAPI *next_RegCreateKeyExW)(
         HKEY parent,
         const wchar_t *name,
@@ -127,6 +400,14 @@ static LSTATUS (WINAPI *next_RegQueryValueExW)(
         void *bytes,
         uint32_t *nbytes);
 
+static LSTATUS (WINAPI *next_RegSetValueExA)(
+        HKEY handle,
+        const char *name,
+        uint32_t reserved,
+        uint32_t type,
+        const void *bytes,
+        uint32_t nbytes);
+
 static LSTATUS (WINAPI *next_RegSetValueExW)(
         HKEY handle,
         const wchar_t *name,
@@ -135,11 +416,118 @@ static LSTATUS (WINAPI *next_RegSetValueExW)(
         const void *bytes,
         uint32_t nbytes);
 
+static LSTATUS (WINAPI *next_RegDeleteValueA)(HKEY handle, const char *name);
+
+static LSTATUS (WINAPI *next_RegDeleteValueW)(
+        HKEY handle,
+        const wchar_t *name);
+
+static LSTATUS (WINAPI *next_RegEnumKeyExA)(
+        HKEY handle,
+        uint32_t index,
+        char *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        char *class_,
+        uint32_t *class_count,
+        FILETIME *last_write);
+
+static LSTATUS (WINAPI *next_RegEnumKeyExW)(
+        HKEY handle,
+        uint32_t index,
+        wchar_t *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        wchar_t *class_,
+        uint32_t *class_count,
+        FILETIME *last_write);
+
+static LSTATUS (WINAPI *next_RegEnumValueA)(
+        HKEY handle,
+        uint32_t index,
+        char *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS (WINAPI *next_RegEnumValueW)(
+        HKEY handle,
+        uint32_t index,
+        wchar_t *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS (WINAPI *next_RegQueryInfoKeyA)(
+        HKEY handle,
+        char *class_,
+        uint32_t *class_count,
+        uint32_t *reserved,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *max_class_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len,
+        uint32_t *security_desc_len,
+        FILETIME *last_write);
+
+static LSTATUS (WINAPI *next_RegQueryInfoKeyW)(
+        HKEY handle,
+        wchar_t *class_,
+        uint32_t *class_count,
+        uint32_t *reserved,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *max_class_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len,
+        uint32_t *security_desc_len,
+        FILETIME *last_write);
+
+static LSTATUS (WINAPI *next_RegGetValueA)(
+        HKEY handle,
+        const char *subkey,
+        const char *name,
+        uint32_t flags,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS (WINAPI *next_RegGetValueW)(
+        HKEY handle,
+        const wchar_t *subkey,
+        const wchar_t *name,
+        uint32_t flags,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes);
+
+static LSTATUS (WINAPI *next_RegNotifyChangeKeyValue)(
+        HKEY handle,
+        BOOL subtree,
+        uint32_t filter,
+        HANDLE event,
+        BOOL async);
+
 static const struct hook_symbol reg_hook_syms[] = {
     {
+        .name   = "RegOpenKeyExA",
+        .patch  = hook_RegOpenKeyExA,
+        .link   = (void **) &next_RegOpenKeyExA,
+    }, {
         .name   = "RegOpenKeyExW",
         .patch  = hook_RegOpenKeyExW,
         .link   = (void **) &next_RegOpenKeyExW,
+    }, {
+        .name   = "RegCreateKeyExA",
+        .patch  = hook_RegCreateKeyExA,
+        .link   = (void **) &next_RegCreateKeyExA,
     }, {
         .name   = "RegCreateKeyExW",
         .patch  = hook_RegCreateKeyExW,
@@ -156,17 +544,67 @@ static const struct hook_symbol reg_hook_syms[] = {
         .name   = "RegQueryValueExW",
         .patch  = hook_RegQueryValueExW,
         .link   = (void **) &next_RegQueryValueExW,
+    }, {
+        .name   = "RegSetValueExA",
+        .patch  = hook_RegSetValueExA,
+        .link   = (void **) &next_RegSetValueExA,
     }, {
         .name   = "RegSetValueExW",
         .patch  = hook_RegSetValueExW,
         .link   = (void **) &next_RegSetValueExW,
+    }, {
+        .name   = "RegDeleteValueA",
+        .patch  = hook_RegDeleteValueA,
+        .link   = (void **) &next_RegDeleteValueA,
+    }, {
+        .name   = "RegDeleteValueW",
+        .patch  = hook_RegDeleteValueW,
+        .link   = (void **) &next_RegDeleteValueW,
+    }, {
+        .name   = "RegEnumKeyExA",
+        .patch  = hook_RegEnumKeyExA,
+        .link   = (void **) &next_RegEnumKeyExA,
+    }, {
+        .name   = "RegEnumKeyExW",
+        .patch  = hook_RegEnumKeyExW,
+        .link   = (void **) &next_RegEnumKeyExW,
+    }, {
+        .name   = "RegEnumValueA",
+        .patch  = hook_RegEnumValueA,
+        .link   = (void **) &next_RegEnumValueA,
+    }, {
+        .name   = "RegEnumValueW",
+        .patch  = hook_RegEnumValueW,
+        .link   = (void **) &next_RegEnumValueW,
+    }, {
+        .name   = "RegQueryInfoKeyA",
+        .patch  = hook_RegQueryInfoKeyA,
+        .link   = (void **) &next_RegQueryInfoKeyA,
+    }, {
+        .name   = "RegQueryInfoKeyW",
+        .patch  = hook_RegQueryInfoKeyW,
+        .link   = (void **) &next_RegQueryInfoKeyW,
+    }, {
+        .name   = "RegGetValueA",
+        .patch  = hook_RegGetValueA,
+        .link   = (void **) &next_RegGetValueA,
+    }, {
+        .name   = "RegGetValueW",
+        .patch  = hook_RegGetValueW,
+        .link   = (void **) &next_RegGetValueW,
+    }, {
+        .name   = "RegNotifyChangeKeyValue",
+        .patch  = hook_RegNotifyChangeKeyValue,
+        .link   = (void **) &next_RegNotifyChangeKeyValue,
     }
 };
 
 static bool reg_hook_initted;
-static CRITICAL_SECTION reg_hook_lock;
+static SRWLOCK reg_hook_lock = SRWLOCK_INIT;
 static struct reg_hook_key *reg_hook_keys;
 static size_t reg_hook_nkeys;
+static struct reg_hook_handle *reg_hook_handles[REG_HOOK_HANDLE_BUCKETS];
+static uintptr_t reg_hook_next_handle = REG_HOOK_HANDLE_BASE;
 
 HRESULT reg_hook_push_key(
         HKEY root,
@@ -175,7 +613,7 @@ HRESULT reg_hook_push_key(
         size_t nvals)
 {
     struct reg_hook_key *new_mem;
-    struct reg_hook_key *new_key;
+    struct reg_hook_key new_key;
     HRESULT hr;
 
     assert(root != NULL);
@@ -184,24 +622,32 @@ HRESULT reg_hook_push_key(
 
     reg_hook_init();
 
-    EnterCriticalSection(&reg_hook_lock);
+    memset(&new_key, 0, sizeof(new_key));
+    new_key.root = root;
+    new_key.name = name; /* Expect this to be statically allocated */
+    new_key.vals = vals;
+    new_key.nvals = nvals;
+
+    hr = reg_hook_index_key(&new_key);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
 
     new_mem = realloc(
             reg_hook_keys,
             (reg_hook_nkeys + 1) * sizeof(struct reg_hook_key));
 
     if (new_mem == NULL) {
+        free(new_key.index);
         hr = E_OUTOFMEMORY;
 
         goto end;
     }
 
-    new_key = &new_mem[reg_hook_nkeys];
-    memset(new_key, 0, sizeof(*new_key));
-    new_key->root = root;
-    new_key->name = name; /* Expect this to be statically allocated */
-    new_key->vals = vals;
-    new_key->nvals = nvals;
+    new_mem[reg_hook_nkeys] = new_key;
 
     reg_hook_keys = new_mem;
     reg_hook_nkeys++;
@@ -209,7 +655,7 @@ HRESULT reg_hook_push_key(
     hr = S_OK;
 
 end:
-    LeaveCriticalSection(&reg_hook_lock);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
 
     return hr;
 }
@@ -221,9 +667,8 @@ static void reg_hook_init(void)
     }
 
     reg_hook_initted = true;
-    InitializeCriticalSection(&reg_hook_lock);
 
-    hook_table_apply(
+    iat_hook_push(
             NULL,
             "advapi32.dll",
             reg_hook_syms,
@@ -241,133 +686,568 @@ static LRESULT reg_hook_propagate_hr(HRESULT hr)
     }
 }
 
-static struct reg_hook_key *reg_hook_match_key_locked(HKEY handle)
+static uint32_t reg_hook_hash_name(const wchar_t *name)
 {
-    struct reg_hook_key *key;
-    size_t i;
+    uint32_t hash;
 
-    if (handle == NULL || handle == INVALID_HANDLE_VALUE) {
-        return NULL;
-    }
+    /* FNV-1a over the case-folded name, since registry value names are
+       case-insensitive. */
 
-    for (i = 0 ; i < reg_hook_nkeys ; i++) {
-        key = &reg_hook_keys[i];
+    hash = 0x811C9DC5;
 
-        if (key->handle == handle) {
-            return key;
-        }
+    for (; *name != L'\0' ; name++) {
+        hash ^= (uint32_t) towlower(*name);
+        hash *= 0x01000193;
     }
 
-    return NULL;
+    return hash;
 }
 
-static const struct reg_hook_val *reg_hook_match_val_locked(
-        struct reg_hook_key *key,
-        const wchar_t *name)
+static HRESULT reg_hook_index_key(struct reg_hook_key *key)
 {
-    const struct reg_hook_val *val;
+    size_t index_size;
     size_t i;
+    size_t j;
 
-    /* Watch out for accesses to the key's default value */
+    if (key->nvals == 0) {
+        return S_OK;
+    }
 
-    if (name == NULL) {
-        name = L"";
+    if (key->nvals >= UINT16_MAX) {
+        return E_INVALIDARG;
+    }
+
+    /* Open-addressed table of (value index + 1), kept at most half full so
+       that probe sequences stay short. Zero marks an empty slot. */
+
+    index_size = 4;
+
+    while (index_size < key->nvals * 2) {
+        index_size *= 2;
+    }
+
+    key->index = calloc(index_size, sizeof(*key->index));
+
+    if (key->index == NULL) {
+        return E_OUTOFMEMORY;
     }
 
+    key->index_size = index_size;
+
     for (i = 0 ; i < key->nvals ; i++) {
-        val = &key->vals[i];
+        j = reg_hook_hash_name(key->vals[i].name) & (index_size - 1);
 
-        if (wstr_ieq(val->name, name)) {
-            return val;
+        while (key->index[j] != 0) {
+            j = (j + 1) & (index_size - 1);
         }
+
+        key->index[j] = (uint16_t) (i + 1);
     }
 
-    return NULL;
+    return S_OK;
 }
 
-static LSTATUS reg_hook_open_locked(
-        HKEY parent,
-        const wchar_t *name,
-        HKEY *out)
+static size_t reg_hook_handle_bucket(HKEY handle)
 {
-    struct reg_hook_key *key;
-    LSTATUS err;
-    size_t i;
+    /* Kernel handles and our own are multiples of four */
 
-    *out = NULL;
+    return ((uintptr_t) handle >> 2) % REG_HOOK_HANDLE_BUCKETS;
+}
 
-    for (i = 0 ; i < reg_hook_nkeys ; i++) {
-        /* Assume reg keys are referenced from a root key and not from some
-           intermediary key */
-        key = &reg_hook_keys[i];
+static struct reg_hook_handle *reg_hook_match_handle_locked(HKEY handle)
+{
+    struct reg_hook_handle *h;
 
-        if (key->root == parent && wstr_ieq(key->name, name)) {
-            break;
+    h = reg_hook_handles[reg_hook_handle_bucket(handle)];
+
+    for (; h != NULL ; h = h->next) {
+        if (h->handle == handle) {
+            return h;
         }
     }
 
-    /* (Bail out if we didn't find anything; this causes the open/create call
-       to be passed onward down the hook chain) */
+    return NULL;
+}
+
+static LSTATUS reg_hook_backing(HKEY handle, HKEY *out)
+{
+    struct reg_hook_handle *h;
+    wchar_t path[REG_HOOK_MAX_PATH];
+    HKEY backing;
+    HKEY root;
+    LSTATUS err;
+
+    /* Find a real key to stand in for `handle`, which is `handle` itself
+       unless it is one of ours. The real key is opened the first time it is
+       asked for, outside the lock. It is the key at the same path if there
+       is one and HKLM\SOFTWARE otherwise, and it is closed together with
+       the virtual key. Opening it calls advapi32 directly, since our own
+       imports aren't hooked and the game might not import RegOpenKeyExW. */
+
+    *out = handle;
+
+    AcquireSRWLockShared(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
 
-    if (i >= reg_hook_nkeys) {
         return ERROR_SUCCESS;
     }
 
-    /* Assume only one handle will be open at a time */
+    backing = h->backing;
+    root = h->root;
 
-    if (key->handle != NULL) {
-        return ERROR_SHARING_VIOLATION;
+    if (!reg_hook_join_path(path, h->path, L"")) {
+        path[0] = L'\0';
     }
 
-    /* Open a unique HKEY handle that we can use to identify accesses to
-       this virtual registry key. We open a read-only handle to an arbitrary
-       registry key that we can reliably assume exists and isn't one of the
-       hardcoded root handles. HKLM\SOFTWARE will suffice for this purpose. */
+    ReleaseSRWLockShared(&reg_hook_lock);
 
-    err = next_RegOpenKeyExW(
-            HKEY_LOCAL_MACHINE,
-            L"SOFTWARE",
-            0,
-            KEY_READ,
-            out);
+    if (backing != NULL) {
+        *out = backing;
 
-    if (err == ERROR_SUCCESS) {
-        key->handle = *out;
+        return ERROR_SUCCESS;
     }
 
-    return err;
-}
+    err = ERROR_FILE_NOT_FOUND;
 
-static LSTATUS WINAPI hook_RegOpenKeyExW(
-        HKEY parent,
-        const wchar_t *name,
-        uint32_t flags,
-        uint32_t access,
-        HKEY *out)
-{
-    LSTATUS err;
+    if (path[0] != L'\0') {
+        err = RegOpenKeyExW(root, path, 0, KEY_READ, &backing);
+    }
 
-    if (out == NULL) {
-        return ERROR_INVALID_PARAMETER;
+    if (err != ERROR_SUCCESS) {
+        err = RegOpenKeyExW(
+                HKEY_LOCAL_MACHINE,
+                L"SOFTWARE",
+                0,
+                KEY_READ,
+                &backing);
     }
 
-    EnterCriticalSection(&reg_hook_lock);
-    err = reg_hook_open_locked(parent, name, out);
-    LeaveCriticalSection(&reg_hook_lock);
+    if (err != ERROR_SUCCESS) {
+        dprintf("Registry: Failed to open backing key for %S: %i\n",
+                path,
+                (int) err);
 
-    if (err == ERROR_SUCCESS) {
-        if (*out != NULL) {
-            //dprintf("Registry: Opened virtual key %S\n", name);
-        } else {
-            err = next_RegOpenKeyExW(parent, name, flags, access, out);
-        }
+        return err;
     }
 
-    return err;
-}
+    /* Another thread may have raced us to it, or closed the handle */
 
-static LSTATUS WINAPI hook_RegCreateKeyExW(
-        HKEY parent,
+    AcquireSRWLockExclusive(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        err = ERROR_INVALID_HANDLE;
+    } else if (h->backing == NULL) {
+        h->backing = backing;
+        *out = backing;
+        backing = NULL;
+    } else {
+        *out = h->backing;
+    }
+
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    if (backing != NULL) {
+        RegCloseKey(backing);
+    }
+
+    return err;
+}
+
+static struct reg_hook_key *reg_hook_handle_key(
+        const struct reg_hook_handle *h)
+{
+    if (h->key == REG_HOOK_NO_KEY) {
+        return NULL;
+    }
+
+    return &reg_hook_keys[h->key];
+}
+
+static const struct reg_hook_val *reg_hook_match_val_locked(
+        struct reg_hook_key *key,
+        const wchar_t *name)
+{
+    const struct reg_hook_val *val;
+    uint16_t pos;
+    size_t j;
+
+    /* Watch out for accesses to the key's default value */
+
+    if (name == NULL) {
+        name = L"";
+    }
+
+    if (key->index == NULL) {
+        return NULL;
+    }
+
+    j = reg_hook_hash_name(name) & (key->index_size - 1);
+
+    for (;;) {
+        pos = key->index[j];
+
+        if (pos == 0) {
+            return NULL;
+        }
+
+        val = &key->vals[pos - 1];
+
+        if (wstr_ieq(val->name, name)) {
+            return val;
+        }
+
+        j = (j + 1) & (key->index_size - 1);
+    }
+}
+
+static bool reg_hook_join_path(
+        wchar_t *path,
+        const wchar_t *dir,
+        const wchar_t *name)
+{
+    size_t dir_len;
+    size_t name_len;
+    size_t sep;
+
+    /* Build `dir\name` in a REG_HOOK_MAX_PATH buffer, leaving out the
+       backslash if either half is empty. The lengths are checked up front
+       since the secure CRT copies raise the invalid parameter handler when
+       they overflow instead of just failing. */
+
+    dir_len = wcslen(dir);
+    name_len = wcslen(name);
+    sep = dir_len > 0 && name_len > 0 ? 1 : 0;
+
+    if (dir_len + sep + name_len >= REG_HOOK_MAX_PATH) {
+        return false;
+    }
+
+    memcpy(path, dir, dir_len * sizeof(wchar_t));
+
+    if (sep) {
+        path[dir_len] = L'\\';
+    }
+
+    memcpy(path + dir_len + sep, name, (name_len + 1) * sizeof(wchar_t));
+
+    return true;
+}
+
+static LSTATUS reg_hook_open_locked(
+        HKEY parent,
+        const wchar_t *name,
+        bool create,
+        wchar_t *path,
+        HKEY *next_parent,
+        HKEY *out,
+        uint32_t *disposition)
+{
+    const struct reg_hook_handle *ph;
+    struct reg_hive_key *hive_root;
+    struct reg_hive_key *hive;
+    HKEY root;
+    size_t key;
+    size_t i;
+
+    /* `path` has room for REG_HOOK_MAX_PATH characters. If we leave *out
+       NULL then the call is passed onward down the hook chain, as a call
+       relative to *next_parent. That is either the caller's own parent key
+       (with the caller's name) or a root key, in which case `path` holds the
+       full path of the requested key. */
+
+    *out = NULL;
+    *next_parent = parent;
+
+    if (name == NULL) {
+        name = L"";
+    }
+
+    /* Resolve the full path of the requested key. Opens relative to one of
+       our own keys are resolved from the root that key lives under. */
+
+    ph = reg_hook_match_handle_locked(parent);
+
+    if (ph != NULL) {
+        root = ph->root;
+
+        if (!reg_hook_join_path(path, ph->path, name)) {
+            return ERROR_FILENAME_EXCED_RANGE;
+        }
+
+        *next_parent = root;
+    } else {
+        root = parent;
+
+        /* Too long to be one of ours, let the real registry judge it */
+
+        if (!reg_hook_join_path(path, L"", name)) {
+            return ERROR_SUCCESS;
+        }
+    }
+
+    key = REG_HOOK_NO_KEY;
+
+    for (i = 0 ; i < reg_hook_nkeys ; i++) {
+        /* Callback keys are matched on their full path from a root key */
+
+        if (    reg_hook_keys[i].root == root &&
+                wstr_ieq(reg_hook_keys[i].name, path)) {
+            key = i;
+
+            break;
+        }
+    }
+
+    /* Only keys that the hive defines, and anything underneath them, are
+       virtual. The keys above them (like HKLM\SOFTWARE) and keys that
+       simply aren't in the hive stay real. */
+
+    hive_root = reg_hive_root(root);
+    hive = NULL;
+
+    if (hive_root != NULL && reg_hive_covers(hive_root, path)) {
+        hive = reg_hive_find(hive_root, path, false, NULL);
+
+        if (hive == NULL && create) {
+            hive = reg_hive_find(hive_root, path, true, NULL);
+
+            if (hive == NULL) {
+                return ERROR_OUTOFMEMORY;
+            }
+
+            hive->defined = true;
+            reg_hive_journal_append_key(hive);
+
+            if (disposition != NULL) {
+                *disposition = REG_CREATED_NEW_KEY;
+            }
+        } else if (hive != NULL && disposition != NULL) {
+            *disposition = REG_OPENED_EXISTING_KEY;
+        }
+    }
+
+    if (key == REG_HOOK_NO_KEY && hive == NULL) {
+        return ERROR_SUCCESS;
+    }
+
+    if (hive == NULL && disposition != NULL) {
+        *disposition = REG_OPENED_EXISTING_KEY;
+    }
+
+    return reg_hook_alloc_handle_locked(root, path, key, hive, out);
+}
+
+static LSTATUS reg_hook_alloc_handle_locked(
+        HKEY root,
+        const wchar_t *path,
+        size_t key,
+        struct reg_hive_key *hive,
+        HKEY *out)
+{
+    struct reg_hook_handle *h;
+    uintptr_t value;
+    size_t bucket;
+
+    h = calloc(1, sizeof(*h));
+
+    if (h == NULL) {
+        return ERROR_OUTOFMEMORY;
+    }
+
+    h->path = _wcsdup(path);
+
+    if (h->path == NULL) {
+        free(h);
+
+        return ERROR_OUTOFMEMORY;
+    }
+
+    /* Hand out the next free synthetic handle. Wrapping around would take
+       hundreds of millions of opens, but skip anything still open if so. */
+
+    do {
+        value = reg_hook_next_handle;
+        reg_hook_next_handle += 4;
+
+        if (reg_hook_next_handle > REG_HOOK_HANDLE_END) {
+            reg_hook_next_handle = REG_HOOK_HANDLE_BASE;
+        }
+    } while (reg_hook_match_handle_locked((HKEY) value) != NULL);
+
+    h->handle = (HKEY) value;
+    h->root = root;
+    h->key = key;
+    h->hive = hive;
+
+    bucket = reg_hook_handle_bucket(h->handle);
+    h->next = reg_hook_handles[bucket];
+    reg_hook_handles[bucket] = h;
+
+    *out = h->handle;
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS WINAPI hook_RegOpenKeyExA(
+        HKEY parent,
+        const char *name,
+        uint32_t flags,
+        uint32_t access,
+        HKEY *out)
+{
+    wchar_t path[REG_HOOK_MAX_PATH];
+    wchar_t *name_w;
+    HKEY next_parent;
+    LSTATUS err;
+
+    if (out == NULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    err = reg_hook_widen(name, &name_w);
+
+    if (err != ERROR_SUCCESS) {
+        return err;
+    }
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+    err = reg_hook_open_locked(
+            parent,
+            name_w,
+            false,
+            path,
+            &next_parent,
+            out,
+            NULL);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    if (err == ERROR_SUCCESS && *out == NULL) {
+        if (next_parent != parent) {
+            err = next_RegOpenKeyExW(next_parent, path, flags, access, out);
+        } else {
+            err = next_RegOpenKeyExA(parent, name, flags, access, out);
+        }
+    }
+
+    free(name_w);
+
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegOpenKeyExW(
+        HKEY parent,
+        const wchar_t *name,
+        uint32_t flags,
+        uint32_t access,
+        HKEY *out)
+{
+    wchar_t path[REG_HOOK_MAX_PATH];
+    HKEY next_parent;
+    LSTATUS err;
+
+    if (out == NULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+    err = reg_hook_open_locked(
+            parent,
+            name,
+            false,
+            path,
+            &next_parent,
+            out,
+            NULL);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    if (err == ERROR_SUCCESS) {
+        if (*out != NULL) {
+            //dprintf("Registry: Opened virtual key %S\n", name);
+        } else if (next_parent != parent) {
+            err = next_RegOpenKeyExW(next_parent, path, flags, access, out);
+        } else {
+            err = next_RegOpenKeyExW(parent, name, flags, access, out);
+        }
+    }
+
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegCreateKeyExA(
+        HKEY parent,
+        const char *name,
+        uint32_t reserved,
+        const char *class_,
+        uint32_t options,
+        uint32_t access,
+        const SECURITY_ATTRIBUTES *sa,
+        HKEY *out,
+        uint32_t *disposition)
+{
+    wchar_t path[REG_HOOK_MAX_PATH];
+    wchar_t *name_w;
+    HKEY next_parent;
+    LSTATUS err;
+
+    if (out == NULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    err = reg_hook_widen(name, &name_w);
+
+    if (err != ERROR_SUCCESS) {
+        return err;
+    }
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+    err = reg_hook_open_locked(
+            parent,
+            name_w,
+            true,
+            path,
+            &next_parent,
+            out,
+            disposition);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    if (err == ERROR_SUCCESS && *out == NULL && next_parent != parent) {
+        /* Class names are not preserved on this path; nothing uses them */
+        err = next_RegCreateKeyExW(
+                next_parent,
+                path,
+                reserved,
+                NULL,
+                options,
+                access,
+                sa,
+                out,
+                disposition);
+    } else if (err == ERROR_SUCCESS && *out == NULL) {
+        err = next_RegCreateKeyExA(
+                parent,
+                name,
+                reserved,
+                class_,
+                options,
+                access,
+                sa,
+                out,
+                disposition);
+    }
+
+    free(name_w);
+
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegCreateKeyExW(
+        HKEY parent,
         const wchar_t *name,
         uint32_t reserved,
         const wchar_t *class_,
@@ -377,19 +1257,39 @@ static LSTATUS WINAPI hook_RegCreateKeyExW(
         HKEY *out,
         uint32_t *disposition)
 {
+    wchar_t path[REG_HOOK_MAX_PATH];
+    HKEY next_parent;
     LSTATUS err;
 
     if (out == NULL) {
         return ERROR_INVALID_PARAMETER;
     }
 
-    EnterCriticalSection(&reg_hook_lock);
-    err = reg_hook_open_locked(parent, name, out);
-    LeaveCriticalSection(&reg_hook_lock);
+    AcquireSRWLockExclusive(&reg_hook_lock);
+    err = reg_hook_open_locked(
+            parent,
+            name,
+            true,
+            path,
+            &next_parent,
+            out,
+            disposition);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
 
     if (err == ERROR_SUCCESS) {
         if (*out != NULL) {
             //dprintf("Registry: Created virtual key %S\n", name);
+        } else if (next_parent != parent) {
+            err = next_RegCreateKeyExW(
+                    next_parent,
+                    path,
+                    reserved,
+                    class_,
+                    options,
+                    access,
+                    sa,
+                    out,
+                    disposition);
         } else {
             err = next_RegCreateKeyExW(
                     parent,
@@ -409,23 +1309,40 @@ static LSTATUS WINAPI hook_RegCreateKeyExW(
 
 static LSTATUS WINAPI hook_RegCloseKey(HKEY handle)
 {
-    struct reg_hook_key *key;
-    size_t i;
+    struct reg_hook_handle **link;
+    struct reg_hook_handle *h;
 
-    EnterCriticalSection(&reg_hook_lock);
+    /* Virtual keys only have a real key behind them if something asked for
+       one, and the synthetic handle itself means nothing to advapi32. */
 
-    for (i = 0 ; i < reg_hook_nkeys ; i++) {
-        key = &reg_hook_keys[i];
+    AcquireSRWLockExclusive(&reg_hook_lock);
 
-        if (key->handle == handle) {
-            //dprintf("Registry: Closed virtual key %S\n", key->name);
-            key->handle = NULL;
+    h = NULL;
+    link = &reg_hook_handles[reg_hook_handle_bucket(handle)];
+
+    for (; *link != NULL ; link = &(*link)->next) {
+        if ((*link)->handle == handle) {
+            h = *link;
+            *link = h->next;
+
+            break;
         }
     }
 
-    LeaveCriticalSection(&reg_hook_lock);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    if (h == NULL) {
+        return next_RegCloseKey(handle);
+    }
+
+    if (h->backing != NULL) {
+        RegCloseKey(h->backing);
+    }
+
+    free(h->path);
+    free(h);
 
-    return next_RegCloseKey(handle);
+    return ERROR_SUCCESS;
 }
 
 static LSTATUS WINAPI hook_RegQueryValueExW(
@@ -436,17 +1353,20 @@ static LSTATUS WINAPI hook_RegQueryValueExW(
         void *bytes,
         uint32_t *nbytes)
 {
-    struct reg_hook_key *key;
+    struct reg_hook_handle *h;
     LSTATUS err;
 
-    EnterCriticalSection(&reg_hook_lock);
+    /* Queries only take the lock in shared mode, so read handlers may run
+       concurrently on several threads. Writes are still serialized. */
+
+    AcquireSRWLockShared(&reg_hook_lock);
 
-    key = reg_hook_match_key_locked(handle);
+    h = reg_hook_match_handle_locked(handle);
 
     /* Check if this is a virtualized registry key */
 
-    if (key == NULL) {
-        LeaveCriticalSection(&reg_hook_lock);
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
 
         return next_RegQueryValueExW(
                 handle,
@@ -460,9 +1380,9 @@ static LSTATUS WINAPI hook_RegQueryValueExW(
     /* Call the factored out core of this function because RegQueryValueExA
        has to be a blight upon my existence */
 
-    err = reg_hook_query_val_locked(key, name, type, bytes, nbytes);
+    err = reg_hook_query_val_locked(h, name, type, bytes, nbytes);
 
-    LeaveCriticalSection(&reg_hook_lock);
+    ReleaseSRWLockShared(&reg_hook_lock);
 
     return err;
 }
@@ -479,12 +1399,11 @@ static LSTATUS WINAPI hook_RegQueryValueExA(
 {
     /* _s: sizeof, _c: _countof(), _w: widened */
 
-    struct reg_hook_key *key;
+    struct reg_hook_handle *h;
     wchar_t *name_w;
     size_t name_c;
     wchar_t *content;
     uint32_t content_s;
-    size_t content_c;
     uint32_t type_site;
     LSTATUS err;
 
@@ -503,11 +1422,11 @@ static LSTATUS WINAPI hook_RegQueryValueExA(
 
     /* Look up key handle, early exit if no match */
 
-    EnterCriticalSection(&reg_hook_lock);
-    key = reg_hook_match_key_locked(handle);
+    AcquireSRWLockShared(&reg_hook_lock);
+    h = reg_hook_match_handle_locked(handle);
 
-    if (key == NULL) {
-        LeaveCriticalSection(&reg_hook_lock);
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
 
         return next_RegQueryValueExA(
                 handle,
@@ -536,26 +1455,23 @@ static LSTATUS WINAPI hook_RegQueryValueExA(
        pass through if they don't. */
 
     if (bytes == NULL && nbytes == NULL) {
-        err = reg_hook_query_val_locked(key, name_w, type, NULL, NULL);
+        err = reg_hook_query_val_locked(h, name_w, type, NULL, NULL);
 
         goto end;
     }
 
-    /* Next, we need to check the key type to see if it's REG_SZ. */
+    /* Next, we need to check the value type to see if it's a string. */
 
-    err = reg_hook_query_val_locked(key, name_w, type, NULL, NULL);
+    err = reg_hook_query_val_locked(h, name_w, type, NULL, NULL);
 
     if (err != ERROR_SUCCESS) {
         goto end;
     }
 
-    /* If it is not REG_SZ then pass the content directly.
-       (We ignore the REG_MULTI_SZ case here). */
-
-    assert(*type != REG_MULTI_SZ);
+    /* If it is not a string of some sort then pass the content directly. */
 
-    if (*type != REG_SZ) {
-        err = reg_hook_query_val_locked(key, name_w, type, bytes, nbytes);
+    if (!reg_hook_is_string_type(*type)) {
+        err = reg_hook_query_val_locked(h, name_w, type, bytes, nbytes);
 
         goto end;
     }
@@ -564,7 +1480,7 @@ static LSTATUS WINAPI hook_RegQueryValueExA(
        character length of the value (hopefully said value does not change
        under our feet, of course). */
 
-    err = reg_hook_query_val_locked(key, name_w, type, NULL, &content_s);
+    err = reg_hook_query_val_locked(h, name_w, type, NULL, &content_s);
 
     if (err != ERROR_SUCCESS) {
         goto end;
@@ -584,40 +1500,20 @@ static LSTATUS WINAPI hook_RegQueryValueExA(
 
     /* Get the data... */
 
-    err = reg_hook_query_val_locked(key, name_w, type, content, &content_s);
+    err = reg_hook_query_val_locked(h, name_w, type, content, &content_s);
 
     if (err != ERROR_SUCCESS) {
         goto end;
     }
 
-    /* Now size the corresponding narrow form and return it to the caller */
-
-    wcstombs_s(&content_c, NULL, 0, content, 0);
-
-    if (bytes != NULL) {
-        if (nbytes == NULL) {
-            err = ERROR_INVALID_PARAMETER;
-
-            goto end;
-        }
-
-        if (*nbytes < content_c) {
-            err = ERROR_MORE_DATA;
-
-            goto end;
-        }
-
-        wcstombs_s(NULL, bytes, *nbytes, content, content_c - 1);
-    }
-
-    if (nbytes != NULL) { /* It really should be, based on earlier checks ... */
-        *nbytes = content_c;
-    }
+    /* Now narrow it into the caller's buffer. REG_SZ, REG_EXPAND_SZ and
+       REG_MULTI_SZ all go through the ANSI code page the same way, embedded
+       NULs and all. */
 
-    err = ERROR_SUCCESS;
+    err = reg_hook_narrow_data(*type, content, content_s, bytes, nbytes);
 
 end:
-    LeaveCriticalSection(&reg_hook_lock);
+    ReleaseSRWLockShared(&reg_hook_lock);
 
     free(content);
     free(name_w);
@@ -626,17 +1522,21 @@ end:
 }
 
 static LSTATUS reg_hook_query_val_locked(
-        struct reg_hook_key *key,
+        const struct reg_hook_handle *h,
         const wchar_t *name,
         uint32_t *type,
         void *bytes,
         uint32_t *nbytes)
 {
+    struct reg_hook_key *key;
     const struct reg_hook_val *val;
+    const struct reg_hive_val *hive_val;
     LSTATUS err;
     HRESULT hr;
 
-    val = reg_hook_match_val_locked(key, name);
+    key = reg_hook_handle_key(h);
+    val = key != NULL ? reg_hook_match_val_locked(key, name) : NULL;
+    hive_val = h->hive != NULL ? reg_hive_find_val(h->hive, name) : NULL;
 
     if (val != NULL) {
         if (type != NULL) {
@@ -648,15 +1548,88 @@ static LSTATUS reg_hook_query_val_locked(
             err = reg_hook_propagate_hr(hr);
         } else {
             dprintf("Registry: %S: Val %S has no read handler\n",
-                    key->name,
+                    h->path,
                     name);
 
             err = ERROR_ACCESS_DENIED;
         }
-    } else {
-        dprintf("Registry: Key %S: Val %S not found\n", key->name, name);
-        err = ERROR_FILE_NOT_FOUND;
-    }
+    } else if (hive_val != NULL) {
+        if (type != NULL) {
+            *type = hive_val->type;
+        }
+
+        hr = reg_hook_read_bin(
+                bytes,
+                nbytes,
+                hive_val->bytes,
+                hive_val->nbytes);
+        err = reg_hook_propagate_hr(hr);
+    } else {
+        dprintf("Registry: Key %S: Val %S not found\n", h->path, name);
+        err = ERROR_FILE_NOT_FOUND;
+    }
+
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegSetValueExA(
+        HKEY handle,
+        const char *name,
+        uint32_t reserved,
+        uint32_t type,
+        const void *bytes,
+        uint32_t nbytes)
+{
+    struct reg_hook_handle *h;
+    wchar_t *name_w;
+    void *bytes_w;
+    uint32_t nbytes_w;
+    LSTATUS err;
+
+    name_w = NULL;
+    bytes_w = NULL;
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockExclusive(&reg_hook_lock);
+
+        return next_RegSetValueExA(
+                handle,
+                name,
+                reserved,
+                type,
+                bytes,
+                nbytes);
+    }
+
+    err = reg_hook_widen(name, &name_w);
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    if (bytes == NULL && nbytes != 0) {
+        err = ERROR_INVALID_PARAMETER;
+
+        goto end;
+    }
+
+    err = reg_hook_widen_data(type, bytes, nbytes, &bytes_w, &nbytes_w);
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    err = reg_hook_set_val_locked(h, name_w, type, bytes_w, nbytes_w);
+
+end:
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    free(bytes_w);
+    free(name_w);
 
     return err;
 }
@@ -669,17 +1642,15 @@ static LSTATUS WINAPI hook_RegSetValueExW(
         const void *bytes,
         uint32_t nbytes)
 {
-    struct reg_hook_key *key;
-    const struct reg_hook_val *val;
+    struct reg_hook_handle *h;
     LSTATUS err;
-    HRESULT hr;
 
-    EnterCriticalSection(&reg_hook_lock);
+    AcquireSRWLockExclusive(&reg_hook_lock);
 
-    key = reg_hook_match_key_locked(handle);
+    h = reg_hook_match_handle_locked(handle);
 
-    if (key == NULL) {
-        LeaveCriticalSection(&reg_hook_lock);
+    if (h == NULL) {
+        ReleaseSRWLockExclusive(&reg_hook_lock);
 
         return next_RegSetValueExW(
                 handle,
@@ -690,14 +1661,39 @@ static LSTATUS WINAPI hook_RegSetValueExW(
                 nbytes);
     }
 
-    val = reg_hook_match_val_locked(key, name);
+    if (bytes == NULL && nbytes != 0) {
+        err = ERROR_INVALID_PARAMETER;
+    } else {
+        err = reg_hook_set_val_locked(h, name, type, bytes, nbytes);
+    }
+
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    return err;
+}
+
+static LSTATUS reg_hook_set_val_locked(
+        const struct reg_hook_handle *h,
+        const wchar_t *name,
+        uint32_t type,
+        const void *bytes,
+        uint32_t nbytes)
+{
+    struct reg_hook_key *key;
+    const struct reg_hook_val *val;
+    struct reg_hive_val *hive_val;
+    LSTATUS err;
+    HRESULT hr;
+
+    key = reg_hook_handle_key(h);
+    val = key != NULL ? reg_hook_match_val_locked(key, name) : NULL;
 
     if (val != NULL) {
         if (val->write != NULL) {
             if (type != val->type) {
                 dprintf(        "Registry: Key %S: Val %S: Type mismatch "
                                 "(expected %i got %i)\n",
-                        key->name,
+                        h->path,
                         name,
                         val->type,
                         type);
@@ -705,7 +1701,7 @@ static LSTATUS WINAPI hook_RegSetValueExW(
                 err = ERROR_ACCESS_DENIED;
             } else {
                 dprintf("Registry: Write virtual key %S value %S\n",
-                        key->name,
+                        h->path,
                         val->name);
 
                 hr = val->write(bytes, nbytes);
@@ -717,16 +1713,1248 @@ static LSTATUS WINAPI hook_RegSetValueExW(
 
             err = ERROR_SUCCESS;
         }
+    } else if (h->hive != NULL) {
+        hr = reg_hive_set_val(h->hive, name, type, bytes, nbytes);
+
+        if (SUCCEEDED(hr)) {
+            hive_val = reg_hive_find_val(h->hive, name);
+            reg_hive_journal_append(h->hive, hive_val);
+        }
+
+        err = reg_hook_propagate_hr(hr);
     } else {
-        dprintf("Registry: Key %S: Val %S not found\n", key->name, name);
+        dprintf("Registry: Key %S: Val %S not found\n", h->path, name);
         err = ERROR_FILE_NOT_FOUND;
     }
 
-    LeaveCriticalSection(&reg_hook_lock);
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegDeleteValueA(HKEY handle, const char *name)
+{
+    struct reg_hook_handle *h;
+    wchar_t *name_w;
+    LSTATUS err;
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockExclusive(&reg_hook_lock);
+
+        return next_RegDeleteValueA(handle, name);
+    }
+
+    err = reg_hook_widen(name, &name_w);
+
+    if (err == ERROR_SUCCESS) {
+        err = reg_hook_delete_val_locked(h, name_w);
+    }
+
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    free(name_w);
+
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegDeleteValueW(HKEY handle, const wchar_t *name)
+{
+    struct reg_hook_handle *h;
+    LSTATUS err;
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockExclusive(&reg_hook_lock);
+
+        return next_RegDeleteValueW(handle, name);
+    }
+
+    err = reg_hook_delete_val_locked(h, name);
+
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    return err;
+}
+
+static LSTATUS reg_hook_delete_val_locked(
+        const struct reg_hook_handle *h,
+        const wchar_t *name)
+{
+    struct reg_hook_key *key;
+
+    if (name == NULL) {
+        name = L"";
+    }
+
+    /* Callback values can't go away, hive values are journalled as deleted */
+
+    key = reg_hook_handle_key(h);
+
+    if (key != NULL && reg_hook_match_val_locked(key, name) != NULL) {
+        return ERROR_ACCESS_DENIED;
+    }
+
+    if (h->hive == NULL || reg_hive_find_val(h->hive, name) == NULL) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+
+    reg_hive_delete_val(h->hive, name);
+    reg_hive_journal_append_delete(h->hive, name);
+
+    return ERROR_SUCCESS;
+}
+
+static bool reg_hook_enum_val_locked(
+        const struct reg_hook_handle *h,
+        uint32_t index,
+        const struct reg_hook_val **val,
+        const struct reg_hive_val **hive_val)
+{
+    struct reg_hook_key *key;
+    size_t i;
+
+    /* Callback values come first, followed by any hive values that they do
+       not shadow. */
+
+    *val = NULL;
+    *hive_val = NULL;
+    key = reg_hook_handle_key(h);
+
+    if (key != NULL) {
+        if (index < key->nvals) {
+            *val = &key->vals[index];
+
+            return true;
+        }
+
+        index -= key->nvals;
+    }
+
+    if (h->hive == NULL) {
+        return false;
+    }
+
+    for (i = 0 ; i < h->hive->nvals ; i++) {
+        if (    key != NULL &&
+                reg_hook_match_val_locked(key, h->hive->vals[i].name) != NULL) {
+            continue;
+        }
+
+        if (index == 0) {
+            *hive_val = &h->hive->vals[i];
+
+            return true;
+        }
+
+        index--;
+    }
+
+    return false;
+}
+
+static HRESULT reg_hook_read_enum_val(
+        const struct reg_hook_val *val,
+        const struct reg_hive_val *hive_val,
+        void *bytes,
+        uint32_t *nbytes)
+{
+    if (val == NULL) {
+        return reg_hook_read_bin(
+                bytes,
+                nbytes,
+                hive_val->bytes,
+                hive_val->nbytes);
+    } else if (val->read != NULL) {
+        return val->read(bytes, nbytes);
+    } else {
+        return reg_hook_read_bin(bytes, nbytes, NULL, 0);
+    }
+}
+
+static LSTATUS reg_hook_copy_name(
+        const wchar_t *src,
+        wchar_t *dest,
+        uint32_t *ndest)
+{
+    size_t len;
+
+    if (dest == NULL || ndest == NULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    /* Counts are in characters; on success the count excludes the NUL */
+
+    len = wcslen(src);
+
+    if (*ndest <= len) {
+        return ERROR_MORE_DATA;
+    }
+
+    memcpy(dest, src, (len + 1) * sizeof(wchar_t));
+    *ndest = (uint32_t) len;
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS reg_hook_copy_name_a(
+        const wchar_t *src,
+        char *dest,
+        uint32_t *ndest)
+{
+    int len;
+
+    if (dest == NULL || ndest == NULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    /* Same as above, but narrowed to the ANSI code page like advapi32 */
+
+    len = WideCharToMultiByte(CP_ACP, 0, src, -1, NULL, 0, NULL, NULL);
+
+    if (len <= 0) {
+        return GetLastError();
+    }
+
+    if (*ndest < (uint32_t) len) {
+        return ERROR_MORE_DATA;
+    }
+
+    WideCharToMultiByte(CP_ACP, 0, src, -1, dest, len, NULL, NULL);
+    *ndest = (uint32_t) len - 1;
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS WINAPI hook_RegEnumKeyExA(
+        HKEY handle,
+        uint32_t index,
+        char *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        char *class_,
+        uint32_t *class_count,
+        FILETIME *last_write)
+{
+    struct reg_hook_handle *h;
+    LSTATUS err;
+
+    AcquireSRWLockShared(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
+
+        return next_RegEnumKeyExA(
+                handle,
+                index,
+                name,
+                name_count,
+                reserved,
+                class_,
+                class_count,
+                last_write);
+    }
+
+    if (h->hive == NULL || index >= h->hive->nchildren) {
+        err = ERROR_NO_MORE_ITEMS;
+
+        goto end;
+    }
+
+    err = reg_hook_copy_name_a(
+            h->hive->children[index]->name,
+            name,
+            name_count);
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    if (class_ != NULL && class_count != NULL && *class_count > 0) {
+        class_[0] = '\0';
+    }
+
+    if (class_count != NULL) {
+        *class_count = 0;
+    }
+
+    if (last_write != NULL) {
+        memset(last_write, 0, sizeof(*last_write));
+    }
+
+end:
+    ReleaseSRWLockShared(&reg_hook_lock);
+
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegEnumKeyExW(
+        HKEY handle,
+        uint32_t index,
+        wchar_t *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        wchar_t *class_,
+        uint32_t *class_count,
+        FILETIME *last_write)
+{
+    struct reg_hook_handle *h;
+    LSTATUS err;
+
+    AcquireSRWLockShared(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
+
+        return next_RegEnumKeyExW(
+                handle,
+                index,
+                name,
+                name_count,
+                reserved,
+                class_,
+                class_count,
+                last_write);
+    }
+
+    if (h->hive == NULL || index >= h->hive->nchildren) {
+        err = ERROR_NO_MORE_ITEMS;
+
+        goto end;
+    }
+
+    err = reg_hook_copy_name(h->hive->children[index]->name, name, name_count);
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    if (class_ != NULL && class_count != NULL && *class_count > 0) {
+        class_[0] = L'\0';
+    }
+
+    if (class_count != NULL) {
+        *class_count = 0;
+    }
+
+    if (last_write != NULL) {
+        memset(last_write, 0, sizeof(*last_write));
+    }
+
+end:
+    ReleaseSRWLockShared(&reg_hook_lock);
 
     return err;
 }
 
+static LSTATUS WINAPI hook_RegEnumValueA(
+        HKEY handle,
+        uint32_t index,
+        char *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes)
+{
+    struct reg_hook_handle *h;
+    const struct reg_hook_val *val;
+    const struct reg_hive_val *hive_val;
+    void *content;
+    uint32_t content_s;
+    uint32_t val_type;
+    LSTATUS err;
+    HRESULT hr;
+
+    content = NULL;
+
+    AcquireSRWLockShared(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
+
+        return next_RegEnumValueA(
+                handle,
+                index,
+                name,
+                name_count,
+                reserved,
+                type,
+                bytes,
+                nbytes);
+    }
+
+    if (!reg_hook_enum_val_locked(h, index, &val, &hive_val)) {
+        err = ERROR_NO_MORE_ITEMS;
+
+        goto end;
+    }
+
+    err = reg_hook_copy_name_a(
+            val != NULL ? val->name : hive_val->name,
+            name,
+            name_count);
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    val_type = val != NULL ? val->type : hive_val->type;
+
+    if (type != NULL) {
+        *type = val_type;
+    }
+
+    if (bytes == NULL && nbytes == NULL) {
+        goto end;
+    }
+
+    /* Fetch the wide content in full, then narrow it into the caller's
+       buffer. Strings change length on the way, so this has to happen even
+       if the caller only wants to know the size. */
+
+    hr = reg_hook_read_enum_val(val, hive_val, NULL, &content_s);
+
+    if (FAILED(hr)) {
+        err = reg_hook_propagate_hr(hr);
+
+        goto end;
+    }
+
+    content = malloc(content_s != 0 ? content_s : 1);
+
+    if (content == NULL) {
+        err = ERROR_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    hr = reg_hook_read_enum_val(val, hive_val, content, &content_s);
+
+    if (FAILED(hr)) {
+        err = reg_hook_propagate_hr(hr);
+
+        goto end;
+    }
+
+    err = reg_hook_narrow_data(val_type, content, content_s, bytes, nbytes);
+
+end:
+    ReleaseSRWLockShared(&reg_hook_lock);
+
+    free(content);
+
+    return err;
+}
+
+static LSTATUS WINAPI hook_RegEnumValueW(
+        HKEY handle,
+        uint32_t index,
+        wchar_t *name,
+        uint32_t *name_count,
+        uint32_t *reserved,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes)
+{
+    struct reg_hook_handle *h;
+    const struct reg_hook_val *val;
+    const struct reg_hive_val *hive_val;
+    LSTATUS err;
+    HRESULT hr;
+
+    AcquireSRWLockShared(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
+
+        return next_RegEnumValueW(
+                handle,
+                index,
+                name,
+                name_count,
+                reserved,
+                type,
+                bytes,
+                nbytes);
+    }
+
+    if (!reg_hook_enum_val_locked(h, index, &val, &hive_val)) {
+        err = ERROR_NO_MORE_ITEMS;
+
+        goto end;
+    }
+
+    err = reg_hook_copy_name(
+            val != NULL ? val->name : hive_val->name,
+            name,
+            name_count);
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    if (type != NULL) {
+        *type = val != NULL ? val->type : hive_val->type;
+    }
+
+    hr = reg_hook_read_enum_val(val, hive_val, bytes, nbytes);
+    err = reg_hook_propagate_hr(hr);
+
+end:
+    ReleaseSRWLockShared(&reg_hook_lock);
+
+    return err;
+}
+
+static void reg_hook_query_info_locked(
+        const struct reg_hook_handle *h,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len)
+{
+    const struct reg_hook_val *val;
+    const struct reg_hive_val *hive_val;
+    uint32_t max_name;
+    uint32_t max_len;
+    uint32_t len;
+    uint32_t i;
+
+    /* Subkeys */
+
+    max_name = 0;
+
+    for (i = 0 ; h->hive != NULL && i < h->hive->nchildren ; i++) {
+        len = (uint32_t) wcslen(h->hive->children[i]->name);
+
+        if (max_name < len) {
+            max_name = len;
+        }
+    }
+
+    if (nsubkeys != NULL) {
+        *nsubkeys = h->hive != NULL ? (uint32_t) h->hive->nchildren : 0;
+    }
+
+    if (max_subkey_len != NULL) {
+        *max_subkey_len = max_name;
+    }
+
+    /* Values */
+
+    max_name = 0;
+    max_len = 0;
+
+    for (i = 0 ; reg_hook_enum_val_locked(h, i, &val, &hive_val) ; i++) {
+        if (val != NULL) {
+            len = (uint32_t) wcslen(val->name);
+
+            if (max_name < len) {
+                max_name = len;
+            }
+
+            len = 0;
+
+            if (val->read != NULL && SUCCEEDED(val->read(NULL, &len))) {
+                if (max_len < len) {
+                    max_len = len;
+                }
+            }
+        } else {
+            len = (uint32_t) wcslen(hive_val->name);
+
+            if (max_name < len) {
+                max_name = len;
+            }
+
+            if (max_len < hive_val->nbytes) {
+                max_len = hive_val->nbytes;
+            }
+        }
+    }
+
+    if (nvals != NULL) {
+        *nvals = i;
+    }
+
+    if (max_val_name_len != NULL) {
+        *max_val_name_len = max_name;
+    }
+
+    if (max_val_len != NULL) {
+        *max_val_len = max_len;
+    }
+}
+
+static LSTATUS WINAPI hook_RegQueryInfoKeyA(
+        HKEY handle,
+        char *class_,
+        uint32_t *class_count,
+        uint32_t *reserved,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *max_class_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len,
+        uint32_t *security_desc_len,
+        FILETIME *last_write)
+{
+    struct reg_hook_handle *h;
+
+    AcquireSRWLockShared(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
+
+        return next_RegQueryInfoKeyA(
+                handle,
+                class_,
+                class_count,
+                reserved,
+                nsubkeys,
+                max_subkey_len,
+                max_class_len,
+                nvals,
+                max_val_name_len,
+                max_val_len,
+                security_desc_len,
+                last_write);
+    }
+
+    /* Wide lengths are an upper bound on the narrowed ones, which is all
+       that callers use them for. */
+
+    reg_hook_query_info_locked(
+            h,
+            nsubkeys,
+            max_subkey_len,
+            nvals,
+            max_val_name_len,
+            max_val_len);
+
+    ReleaseSRWLockShared(&reg_hook_lock);
+
+    if (class_ != NULL && class_count != NULL && *class_count > 0) {
+        class_[0] = '\0';
+    }
+
+    if (class_count != NULL) {
+        *class_count = 0;
+    }
+
+    if (max_class_len != NULL) {
+        *max_class_len = 0;
+    }
+
+    if (security_desc_len != NULL) {
+        *security_desc_len = 0;
+    }
+
+    if (last_write != NULL) {
+        memset(last_write, 0, sizeof(*last_write));
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS WINAPI hook_RegQueryInfoKeyW(
+        HKEY handle,
+        wchar_t *class_,
+        uint32_t *class_count,
+        uint32_t *reserved,
+        uint32_t *nsubkeys,
+        uint32_t *max_subkey_len,
+        uint32_t *max_class_len,
+        uint32_t *nvals,
+        uint32_t *max_val_name_len,
+        uint32_t *max_val_len,
+        uint32_t *security_desc_len,
+        FILETIME *last_write)
+{
+    struct reg_hook_handle *h;
+
+    AcquireSRWLockShared(&reg_hook_lock);
+
+    h = reg_hook_match_handle_locked(handle);
+
+    if (h == NULL) {
+        ReleaseSRWLockShared(&reg_hook_lock);
+
+        return next_RegQueryInfoKeyW(
+                handle,
+                class_,
+                class_count,
+                reserved,
+                nsubkeys,
+                max_subkey_len,
+                max_class_len,
+                nvals,
+                max_val_name_len,
+                max_val_len,
+                security_desc_len,
+                last_write);
+    }
+
+    reg_hook_query_info_locked(
+            h,
+            nsubkeys,
+            max_subkey_len,
+            nvals,
+            max_val_name_len,
+            max_val_len);
+
+    ReleaseSRWLockShared(&reg_hook_lock);
+
+    if (class_ != NULL && class_count != NULL && *class_count > 0) {
+        class_[0] = L'\0';
+    }
+
+    if (class_count != NULL) {
+        *class_count = 0;
+    }
+
+    if (max_class_len != NULL) {
+        *max_class_len = 0;
+    }
+
+    if (security_desc_len != NULL) {
+        *security_desc_len = 0;
+    }
+
+    if (last_write != NULL) {
+        memset(last_write, 0, sizeof(*last_write));
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS WINAPI hook_RegGetValueA(
+        HKEY handle,
+        const char *subkey,
+        const char *name,
+        uint32_t flags,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes)
+{
+    wchar_t path[REG_HOOK_MAX_PATH];
+    char path_a[REG_HOOK_MAX_PATH * 2];
+    wchar_t *subkey_w;
+    HKEY next_parent;
+    HKEY key;
+    LSTATUS err;
+
+    err = reg_hook_widen(subkey, &subkey_w);
+
+    if (err != ERROR_SUCCESS) {
+        return err;
+    }
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+    err = reg_hook_open_locked(
+            handle,
+            subkey_w,
+            false,
+            path,
+            &next_parent,
+            &key,
+            NULL);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    free(subkey_w);
+
+    if (err != ERROR_SUCCESS) {
+        return err;
+    }
+
+    if (key != NULL) {
+        err = reg_hook_get_val(key, name, true, flags, type, bytes, nbytes);
+        hook_RegCloseKey(key);
+
+        return err;
+    }
+
+    if (next_parent == handle) {
+        return next_RegGetValueA(
+                handle,
+                subkey,
+                name,
+                flags,
+                type,
+                bytes,
+                nbytes);
+    }
+
+    /* A real key under one of ours. Only the A function is sure to be
+       linked, so hand it the full path from the root in the ANSI code
+       page. */
+
+    if (WideCharToMultiByte(
+            CP_ACP,
+            0,
+            path,
+            -1,
+            path_a,
+            sizeof(path_a),
+            NULL,
+            NULL) == 0) {
+        return GetLastError();
+    }
+
+    return next_RegGetValueA(
+            next_parent,
+            path_a,
+            name,
+            flags,
+            type,
+            bytes,
+            nbytes);
+}
+
+static LSTATUS WINAPI hook_RegGetValueW(
+        HKEY handle,
+        const wchar_t *subkey,
+        const wchar_t *name,
+        uint32_t flags,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes)
+{
+    wchar_t path[REG_HOOK_MAX_PATH];
+    HKEY next_parent;
+    HKEY key;
+    LSTATUS err;
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+    err = reg_hook_open_locked(
+            handle,
+            subkey,
+            false,
+            path,
+            &next_parent,
+            &key,
+            NULL);
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    if (err != ERROR_SUCCESS) {
+        return err;
+    }
+
+    if (key != NULL) {
+        err = reg_hook_get_val(key, name, false, flags, type, bytes, nbytes);
+        hook_RegCloseKey(key);
+
+        return err;
+    }
+
+    if (next_parent != handle) {
+        return next_RegGetValueW(
+                next_parent,
+                path,
+                name,
+                flags,
+                type,
+                bytes,
+                nbytes);
+    }
+
+    return next_RegGetValueW(handle, subkey, name, flags, type, bytes, nbytes);
+}
+
+static LSTATUS reg_hook_get_val(
+        HKEY handle,
+        const void *name,
+        bool ansi,
+        uint32_t flags,
+        uint32_t *type,
+        void *bytes,
+        uint32_t *nbytes)
+{
+    uint32_t val_type;
+    uint32_t avail;
+    uint32_t size;
+    void *expanded;
+    void *data;
+    DWORD nchars;
+    LSTATUS err;
+
+    /* RegGetValue on a virtual key: read the value through our own
+       RegQueryValueEx, then apply RegGetValue's type restrictions and
+       expansion on top of it. */
+
+    data = NULL;
+    expanded = NULL;
+    avail = nbytes != NULL ? *nbytes : 0;
+
+    if (bytes != NULL && nbytes == NULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if ((flags & RRF_RT_REG_EXPAND_SZ) && !(flags & RRF_NOEXPAND)) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    if (ansi) {
+        err = hook_RegQueryValueExA(handle, name, NULL, &val_type, NULL, &size);
+    } else {
+        err = hook_RegQueryValueExW(handle, name, NULL, &val_type, NULL, &size);
+    }
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    /* Leave room to terminate string data before expanding it */
+
+    data = calloc(size + sizeof(wchar_t), 1);
+
+    if (data == NULL) {
+        err = ERROR_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    if (ansi) {
+        err = hook_RegQueryValueExA(handle, name, NULL, &val_type, data, &size);
+    } else {
+        err = hook_RegQueryValueExW(handle, name, NULL, &val_type, data, &size);
+    }
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    if (val_type == REG_EXPAND_SZ && !(flags & RRF_NOEXPAND)) {
+        if (ansi) {
+            nchars = ExpandEnvironmentStringsA(data, NULL, 0);
+            size = nchars;
+        } else {
+            nchars = ExpandEnvironmentStringsW(data, NULL, 0);
+            size = nchars * sizeof(wchar_t);
+        }
+
+        if (nchars == 0) {
+            err = GetLastError();
+
+            goto end;
+        }
+
+        expanded = malloc(size);
+
+        if (expanded == NULL) {
+            err = ERROR_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        if (ansi) {
+            ExpandEnvironmentStringsA(data, expanded, nchars);
+        } else {
+            ExpandEnvironmentStringsW(data, expanded, nchars);
+        }
+
+        free(data);
+        data = expanded;
+        expanded = NULL;
+        val_type = REG_SZ;
+    }
+
+    err = reg_hook_check_get_type(val_type, size, flags);
+
+    if (err != ERROR_SUCCESS) {
+        goto end;
+    }
+
+    if (bytes != NULL && avail < size) {
+        err = ERROR_MORE_DATA;
+    } else if (bytes != NULL) {
+        memcpy(bytes, data, size);
+    }
+
+    if (type != NULL) {
+        *type = val_type;
+    }
+
+    if (nbytes != NULL) {
+        *nbytes = size;
+    }
+
+end:
+    if (    err != ERROR_SUCCESS &&
+            (flags & RRF_ZEROONFAILURE) &&
+            bytes != NULL) {
+        memset(bytes, 0, avail);
+    }
+
+    free(expanded);
+    free(data);
+
+    return err;
+}
+
+static LSTATUS reg_hook_check_get_type(
+        uint32_t type,
+        uint32_t nbytes,
+        uint32_t flags)
+{
+    uint32_t mask;
+    uint32_t expect;
+
+    switch (type) {
+    case REG_NONE:      mask = RRF_RT_REG_NONE; break;
+    case REG_SZ:        mask = RRF_RT_REG_SZ; break;
+    case REG_EXPAND_SZ: mask = RRF_RT_REG_EXPAND_SZ; break;
+    case REG_BINARY:    mask = RRF_RT_REG_BINARY; break;
+    case REG_DWORD:     mask = RRF_RT_REG_DWORD; break;
+    case REG_MULTI_SZ:  mask = RRF_RT_REG_MULTI_SZ; break;
+    case REG_QWORD:     mask = RRF_RT_REG_QWORD; break;
+    default:            mask = 0; break;
+    }
+
+    if (!(flags & mask)) {
+        return ERROR_UNSUPPORTED_TYPE;
+    }
+
+    /* RRF_RT_DWORD and RRF_RT_QWORD also admit REG_BINARY of that size */
+
+    expect = 0;
+
+    if ((flags & RRF_RT_ANY) == RRF_RT_DWORD) {
+        expect = sizeof(uint32_t);
+    } else if ((flags & RRF_RT_ANY) == RRF_RT_QWORD) {
+        expect = sizeof(uint64_t);
+    }
+
+    if (type == REG_BINARY && expect != 0 && nbytes != expect) {
+        return ERROR_DATATYPE_MISMATCH;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS WINAPI hook_RegNotifyChangeKeyValue(
+        HKEY handle,
+        BOOL subtree,
+        uint32_t filter,
+        HANDLE event,
+        BOOL async)
+{
+    HKEY backing;
+    LSTATUS err;
+
+    /* Virtual keys never change behind the game's back, so watch whatever
+       real key stands in for them. */
+
+    err = reg_hook_backing(handle, &backing);
+
+    if (err != ERROR_SUCCESS) {
+        return err;
+    }
+
+    return next_RegNotifyChangeKeyValue(backing, subtree, filter, event, async);
+}
+
+static LSTATUS reg_hook_widen(const char *src, wchar_t **out)
+{
+    wchar_t *dest;
+    int nchars;
+
+    /* NULL stays NULL, since that means something to most registry calls */
+
+    *out = NULL;
+
+    if (src == NULL) {
+        return ERROR_SUCCESS;
+    }
+
+    nchars = MultiByteToWideChar(CP_ACP, 0, src, -1, NULL, 0);
+
+    if (nchars <= 0) {
+        return GetLastError();
+    }
+
+    dest = malloc(nchars * sizeof(wchar_t));
+
+    if (dest == NULL) {
+        return ERROR_OUTOFMEMORY;
+    }
+
+    MultiByteToWideChar(CP_ACP, 0, src, -1, dest, nchars);
+    *out = dest;
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS reg_hook_widen_data(
+        uint32_t type,
+        const void *src,
+        uint32_t src_nbytes,
+        void **out,
+        uint32_t *out_nbytes)
+{
+    wchar_t *dest;
+    int nchars;
+
+    /* String data passed to the A functions is in the ANSI code page. Convert
+       every byte, embedded NULs included, so that REG_MULTI_SZ survives. */
+
+    *out = NULL;
+    *out_nbytes = 0;
+
+    if (!reg_hook_is_string_type(type)) {
+        if (src_nbytes == 0) {
+            return ERROR_SUCCESS;
+        }
+
+        *out = malloc(src_nbytes);
+
+        if (*out == NULL) {
+            return ERROR_OUTOFMEMORY;
+        }
+
+        memcpy(*out, src, src_nbytes);
+        *out_nbytes = src_nbytes;
+
+        return ERROR_SUCCESS;
+    }
+
+    if (src_nbytes == 0) {
+        return ERROR_SUCCESS;
+    }
+
+    nchars = MultiByteToWideChar(CP_ACP, 0, src, src_nbytes, NULL, 0);
+
+    if (nchars <= 0) {
+        return GetLastError();
+    }
+
+    dest = malloc(nchars * sizeof(wchar_t));
+
+    if (dest == NULL) {
+        return ERROR_OUTOFMEMORY;
+    }
+
+    MultiByteToWideChar(CP_ACP, 0, src, src_nbytes, dest, nchars);
+
+    *out = dest;
+    *out_nbytes = nchars * sizeof(wchar_t);
+
+    return ERROR_SUCCESS;
+}
+
+static LSTATUS reg_hook_narrow_data(
+        uint32_t type,
+        const void *src,
+        uint32_t src_nbytes,
+        void *bytes,
+        uint32_t *nbytes)
+{
+    int len;
+
+    if (!reg_hook_is_string_type(type)) {
+        return reg_hook_propagate_hr(
+                reg_hook_read_bin(bytes, nbytes, src, src_nbytes));
+    }
+
+    len = 0;
+
+    if (src_nbytes >= sizeof(wchar_t)) {
+        len = WideCharToMultiByte(
+                CP_ACP,
+                0,
+                src,
+                src_nbytes / sizeof(wchar_t),
+                NULL,
+                0,
+                NULL,
+                NULL);
+    }
+
+    if (bytes != NULL) {
+        if (nbytes == NULL) {
+            return ERROR_INVALID_PARAMETER;
+        }
+
+        if (*nbytes < (uint32_t) len) {
+            *nbytes = len;
+
+            return ERROR_MORE_DATA;
+        }
+
+        if (len > 0) {
+            WideCharToMultiByte(
+                    CP_ACP,
+                    0,
+                    src,
+                    src_nbytes / sizeof(wchar_t),
+                    bytes,
+                    len,
+                    NULL,
+                    NULL);
+        }
+    }
+
+    if (nbytes != NULL) {
+        *nbytes = len;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+static bool reg_hook_is_string_type(uint32_t type)
+{
+    return type == REG_SZ || type == REG_EXPAND_SZ || type == REG_MULTI_SZ;
+}
+
+HRESULT reg_hook_hive_init(const struct reg_config *cfg)
+{
+    HRESULT hr;
+
+    assert(cfg != NULL);
+
+    if (!cfg->enable || cfg->path[0] == L'\0') {
+        return S_FALSE;
+    }
+
+    reg_hook_init();
+
+    /* Only called during startup, before the game has a chance to touch the
+       registry, but take the lock anyway for consistency. */
+
+    AcquireSRWLockExclusive(&reg_hook_lock);
+
+    hr = reg_hive_load_file(cfg->path);
+
+    if (FAILED(hr)) {
+        dprintf("Registry: %S: Error loading registry file: %x\n",
+                cfg->path,
+                (int) hr);
+    } else if (cfg->journal[0] != L'\0') {
+        hr = reg_hive_journal_open(cfg->journal);
+    }
+
+    ReleaseSRWLockExclusive(&reg_hook_lock);
+
+    return hr;
+}
+
 HRESULT reg_hook_read_bin(
         void *bytes,
         uint32_t *nbytes,
@@ -2,9 +2,16 @@
 
 #include <windows.h>
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+struct reg_config {
+    bool enable;
+    wchar_t path[MAX_PATH];
+    wchar_t journal[MAX_PATH];
+};
+
 struct reg_hook_val {
     const wchar_t *name;
     HRESULT (*read)(void *bytes, uint32_t *nbytes);
@@ -18,6 +25,15 @@ HRESULT reg_hook_push_key(
         const struct reg_hook_val *vals,
         size_t nvals);
 
+/* Load a .reg file into an in-memory hive that serves opens, queries,
+   enumeration and writes for the keys it contains, and for anything below
+   them, without touching the real registry. Keys above those (the hive only
+   holds them as paths) and keys outside the hive go to the real registry.
+   Keys registered with reg_hook_push_key() take precedence over hive keys
+   with the same path. */
+
+HRESULT reg_hook_hive_init(const struct reg_config *cfg);
+
 HRESULT reg_hook_read_bin(
         void *bytes,
         uint32_t *nbytes,
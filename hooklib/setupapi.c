@@ -4,22 +4,65 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
 #include "hooklib/setupapi.h"
 
 #include "util/dprintf.h"
 
+/* Maximum number of device info sets with phantom members that can be open
+   at the same time. Must be a power of two. */
+
+#define SETUPAPI_MAX_SETS 64
+
+/* Marks a set table slot whose set has been destroyed */
+
+#define SETUPAPI_SET_DEAD ((HDEVINFO) (intptr_t) -2)
+
+/* Everything SetupDiGetDeviceInterfaceDetailW needs is worked out when the
+   device is registered. A pointer to this struct goes in the Reserved field
+   of the SP_DEVICE_INTERFACE_DATA that we hand out for it. */
+
+struct setupapi_dev {
+    const wchar_t *path;
+    size_t nbytes_path;
+    DWORD nbytes_detail;
+};
+
+/* Phantom devices sharing an interface class GUID. These occupy the first
+   member indexes of any device info set opened for that GUID; the set's real
+   members follow on after them. */
+
 struct setupapi_class {
     const GUID *guid;
-    const wchar_t *path;
-    HDEVINFO cur_handle;
+    struct setupapi_dev **devs;
+    size_t ndevs;
+};
+
+/* Open addressed on the set handle, with linear probing. A NULL handle marks
+   an empty slot. Classes are kept by index, since the class array moves
+   whenever it grows. */
+
+struct setupapi_set {
+    HDEVINFO handle;
+    size_t class_;
 };
 
 static void setupapi_hook_init(void);
+static struct setupapi_class *setupapi_find_class_locked(const GUID *guid);
+static size_t setupapi_hash_set(HDEVINFO handle);
+static bool setupapi_set_insert_locked(HDEVINFO handle, size_t class_);
+static const struct setupapi_class *setupapi_set_lookup_locked(
+        HDEVINFO handle);
+static void setupapi_set_remove_locked(HDEVINFO handle);
+static const struct setupapi_dev *setupapi_class_find_dev_locked(
+        const struct setupapi_class *class_,
+        ULONG_PTR reserved);
 
 /* API hooks */
 
@@ -94,14 +137,17 @@ static const struct hook_symbol setupapi_syms[] = {
 };
 
 static bool setupapi_initted;
-static CRITICAL_SECTION setupapi_lock;
+static SRWLOCK setupapi_lock = SRWLOCK_INIT;
 static struct setupapi_class *setupapi_classes;
 static size_t setupapi_nclasses;
+static struct setupapi_set setupapi_sets[SETUPAPI_MAX_SETS];
 
 HRESULT setupapi_add_phantom_dev(const GUID *iface_class, const wchar_t *path)
 {
     struct setupapi_class *class_;
     struct setupapi_class *new_array;
+    struct setupapi_dev **new_devs;
+    struct setupapi_dev *dev;
     HRESULT hr;
 
     assert(iface_class != NULL);
@@ -109,27 +155,59 @@ HRESULT setupapi_add_phantom_dev(const GUID *iface_class, const wchar_t *path)
 
     setupapi_hook_init();
 
-    EnterCriticalSection(&setupapi_lock);
+    dev = malloc(sizeof(*dev));
+
+    if (dev == NULL) {
+        return E_OUTOFMEMORY;
+    }
 
-    new_array = realloc(
-            setupapi_classes,
-            (setupapi_nclasses + 1) * sizeof(struct setupapi_class));
+    dev->path = path;
+    dev->nbytes_path = (wcslen(path) + 1) * sizeof(wchar_t);
+    dev->nbytes_detail = (DWORD) (
+            offsetof(SP_DEVICE_INTERFACE_DETAIL_DATA_W, DevicePath) +
+            dev->nbytes_path);
 
-    if (new_array == NULL) {
+    AcquireSRWLockExclusive(&setupapi_lock);
+
+    class_ = setupapi_find_class_locked(iface_class);
+
+    if (class_ == NULL) {
+        new_array = realloc(
+                setupapi_classes,
+                (setupapi_nclasses + 1) * sizeof(struct setupapi_class));
+
+        if (new_array == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        setupapi_classes = new_array;
+
+        class_ = &setupapi_classes[setupapi_nclasses++];
+        class_->guid = iface_class;
+        class_->devs = NULL;
+        class_->ndevs = 0;
+    }
+
+    new_devs = realloc(
+            class_->devs,
+            (class_->ndevs + 1) * sizeof(struct setupapi_dev *));
+
+    if (new_devs == NULL) {
         hr = E_OUTOFMEMORY;
 
         goto end;
     }
 
-    setupapi_classes = new_array;
-
-    class_ = &setupapi_classes[setupapi_nclasses++];
-    class_->guid = iface_class;
-    class_->path = path;
+    class_->devs = new_devs;
+    class_->devs[class_->ndevs++] = dev;
+    dev = NULL;
     hr = S_OK;
 
 end:
-    LeaveCriticalSection(&setupapi_lock);
+    ReleaseSRWLockExclusive(&setupapi_lock);
+    free(dev);
 
     return hr;
 }
@@ -140,25 +218,141 @@ static void setupapi_hook_init(void)
         return;
     }
 
-    hook_table_apply(
+    iat_hook_push(
             NULL,
             "setupapi.dll",
             setupapi_syms,
             _countof(setupapi_syms));
 
-    InitializeCriticalSection(&setupapi_lock);
     setupapi_initted = true;
 }
 
+static struct setupapi_class *setupapi_find_class_locked(const GUID *guid)
+{
+    size_t i;
+
+    for (i = 0 ; i < setupapi_nclasses ; i++) {
+        if (memcmp(guid, setupapi_classes[i].guid, sizeof(*guid)) == 0) {
+            return &setupapi_classes[i];
+        }
+    }
+
+    return NULL;
+}
+
+static size_t setupapi_hash_set(HDEVINFO handle)
+{
+    uintptr_t value;
+
+    /* Set handles are heap pointers, so the low bits carry little entropy */
+
+    value = (uintptr_t) handle >> 4;
+
+    return (size_t) (value * 0x9E3779B1u) & (SETUPAPI_MAX_SETS - 1);
+}
+
+static bool setupapi_set_insert_locked(HDEVINFO handle, size_t class_)
+{
+    struct setupapi_set *set;
+    size_t pos;
+    size_t i;
+
+    pos = setupapi_hash_set(handle);
+
+    for (i = 0 ; i < SETUPAPI_MAX_SETS ; i++) {
+        set = &setupapi_sets[(pos + i) & (SETUPAPI_MAX_SETS - 1)];
+
+        if (    set->handle == NULL ||
+                set->handle == SETUPAPI_SET_DEAD ||
+                set->handle == handle) {
+            set->handle = handle;
+            set->class_ = class_;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static const struct setupapi_class *setupapi_set_lookup_locked(
+        HDEVINFO handle)
+{
+    const struct setupapi_set *set;
+    size_t pos;
+    size_t i;
+
+    /* The result points into the class array, so it is only good for as
+       long as the lock is held. */
+
+    pos = setupapi_hash_set(handle);
+
+    for (i = 0 ; i < SETUPAPI_MAX_SETS ; i++) {
+        set = &setupapi_sets[(pos + i) & (SETUPAPI_MAX_SETS - 1)];
+
+        if (set->handle == NULL) {
+            break;
+        }
+
+        if (set->handle == handle) {
+            return &setupapi_classes[set->class_];
+        }
+    }
+
+    return NULL;
+}
+
+static void setupapi_set_remove_locked(HDEVINFO handle)
+{
+    struct setupapi_set *set;
+    size_t pos;
+    size_t i;
+
+    pos = setupapi_hash_set(handle);
+
+    for (i = 0 ; i < SETUPAPI_MAX_SETS ; i++) {
+        set = &setupapi_sets[(pos + i) & (SETUPAPI_MAX_SETS - 1)];
+
+        if (set->handle == NULL) {
+            break;
+        }
+
+        if (set->handle == handle) {
+            set->handle = SETUPAPI_SET_DEAD;
+            set->class_ = 0;
+
+            break;
+        }
+    }
+}
+
+static const struct setupapi_dev *setupapi_class_find_dev_locked(
+        const struct setupapi_class *class_,
+        ULONG_PTR reserved)
+{
+    size_t i;
+
+    /* Reserved is opaque for real devices, so only compare it against our own
+       pointers rather than dereferencing it. */
+
+    for (i = 0 ; i < class_->ndevs ; i++) {
+        if (reserved == (ULONG_PTR) class_->devs[i]) {
+            return class_->devs[i];
+        }
+    }
+
+    return NULL;
+}
+
 static HDEVINFO WINAPI my_SetupDiGetClassDevsW(
         const GUID *ClassGuid,
         wchar_t *Enumerator,
         HWND hwndParent,
         DWORD Flags)
 {
-    struct setupapi_class *class_;
+    const struct setupapi_class *class_;
     HDEVINFO result;
-    size_t i;
+    bool ok;
 
     result = next_SetupDiGetClassDevsW(
             ClassGuid,
@@ -170,16 +364,21 @@ static HDEVINFO WINAPI my_SetupDiGetClassDevsW(
         return result;
     }
 
-    EnterCriticalSection(&setupapi_lock);
+    AcquireSRWLockExclusive(&setupapi_lock);
 
-    for (i = 0 ; i < setupapi_nclasses ; i++) {
-        class_ = &setupapi_classes[i];
-        if (memcmp(ClassGuid, class_->guid, sizeof(*ClassGuid)) == 0) {
-            class_->cur_handle = result;
-        }
+    class_ = setupapi_find_class_locked(ClassGuid);
+    ok = true;
+
+    if (class_ != NULL) {
+        ok = setupapi_set_insert_locked(result, class_ - setupapi_classes);
     }
 
-    LeaveCriticalSection(&setupapi_lock);
+    ReleaseSRWLockExclusive(&setupapi_lock);
+
+    if (!ok) {
+        dprintf("SetupAPI: Too many open device info sets, phantom devices "
+                "will not be enumerated\n");
+    }
 
     return result;
 }
@@ -192,7 +391,8 @@ static BOOL WINAPI my_SetupDiEnumDeviceInterfaces(
         SP_DEVICE_INTERFACE_DATA *DeviceInterfaceData)
 {
     const struct setupapi_class *class_;
-    size_t i;
+    const struct setupapi_dev *dev;
+    const GUID *guid;
 
     if (    DeviceInfoSet == INVALID_HANDLE_VALUE ||
             DeviceInterfaceData == NULL ||
@@ -200,38 +400,39 @@ static BOOL WINAPI my_SetupDiEnumDeviceInterfaces(
         goto pass;
     }
 
-    if (MemberIndex > 0) {
-        MemberIndex--;
+    /* Phantom devices come first, then the set's real members. Devices and
+       GUIDs stay put, so they can be used once the lock is dropped. */
 
-        goto pass;
-    }
+    dev = NULL;
+    guid = NULL;
 
-    EnterCriticalSection(&setupapi_lock);
+    AcquireSRWLockShared(&setupapi_lock);
+    class_ = setupapi_set_lookup_locked(DeviceInfoSet);
 
-    for (   i = 0, class_ = NULL ;
-            i < setupapi_nclasses && class_ == NULL ;
-            i++) {
-        if (DeviceInfoSet == setupapi_classes[i].cur_handle) {
-            class_ = &setupapi_classes[i];
-
-            dprintf("SetupAPI: Interface {%08lx-...} -> Device node %S\n",
-                    class_->guid->Data1,
-                    class_->path);
-
-            memcpy( &DeviceInterfaceData->InterfaceClassGuid,
-                    class_->guid,
-                    sizeof(GUID));
-            DeviceInterfaceData->Flags = SPINT_ACTIVE;
-            DeviceInterfaceData->Reserved = (ULONG_PTR) class_->path;
+    if (class_ != NULL) {
+        if (MemberIndex < class_->ndevs) {
+            dev = class_->devs[MemberIndex];
+            guid = class_->guid;
+        } else {
+            MemberIndex -= (DWORD) class_->ndevs;
         }
     }
 
-    LeaveCriticalSection(&setupapi_lock);
+    ReleaseSRWLockShared(&setupapi_lock);
 
-    if (class_ == NULL) {
+    if (dev == NULL) {
         goto pass;
     }
 
+    dprintf("SetupAPI: Interface {%08lx-...} #%u -> Device node %S\n",
+            guid->Data1,
+            (unsigned int) MemberIndex,
+            dev->path);
+
+    memcpy(&DeviceInterfaceData->InterfaceClassGuid, guid, sizeof(GUID));
+    DeviceInterfaceData->Flags = SPINT_ACTIVE;
+    DeviceInterfaceData->Reserved = (ULONG_PTR) dev;
+
     SetLastError(ERROR_SUCCESS);
 
     return TRUE;
@@ -253,44 +454,36 @@ static BOOL WINAPI my_SetupDiGetDeviceInterfaceDetailW(
         DWORD *RequiredSize,
         SP_DEVINFO_DATA *DeviceInfoData)
 {
-    const wchar_t *wstr;
-    size_t nbytes_wstr;
-    size_t nbytes_total;
-    size_t i;
-    bool match;
+    const struct setupapi_class *class_;
+    const struct setupapi_dev *dev;
 
     if (DeviceInfoSet == INVALID_HANDLE_VALUE || DeviceInterfaceData == NULL) {
         goto pass;
     }
 
-    EnterCriticalSection(&setupapi_lock);
+    dev = NULL;
 
-    for (   i = 0, match = false ;
-            i < setupapi_nclasses && !match ;
-            i++) {
-        if (    DeviceInfoSet == setupapi_classes[i].cur_handle &&
-                DeviceInterfaceData->Reserved == (ULONG_PTR) setupapi_classes[i].path) {
-            match = true;
-        }
+    AcquireSRWLockShared(&setupapi_lock);
+    class_ = setupapi_set_lookup_locked(DeviceInfoSet);
+
+    if (class_ != NULL) {
+        dev = setupapi_class_find_dev_locked(
+                class_,
+                DeviceInterfaceData->Reserved);
     }
 
-    LeaveCriticalSection(&setupapi_lock);
+    ReleaseSRWLockShared(&setupapi_lock);
 
-    if (!match) {
+    if (dev == NULL) {
         goto pass;
     }
 
-    wstr = (const wchar_t *) DeviceInterfaceData->Reserved;
-    nbytes_wstr = (wcslen(wstr) + 1) * sizeof(wchar_t);
-    nbytes_total  = offsetof(SP_DEVICE_INTERFACE_DETAIL_DATA_W, DevicePath);
-    nbytes_total += nbytes_wstr;
-
     if (RequiredSize != NULL) {
-        *RequiredSize = (DWORD) nbytes_total;
+        *RequiredSize = dev->nbytes_detail;
     }
 
-    if (    DeviceInterfaceDetailData == NULL &&
-            DeviceInterfaceDetailDataSize < nbytes_total) {
+    if (    DeviceInterfaceDetailData == NULL ||
+            DeviceInterfaceDetailDataSize < dev->nbytes_detail) {
         SetLastError(ERROR_INSUFFICIENT_BUFFER);
 
         return FALSE;
@@ -302,7 +495,7 @@ static BOOL WINAPI my_SetupDiGetDeviceInterfaceDetailW(
         return FALSE;
     }
 
-    memcpy(DeviceInterfaceDetailData->DevicePath, wstr, nbytes_wstr);
+    memcpy(DeviceInterfaceDetailData->DevicePath, dev->path, dev->nbytes_path);
     SetLastError(ERROR_SUCCESS);
 
     return TRUE;
@@ -319,17 +512,9 @@ pass:
 
 static BOOL WINAPI my_SetupDiDestroyDeviceInfoList(HDEVINFO DeviceInfoSet)
 {
-    size_t i;
-
-    EnterCriticalSection(&setupapi_lock);
-
-    for (i = 0 ; i < setupapi_nclasses ; i++) {
-        if (setupapi_classes[i].cur_handle == DeviceInfoSet) {
-            setupapi_classes[i].cur_handle = NULL;
-        }
-    }
-
-    LeaveCriticalSection(&setupapi_lock);
+    AcquireSRWLockExclusive(&setupapi_lock);
+    setupapi_set_remove_locked(DeviceInfoSet);
+    ReleaseSRWLockExclusive(&setupapi_lock);
 
     return next_SetupDiDestroyDeviceInfoList(DeviceInfoSet);
 }
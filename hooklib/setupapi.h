@@ -4,4 +4,8 @@
 
 #include <stddef.h>
 
+/* Add a phantom device interface to every device info set that is opened for
+   the given interface class. Any number of devices may share a class; they
+   are enumerated in the order they were added, ahead of the real devices. */
+
 HRESULT setupapi_add_phantom_dev(const GUID *iface_class, const wchar_t *path);
@@ -11,6 +11,7 @@
 #include "hooklib/spike.h"
 
 #include "util/dprintf.h"
+#include "util/ini.h"
 
 static void spike_hook_read_config(const wchar_t *spike_file);
 
@@ -159,7 +160,7 @@ void spike_hook_init(const wchar_t *ini_file)
     /* Check our INI file to see if any spikes are configured for this EXE.
        Normally we separate out config reading into a separate module... */
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"spike",
             basename,
             L"",
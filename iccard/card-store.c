@@ -0,0 +1,405 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "iccard/card-store.h"
+#include "iccard/mifare.h"
+
+#include "util/dprintf.h"
+
+static HRESULT card_store_add_file(
+        struct card_store *store,
+        const wchar_t *dir,
+        const wchar_t *name);
+
+static HRESULT card_store_map_file(
+        const wchar_t *path,
+        const uint8_t **out,
+        size_t *nbytes);
+
+static HRESULT card_store_parse_hex(
+        const wchar_t *src,
+        uint8_t *bytes,
+        size_t nbytes);
+
+static int card_store_mifare_cmp(const void *lhs, const void *rhs);
+static int card_store_felica_cmp(const void *lhs, const void *rhs);
+
+HRESULT card_store_open(struct card_store *store, const wchar_t *dir)
+{
+    WIN32_FIND_DATAW find;
+    wchar_t pattern[MAX_PATH];
+    HANDLE h;
+    HRESULT hr;
+
+    assert(store != NULL);
+    assert(dir != NULL);
+
+    memset(store, 0, sizeof(*store));
+
+    if (swprintf_s(pattern, _countof(pattern), L"%s\\*.bin", dir) < 0) {
+        return E_INVALIDARG;
+    }
+
+    h = FindFirstFileW(pattern, &find);
+
+    if (h == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        if (hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+            dprintf("Card store: %S: No card images found\n", dir);
+
+            return S_FALSE;
+        }
+
+        dprintf("Card store: %S: Error opening directory: %x\n",
+                dir,
+                (int) hr);
+
+        return hr;
+    }
+
+    do {
+        if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            continue;
+        }
+
+        hr = card_store_add_file(store, dir, find.cFileName);
+
+        if (FAILED(hr)) {
+            FindClose(h);
+
+            return hr;
+        }
+    } while (FindNextFileW(h, &find));
+
+    FindClose(h);
+
+    /* The set of images is fixed from here on, so lookups are a binary search
+       over these arrays and need no locking. */
+
+    qsort(  store->mifare,
+            store->nmifare,
+            sizeof(*store->mifare),
+            card_store_mifare_cmp);
+
+    qsort(  store->felica,
+            store->nfelica,
+            sizeof(*store->felica),
+            card_store_felica_cmp);
+
+    dprintf("Card store: %S: Mapped %i MIFARE and %i FeliCa images\n",
+            dir,
+            (int) store->nmifare,
+            (int) store->nfelica);
+
+    return S_OK;
+}
+
+static HRESULT card_store_add_file(
+        struct card_store *store,
+        const wchar_t *dir,
+        const wchar_t *name)
+{
+    struct card_store_mifare *mifare;
+    struct card_store_felica *felica;
+    wchar_t path[MAX_PATH];
+    const uint8_t *bytes;
+    uint8_t id[10];
+    size_t nbytes;
+    size_t len;
+    size_t i;
+    HRESULT hr;
+
+    /* File name stem is the card ID in hex; its length tells us the card type
+       (FindFirstFileW already guaranteed the .bin extension). */
+
+    len = wcslen(name) - 4;
+
+    if (len != 20 && len != 16) {
+        dprintf("Card store: %S: Unrecognized file name, skipping\n", name);
+
+        return S_FALSE;
+    }
+
+    hr = card_store_parse_hex(name, id, len / 2);
+
+    if (FAILED(hr)) {
+        dprintf("Card store: %S: Unrecognized file name, skipping\n", name);
+
+        return S_FALSE;
+    }
+
+    if (swprintf_s(path, _countof(path), L"%s\\%s", dir, name) < 0) {
+        return E_INVALIDARG;
+    }
+
+    hr = card_store_map_file(path, &bytes, &nbytes);
+
+    if (FAILED(hr) || hr == S_FALSE) {
+        return hr;
+    }
+
+    if (len == 20) {
+        if (nbytes != sizeof(struct mifare)) {
+            dprintf("Card store: %S: MIFARE image must be %i bytes\n",
+                    name,
+                    (int) sizeof(struct mifare));
+            UnmapViewOfFile(bytes);
+
+            return S_FALSE;
+        }
+
+        mifare = realloc(
+                store->mifare,
+                (store->nmifare + 1) * sizeof(*store->mifare));
+
+        if (mifare == NULL) {
+            UnmapViewOfFile(bytes);
+
+            return E_OUTOFMEMORY;
+        }
+
+        store->mifare = mifare;
+        mifare = &store->mifare[store->nmifare++];
+        memcpy(mifare->luid, id, sizeof(mifare->luid));
+        mifare->image = (const struct mifare *) bytes;
+    } else {
+        if (nbytes % 16 != 0) {
+            dprintf("Card store: %S: FeliCa image must be a multiple of 16 "
+                    "bytes\n",
+                    name);
+            UnmapViewOfFile(bytes);
+
+            return S_FALSE;
+        }
+
+        felica = realloc(
+                store->felica,
+                (store->nfelica + 1) * sizeof(*store->felica));
+
+        if (felica == NULL) {
+            UnmapViewOfFile(bytes);
+
+            return E_OUTOFMEMORY;
+        }
+
+        store->felica = felica;
+        felica = &store->felica[store->nfelica++];
+        felica->IDm = 0;
+
+        for (i = 0 ; i < 8 ; i++) {
+            felica->IDm = (felica->IDm << 8) | id[i];
+        }
+
+        felica->blocks = bytes;
+        felica->nblocks = nbytes / 16;
+    }
+
+    return S_OK;
+}
+
+static HRESULT card_store_map_file(
+        const wchar_t *path,
+        const uint8_t **out,
+        size_t *nbytes)
+{
+    LARGE_INTEGER size;
+    HANDLE file;
+    HANDLE mapping;
+    void *view;
+    HRESULT hr;
+    BOOL ok;
+
+    assert(path != NULL);
+    assert(out != NULL);
+    assert(nbytes != NULL);
+
+    *out = NULL;
+    *nbytes = 0;
+    mapping = NULL;
+
+    file = CreateFileW(
+            path,
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Card store: %S: Error opening image: %x\n", path, (int) hr);
+
+        goto end;
+    }
+
+    ok = GetFileSizeEx(file, &size);
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Card store: %S: GetFileSizeEx failed: %x\n", path, (int) hr);
+
+        goto end;
+    }
+
+    if (size.QuadPart == 0 || size.QuadPart > 0x100000) {
+        dprintf("Card store: %S: Implausible image size\n", path);
+        hr = S_FALSE;
+
+        goto end;
+    }
+
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mapping == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Card store: %S: CreateFileMapping failed: %x\n",
+                path,
+                (int) hr);
+
+        goto end;
+    }
+
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (view == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Card store: %S: MapViewOfFile failed: %x\n", path, (int) hr);
+
+        goto end;
+    }
+
+    /* The view keeps the underlying section alive after the handles are
+       closed, and card images stay mapped for the lifetime of the process. */
+
+    *out = view;
+    *nbytes = (size_t) size.QuadPart;
+    hr = S_OK;
+
+end:
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
+static HRESULT card_store_parse_hex(
+        const wchar_t *src,
+        uint8_t *bytes,
+        size_t nbytes)
+{
+    wchar_t c;
+    uint8_t nibble;
+    size_t i;
+
+    for (i = 0 ; i < nbytes * 2 ; i++) {
+        c = src[i];
+
+        if (c >= L'0' && c <= L'9') {
+            nibble = c - L'0';
+        } else if (c >= L'a' && c <= L'f') {
+            nibble = c - L'a' + 10;
+        } else if (c >= L'A' && c <= L'F') {
+            nibble = c - L'A' + 10;
+        } else {
+            return E_INVALIDARG;
+        }
+
+        if (i % 2 == 0) {
+            bytes[i / 2] = nibble << 4;
+        } else {
+            bytes[i / 2] |= nibble;
+        }
+    }
+
+    return S_OK;
+}
+
+static int card_store_mifare_cmp(const void *lhs, const void *rhs)
+{
+    const struct card_store_mifare *l;
+    const struct card_store_mifare *r;
+
+    l = lhs;
+    r = rhs;
+
+    return memcmp(l->luid, r->luid, sizeof(l->luid));
+}
+
+static int card_store_felica_cmp(const void *lhs, const void *rhs)
+{
+    const struct card_store_felica *l;
+    const struct card_store_felica *r;
+
+    l = lhs;
+    r = rhs;
+
+    if (l->IDm < r->IDm) {
+        return -1;
+    } else if (l->IDm > r->IDm) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+const struct mifare *card_store_find_mifare(
+        const struct card_store *store,
+        const uint8_t *luid,
+        size_t nbytes)
+{
+    struct card_store_mifare key;
+    const struct card_store_mifare *found;
+
+    assert(store != NULL);
+    assert(luid != NULL);
+
+    if (nbytes != sizeof(key.luid) || store->nmifare == 0) {
+        return NULL;
+    }
+
+    memcpy(key.luid, luid, sizeof(key.luid));
+
+    found = bsearch(
+            &key,
+            store->mifare,
+            store->nmifare,
+            sizeof(*store->mifare),
+            card_store_mifare_cmp);
+
+    return found != NULL ? found->image : NULL;
+}
+
+const struct card_store_felica *card_store_find_felica(
+        const struct card_store *store,
+        uint64_t IDm)
+{
+    struct card_store_felica key;
+
+    assert(store != NULL);
+
+    if (store->nfelica == 0) {
+        return NULL;
+    }
+
+    key.IDm = IDm;
+
+    return bsearch(
+            &key,
+            store->felica,
+            store->nfelica,
+            sizeof(*store->felica),
+            card_store_felica_cmp);
+}
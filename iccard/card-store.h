@@ -0,0 +1,47 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "iccard/mifare.h"
+
+/* A directory of binary IC card images, memory-mapped read-only at startup.
+
+   MIFARE images are named after the card's 10-byte Aime LUID (20 hex digits,
+   e.g. 01234567890123456789.bin) and must be exactly 1 KiB long: sixteen
+   sectors of four blocks each, with the card UID in the first four bytes of
+   block 0 as on a real MIFARE Classic card.
+
+   FeliCa images are named after the card's IDm (16 hex digits) and contain a
+   flat array of 16-byte blocks, addressed by block number. */
+
+struct card_store_mifare {
+    uint8_t luid[10];
+    const struct mifare *image;
+};
+
+struct card_store_felica {
+    uint64_t IDm;
+    const uint8_t *blocks;
+    size_t nblocks;
+};
+
+struct card_store {
+    struct card_store_mifare *mifare;
+    size_t nmifare;
+    struct card_store_felica *felica;
+    size_t nfelica;
+};
+
+HRESULT card_store_open(struct card_store *store, const wchar_t *dir);
+
+const struct mifare *card_store_find_mifare(
+        const struct card_store *store,
+        const uint8_t *luid,
+        size_t nbytes);
+
+const struct card_store_felica *card_store_find_felica(
+        const struct card_store *store,
+        uint64_t IDm);
@@ -11,11 +11,23 @@
 #include "util/dprintf.h"
 #include "util/dump.h"
 
+/* Largest multi-block read that still fits in a single SG NFC encapsulated
+   response frame. */
+
+enum {
+    FELICA_READ_MAX_BLOCKS = 14,
+};
+
 static HRESULT felica_cmd_poll(
         struct felica *f,
         struct const_iobuf *req,
         struct iobuf *res);
 
+static HRESULT felica_cmd_read(
+        struct felica *f,
+        struct const_iobuf *req,
+        struct iobuf *res);
+
 static HRESULT felica_cmd_get_system_code(
         struct felica *f,
         struct const_iobuf *req,
@@ -87,6 +99,9 @@ HRESULT felica_transact(
     case FELICA_CMD_POLL:
         return felica_cmd_poll(f, req, res);
 
+    case FELICA_CMD_READ:
+        return felica_cmd_read(f, req, res);
+
     case FELICA_CMD_GET_SYSTEM_CODE:
         return felica_cmd_get_system_code(f, req, res);
 
@@ -162,6 +177,106 @@ static HRESULT felica_cmd_poll(
     return S_OK;
 }
 
+static HRESULT felica_cmd_read(
+        struct felica *f,
+        struct const_iobuf *req,
+        struct iobuf *res)
+{
+    uint16_t block_nos[FELICA_READ_MAX_BLOCKS];
+    uint8_t nservices;
+    uint8_t nblocks;
+    uint8_t elem[3];
+    uint8_t status;
+    size_t i;
+    HRESULT hr;
+
+    /* Request: service code list, then block list. We serve every service
+       from the same flat card image, so the service codes themselves are only
+       used to validate the block list's service indices. */
+
+    hr = iobuf_read_8(req, &nservices);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    if (nservices == 0 || req->nbytes - req->pos < 2 * nservices) {
+        return E_FAIL;
+    }
+
+    req->pos += 2 * nservices;
+
+    hr = iobuf_read_8(req, &nblocks);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    status = 0x00;
+
+    if (nblocks == 0 || nblocks > FELICA_READ_MAX_BLOCKS) {
+        status = 0xA2; /* Illegal number of blocks */
+    }
+
+    for (i = 0 ; i < nblocks && status == 0x00 ; i++) {
+        hr = iobuf_read(req, elem, 2);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        if ((elem[0] & 0x0F) >= nservices) {
+            status = 0xA3; /* Illegal service code list order */
+        } else if (elem[0] & 0x80) {
+            /* Two-byte block list element */
+            block_nos[i] = elem[1];
+        } else {
+            /* Three-byte block list element, LE block number */
+            hr = iobuf_read_8(req, &elem[2]);
+
+            if (FAILED(hr)) {
+                return hr;
+            }
+
+            block_nos[i] = elem[1] | (elem[2] << 8);
+        }
+
+        if (status == 0x00 && block_nos[i] >= f->nblocks) {
+            status = 0xA8; /* Illegal block number */
+        }
+    }
+
+    /* Response: status flags, then all requested blocks in one go */
+
+    hr = iobuf_write_8(res, status != 0x00 ? 0xFF : 0x00);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    hr = iobuf_write_8(res, status);
+
+    if (FAILED(hr) || status != 0x00) {
+        return hr;
+    }
+
+    hr = iobuf_write_8(res, nblocks);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    for (i = 0 ; i < nblocks ; i++) {
+        hr = iobuf_write(res, &f->blocks[block_nos[i] * 16], 16);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    return S_OK;
+}
+
 static HRESULT felica_cmd_get_system_code(
         struct felica *f,
         struct const_iobuf *req,
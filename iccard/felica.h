@@ -9,6 +9,7 @@
 
 enum {
     FELICA_CMD_POLL             = 0x00,
+    FELICA_CMD_READ             = 0x06,
     FELICA_CMD_GET_SYSTEM_CODE  = 0x0c,
     FELICA_CMD_NDA_A4           = 0xa4,
 };
@@ -17,6 +18,12 @@ struct felica {
     uint64_t IDm;
     uint64_t PMm;
     uint16_t system_code;
+
+    /* Optional card image backing Read Without Encryption, in 16-byte blocks.
+       NULL if the emulated card has no readable blocks. */
+
+    const uint8_t *blocks;
+    size_t nblocks;
 };
 
 HRESULT felica_transact(
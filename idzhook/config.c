@@ -16,6 +16,8 @@
 #include "platform/config.h"
 #include "platform/platform.h"
 
+#include "util/ini.h"
+
 void idz_dll_config_load(
         struct idz_dll_config *cfg,
         const wchar_t *filename)
@@ -23,7 +25,7 @@ void idz_dll_config_load(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"idzio",
             L"path",
             L"",
@@ -52,5 +54,5 @@ void zinput_config_load(struct zinput_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"zinput", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"zinput", L"enable", 1, filename);
 }
@@ -9,6 +9,7 @@
 #include "hook/process.h"
 
 #include "hooklib/dvd.h"
+#include "hooklib/iat.h"
 #include "hooklib/serial.h"
 #include "hooklib/spike.h"
 
@@ -35,6 +36,11 @@ static DWORD CALLBACK idz_pre_startup(void)
 
     idz_hook_config_load(&idz_hook_cfg, L".\\segatools.ini");
 
+    /* Queue up import table patches so that each module's imports are only
+       walked once, when the batch ends */
+
+    iat_hook_begin_batch();
+
     /* Hook Win32 APIs */
 
     serial_hook_init();
@@ -71,6 +77,8 @@ static DWORD CALLBACK idz_pre_startup(void)
         goto fail;
     }
 
+    iat_hook_end_batch();
+
     /* Initialize debug helpers */
 
     spike_hook_init(L".\\segatools.ini");
@@ -10,6 +10,8 @@
 
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
+
 #include "util/dprintf.h"
 
 HRESULT WINAPI hook_DirectInput8Create(
@@ -90,7 +92,7 @@ HRESULT zinput_hook_init(struct zinput_config *cfg)
         return S_FALSE;
     }
 
-    hook_table_apply(
+    iat_hook_push(
             NULL,
             "dinput8.dll",
             zinput_hook_syms,
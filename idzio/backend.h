@@ -1,11 +1,19 @@
 #pragma once
 
+#include <windows.h>
+
 #include <stdint.h>
 
+#include "idzio/config.h"
 #include "idzio/idzio.h"
 
 struct idz_io_backend {
     void (*jvs_read_buttons)(uint8_t *gamebtn);
     void (*jvs_read_shifter)(uint8_t *gear);
     void (*jvs_read_analogs)(struct idz_io_analog_state *state);
+
+    /* Re-apply the bindings and axis settings from a reloaded config. Which
+       devices are used is only decided at startup. */
+
+    HRESULT (*config_update)(const struct idz_io_config *cfg);
 };
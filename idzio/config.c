@@ -8,6 +8,8 @@
 
 #include "idzio/config.h"
 
+#include "util/ini.h"
+
 void idz_di_config_load(struct idz_di_config *cfg, const wchar_t *filename)
 {
     wchar_t key[8];
@@ -16,7 +18,7 @@ void idz_di_config_load(struct idz_di_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dinput",
             L"deviceName",
             L"",
@@ -24,7 +26,7 @@ void idz_di_config_load(struct idz_di_config *cfg, const wchar_t *filename)
             _countof(cfg->device_name),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dinput",
             L"shifterName",
             L"",
@@ -32,7 +34,7 @@ void idz_di_config_load(struct idz_di_config *cfg, const wchar_t *filename)
             _countof(cfg->shifter_name),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dinput",
             L"brakeAxis",
             L"RZ",
@@ -40,7 +42,7 @@ void idz_di_config_load(struct idz_di_config *cfg, const wchar_t *filename)
             _countof(cfg->brake_axis),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dinput",
             L"accelAxis",
             L"Y",
@@ -48,17 +50,17 @@ void idz_di_config_load(struct idz_di_config *cfg, const wchar_t *filename)
             _countof(cfg->accel_axis),
             filename);
 
-    cfg->start = GetPrivateProfileIntW(L"dinput", L"start", 0, filename);
-    cfg->view_chg = GetPrivateProfileIntW(L"dinput", L"viewChg", 0, filename);
-    cfg->shift_dn = GetPrivateProfileIntW(L"dinput", L"shiftDn", 0, filename);
-    cfg->shift_up = GetPrivateProfileIntW(L"dinput", L"shiftUp", 0, filename);
+    cfg->start = ini_get_int(L"dinput", L"start", 0, filename);
+    cfg->view_chg = ini_get_int(L"dinput", L"viewChg", 0, filename);
+    cfg->shift_dn = ini_get_int(L"dinput", L"shiftDn", 0, filename);
+    cfg->shift_up = ini_get_int(L"dinput", L"shiftUp", 0, filename);
 
-    cfg->reverse_brake_axis = GetPrivateProfileIntW(
+    cfg->reverse_brake_axis = ini_get_int(
                             L"dinput",
                             L"reverseBrakeAxis",
                             0,
                             filename);
-    cfg->reverse_accel_axis = GetPrivateProfileIntW(
+    cfg->reverse_accel_axis = ini_get_int(
                             L"dinput",
                             L"reverseAccelAxis",
                             0,
@@ -66,7 +68,7 @@ void idz_di_config_load(struct idz_di_config *cfg, const wchar_t *filename)
 
     for (i = 0 ; i < 6 ; i++) {
         swprintf_s(key, _countof(key), L"gear%i", i + 1);
-        cfg->gear[i] = GetPrivateProfileIntW(L"dinput", key, i + 1, filename);
+        cfg->gear[i] = ini_get_int(L"dinput", key, i + 1, filename);
     }
 
 }
@@ -76,7 +78,7 @@ void idz_xi_config_load(struct idz_xi_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->single_stick_steering = GetPrivateProfileIntW(
+    cfg->single_stick_steering = ini_get_int(
                                 L"io3",
                                 L"singleStickSteering",
                                 0,
@@ -88,12 +90,12 @@ void idz_io_config_load(struct idz_io_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->vk_test = GetPrivateProfileIntW(L"io3", L"test", '1', filename);
-    cfg->vk_service = GetPrivateProfileIntW(L"io3", L"service", '2', filename);
-    cfg->vk_coin = GetPrivateProfileIntW(L"io3", L"coin", '3', filename);
-    cfg->restrict_ = GetPrivateProfileIntW(L"io3", L"restrict", 97, filename);
+    cfg->vk_test = ini_get_int(L"io3", L"test", '1', filename);
+    cfg->vk_service = ini_get_int(L"io3", L"service", '2', filename);
+    cfg->vk_coin = ini_get_int(L"io3", L"coin", '3', filename);
+    cfg->restrict_ = ini_get_int(L"io3", L"restrict", 97, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"io3",
             L"mode",
             L"xinput",
@@ -113,7 +115,7 @@ void idz_shifter_config_load(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->auto_neutral = GetPrivateProfileIntW(
+    cfg->auto_neutral = ini_get_int(
             L"io3",
             L"autoNeutral",
             0,
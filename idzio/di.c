@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <wchar.h>
 
 #include "idzio/backend.h"
@@ -21,7 +22,24 @@ struct idz_di_axis {
     size_t off;
 };
 
+/* Button and axis bindings, validated and resolved from idz_di_config. The
+   poll functions read the current map through a single pointer, so a config
+   reload can swap in a new one without locking them out. */
+
+struct idz_di_map {
+    size_t off_brake;
+    size_t off_accel;
+    uint8_t shift_dn;
+    uint8_t shift_up;
+    uint8_t view_chg;
+    uint8_t start;
+    uint8_t gear[6];
+    bool reverse_brake_axis;
+    bool reverse_accel_axis;
+};
+
 static HRESULT idz_di_config_apply(const struct idz_di_config *cfg);
+static HRESULT idz_di_config_update(const struct idz_io_config *cfg);
 static const struct idz_di_axis *idz_di_get_axis(const wchar_t *name);
 static BOOL CALLBACK idz_di_enum_callback(
         const DIDEVICEINSTANCEW *dev,
@@ -52,6 +70,7 @@ static const struct idz_io_backend idz_di_backend = {
     .jvs_read_buttons   = idz_di_jvs_read_buttons,
     .jvs_read_shifter   = idz_di_jvs_read_shifter,
     .jvs_read_analogs   = idz_di_jvs_read_analogs,
+    .config_update      = idz_di_config_update,
 };
 
 static HWND idz_di_wnd;
@@ -59,15 +78,7 @@ static IDirectInput8W *idz_di_api;
 static IDirectInputDevice8W *idz_di_dev;
 static IDirectInputDevice8W *idz_di_shifter;
 static IDirectInputEffect *idz_di_fx;
-static size_t idz_di_off_brake;
-static size_t idz_di_off_accel;
-static uint8_t idz_di_shift_dn;
-static uint8_t idz_di_shift_up;
-static uint8_t idz_di_view_chg;
-static uint8_t idz_di_start;
-static uint8_t idz_di_gear[6];
-static bool idz_di_reverse_brake_axis;
-static bool idz_di_reverse_accel_axis;
+static const struct idz_di_map *volatile idz_di_map;
 
 HRESULT idz_di_init(
         const struct idz_di_config *cfg,
@@ -206,6 +217,7 @@ static HRESULT idz_di_config_apply(const struct idz_di_config *cfg)
 {
     const struct idz_di_axis *brake_axis;
     const struct idz_di_axis *accel_axis;
+    struct idz_di_map *map;
     int i;
 
     brake_axis = idz_di_get_axis(cfg->brake_axis);
@@ -286,22 +298,40 @@ static HRESULT idz_di_config_apply(const struct idz_di_config *cfg)
         dprintf("Shifter: ---  End  configuration ---\n");
     }
 
-    idz_di_off_brake = accel_axis->off;
-    idz_di_off_accel = brake_axis->off;
-    idz_di_start = cfg->start;
-    idz_di_view_chg = cfg->view_chg;
-    idz_di_shift_dn = cfg->shift_dn;
-    idz_di_shift_up = cfg->shift_up;
-    idz_di_reverse_brake_axis = cfg->reverse_brake_axis;
-    idz_di_reverse_accel_axis = cfg->reverse_accel_axis;
+    map = malloc(sizeof(*map));
+
+    if (map == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    map->off_brake = accel_axis->off;
+    map->off_accel = brake_axis->off;
+    map->start = cfg->start;
+    map->view_chg = cfg->view_chg;
+    map->shift_dn = cfg->shift_dn;
+    map->shift_up = cfg->shift_up;
+    map->reverse_brake_axis = cfg->reverse_brake_axis;
+    map->reverse_accel_axis = cfg->reverse_accel_axis;
 
     for (i = 0 ; i < 6 ; i++) {
-        idz_di_gear[i] = cfg->gear[i];
+        map->gear[i] = cfg->gear[i];
     }
 
+    /* Old maps are leaked for the same reason as config snapshots, see
+       ini_watch_t */
+
+    InterlockedExchangePointer((PVOID volatile *) &idz_di_map, map);
+
     return S_OK;
 }
 
+static HRESULT idz_di_config_update(const struct idz_io_config *cfg)
+{
+    /* Device names only take effect at startup */
+
+    return idz_di_config_apply(&cfg->di);
+}
+
 static const struct idz_di_axis *idz_di_get_axis(const wchar_t *name)
 {
     const struct idz_di_axis *axis;
@@ -376,6 +406,7 @@ static BOOL CALLBACK idz_di_enum_callback_shifter(
 
 static void idz_di_jvs_read_buttons(uint8_t *gamebtn_out)
 {
+    const struct idz_di_map *map;
     union idz_di_state state;
     uint8_t gamebtn;
     HRESULT hr;
@@ -388,13 +419,14 @@ static void idz_di_jvs_read_buttons(uint8_t *gamebtn_out)
         return;
     }
 
+    map = idz_di_map;
     gamebtn = idz_di_decode_pov(state.st.rgdwPOV[0]);
 
-    if (idz_di_start && state.st.rgbButtons[idz_di_start - 1]) {
+    if (map->start && state.st.rgbButtons[map->start - 1]) {
         gamebtn |= IDZ_IO_GAMEBTN_START;
     }
 
-    if (idz_di_view_chg && state.st.rgbButtons[idz_di_view_chg - 1]) {
+    if (map->view_chg && state.st.rgbButtons[map->view_chg - 1]) {
         gamebtn |= IDZ_IO_GAMEBTN_VIEW_CHANGE;
     }
 
@@ -429,6 +461,7 @@ static void idz_di_jvs_read_shifter(uint8_t *gear)
 
 static void idz_di_jvs_read_shifter_pos(uint8_t *out)
 {
+    const struct idz_di_map *map;
     union idz_di_state state;
     uint8_t btn_no;
     uint8_t gear;
@@ -444,10 +477,11 @@ static void idz_di_jvs_read_shifter_pos(uint8_t *out)
         return;
     }
 
+    map = idz_di_map;
     gear = 0;
 
     for (i = 0 ; i < 6 ; i++) {
-        btn_no = idz_di_gear[i];
+        btn_no = map->gear[i];
 
         if (btn_no && state.st.rgbButtons[btn_no - 1]) {
             gear = i + 1;
@@ -459,6 +493,7 @@ static void idz_di_jvs_read_shifter_pos(uint8_t *out)
 
 static void idz_di_jvs_read_shifter_virt(uint8_t *gear)
 {
+    const struct idz_di_map *map;
     union idz_di_state state;
     bool shift_dn;
     bool shift_up;
@@ -472,14 +507,16 @@ static void idz_di_jvs_read_shifter_virt(uint8_t *gear)
         return;
     }
 
-    if (idz_di_shift_dn) {
-        shift_dn = state.st.rgbButtons[idz_di_shift_dn - 1];
+    map = idz_di_map;
+
+    if (map->shift_dn) {
+        shift_dn = state.st.rgbButtons[map->shift_dn - 1];
     } else {
         shift_dn = false;
     }
 
-    if (idz_di_shift_up) {
-        shift_up = state.st.rgbButtons[idz_di_shift_up - 1];
+    if (map->shift_up) {
+        shift_up = state.st.rgbButtons[map->shift_up - 1];
     } else {
         shift_up = false;
     }
@@ -491,6 +528,7 @@ static void idz_di_jvs_read_shifter_virt(uint8_t *gear)
 
 static void idz_di_jvs_read_analogs(struct idz_io_analog_state *out)
 {
+    const struct idz_di_map *map;
     union idz_di_state state;
     const LONG *brake;
     const LONG *accel;
@@ -504,18 +542,19 @@ static void idz_di_jvs_read_analogs(struct idz_io_analog_state *out)
         return;
     }
 
-    brake = (LONG *) &state.bytes[idz_di_off_brake];
-    accel = (LONG *) &state.bytes[idz_di_off_accel];
+    map = idz_di_map;
+    brake = (LONG *) &state.bytes[map->off_brake];
+    accel = (LONG *) &state.bytes[map->off_accel];
 
     out->wheel = state.st.lX - 32768;
 
-    if (idz_di_reverse_brake_axis) {
+    if (map->reverse_brake_axis) {
         out->brake = *brake;
     } else {
         out->brake = 65535 - *brake;
     }
 
-    if (idz_di_reverse_accel_axis) {
+    if (map->reverse_accel_axis) {
         out->accel = *accel;
     } else {
         out->accel = 65535 - *accel;
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "idzio/backend.h"
 #include "idzio/config.h"
@@ -11,9 +12,13 @@
 #include "idzio/xi.h"
 
 #include "util/dprintf.h"
+#include "util/ini.h"
 #include "util/str.h"
 
-static struct idz_io_config idz_io_cfg;
+static void idz_io_config_reload(void *ctx);
+
+static struct idz_io_config idz_io_cfg_initial;
+static const struct idz_io_config *volatile idz_io_cfg = &idz_io_cfg_initial;
 static const struct idz_io_backend *idz_io_backend;
 static bool idz_io_coin;
 static uint16_t idz_io_coins;
@@ -39,36 +44,79 @@ HRESULT idz_io_jvs_init(void)
         return hr;
     }
 
-    idz_io_config_load(&idz_io_cfg, L".\\segatools.ini");
+    idz_io_config_load(&idz_io_cfg_initial, L".\\segatools.ini");
 
-    if (wstr_ieq(idz_io_cfg.mode, L"dinput")) {
-        hr = idz_di_init(&idz_io_cfg.di, inst, &idz_io_backend);
-    } else if (wstr_ieq(idz_io_cfg.mode, L"xinput")) {
-        hr = idz_xi_init(&idz_io_cfg.xi, &idz_io_backend);
+    if (wstr_ieq(idz_io_cfg_initial.mode, L"dinput")) {
+        hr = idz_di_init(&idz_io_cfg_initial.di, inst, &idz_io_backend);
+    } else if (wstr_ieq(idz_io_cfg_initial.mode, L"xinput")) {
+        hr = idz_xi_init(&idz_io_cfg_initial.xi, &idz_io_backend);
     } else {
         hr = E_INVALIDARG;
         dprintf("IDZ IO: Invalid IO mode \"%S\", use dinput or xinput\n",
-                idz_io_cfg.mode);
+                idz_io_cfg_initial.mode);
+    }
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* Not fatal, the config just stays as it was at startup */
+
+    if (FAILED(ini_watch(L".\\segatools.ini", idz_io_config_reload, NULL))) {
+        dprintf("IDZ IO: Failed to watch config file for changes\n");
+    }
+
+    return S_OK;
+}
+
+static void idz_io_config_reload(void *ctx)
+{
+    struct idz_io_config *cfg;
+    HRESULT hr;
+
+    cfg = malloc(sizeof(*cfg));
+
+    if (cfg == NULL) {
+        return;
+    }
+
+    idz_io_config_load(cfg, L".\\segatools.ini");
+
+    /* The backend validates its part of the new config; if it rejects it then
+       keep running with the old one. */
+
+    hr = idz_io_backend->config_update(cfg);
+
+    if (FAILED(hr)) {
+        dprintf("IDZ IO: Reloaded config is invalid, ignoring it\n");
+        free(cfg);
+
+        return;
     }
 
-    return hr;
+    /* The old snapshot is leaked, see ini_watch_t */
+
+    InterlockedExchangePointer((PVOID volatile *) &idz_io_cfg, cfg);
+    dprintf("IDZ IO: Reloaded configuration\n");
 }
 
 void idz_io_jvs_read_buttons(uint8_t *opbtn_out, uint8_t *gamebtn_out)
 {
+    const struct idz_io_config *cfg;
     uint8_t opbtn;
 
     assert(idz_io_backend != NULL);
     assert(opbtn_out != NULL);
     assert(gamebtn_out != NULL);
 
+    cfg = idz_io_cfg;
     opbtn = 0;
 
-    if (GetAsyncKeyState(idz_io_cfg.vk_test) & 0x8000) {
+    if (GetAsyncKeyState(cfg->vk_test) & 0x8000) {
         opbtn |= IDZ_IO_OPBTN_TEST;
     }
 
-    if (GetAsyncKeyState(idz_io_cfg.vk_service) & 0x8000) {
+    if (GetAsyncKeyState(cfg->vk_service) & 0x8000) {
         opbtn |= IDZ_IO_OPBTN_SERVICE;
     }
 
@@ -100,19 +148,22 @@ void idz_io_jvs_read_analogs(struct idz_io_analog_state *out)
        for the wheel restriction config parameter to 97 (out of 128). This
        scaling factor is applied using fixed-point arithmetic below. */
 
-    out->wheel = (tmp.wheel * idz_io_cfg.restrict_) / 128;
+    out->wheel = (tmp.wheel * idz_io_cfg->restrict_) / 128;
     out->accel = tmp.accel;
     out->brake = tmp.brake;
 }
 
 void idz_io_jvs_read_coin_counter(uint16_t *out)
 {
+    const struct idz_io_config *cfg;
+
     assert(out != NULL);
 
     /* Coin counter is not backend-specific */
 
-    if (    idz_io_cfg.vk_coin &&
-            (GetAsyncKeyState(idz_io_cfg.vk_coin) & 0x8000)) {
+    cfg = idz_io_cfg;
+
+    if (cfg->vk_coin && (GetAsyncKeyState(cfg->vk_coin) & 0x8000)) {
         if (!idz_io_coin) {
             idz_io_coin = true;
             idz_io_coins++;
@@ -18,11 +18,13 @@ static void idz_xi_jvs_read_shifter(uint8_t *gear);
 static void idz_xi_jvs_read_analogs(struct idz_io_analog_state *out);
 
 static HRESULT idz_xi_config_apply(const struct idz_xi_config *cfg);
+static HRESULT idz_xi_config_update(const struct idz_io_config *cfg);
 
 static const struct idz_io_backend idz_xi_backend = {
     .jvs_read_buttons   = idz_xi_jvs_read_buttons,
     .jvs_read_shifter   = idz_xi_jvs_read_shifter,
     .jvs_read_analogs   = idz_xi_jvs_read_analogs,
+    .config_update      = idz_xi_config_update,
 };
 
 static bool idz_xi_single_stick_steering;
@@ -56,6 +58,11 @@ static HRESULT idz_xi_config_apply(const struct idz_xi_config *cfg)
     return S_OK;
 }
 
+static HRESULT idz_xi_config_update(const struct idz_io_config *cfg)
+{
+    return idz_xi_config_apply(&cfg->xi);
+}
+
 static void idz_xi_jvs_read_buttons(uint8_t *gamebtn_out)
 {
     uint8_t gamebtn;
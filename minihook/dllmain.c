@@ -7,6 +7,7 @@
 
 #include "hook/process.h"
 
+#include "hooklib/iat.h"
 #include "hooklib/spike.h"
 
 #include "platform/clock.h"
@@ -31,6 +32,11 @@ static DWORD CALLBACK app_pre_startup(void)
     nusec_config_load(&nusec_cfg, L".\\segatools.ini");
     spike_hook_init(L".\\segatools.ini");
 
+    /* Queue up import table patches so that each module's imports are only
+       walked once, when the batch ends */
+
+    iat_hook_begin_batch();
+
     hr = clock_hook_init(&clock_cfg);
 
     if (FAILED(hr)) {
@@ -49,6 +55,8 @@ static DWORD CALLBACK app_pre_startup(void)
         goto fail;
     }
 
+    iat_hook_end_batch();
+
     dprintf("---  End  %s ---\n", __func__);
 
     return app_startup();
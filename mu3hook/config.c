@@ -11,6 +11,8 @@
 
 #include "platform/config.h"
 
+#include "util/ini.h"
+
 void mu3_dll_config_load(
         struct mu3_dll_config *cfg,
         const wchar_t *filename)
@@ -18,7 +20,7 @@ void mu3_dll_config_load(
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"mu3io",
             L"path",
             L"",
@@ -9,6 +9,7 @@
 #include "hook/process.h"
 
 #include "hooklib/dvd.h"
+#include "hooklib/iat.h"
 #include "hooklib/serial.h"
 #include "hooklib/spike.h"
 
@@ -35,6 +36,11 @@ static DWORD CALLBACK mu3_pre_startup(void)
 
     mu3_hook_config_load(&mu3_hook_cfg, L".\\segatools.ini");
 
+    /* Queue up import table patches so that each module's imports are only
+       walked once, when the batch ends */
+
+    iat_hook_begin_batch();
+
     /* Hook Win32 APIs */
 
     dvd_hook_init(&mu3_hook_cfg.dvd, mu3_hook_mod);
@@ -84,6 +90,8 @@ static DWORD CALLBACK mu3_pre_startup(void)
 
     unity_hook_init();
 
+    iat_hook_end_batch();
+
     /* Initialize debug helpers */
 
     spike_hook_init(L".\\segatools.ini");
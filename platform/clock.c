@@ -5,11 +5,17 @@
 
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
+
 #include "platform/clock.h"
 
 #include "util/dprintf.h"
 
+static int64_t clock_warp(int64_t real_jiffies);
+static int64_t clock_warp_slow(int64_t real_jiffies);
+
 static void WINAPI my_GetSystemTimeAsFileTime(FILETIME *out);
+static void WINAPI my_GetSystemTimePreciseAsFileTime(FILETIME *out);
 static BOOL WINAPI my_GetLocalTime(SYSTEMTIME *out);
 static BOOL WINAPI my_GetSystemTime(SYSTEMTIME *out);
 static DWORD WINAPI my_GetTimeZoneInformation(TIME_ZONE_INFORMATION *tzinfo);
@@ -17,7 +23,8 @@ static BOOL WINAPI my_SetLocalTime(SYSTEMTIME *in);
 static BOOL WINAPI my_SetSystemTime(SYSTEMTIME *in);
 static BOOL WINAPI my_SetTimeZoneInformation(TIME_ZONE_INFORMATION *tzinfo);
 
-static BOOL (WINAPI * next_GetSystemTimeAsFileTime)(FILETIME *out);
+static void (WINAPI * next_GetSystemTimeAsFileTime)(FILETIME *out);
+static void (WINAPI * next_GetSystemTimePreciseAsFileTime)(FILETIME *out);
 static int64_t clock_current_day;
 static bool clock_time_warp;
 
@@ -26,6 +33,10 @@ static const struct hook_symbol clock_base_hook_syms[] = {
         .name   = "GetSystemTimeAsFileTime",
         .patch  = my_GetSystemTimeAsFileTime,
         .link   = (void **) &next_GetSystemTimeAsFileTime,
+    }, {
+        .name   = "GetSystemTimePreciseAsFileTime",
+        .patch  = my_GetSystemTimePreciseAsFileTime,
+        .link   = (void **) &next_GetSystemTimePreciseAsFileTime,
     }
 };
 
@@ -62,33 +73,68 @@ static const struct hook_symbol clock_write_hook_syms[] = {
 #define jiffies_per_hour    (jiffies_per_sec * 3600LL)
 #define jiffies_per_day     (jiffies_per_hour * 24LL)
 
-static void WINAPI my_GetSystemTimeAsFileTime(FILETIME *out)
+/* Time warp runs every real day through a fake day that skips the keepout
+   period, so time of day gets scaled by 19/24 (see clock_warp_slow). Doing
+   that from scratch costs several 64-bit divisions, which is slow when the
+   game asks for the time every frame, so we cache a window of real time that
+   starts on a multiple of 24 jiffies. Inside that window the fake time is
+   the window's fake start time plus (offset * 19) / 24, and as long as
+   offset * 19 fits in 32 bits that is exact and compiles to a 32-bit
+   multiply-shift. Windows never cross a (biased) day boundary.
+
+   The window is published under a sequence lock: the count is odd while the
+   window is being rewritten, and readers that see it change fall back to the
+   slow path. */
+
+#define clock_window_jiffies (24LL * 9000000LL) /* 21.6 sec */
+
+static volatile LONG clock_window_seq;
+static volatile int64_t clock_window_start;
+static volatile int64_t clock_window_end;
+static volatile int64_t clock_window_fake;
+
+static int64_t clock_warp(int64_t real_jiffies)
 {
-    FILETIME in;
-    int64_t day;
-    int64_t real_jiffies;
-    int64_t real_jiffies_biased;
-    int64_t real_time;
-    int64_t fake_time;
-    int64_t fake_jiffies_biased;
-    int64_t fake_jiffies;
+    int64_t start;
+    int64_t end;
+    int64_t fake;
+    uint32_t offset;
+    LONG seq;
 
-    if (!clock_time_warp) {
-        next_GetSystemTimeAsFileTime(out);
+    seq = clock_window_seq;
 
-        return;
+    if (seq & 1) {
+        return clock_warp_slow(real_jiffies);
     }
 
-    if (out == NULL) {
-        SetLastError(ERROR_INVALID_PARAMETER);
+    start = clock_window_start;
+    end = clock_window_end;
+    fake = clock_window_fake;
 
-        return;
+    if (    clock_window_seq != seq ||
+            real_jiffies < start ||
+            real_jiffies >= end) {
+        return clock_warp_slow(real_jiffies);
     }
 
-    /* Get and convert real jiffies */
+    offset = (uint32_t) (real_jiffies - start);
 
-    next_GetSystemTimeAsFileTime(&in);
-    real_jiffies = (((int64_t) in.dwHighDateTime) << 32) | in.dwLowDateTime;
+    return fake + (offset * 19U) / 24U;
+}
+
+static int64_t clock_warp_slow(int64_t real_jiffies)
+{
+    int64_t day;
+    int64_t real_jiffies_biased;
+    int64_t real_time;
+    int64_t window_time;
+    int64_t window_start;
+    int64_t window_end;
+    int64_t window_fake;
+    int64_t fake_time;
+    int64_t fake_jiffies_biased;
+    int64_t fake_jiffies;
+    LONG seq;
 
     /* Keepout period is JST [02:00, 07:00), which is equivalent to
        UTC [17:00, 22:00). Bias UTC forward by 2 hours, changing this interval
@@ -101,7 +147,8 @@ static void WINAPI my_GetSystemTimeAsFileTime(FILETIME *out)
           day = real_jiffies_biased / jiffies_per_day;
     real_time = real_jiffies_biased % jiffies_per_day;
 
-    /* Debug log */
+    /* Debug log. Every change of day comes through here, since cache
+       windows end at midnight. */
 
     if (clock_current_day != 0 && clock_current_day != day) {
         dprintf("\n*** CLOCK JUMP! ***\n\n");
@@ -122,7 +169,86 @@ static void WINAPI my_GetSystemTimeAsFileTime(FILETIME *out)
 
     fake_jiffies = fake_jiffies_biased - 2LL * jiffies_per_hour;
 
-    /* Return result */
+    /* Cache a window starting at the multiple of 24 jiffies at or before
+       now, unless another thread is busy doing the same. */
+
+    window_time = real_time - real_time % 24;
+    window_start = day * jiffies_per_day + window_time;
+    window_end = window_start + clock_window_jiffies;
+
+    if (window_end > (day + 1) * jiffies_per_day) {
+        window_end = (day + 1) * jiffies_per_day;
+    }
+
+    window_fake = day * jiffies_per_day + (window_time / 24) * 19;
+
+    seq = clock_window_seq;
+
+    if (    !(seq & 1) &&
+            InterlockedCompareExchange(
+                &clock_window_seq,
+                seq + 1,
+                seq) == seq) {
+        clock_window_start = window_start - 2LL * jiffies_per_hour;
+        clock_window_end = window_end - 2LL * jiffies_per_hour;
+        clock_window_fake = window_fake - 2LL * jiffies_per_hour;
+        InterlockedExchange(&clock_window_seq, seq + 2);
+    }
+
+    return fake_jiffies;
+}
+
+static void WINAPI my_GetSystemTimeAsFileTime(FILETIME *out)
+{
+    FILETIME in;
+    int64_t real_jiffies;
+    int64_t fake_jiffies;
+
+    if (!clock_time_warp) {
+        next_GetSystemTimeAsFileTime(out);
+
+        return;
+    }
+
+    if (out == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+
+        return;
+    }
+
+    next_GetSystemTimeAsFileTime(&in);
+    real_jiffies = (((int64_t) in.dwHighDateTime) << 32) | in.dwLowDateTime;
+    fake_jiffies = clock_warp(real_jiffies);
+
+    out->dwLowDateTime  = fake_jiffies;
+    out->dwHighDateTime = fake_jiffies >> 32;
+}
+
+static void WINAPI my_GetSystemTimePreciseAsFileTime(FILETIME *out)
+{
+    FILETIME in;
+    int64_t real_jiffies;
+    int64_t fake_jiffies;
+
+    /* Only exists on Windows 8 and later. Callers that import it directly
+       won't load on anything older, so the link is always set if we get
+       called through the hook. */
+
+    if (!clock_time_warp) {
+        next_GetSystemTimePreciseAsFileTime(out);
+
+        return;
+    }
+
+    if (out == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+
+        return;
+    }
+
+    next_GetSystemTimePreciseAsFileTime(&in);
+    real_jiffies = (((int64_t) in.dwHighDateTime) << 32) | in.dwLowDateTime;
+    fake_jiffies = clock_warp(real_jiffies);
 
     out->dwLowDateTime  = fake_jiffies;
     out->dwHighDateTime = fake_jiffies >> 32;
@@ -223,15 +349,29 @@ static BOOL WINAPI my_SetTimeZoneInformation(TIME_ZONE_INFORMATION *in)
 
 HRESULT clock_hook_init(const struct clock_config *cfg)
 {
+    HMODULE kernel32;
+
     assert(cfg != NULL);
 
     clock_time_warp = cfg->timewarp;
 
+    /* The read hooks call through to the real GetSystemTimeAsFileTime even
+       if the EXE does not import it, so don't rely on the IAT hook to fill
+       in this link. */
+
+    kernel32 = GetModuleHandleW(L"kernel32.dll");
+
+    if (kernel32 != NULL) {
+        next_GetSystemTimeAsFileTime = (void *) GetProcAddress(
+                kernel32,
+                "GetSystemTimeAsFileTime");
+    }
+
     if (cfg->timezone || cfg->timewarp || !cfg->writeable) {
         /* All the clock hooks require the core GSTAFT hook to be installed */
         /* Note the ! up there btw. */
 
-        hook_table_apply(
+        iat_hook_push(
                 NULL,
                 "kernel32.dll",
                 clock_base_hook_syms,
@@ -239,7 +379,7 @@ HRESULT clock_hook_init(const struct clock_config *cfg)
     }
 
     if (cfg->timezone) {
-        hook_table_apply(
+        iat_hook_push(
                 NULL,
                 "kernel32.dll",
                 clock_read_hook_syms,
@@ -248,7 +388,7 @@ HRESULT clock_hook_init(const struct clock_config *cfg)
 
     if (!cfg->writeable) {
         /* Install hook if this config parameter is FALSE! */
-        hook_table_apply(
+        iat_hook_push(
                 NULL,
                 "kernel32.dll",
                 clock_write_hook_syms,
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "hooklib/config.h"
+
 #include "platform/amvideo.h"
 #include "platform/clock.h"
 #include "platform/config.h"
@@ -22,6 +24,9 @@
 #include "platform/platform.h"
 #include "platform/vfs.h"
 
+#include "util/dprintf.h"
+#include "util/ini.h"
+
 void platform_config_load(struct platform_config *cfg, const wchar_t *filename)
 {
     assert(cfg != NULL);
@@ -34,6 +39,7 @@ void platform_config_load(struct platform_config *cfg, const wchar_t *filename)
     hwreset_config_load(&cfg->hwreset, filename);
     misc_config_load(&cfg->misc, filename);
     pcbid_config_load(&cfg->pcbid, filename);
+    reg_config_load(&cfg->reg, filename);
     netenv_config_load(&cfg->netenv, filename);
     nusec_config_load(&cfg->nusec, filename);
     vfs_config_load(&cfg->vfs, filename);
@@ -44,7 +50,7 @@ void amvideo_config_load(struct amvideo_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"amvideo", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"amvideo", L"enable", 1, filename);
 }
 
 void clock_config_load(struct clock_config *cfg, const wchar_t *filename)
@@ -52,9 +58,9 @@ void clock_config_load(struct clock_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->timezone = GetPrivateProfileIntW(L"clock", L"timezone", 1, filename);
-    cfg->timewarp = GetPrivateProfileIntW(L"clock", L"timewarp", 0, filename);
-    cfg->writeable = GetPrivateProfileIntW(
+    cfg->timezone = ini_get_int(L"clock", L"timezone", 1, filename);
+    cfg->timewarp = ini_get_int(L"clock", L"timewarp", 0, filename);
+    cfg->writeable = ini_get_int(
             L"clock",
             L"writeable",
             0,
@@ -63,14 +69,19 @@ void clock_config_load(struct clock_config *cfg, const wchar_t *filename)
 
 void dns_config_load(struct dns_config *cfg, const wchar_t *filename)
 {
+    struct dns_override *override;
+    wchar_t rule[256];
     wchar_t default_[128];
+    wchar_t key[16];
+    wchar_t *sep;
+    size_t i;
 
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"dns", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"dns", L"enable", 1, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dns",
             L"default",
             L"localhost",
@@ -78,7 +89,7 @@ void dns_config_load(struct dns_config *cfg, const wchar_t *filename)
             _countof(default_),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dns",
             L"router",
             default_,
@@ -86,7 +97,7 @@ void dns_config_load(struct dns_config *cfg, const wchar_t *filename)
             _countof(cfg->router),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dns",
             L"startup",
             default_,
@@ -94,7 +105,7 @@ void dns_config_load(struct dns_config *cfg, const wchar_t *filename)
             _countof(cfg->startup),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dns",
             L"billing",
             default_,
@@ -102,13 +113,42 @@ void dns_config_load(struct dns_config *cfg, const wchar_t *filename)
             _countof(cfg->billing),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"dns",
             L"aimedb",
             default_,
             cfg->aimedb,
             _countof(cfg->aimedb),
             filename);
+
+    /* Additional rules, given as override.N=name;target */
+
+    cfg->noverrides = 0;
+
+    for (i = 0 ; i < DNS_MAX_OVERRIDES ; i++) {
+        swprintf_s(key, _countof(key), L"override.%u", (unsigned int) i);
+        ini_get_string(L"dns", key, L"", rule, _countof(rule), filename);
+
+        if (rule[0] == L'\0') {
+            continue;
+        }
+
+        sep = wcschr(rule, L';');
+
+        if (    sep == NULL ||
+                sep == rule ||
+                sep - rule >= _countof(override->name) ||
+                wcslen(sep + 1) >= _countof(override->to)) {
+            dprintf("DNS: Ignoring malformed %S: %S\n", key, rule);
+
+            continue;
+        }
+
+        *sep = L'\0';
+        override = &cfg->overrides[cfg->noverrides++];
+        wcscpy_s(override->name, _countof(override->name), rule);
+        wcscpy_s(override->to, _countof(override->to), sep + 1);
+    }
 }
 
 void hwmon_config_load(struct hwmon_config *cfg, const wchar_t *filename)
@@ -116,7 +156,7 @@ void hwmon_config_load(struct hwmon_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"hwmon", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"hwmon", L"enable", 1, filename);
 }
 
 void hwreset_config_load(struct hwreset_config *cfg, const wchar_t *filename)
@@ -124,7 +164,7 @@ void hwreset_config_load(struct hwreset_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"hwreset", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"hwreset", L"enable", 1, filename);
 }
 
 void misc_config_load(struct misc_config *cfg, const wchar_t *filename)
@@ -132,7 +172,7 @@ void misc_config_load(struct misc_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"misc", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"misc", L"enable", 1, filename);
 }
 
 void netenv_config_load(struct netenv_config *cfg, const wchar_t *filename)
@@ -144,21 +184,21 @@ void netenv_config_load(struct netenv_config *cfg, const wchar_t *filename)
 
     memset(cfg, 0, sizeof(*cfg));
 
-    cfg->enable = GetPrivateProfileIntW(L"netenv", L"enable", 0, filename);
+    cfg->enable = ini_get_int(L"netenv", L"enable", 0, filename);
 
-    cfg->addr_suffix = GetPrivateProfileIntW(
+    cfg->addr_suffix = ini_get_int(
             L"netenv",
             L"addrSuffix",
             11,
             filename);
 
-    cfg->router_suffix = GetPrivateProfileIntW(
+    cfg->router_suffix = ini_get_int(
             L"netenv",
             L"routerSuffix",
             254,
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"netenv",
             L"macAddr",
             L"01:02:03:04:05:06",
@@ -175,6 +215,12 @@ void netenv_config_load(struct netenv_config *cfg, const wchar_t *filename)
             &cfg->mac_addr[4],
             &cfg->mac_addr[5],
             &cfg->mac_addr[6]);
+
+    cfg->adapters = ini_get_int(L"netenv", L"adapters", 1, filename);
+    cfg->ping_rtt = ini_get_int(L"netenv", L"pingRtt", 1, filename);
+    cfg->ping_jitter = ini_get_int(L"netenv", L"pingJitter", 0, filename);
+    cfg->ping_loss = ini_get_int(L"netenv", L"pingLoss", 0, filename);
+    cfg->ping_seed = ini_get_int(L"netenv", L"pingSeed", 1, filename);
 }
 
 void nusec_config_load(struct nusec_config *cfg, const wchar_t *filename)
@@ -195,9 +241,9 @@ void nusec_config_load(struct nusec_config *cfg, const wchar_t *filename)
     memset(platform_id, 0, sizeof(platform_id));
     memset(subnet, 0, sizeof(subnet));
 
-    cfg->enable = GetPrivateProfileIntW(L"keychip", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"keychip", L"enable", 1, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"keychip",
             L"id",
             L"A69E-01A88888888",
@@ -205,7 +251,7 @@ void nusec_config_load(struct nusec_config *cfg, const wchar_t *filename)
             _countof(keychip_id),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"keychip",
             L"gameId",
             L"",
@@ -213,7 +259,7 @@ void nusec_config_load(struct nusec_config *cfg, const wchar_t *filename)
             _countof(game_id),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"keychip",
             L"platformId",
             L"",
@@ -221,14 +267,14 @@ void nusec_config_load(struct nusec_config *cfg, const wchar_t *filename)
             _countof(platform_id),
             filename);
 
-    cfg->region = GetPrivateProfileIntW(L"keychip", L"region", 1, filename);
-    cfg->system_flag = GetPrivateProfileIntW(
+    cfg->region = ini_get_int(L"keychip", L"region", 1, filename);
+    cfg->system_flag = ini_get_int(
             L"keychip",
             L"systemFlag",
             0x64,
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"keychip",
             L"subnet",
             L"192.168.100.0",
@@ -251,7 +297,7 @@ void nusec_config_load(struct nusec_config *cfg, const wchar_t *filename)
     swscanf(subnet, L"%u.%u.%u.%u", &ip[0], &ip[1], &ip[2], &ip[3]);
     cfg->subnet = (ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | 0;
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"keychip",
             L"billingCa",
             L"DEVICE\\ca.crt",
@@ -259,13 +305,21 @@ void nusec_config_load(struct nusec_config *cfg, const wchar_t *filename)
             _countof(cfg->billing_ca),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"keychip",
             L"billingPub",
             L"DEVICE\\billing.pub",
             cfg->billing_pub,
             _countof(cfg->billing_pub),
             filename);
+
+    ini_get_string(
+            L"keychip",
+            L"nvram",
+            L"DEVICE\\keychip.bin",
+            cfg->nvram,
+            _countof(cfg->nvram),
+            filename);
 }
 
 void pcbid_config_load(struct pcbid_config *cfg, const wchar_t *filename)
@@ -273,9 +327,9 @@ void pcbid_config_load(struct pcbid_config *cfg, const wchar_t *filename)
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"pcbid", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"pcbid", L"enable", 1, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"pcbid",
             L"serialNo",
             L"ACAE01A99999999",
@@ -286,12 +340,24 @@ void pcbid_config_load(struct pcbid_config *cfg, const wchar_t *filename)
 
 void vfs_config_load(struct vfs_config *cfg, const wchar_t *filename)
 {
+    wchar_t overlay[(2 + VFS_MAX_LOWERS) * MAX_PATH];
+    wchar_t *parts[2 + VFS_MAX_LOWERS + 1];
+    wchar_t mount[2 * MAX_PATH];
+    wchar_t key[16];
+    struct vfs_overlay *ov;
+    wchar_t *flag;
+    wchar_t *sep;
+    size_t nparts;
+    DWORD len;
+    size_t i;
+    size_t j;
+
     assert(cfg != NULL);
     assert(filename != NULL);
 
-    cfg->enable = GetPrivateProfileIntW(L"vfs", L"enable", 1, filename);
+    cfg->enable = ini_get_int(L"vfs", L"enable", 1, filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"vfs",
             L"amfs",
             L"",
@@ -299,7 +365,7 @@ void vfs_config_load(struct vfs_config *cfg, const wchar_t *filename)
             _countof(cfg->amfs),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"vfs",
             L"appdata",
             L"",
@@ -307,12 +373,212 @@ void vfs_config_load(struct vfs_config *cfg, const wchar_t *filename)
             _countof(cfg->appdata),
             filename);
 
-    GetPrivateProfileStringW(
+    ini_get_string(
             L"vfs",
             L"option",
             L"",
             cfg->option,
             _countof(cfg->option),
             filename);
+
+    cfg->amfs_cache = ini_get_int(L"vfs", L"amfsCache", 0, filename);
+    cfg->appdata_cache = ini_get_int(L"vfs", L"appdataCache", 0, filename);
+    cfg->option_cache = ini_get_int(L"vfs", L"optionCache", 0, filename);
+
+    /* Additional mounts, given as mount.N=src;dest[;cache]. Gaps in the
+       numbering are allowed. */
+
+    cfg->nmounts = 0;
+
+    for (i = 0 ; i < VFS_MAX_MOUNTS ; i++) {
+        swprintf_s(key, _countof(key), L"mount.%u", (unsigned int) i);
+        len = ini_get_string(
+                L"vfs",
+                key,
+                L"",
+                mount,
+                _countof(mount),
+                filename);
+
+        if (mount[0] == L'\0') {
+            continue;
+        }
+
+        if (len + 1 >= _countof(mount)) {
+            dprintf("Vfs: Ignoring %S, path is too long\n", key);
+
+            continue;
+        }
+
+        sep = wcschr(mount, L';');
+
+        if (sep == NULL || sep == mount || sep[1] == L'\0') {
+            dprintf("Vfs: Ignoring %S, expected src;dest[;cache]: %S\n",
+                    key,
+                    mount);
+
+            continue;
+        }
+
+        *sep = L'\0';
+        cfg->mounts[cfg->nmounts].cache = false;
+        flag = wcsrchr(sep + 1, L';');
+
+        if (flag != NULL && _wcsicmp(flag + 1, L"cache") == 0) {
+            *flag = L'\0';
+            cfg->mounts[cfg->nmounts].cache = true;
+        }
+
+        if (sep[1] == L'\0') {
+            dprintf("Vfs: Ignoring %S, destination is empty\n", key);
+
+            continue;
+        }
+
+        if (wcslen(mount) >= MAX_PATH || wcslen(sep + 1) >= MAX_PATH) {
+            dprintf("Vfs: Ignoring %S, path is too long\n", key);
+
+            continue;
+        }
+
+        wcscpy_s(
+                cfg->mounts[cfg->nmounts].src,
+                _countof(cfg->mounts[cfg->nmounts].src),
+                mount);
+
+        wcscpy_s(
+                cfg->mounts[cfg->nmounts].dest,
+                _countof(cfg->mounts[cfg->nmounts].dest),
+                sep + 1);
+
+        cfg->nmounts++;
+    }
+
+    /* Overlay mounts, given as overlay.N=src;upper;lower[;lower...] */
+
+    cfg->noverlays = 0;
+
+    for (i = 0 ; i < VFS_MAX_OVERLAYS ; i++) {
+        swprintf_s(key, _countof(key), L"overlay.%u", (unsigned int) i);
+        len = ini_get_string(
+                L"vfs",
+                key,
+                L"",
+                overlay,
+                _countof(overlay),
+                filename);
+
+        if (overlay[0] == L'\0') {
+            continue;
+        }
+
+        if (len + 1 >= _countof(overlay)) {
+            dprintf("Vfs: Ignoring %S, path is too long\n", key);
+
+            continue;
+        }
+
+        nparts = 0;
+        parts[nparts++] = overlay;
+
+        for (sep = wcschr(overlay, L';') ;
+                sep != NULL && nparts < _countof(parts) ;
+                sep = wcschr(sep + 1, L';')) {
+            *sep = L'\0';
+            parts[nparts++] = sep + 1;
+        }
+
+        if (sep != NULL || nparts < 3 || nparts > 2 + VFS_MAX_LOWERS) {
+            dprintf("Vfs: Ignoring %S, expected src;upper;lower[;lower...] "
+                    "with at most %u lowers\n",
+                    key,
+                    (unsigned int) VFS_MAX_LOWERS);
+
+            continue;
+        }
+
+        for (j = 0 ; j < nparts ; j++) {
+            if (parts[j][0] == L'\0' || wcslen(parts[j]) >= MAX_PATH) {
+                break;
+            }
+        }
+
+        if (j < nparts) {
+            dprintf("Vfs: Ignoring %S, path %u is %s\n",
+                    key,
+                    (unsigned int) j,
+                    parts[j][0] == L'\0' ? "empty" : "too long");
+
+            continue;
+        }
+
+        ov = &cfg->overlays[cfg->noverlays];
+
+        wcscpy_s(ov->src, _countof(ov->src), parts[0]);
+        wcscpy_s(ov->upper, _countof(ov->upper), parts[1]);
+
+        for (j = 2 ; j < nparts ; j++) {
+            wcscpy_s(
+                    ov->lowers[j - 2],
+                    _countof(ov->lowers[j - 2]),
+                    parts[j]);
+        }
+
+        ov->nlowers = nparts - 2;
+        cfg->noverlays++;
+    }
+
+    /* Archive mounts, given as archive.N=src;file */
+
+    cfg->narchives = 0;
+
+    for (i = 0 ; i < VFS_MAX_ARCHIVES ; i++) {
+        swprintf_s(key, _countof(key), L"archive.%u", (unsigned int) i);
+        len = ini_get_string(
+                L"vfs",
+                key,
+                L"",
+                mount,
+                _countof(mount),
+                filename);
+
+        if (mount[0] == L'\0') {
+            continue;
+        }
+
+        if (len + 1 >= _countof(mount)) {
+            dprintf("Vfs: Ignoring %S, path is too long\n", key);
+
+            continue;
+        }
+
+        sep = wcschr(mount, L';');
+
+        if (sep == NULL || sep == mount || sep[1] == L'\0') {
+            dprintf("Vfs: Ignoring %S, expected src;file: %S\n", key, mount);
+
+            continue;
+        }
+
+        *sep = L'\0';
+
+        if (wcslen(mount) >= MAX_PATH || wcslen(sep + 1) >= MAX_PATH) {
+            dprintf("Vfs: Ignoring %S, path is too long\n", key);
+
+            continue;
+        }
+
+        wcscpy_s(
+                cfg->archives[cfg->narchives].src,
+                _countof(cfg->archives[cfg->narchives].src),
+                mount);
+
+        wcscpy_s(
+                cfg->archives[cfg->narchives].path,
+                _countof(cfg->archives[cfg->narchives].path),
+                sep + 1);
+
+        cfg->narchives++;
+    }
 }
 
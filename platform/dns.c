@@ -1,14 +1,22 @@
 #include <windows.h>
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 #include "hooklib/dns.h"
 
 #include "platform/dns.h"
 
+#include "util/dprintf.h"
+
+static void dns_platform_report_cache(void);
+
 HRESULT dns_platform_hook_init(const struct dns_config *cfg)
 {
+    const struct dns_override *override;
     HRESULT hr;
+    size_t i;
 
     assert(cfg != NULL);
 
@@ -16,6 +24,19 @@ HRESULT dns_platform_hook_init(const struct dns_config *cfg)
         return S_FALSE;
     }
 
+    /* User overrides go first, since the first rule pushed for a name wins */
+
+    for (i = 0 ; i < cfg->noverrides ; i++) {
+        override = &cfg->overrides[i];
+        hr = dns_hook_push(
+                override->name,
+                override->to[0] != L'\0' ? override->to : NULL);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
     hr = dns_hook_push(L"tenporouter.loc", cfg->router);
 
     if (FAILED(hr)) {
@@ -79,5 +100,21 @@ HRESULT dns_platform_hook_init(const struct dns_config *cfg)
         return hr;
     }
 
+    atexit(dns_platform_report_cache);
+
     return S_OK;
 }
+
+static void dns_platform_report_cache(void)
+{
+    uint32_t hits;
+    uint32_t misses;
+
+    dns_hook_get_cache_stats(&hits, &misses);
+
+    if (hits + misses > 0) {
+        dprintf("DNS: Resolver cache: %u hits, %u misses\n",
+                (unsigned int) hits,
+                (unsigned int) misses);
+    }
+}
@@ -5,12 +5,25 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#define DNS_MAX_OVERRIDES 16
+
+/* Extra redirection rule from the [dns] section. The name may be a wildcard
+   such as "*.naominet.jp" (see dns_hook_push()); an empty target makes
+   lookups of the name fail. */
+
+struct dns_override {
+    wchar_t name[128];
+    wchar_t to[128];
+};
+
 struct dns_config {
     bool enable;
     wchar_t router[128];
     wchar_t startup[128];
     wchar_t billing[128];
     wchar_t aimedb[128];
+    struct dns_override overrides[DNS_MAX_OVERRIDES];
+    size_t noverrides;
 };
 
 HRESULT dns_platform_hook_init(const struct dns_config *cfg);
@@ -7,6 +7,7 @@
 
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
 #include "hooklib/reg.h"
 
 #include "platform/misc.h"
@@ -124,7 +125,7 @@ HRESULT misc_hook_init(const struct misc_config *cfg, const char *platform_id)
 
     /* Apply function hooks */
 
-    hook_table_apply(NULL, "user32.dll", misc_syms, _countof(misc_syms));
+    iat_hook_push(NULL, "user32.dll", misc_syms, _countof(misc_syms));
 
     return S_OK;
 }
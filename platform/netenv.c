@@ -1,20 +1,32 @@
 #include <windows.h>
 #include <wincrypt.h>
 #include <iphlpapi.h>
+#include <winternl.h>
 
+#include <assert.h>
+#include <process.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
+
 #include "platform/netenv.h"
 #include "platform/nusec.h"
 
 #include "util/dprintf.h"
 
+#define NETENV_MAX_ADAPTERS 4
+#define NETENV_MAX_RELOCS   (NETENV_MAX_ADAPTERS * 16)
+
+/* One adapter's worth of GetAdaptersAddresses() output */
+
 struct netenv {
     IP_ADAPTER_ADDRESSES head;
     char name[64];
@@ -31,6 +43,59 @@ struct netenv {
     struct sockaddr_in dns_sa;
 };
 
+/* A canned API response that gets built once and then copied out for each
+   call. Pointers inside the template hold offsets from the start of the
+   template; relocs lists where they are so that copies can add their own
+   base address to them. */
+
+struct netenv_tmpl {
+    void *bytes;
+    size_t nbytes;
+    size_t relocs[NETENV_MAX_RELOCS];
+    size_t nrelocs;
+};
+
+struct netenv_if_table {
+    DWORD dwNumEntries;
+    MIB_IFROW table[NETENV_MAX_ADAPTERS];
+};
+
+/* An asynchronous IcmpSendEcho2 call waiting for its simulated reply */
+
+struct netenv_ping {
+    ULONGLONG due;
+    ICMP_ECHO_REPLY *reply;
+    uint32_t dest;
+    uint32_t rtt;
+    bool lost;
+    HANDLE event;
+    HANDLE thread;
+    PIO_APC_ROUTINE apc;
+    void *apc_ctx;
+    IO_STATUS_BLOCK iosb;
+    struct netenv_ping *next;
+};
+
+static void netenv_build_addrs(struct netenv *env, unsigned int i);
+static void netenv_build_info(IP_ADAPTER_INFO *ai, unsigned int i);
+static void netenv_build_if_row(MIB_IFROW *row, unsigned int i);
+static void netenv_format_ip(char *out, size_t nchars, uint32_t ip);
+static void netenv_tmpl_link(
+        struct netenv_tmpl *tmpl,
+        void *field,
+        const void *target);
+static void netenv_tmpl_emit(const struct netenv_tmpl *tmpl, void *dest);
+static uint32_t netenv_ping_roll(uint32_t timeout, bool *lost);
+static void netenv_ping_fill(
+        ICMP_ECHO_REPLY *reply,
+        uint32_t dest,
+        uint32_t rtt,
+        bool lost);
+static HRESULT netenv_ping_submit(struct netenv_ping *ping);
+static unsigned int __stdcall netenv_ping_thread_proc(void *ctx);
+static void netenv_ping_complete(struct netenv_ping *ping);
+static void CALLBACK netenv_ping_apc(ULONG_PTR param);
+
 /* Hook functions */
 
 static uint32_t WINAPI hook_GetAdaptersAddresses(
@@ -131,11 +196,29 @@ static uint32_t netenv_ip_prefix;
 static uint32_t netenv_ip_iface;
 static uint32_t netenv_ip_router;
 static uint8_t netenv_mac_addr[6];
+static unsigned int netenv_nadapters;
+
+static struct netenv netenv_addrs[NETENV_MAX_ADAPTERS];
+static IP_ADAPTER_INFO netenv_info[NETENV_MAX_ADAPTERS];
+static struct netenv_if_table netenv_if_table;
+static struct netenv_tmpl netenv_addrs_tmpl;
+static struct netenv_tmpl netenv_info_tmpl;
+
+static uint32_t netenv_ping_rtt;
+static uint32_t netenv_ping_jitter;
+static uint32_t netenv_ping_loss;
+static uint32_t netenv_ping_rng;
+static CRITICAL_SECTION netenv_ping_lock;
+static CONDITION_VARIABLE netenv_ping_cond;
+static HANDLE netenv_ping_thread;
+static struct netenv_ping *netenv_ping_queue;
 
 HRESULT netenv_hook_init(
         const struct netenv_config *cfg,
         const struct nusec_config *kc_cfg)
 {
+    unsigned int i;
+
     assert(cfg != NULL);
     assert(kc_cfg != NULL);
 
@@ -154,7 +237,52 @@ HRESULT netenv_hook_init(
     netenv_ip_router = kc_cfg->subnet | cfg->router_suffix;
     memcpy(netenv_mac_addr, cfg->mac_addr, sizeof(netenv_mac_addr));
 
-    hook_table_apply(
+    netenv_nadapters = cfg->adapters;
+
+    if (netenv_nadapters < 1) {
+        netenv_nadapters = 1;
+    } else if (netenv_nadapters > NETENV_MAX_ADAPTERS) {
+        netenv_nadapters = NETENV_MAX_ADAPTERS;
+    }
+
+    /* ALL.Net polls the adapter APIs constantly, so build their responses
+       up front and just copy them out from the hooks. */
+
+    dprintf("Netenv: Virtualized LAN configuration:\n");
+
+    netenv_addrs_tmpl.bytes = netenv_addrs;
+    netenv_addrs_tmpl.nbytes = netenv_nadapters * sizeof(netenv_addrs[0]);
+    netenv_info_tmpl.bytes = netenv_info;
+    netenv_info_tmpl.nbytes = netenv_nadapters * sizeof(netenv_info[0]);
+    netenv_if_table.dwNumEntries = netenv_nadapters;
+
+    for (i = 0 ; i < netenv_nadapters ; i++) {
+        netenv_build_addrs(&netenv_addrs[i], i);
+        netenv_build_info(&netenv_info[i], i);
+        netenv_build_if_row(&netenv_if_table.table[i], i);
+    }
+
+    dprintf("Netenv: Router IP    :   %3i.%3i.%3i.%3i\n",
+            (uint8_t) (netenv_ip_router >> 24),
+            (uint8_t) (netenv_ip_router >> 16),
+            (uint8_t) (netenv_ip_router >>  8),
+            (uint8_t) (netenv_ip_router      ));
+
+    netenv_ping_rtt = cfg->ping_rtt;
+    netenv_ping_jitter = cfg->ping_jitter;
+    netenv_ping_loss = cfg->ping_loss;
+    netenv_ping_rng = cfg->ping_seed != 0 ? cfg->ping_seed : 1;
+    InitializeCriticalSection(&netenv_ping_lock);
+    InitializeConditionVariable(&netenv_ping_cond);
+
+    if (netenv_ping_jitter != 0 || netenv_ping_loss != 0) {
+        dprintf("Netenv: Ping model   : %u ms +/- %u ms, %u%% loss\n",
+                netenv_ping_rtt,
+                netenv_ping_jitter,
+                netenv_ping_loss);
+    }
+
+    iat_hook_push(
             NULL,
             "iphlpapi.dll",
             netenv_hook_syms,
@@ -163,59 +291,48 @@ HRESULT netenv_hook_init(
     return S_OK;
 }
 
-static uint32_t WINAPI hook_GetAdaptersAddresses(
-        uint32_t Family,
-        uint32_t Flags,
-        void *Reserved,
-        IP_ADAPTER_ADDRESSES *AdapterAddresses,
-        uint32_t *SizePointer)
+static void netenv_build_addrs(struct netenv *env, unsigned int i)
 {
-    /* This hook errs on the side of caution and returns a lot more
-       information than the ALLNET lib cares about. MSVC mangles the main
-       call site for this API quite aggressively, so by the time we decompile
-       the code in question it's a little difficult to tell which pieces the
-       ALLNET lib pays attention to. */
+    /* This errs on the side of caution and returns a lot more information
+       than the ALLNET lib cares about. MSVC mangles the main call site for
+       this API quite aggressively, so by the time we decompile the code in
+       question it's a little difficult to tell which pieces the ALLNET lib
+       pays attention to. */
 
-    uint32_t nbytes;
-    struct netenv *env;
-
-    if (Reserved != NULL || SizePointer == NULL) {
-        return ERROR_INVALID_PARAMETER;
-    }
+    struct netenv_tmpl *tmpl;
 
-    nbytes = *SizePointer;
-    *SizePointer = sizeof(*env);
-
-    if (AdapterAddresses == NULL || nbytes < sizeof(*env)) {
-        return ERROR_BUFFER_OVERFLOW;
-    }
-
-    env = CONTAINING_RECORD(AdapterAddresses, struct netenv, head);
+    tmpl = &netenv_addrs_tmpl;
     memset(env, 0, sizeof(*env));
 
     env->head.Length = sizeof(env->head);
-    env->head.IfIndex = 1;
-    env->head.AdapterName = env->name;
-    env->head.FirstUnicastAddress = &env->iface;
-    env->head.FirstDnsServerAddress = &env->dns;
-    env->head.DnsSuffix = env->dns_suffix;
-    env->head.Description = env->description;
-    env->head.FriendlyName = env->friendly_name;
+    env->head.IfIndex = i + 1;
+    netenv_tmpl_link(tmpl, &env->head.AdapterName, env->name);
+    netenv_tmpl_link(tmpl, &env->head.FirstUnicastAddress, &env->iface);
+    netenv_tmpl_link(tmpl, &env->head.FirstDnsServerAddress, &env->dns);
+    netenv_tmpl_link(tmpl, &env->head.DnsSuffix, env->dns_suffix);
+    netenv_tmpl_link(tmpl, &env->head.Description, env->description);
+    netenv_tmpl_link(tmpl, &env->head.FriendlyName, env->friendly_name);
     memcpy( env->head.PhysicalAddress,
             netenv_mac_addr,
             sizeof(netenv_mac_addr));
+    env->head.PhysicalAddress[5] += i;
     env->head.PhysicalAddressLength = sizeof(netenv_mac_addr);
     env->head.Flags = IP_ADAPTER_DHCP_ENABLED | IP_ADAPTER_IPV4_ENABLED;
     env->head.Mtu = 4200; /* idk what's typical here */
     env->head.IfType = IF_TYPE_ETHERNET_CSMACD;
     env->head.OperStatus = IfOperStatusUp;
-    env->head.FirstPrefix = &env->prefix;
-    env->head.FirstGatewayAddress = &env->router;
+    netenv_tmpl_link(tmpl, &env->head.FirstPrefix, &env->prefix);
+    netenv_tmpl_link(tmpl, &env->head.FirstGatewayAddress, &env->router);
 
-    strcpy_s(
+    if (i + 1 < netenv_nadapters) {
+        netenv_tmpl_link(tmpl, &env->head.Next, &env[1].head);
+    }
+
+    sprintf_s(
             env->name,
             _countof(env->name),
-            "{00000000-0000-0000-0000-000000000000}");
+            "{00000000-0000-0000-0000-%012x}",
+            i);
 
     wcscpy_s(
             env->dns_suffix,
@@ -227,14 +344,22 @@ static uint32_t WINAPI hook_GetAdaptersAddresses(
             _countof(env->description),
             L"Interface Description");
 
-    wcscpy_s(
-            env->friendly_name,
-            _countof(env->friendly_name),
-            L"Fake Ethernet");
+    if (i == 0) {
+        wcscpy_s(
+                env->friendly_name,
+                _countof(env->friendly_name),
+                L"Fake Ethernet");
+    } else {
+        swprintf_s(
+                env->friendly_name,
+                _countof(env->friendly_name),
+                L"Fake Ethernet %u",
+                i + 1);
+    }
 
     env->iface.Length = sizeof(env->iface);
     env->iface.Flags = 0;
-    env->iface.Address.lpSockaddr = (struct sockaddr *) &env->iface_sa;
+    netenv_tmpl_link(tmpl, &env->iface.Address.lpSockaddr, &env->iface_sa);
     env->iface.Address.iSockaddrLength = sizeof(env->iface_sa);
     env->iface.PrefixOrigin = IpPrefixOriginDhcp;
     env->iface.SuffixOrigin = IpSuffixOriginDhcp;
@@ -245,29 +370,189 @@ static uint32_t WINAPI hook_GetAdaptersAddresses(
     env->iface.OnLinkPrefixLength = 24;
 
     env->prefix.Length = sizeof(env->prefix);
-    env->prefix.Address.lpSockaddr = (struct sockaddr *) &env->prefix_sa;
+    netenv_tmpl_link(tmpl, &env->prefix.Address.lpSockaddr, &env->prefix_sa);
     env->prefix.Address.iSockaddrLength = sizeof(env->prefix_sa);
     env->prefix.PrefixLength = 24;
 
     env->router.Length = sizeof(env->router);
-    env->router.Address.lpSockaddr = (struct sockaddr *) &env->router_sa;
+    netenv_tmpl_link(tmpl, &env->router.Address.lpSockaddr, &env->router_sa);
     env->router.Address.iSockaddrLength = sizeof(env->router_sa);
 
     env->dns.Length = sizeof(env->dns);
-    env->dns.Address.lpSockaddr = (struct sockaddr *) &env->dns_sa;
+    netenv_tmpl_link(tmpl, &env->dns.Address.lpSockaddr, &env->dns_sa);
     env->dns.Address.iSockaddrLength = sizeof(env->dns_sa);
 
     env->prefix_sa.sin_family = AF_INET;
     env->prefix_sa.sin_addr.s_addr = _byteswap_ulong(netenv_ip_prefix);
 
     env->iface_sa.sin_family = AF_INET;
-    env->iface_sa.sin_addr.s_addr = _byteswap_ulong(netenv_ip_iface);
+    env->iface_sa.sin_addr.s_addr = _byteswap_ulong(netenv_ip_iface + i);
 
     env->router_sa.sin_family = AF_INET;
     env->router_sa.sin_addr.s_addr = _byteswap_ulong(netenv_ip_router);
 
     env->dns_sa.sin_family = AF_INET;
     env->dns_sa.sin_addr.s_addr = _byteswap_ulong(netenv_ip_router);
+}
+
+static void netenv_build_info(IP_ADAPTER_INFO *ai, unsigned int i)
+{
+    uint32_t ip;
+    uint8_t *mac;
+
+    ip = netenv_ip_iface + i;
+    memset(ai, 0, sizeof(*ai));
+
+    if (i == 0) {
+        strcpy_s(
+                ai->AdapterName,
+                _countof(ai->AdapterName),
+                "Fake Ethernet");
+    } else {
+        sprintf_s(
+                ai->AdapterName,
+                _countof(ai->AdapterName),
+                "Fake Ethernet %u",
+                i + 1);
+    }
+
+    strcpy_s(ai->Description,
+            _countof(ai->Description),
+            "Adapter Description");
+    ai->AddressLength = sizeof(netenv_mac_addr);
+    memcpy(ai->Address, netenv_mac_addr, sizeof(netenv_mac_addr));
+    ai->Address[5] += i;
+    ai->Index = i + 1;
+    ai->Type = MIB_IF_TYPE_ETHERNET;
+    ai->DhcpEnabled = 1;
+
+    netenv_format_ip(
+            ai->IpAddressList.IpAddress.String,
+            _countof(ai->IpAddressList.IpAddress.String),
+            ip);
+
+    strcpy_s(
+            ai->IpAddressList.IpMask.String,
+            _countof(ai->IpAddressList.IpMask.String),
+            "255.255.255.0");
+
+    netenv_format_ip(
+            ai->GatewayList.IpAddress.String,
+            _countof(ai->GatewayList.IpAddress.String),
+            netenv_ip_router);
+
+    strcpy_s(
+            ai->GatewayList.IpMask.String,
+            _countof(ai->GatewayList.IpMask.String),
+            "255.255.255.0");
+
+    memcpy(&ai->DhcpServer, &ai->GatewayList, sizeof(ai->GatewayList));
+
+    if (i + 1 < netenv_nadapters) {
+        netenv_tmpl_link(&netenv_info_tmpl, &ai->Next, &ai[1]);
+    }
+
+    mac = ai->Address;
+
+    dprintf("Netenv: Interface IP :   %3i.%3i.%3i.%3i\n",
+            (uint8_t) (ip >> 24),
+            (uint8_t) (ip >> 16),
+            (uint8_t) (ip >>  8),
+            (uint8_t) (ip      ));
+    dprintf("Netenv: MAC Address  : %02x:%02x:%02x:%02x:%02x:%02x\n",
+            mac[0],
+            mac[1],
+            mac[2],
+            mac[3],
+            mac[4],
+            mac[5]);
+}
+
+static void netenv_build_if_row(MIB_IFROW *row, unsigned int i)
+{
+    memset(row, 0, sizeof(*row));
+
+    if (i == 0) {
+        wcscpy_s(row->wszName, _countof(row->wszName), L"Fake Ethernet");
+    } else {
+        swprintf_s(
+                row->wszName,
+                _countof(row->wszName),
+                L"Fake Ethernet %u",
+                i + 1);
+    }
+
+    row->dwIndex = i + 1; /* Should match other IF_INDEX fields we return */
+    row->dwType = IF_TYPE_ETHERNET_CSMACD;
+    row->dwMtu = 4200; /* I guess? */
+    row->dwSpeed = 1000000000;
+    row->dwPhysAddrLen = sizeof(netenv_mac_addr);
+    memcpy(row->bPhysAddr, netenv_mac_addr, sizeof(netenv_mac_addr));
+    row->bPhysAddr[5] += i;
+    row->dwAdminStatus = 1;
+    row->dwOperStatus = IF_OPER_STATUS_OPERATIONAL;
+}
+
+static void netenv_format_ip(char *out, size_t nchars, uint32_t ip)
+{
+    sprintf_s(
+            out,
+            nchars,
+            "%i.%i.%i.%i",
+            (uint8_t) (ip >> 24),
+            (uint8_t) (ip >> 16),
+            (uint8_t) (ip >>  8),
+            (uint8_t) (ip      ));
+}
+
+static void netenv_tmpl_link(
+        struct netenv_tmpl *tmpl,
+        void *field,
+        const void *target)
+{
+    size_t pos;
+
+    assert(tmpl->nrelocs < _countof(tmpl->relocs));
+
+    pos = (uint8_t *) field - (uint8_t *) tmpl->bytes;
+    *(uintptr_t *) field = (const uint8_t *) target - (uint8_t *) tmpl->bytes;
+    tmpl->relocs[tmpl->nrelocs++] = pos;
+}
+
+static void netenv_tmpl_emit(const struct netenv_tmpl *tmpl, void *dest)
+{
+    uintptr_t *ptr;
+    size_t i;
+
+    memcpy(dest, tmpl->bytes, tmpl->nbytes);
+
+    for (i = 0 ; i < tmpl->nrelocs ; i++) {
+        ptr = (uintptr_t *) ((uint8_t *) dest + tmpl->relocs[i]);
+        *ptr += (uintptr_t) dest;
+    }
+}
+
+static uint32_t WINAPI hook_GetAdaptersAddresses(
+        uint32_t Family,
+        uint32_t Flags,
+        void *Reserved,
+        IP_ADAPTER_ADDRESSES *AdapterAddresses,
+        uint32_t *SizePointer)
+{
+    uint32_t nbytes;
+
+    if (Reserved != NULL || SizePointer == NULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    nbytes = *SizePointer;
+    *SizePointer = netenv_addrs_tmpl.nbytes;
+
+    if (AdapterAddresses == NULL || nbytes < netenv_addrs_tmpl.nbytes) {
+        return ERROR_BUFFER_OVERFLOW;
+    }
+
+    netenv_tmpl_emit(&netenv_addrs_tmpl, AdapterAddresses);
 
     return ERROR_SUCCESS;
 }
@@ -276,89 +561,29 @@ static uint32_t WINAPI hook_GetAdaptersInfo(
         IP_ADAPTER_INFO *ai,
         uint32_t *nbytes_inout)
 {
-    IP_ADDR_STRING iface;
-    IP_ADDR_STRING router;
     uint32_t nbytes;
+    time_t now;
+    unsigned int i;
 
     if (nbytes_inout == NULL) {
         return ERROR_INVALID_PARAMETER;
     }
 
     nbytes = *nbytes_inout;
-    *nbytes_inout = sizeof(*ai);
+    *nbytes_inout = netenv_info_tmpl.nbytes;
 
-    if (ai == NULL || nbytes < sizeof(*ai)) {
+    if (ai == NULL || nbytes < netenv_info_tmpl.nbytes) {
         return ERROR_BUFFER_OVERFLOW;
     }
 
-    dprintf("Netenv: GetAdaptersInfo: Virtualized LAN configuration:\n");
-    dprintf("Netenv: Interface IP :   %3i.%3i.%3i.%3i\n",
-            (uint8_t) (netenv_ip_iface >> 24),
-            (uint8_t) (netenv_ip_iface >> 16),
-            (uint8_t) (netenv_ip_iface >>  8),
-            (uint8_t) (netenv_ip_iface      ));
-    dprintf("Netenv: Router IP    :   %3i.%3i.%3i.%3i\n",
-            (uint8_t) (netenv_ip_router >> 24),
-            (uint8_t) (netenv_ip_router >> 16),
-            (uint8_t) (netenv_ip_router >>  8),
-            (uint8_t) (netenv_ip_router      ));
-    dprintf("Netenv: MAC Address  : %02x:%02x:%02x:%02x:%02x:%02x\n",
-            netenv_mac_addr[0],
-            netenv_mac_addr[1],
-            netenv_mac_addr[2],
-            netenv_mac_addr[3],
-            netenv_mac_addr[4],
-            netenv_mac_addr[5]);
-
-    memset(&iface, 0, sizeof(iface));
-    memset(&router, 0, sizeof(router));
-
-    sprintf_s(
-            iface.IpAddress.String,
-            _countof(iface.IpAddress.String),
-            "%i.%i.%i.%i",
-            (uint8_t) (netenv_ip_iface >> 24),
-            (uint8_t) (netenv_ip_iface >> 16),
-            (uint8_t) (netenv_ip_iface >>  8),
-            (uint8_t) (netenv_ip_iface      ));
-
-    strcpy_s(
-            iface.IpMask.String,
-            _countof(iface.IpMask.String),
-            "255.255.255.0");
+    netenv_tmpl_emit(&netenv_info_tmpl, ai);
 
-    sprintf_s(
-            router.IpAddress.String,
-            _countof(iface.IpAddress.String),
-            "%i.%i.%i.%i",
-            (uint8_t) (netenv_ip_router >> 24),
-            (uint8_t) (netenv_ip_router >> 16),
-            (uint8_t) (netenv_ip_router >>  8),
-            (uint8_t) (netenv_ip_router      ));
-
-    strcpy_s(
-            router.IpMask.String,
-            _countof(router.IpMask.String),
-            "255.255.255.0");
+    now = time(NULL);
 
-    memset(ai, 0, sizeof(*ai));
-    strcpy_s(
-            ai->AdapterName,
-            _countof(ai->AdapterName),
-            "Fake Ethernet");
-    strcpy_s(ai->Description,
-            _countof(ai->Description),
-            "Adapter Description");
-    ai->AddressLength = sizeof(netenv_mac_addr);
-    memcpy(ai->Address, netenv_mac_addr, sizeof(netenv_mac_addr));
-    ai->Index = 1;
-    ai->Type = MIB_IF_TYPE_ETHERNET;
-    ai->DhcpEnabled = 1;
-    memcpy(&ai->IpAddressList, &iface, sizeof(iface));
-    memcpy(&ai->GatewayList, &router, sizeof(router));
-    memcpy(&ai->DhcpServer, &router, sizeof(router));
-    ai->LeaseObtained = time(NULL) - 3600;
-    ai->LeaseExpires = time(NULL) + 86400;
+    for (i = 0 ; i < netenv_nadapters ; i++) {
+        ai[i].LeaseObtained = now - 3600;
+        ai[i].LeaseExpires = now + 86400;
+    }
 
     return ERROR_SUCCESS;
 }
@@ -396,34 +621,24 @@ static uint32_t WINAPI hook_GetIfTable(
         uint32_t *pdwSize,
         BOOL bOrder)
 {
-    MIB_IFROW *row;
+    uint32_t size;
     uint32_t nbytes;
 
     if (pdwSize == NULL) {
         return ERROR_INVALID_PARAMETER;
     }
 
+    size = offsetof(struct netenv_if_table, table)
+            + netenv_nadapters * sizeof(MIB_IFROW);
+
     nbytes = *pdwSize;
-    *pdwSize = sizeof(*row) + sizeof(DWORD);
+    *pdwSize = size;
 
-    if (pIfTable == NULL || nbytes < sizeof(*row) + sizeof(DWORD)) {
+    if (pIfTable == NULL || nbytes < size) {
         return ERROR_BUFFER_OVERFLOW;
     }
 
-    pIfTable->dwNumEntries = 1;
-
-    row = pIfTable->table;
-    memset(row, 0, sizeof(*row));
-
-    wcscpy_s(row->wszName, _countof(row->wszName), L"Fake Ethernet");
-    row->dwIndex = 1; /* Should match other IF_INDEX fields we return */
-    row->dwType = IF_TYPE_ETHERNET_CSMACD;
-    row->dwMtu = 4200; /* I guess? */
-    row->dwSpeed = 1000000000;
-    row->dwPhysAddrLen = sizeof(netenv_mac_addr);
-    memcpy(row->bPhysAddr, netenv_mac_addr, sizeof(netenv_mac_addr));
-    row->dwAdminStatus = 1;
-    row->dwOperStatus = IF_OPER_STATUS_OPERATIONAL;
+    memcpy(pIfTable, &netenv_if_table, size);
 
     return ERROR_SUCCESS;
 }
@@ -441,8 +656,10 @@ static uint32_t WINAPI hook_IcmpSendEcho2(
         uint32_t ReplySize,
         uint32_t Timeout)
 {
-    ICMP_ECHO_REPLY *pong;
-    BOOL ok;
+    struct netenv_ping *ping;
+    uint32_t rtt;
+    bool lost;
+    HRESULT hr;
 
     if (IcmpHandle == NULL || IcmpHandle == INVALID_HANDLE_VALUE) {
         SetLastError(ERROR_INVALID_PARAMETER);
@@ -450,13 +667,6 @@ static uint32_t WINAPI hook_IcmpSendEcho2(
         return 0;
     }
 
-    if (ApcRoutine != NULL) {
-        dprintf("%s: Got APC routine...\n", __func__);
-        SetLastError(ERROR_NOT_SUPPORTED);
-
-        return 0;
-    }
-
     if (ReplyBuffer == NULL) {
         SetLastError(ERROR_INVALID_PARAMETER);
 
@@ -472,27 +682,261 @@ static uint32_t WINAPI hook_IcmpSendEcho2(
     dprintf("Netenv: Virtualized ICMP Ping to ip4 %x\n",
             (int) _byteswap_ulong(DestinationAddress));
 
-    pong = (ICMP_ECHO_REPLY *) ReplyBuffer;
-    memset(pong, 0, sizeof(*pong));
-    pong->Address = DestinationAddress;
-    pong->Status = IP_SUCCESS;
-    pong->RoundTripTime = 1;
-    pong->DataSize = 0;
-    pong->Reserved = 1; /* Number of ICMP_ECHO_REPLY structs in ReplyBuffer */
-    pong->Data = NULL;
+    rtt = netenv_ping_roll(Timeout, &lost);
+
+    if (Event == NULL && ApcRoutine == NULL) {
+        /* Synchronous call, so just block for the simulated round trip */
+        Sleep(rtt);
+        netenv_ping_fill(ReplyBuffer, DestinationAddress, rtt, lost);
 
-    if (Event != NULL) {
-        ok = SetEvent(Event);
+        if (lost) {
+            SetLastError(IP_REQ_TIMED_OUT);
 
-        if (ok) {
-            SetLastError(ERROR_IO_PENDING);
+            return 0;
         }
 
+        SetLastError(ERROR_SUCCESS);
+
+        return 1;
+    }
+
+    ping = calloc(1, sizeof(*ping));
+
+    if (ping == NULL) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+
         return 0;
     }
 
-    dprintf("%s: Unexpected synchronous call...\n", __func__);
-    SetLastError(ERROR_SUCCESS);
+    ping->due = GetTickCount64() + rtt;
+    ping->reply = ReplyBuffer;
+    ping->dest = DestinationAddress;
+    ping->rtt = rtt;
+    ping->lost = lost;
+    ping->event = Event;
+    ping->apc = ApcRoutine;
+    ping->apc_ctx = ApcContext;
+
+    if (ApcRoutine != NULL) {
+        /* The APC has to run on the calling thread, during an alertable
+           wait, same as it would for the real thing. */
+
+        ping->thread = OpenThread(
+                THREAD_SET_CONTEXT,
+                FALSE,
+                GetCurrentThreadId());
+
+        if (ping->thread == NULL) {
+            free(ping);
+
+            return 0;
+        }
+    }
+
+    hr = netenv_ping_submit(ping);
+
+    if (FAILED(hr)) {
+        if (ping->thread != NULL) {
+            CloseHandle(ping->thread);
+        }
+
+        free(ping);
+        SetLastError(HRESULT_CODE(hr));
+
+        return 0;
+    }
+
+    SetLastError(ERROR_IO_PENDING);
+
+    return 0;
+}
+
+static uint32_t netenv_ping_roll(uint32_t timeout, bool *lost)
+{
+    uint32_t x;
+    uint32_t roll;
+    int64_t rtt;
+
+    /* xorshift32, so that a given seed always produces the same sequence of
+       round trip times and losses. */
+
+    EnterCriticalSection(&netenv_ping_lock);
+
+    x = netenv_ping_rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    netenv_ping_rng = x;
+
+    LeaveCriticalSection(&netenv_ping_lock);
+
+    *lost = (x % 100) < netenv_ping_loss;
+
+    if (*lost) {
+        return timeout;
+    }
+
+    /* Jitter is spread evenly over [rtt - jitter, rtt + jitter] */
+
+    rtt = netenv_ping_rtt;
+
+    if (netenv_ping_jitter != 0) {
+        roll = (x >> 8) % (2 * netenv_ping_jitter + 1);
+        rtt += (int64_t) roll - netenv_ping_jitter;
+    }
+
+    if (rtt < 0) {
+        rtt = 0;
+    }
+
+    /* A reply that would arrive after the timeout is as good as lost */
+
+    if (rtt > timeout) {
+        *lost = true;
+
+        return timeout;
+    }
+
+    return (uint32_t) rtt;
+}
+
+static void netenv_ping_fill(
+        ICMP_ECHO_REPLY *reply,
+        uint32_t dest,
+        uint32_t rtt,
+        bool lost)
+{
+    memset(reply, 0, sizeof(*reply));
+    reply->Address = dest;
+    reply->Status = lost ? IP_REQ_TIMED_OUT : IP_SUCCESS;
+    reply->RoundTripTime = lost ? 0 : rtt;
+    reply->DataSize = 0;
+    reply->Reserved = 1; /* Number of ICMP_ECHO_REPLY structs in ReplyBuffer */
+    reply->Data = NULL;
+}
+
+static HRESULT netenv_ping_submit(struct netenv_ping *ping)
+{
+    struct netenv_ping **pos;
+    HRESULT hr;
+
+    EnterCriticalSection(&netenv_ping_lock);
+
+    if (netenv_ping_thread == NULL) {
+        /* Ensure our completion thread is running */
+        netenv_ping_thread = (HANDLE) _beginthreadex(
+                NULL,
+                0,
+                netenv_ping_thread_proc,
+                NULL,
+                0,
+                NULL);
+
+        if (netenv_ping_thread == NULL) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+
+            goto end;
+        }
+    }
+
+    /* Keep the queue sorted by due time, ties complete in call order */
+
+    for (pos = &netenv_ping_queue ; *pos != NULL ; pos = &(*pos)->next) {
+        if ((*pos)->due > ping->due) {
+            break;
+        }
+    }
+
+    ping->next = *pos;
+    *pos = ping;
+
+    WakeConditionVariable(&netenv_ping_cond);
+    hr = S_OK;
+
+end:
+    LeaveCriticalSection(&netenv_ping_lock);
+
+    return hr;
+}
+
+static unsigned int __stdcall netenv_ping_thread_proc(void *ctx)
+{
+    struct netenv_ping *ping;
+    ULONGLONG now;
+    DWORD wait;
+
+    for (;;) {
+        EnterCriticalSection(&netenv_ping_lock);
+
+        ping = NULL;
+        now = GetTickCount64();
+
+        if (netenv_ping_queue == NULL) {
+            wait = INFINITE;
+        } else if (netenv_ping_queue->due > now) {
+            wait = (DWORD) (netenv_ping_queue->due - now);
+        } else {
+            ping = netenv_ping_queue;
+            netenv_ping_queue = ping->next;
+        }
+
+        if (ping == NULL) {
+            /* Times out when the head of the queue falls due, or wakes up
+               early if something due sooner gets submitted. */
+            SleepConditionVariableCS(
+                    &netenv_ping_cond,
+                    &netenv_ping_lock,
+                    wait);
+        }
+
+        LeaveCriticalSection(&netenv_ping_lock);
+
+        if (ping != NULL) {
+            netenv_ping_complete(ping);
+        }
+    }
+
+    return 0;
+}
+
+static void netenv_ping_complete(struct netenv_ping *ping)
+{
+    HANDLE event;
+
+    netenv_ping_fill(ping->reply, ping->dest, ping->rtt, ping->lost);
+
+    /* Take our own copy of the event before anything wakes the caller; see
+       the comment in util/async.c for why. */
+
+    event = ping->event;
+    MemoryBarrier();
+
+    if (ping->apc != NULL) {
+        ping->iosb.Status = 0; /* STATUS_SUCCESS */
+        ping->iosb.Information = sizeof(ICMP_ECHO_REPLY);
+
+        if (!QueueUserAPC(netenv_ping_apc, ping->thread, (ULONG_PTR) ping)) {
+            dprintf("Netenv: QueueUserAPC failed: %x\n",
+                    (int) GetLastError());
+            CloseHandle(ping->thread);
+            free(ping);
+        }
+    } else {
+        free(ping);
+    }
+
+    if (event != NULL) {
+        SetEvent(event);
+    }
+}
+
+static void CALLBACK netenv_ping_apc(ULONG_PTR param)
+{
+    struct netenv_ping *ping;
+
+    ping = (struct netenv_ping *) param;
+    ping->apc(ping->apc_ctx, &ping->iosb, 0);
 
-    return 1;
+    CloseHandle(ping->thread);
+    free(ping);
 }
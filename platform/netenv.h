@@ -12,6 +12,11 @@ struct netenv_config {
     uint8_t addr_suffix;
     uint8_t router_suffix;
     uint8_t mac_addr[6];
+    uint8_t adapters;
+    uint32_t ping_rtt;
+    uint32_t ping_jitter;
+    uint32_t ping_loss;
+    uint32_t ping_seed;
 };
 
 HRESULT netenv_hook_init(
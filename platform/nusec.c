@@ -1,5 +1,6 @@
 #include <windows.h>
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,6 +36,27 @@ struct nusec_log_record {
     uint8_t unknown[60];
 };
 
+#define NUSEC_STORE_MAGIC   0x4345534E /* "NSEC" */
+#define NUSEC_LOG_RECORDS   7154
+
+/* Layout of the keychip's backing file, which is mapped into memory for as
+   long as the process runs. The trace log is a ring indexed by free-running
+   head and tail counters, records live at (counter % NUSEC_LOG_RECORDS). */
+
+struct nusec_store {
+    uint32_t magic;
+    uint32_t nrecords;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t nearfull;
+    uint32_t play_count;
+    uint32_t play_limit;
+    uint32_t reserved;
+    struct nusec_log_record log[NUSEC_LOG_RECORDS];
+};
+
+static HRESULT nusec_store_open(const wchar_t *path);
+
 static HRESULT nusec_handle_irp(struct irp *irp);
 static HRESULT nusec_handle_open(struct irp *irp);
 static HRESULT nusec_handle_close(struct irp *irp);
@@ -102,12 +124,8 @@ static const struct reg_hook_val nusec_reg_vals[] = {
 };
 
 static HANDLE nusec_fd;
-static uint32_t nusec_nearfull;
-static uint32_t nusec_play_count;
-static uint32_t nusec_play_limit;
-static struct nusec_log_record nusec_log[7154];
-static size_t nusec_log_head;
-static size_t nusec_log_tail;
+static struct nusec_store *nusec_store;
+static struct nusec_store nusec_store_fallback;
 static struct nusec_config nusec_cfg;
 
 HRESULT nusec_hook_init(
@@ -135,9 +153,23 @@ HRESULT nusec_hook_init(
         memcpy(nusec_cfg.platform_id, platform_id, sizeof(nusec_cfg.platform_id));
     }
 
-    nusec_nearfull = 0x00010200;
-    nusec_play_count = 0;
-    nusec_play_limit = 1024;
+    hr = nusec_store_open(nusec_cfg.nvram);
+
+    if (FAILED(hr)) {
+        /* Not fatal, the game can still run, it just forgets everything
+           when it exits. */
+        dprintf("Security: Keeping trace log and counters in memory only\n");
+        nusec_store = &nusec_store_fallback;
+    }
+
+    if (nusec_store->magic != NUSEC_STORE_MAGIC) {
+        memset(nusec_store, 0, sizeof(*nusec_store));
+        nusec_store->magic = NUSEC_STORE_MAGIC;
+        nusec_store->nrecords = NUSEC_LOG_RECORDS;
+        nusec_store->nearfull = 0x00010200;
+        nusec_store->play_count = 0;
+        nusec_store->play_limit = 1024;
+    }
 
     hr = iohook_open_nul_fd(&nusec_fd);
 
@@ -164,6 +196,125 @@ HRESULT nusec_hook_init(
     return S_OK;
 }
 
+static HRESULT nusec_store_open(const wchar_t *path)
+{
+    LARGE_INTEGER size;
+    HANDLE file;
+    HANDLE mapping;
+    void *view;
+    bool resized;
+    HRESULT hr;
+    BOOL ok;
+
+    mapping = NULL;
+    resized = false;
+
+    file = CreateFileW(
+            path,
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Security: Error opening %S: %x\n", path, (int) hr);
+
+        goto end;
+    }
+
+    ok = GetFileSizeEx(file, &size);
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Security: GetFileSizeEx failed: %x\n", (int) hr);
+
+        goto end;
+    }
+
+    /* A file of the wrong size is from something else, so start over. Our
+       caller initializes the store if it fails the magic check. */
+
+    if (size.QuadPart != sizeof(struct nusec_store)) {
+        size.QuadPart = sizeof(struct nusec_store);
+        ok = SetFilePointerEx(file, size, NULL, FILE_BEGIN);
+
+        if (ok) {
+            ok = SetEndOfFile(file);
+        }
+
+        if (!ok) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            dprintf("Security: Error resizing %S: %x\n", path, (int) hr);
+
+            goto end;
+        }
+
+        resized = true;
+    }
+
+    mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+
+    if (mapping == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Security: CreateFileMappingW failed: %x\n", (int) hr);
+
+        goto end;
+    }
+
+    view = MapViewOfFile(
+            mapping,
+            FILE_MAP_WRITE,
+            0,
+            0,
+            sizeof(struct nusec_store));
+
+    if (view == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Security: MapViewOfFile failed: %x\n", (int) hr);
+
+        goto end;
+    }
+
+    /* The view keeps the mapping (and so the file) alive, and stays put
+       until the process exits. Dirty pages get written back by the OS even
+       if we crash. */
+
+    nusec_store = view;
+
+    /* A file laid out for a different ring size is from something else, so
+       it gets reset as well. */
+
+    if (resized || nusec_store->nrecords != NUSEC_LOG_RECORDS) {
+        nusec_store->magic = 0;
+    }
+
+    /* The log indexes below trust head and tail to be at most one ring's
+       worth apart. If a store of ours breaks that, only the trace log is
+       lost: the play counters and limits are still good. */
+
+    if (    nusec_store->magic == NUSEC_STORE_MAGIC &&
+            nusec_store->head - nusec_store->tail > NUSEC_LOG_RECORDS) {
+        dprintf("Security: %S has a corrupt trace log, clearing it\n", path);
+        nusec_store->tail = nusec_store->head;
+    }
+
+    hr = S_OK;
+
+end:
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
 static HRESULT nusec_handle_irp(struct irp *irp)
 {
     assert(irp != NULL);
@@ -276,13 +427,13 @@ static HRESULT nusec_ioctl_erase_trace_log(struct irp *irp)
 
     dprintf("Security: %s(count=%i)\n", __func__, count);
 
-    avail = nusec_log_head - nusec_log_tail;
+    avail = nusec_store->head - nusec_store->tail;
 
-    if (count < avail) {
+    if (count > avail) {
         count = avail;
     }
 
-    nusec_log_tail += count;
+    nusec_store->tail += count;
 
     return S_OK;
 }
@@ -299,13 +450,13 @@ static HRESULT nusec_ioctl_add_play_count(struct irp *irp)
     }
 
     dprintf("Security: Add play count: %i + %i = %i\n",
-            nusec_play_count,
+            nusec_store->play_count,
             delta,
-            nusec_play_count + delta);
+            nusec_store->play_count + delta);
 
-    nusec_play_count += delta;
+    nusec_store->play_count += delta;
 
-    return iobuf_write_le32(&irp->read, nusec_play_count);
+    return iobuf_write_le32(&irp->read, nusec_store->play_count);
 }
 
 static HRESULT nusec_ioctl_get_billing_ca_cert(struct irp *irp)
@@ -408,7 +559,7 @@ static HRESULT nusec_ioctl_get_nearfull(struct irp *irp)
 {
     dprintf("Security: %s\n", __func__);
 
-    return iobuf_write_le32(&irp->read, nusec_nearfull);
+    return iobuf_write_le32(&irp->read, nusec_store->nearfull);
 }
 
 static HRESULT nusec_ioctl_get_nvram_available(struct irp *irp)
@@ -416,8 +567,8 @@ static HRESULT nusec_ioctl_get_nvram_available(struct irp *irp)
     size_t used;
     size_t avail;
 
-    used = nusec_log_head - nusec_log_tail;
-    avail = _countof(nusec_log) - used;
+    used = nusec_store->head - nusec_store->tail;
+    avail = NUSEC_LOG_RECORDS - used;
 
     dprintf("Security: %s: used=%i avail=%i\n", __func__,
             (int) used,
@@ -442,20 +593,22 @@ static HRESULT nusec_ioctl_get_play_count(struct irp *irp)
 {
     dprintf("Security: %s\n", __func__);
 
-    return iobuf_write_le32(&irp->read, nusec_play_count);
+    return iobuf_write_le32(&irp->read, nusec_store->play_count);
 }
 
 static HRESULT nusec_ioctl_get_play_limit(struct irp *irp)
 {
     dprintf("Security: %s\n", __func__);
 
-    return iobuf_write_le32(&irp->read, nusec_play_limit);
+    return iobuf_write_le32(&irp->read, nusec_store->play_limit);
 }
 
 static HRESULT nusec_ioctl_get_trace_log_data(struct irp *irp)
 {
     uint32_t pos;
     uint32_t count;
+    uint32_t first;
+    uint32_t nrun;
     size_t avail;
     HRESULT hr;
 
@@ -475,24 +628,46 @@ static HRESULT nusec_ioctl_get_trace_log_data(struct irp *irp)
 
     dprintf("    Params: %i %i Buf: %i\n", pos, count, (int) irp->read.nbytes);
 
+    /* Clamp to the records between pos and the head. A pos that isn't in
+       the ring at all gets nothing. Do this before checking the buffer, and
+       check it in 64 bits, so that a huge count can't wrap the size. */
+
+    if (nusec_store->head - pos > NUSEC_LOG_RECORDS) {
+        count = 0;
+    } else if (count > nusec_store->head - pos) {
+        count = nusec_store->head - pos;
+    }
+
     avail = irp->read.nbytes - irp->read.pos;
 
-    if (avail < count * sizeof(struct nusec_log_record)) {
+    if ((uint64_t) avail < (uint64_t) count * sizeof(struct nusec_log_record)) {
         dprintf("\tError: Insufficient buffer\n");
 
         return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
     }
 
-    while (count > 0 && pos != nusec_log_head) {
-        memcpy( &irp->read.bytes[irp->read.pos],
-                &nusec_log[pos % _countof(nusec_log)],
-                sizeof(struct nusec_log_record));
+    /* The requested records occupy at most two contiguous runs of the ring:
+       up to its end, then from its start. */
 
-        irp->read.pos += sizeof(struct nusec_log_record);
-        pos++;
-        count--;
+    first = pos % NUSEC_LOG_RECORDS;
+    nrun = NUSEC_LOG_RECORDS - first;
+
+    if (nrun > count) {
+        nrun = count;
     }
 
+    memcpy( &irp->read.bytes[irp->read.pos],
+            &nusec_store->log[first],
+            nrun * sizeof(struct nusec_log_record));
+
+    irp->read.pos += nrun * sizeof(struct nusec_log_record);
+
+    memcpy( &irp->read.bytes[irp->read.pos],
+            &nusec_store->log[0],
+            (count - nrun) * sizeof(struct nusec_log_record));
+
+    irp->read.pos += (count - nrun) * sizeof(struct nusec_log_record);
+
     return S_OK;
 }
 
@@ -502,11 +677,11 @@ static HRESULT nusec_ioctl_get_trace_log_state(struct irp *irp)
 
     dprintf("Security: %s H: %i T: %i\n",
             __func__,
-            (int) nusec_log_head,
-            (int) nusec_log_tail);
+            (int) nusec_store->head,
+            (int) nusec_store->tail);
 
-         iobuf_write_le32(&irp->read, nusec_log_head - nusec_log_tail);
-    hr = iobuf_write_le32(&irp->read, nusec_log_tail);
+         iobuf_write_le32(&irp->read, nusec_store->head - nusec_store->tail);
+    hr = iobuf_write_le32(&irp->read, nusec_store->tail);
 
     return hr;
 }
@@ -516,7 +691,7 @@ static HRESULT nusec_ioctl_put_nearfull(struct irp *irp)
     dprintf("Security: %s\n", __func__);
     dump_const_iobuf(&irp->write);
 
-    return iobuf_read_le32(&irp->write, &nusec_nearfull);
+    return iobuf_read_le32(&irp->write, &nusec_store->nearfull);
 }
 
 static HRESULT nusec_ioctl_put_play_limit(struct irp *irp)
@@ -524,13 +699,12 @@ static HRESULT nusec_ioctl_put_play_limit(struct irp *irp)
     dprintf("Security: %s\n", __func__);
     dump_const_iobuf(&irp->write);
 
-    return iobuf_read_le32(&irp->write, &nusec_play_limit);
+    return iobuf_read_le32(&irp->write, &nusec_store->play_limit);
 }
 
 static HRESULT nusec_ioctl_put_trace_log_data(struct irp *irp)
 {
     dprintf("Security: %s\n", __func__);
-    dump_const_iobuf(&irp->write);
 
     if (irp->write.nbytes != sizeof(struct nusec_log_record)) {
         dprintf("    Log record size is incorrect\n");
@@ -538,19 +712,21 @@ static HRESULT nusec_ioctl_put_trace_log_data(struct irp *irp)
         return E_INVALIDARG;
     }
 
-    if (nusec_log_head - nusec_log_tail >= _countof(nusec_log)) {
+    if (nusec_store->head - nusec_store->tail >= NUSEC_LOG_RECORDS) {
         dprintf("    Log buffer is full!\n");
 
         return HRESULT_FROM_WIN32(ERROR_DISK_FULL);
     }
 
-    memcpy( &nusec_log[nusec_log_head % _countof(nusec_log)],
+    memcpy( &nusec_store->log[nusec_store->head % NUSEC_LOG_RECORDS],
             irp->write.bytes,
             sizeof(struct nusec_log_record));
 
-    nusec_log_head++;
+    nusec_store->head++;
 
-    dprintf("    H: %i T: %i\n", (int) nusec_log_head, (int) nusec_log_tail);
+    dprintf("    H: %i T: %i\n",
+            (int) nusec_store->head,
+            (int) nusec_store->tail);
 
     return S_OK;
 }
@@ -16,6 +16,7 @@ struct nusec_config {
     uint32_t subnet;
     wchar_t billing_ca[MAX_PATH];
     wchar_t billing_pub[MAX_PATH];
+    wchar_t nvram[MAX_PATH];
 };
 
 HRESULT nusec_hook_init(
@@ -7,6 +7,8 @@
 
 #include "hook/table.h"
 
+#include "hooklib/iat.h"
+
 #include "platform/pcbid.h"
 
 #include "util/dprintf.h"
@@ -37,7 +39,7 @@ HRESULT pcbid_hook_init(const struct pcbid_config *cfg)
     }
 
     memcpy(&pcbid_cfg, cfg, sizeof(*cfg));
-    hook_table_apply(NULL, "kernel32.dll", pcbid_syms, _countof(pcbid_syms));
+    iat_hook_push(NULL, "kernel32.dll", pcbid_syms, _countof(pcbid_syms));
 
     return S_OK;
 }
@@ -2,6 +2,8 @@
 
 #include <windows.h>
 
+#include "hooklib/reg.h"
+
 #include "platform/amvideo.h"
 #include "platform/clock.h"
 #include "platform/dns.h"
@@ -21,6 +23,7 @@ struct platform_config {
     struct hwreset_config hwreset;
     struct misc_config misc;
     struct pcbid_config pcbid;
+    struct reg_config reg;
     struct netenv_config netenv;
     struct nusec_config nusec;
     struct vfs_config vfs;
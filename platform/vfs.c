@@ -2,37 +2,92 @@
 #include <shlwapi.h>
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wctype.h>
 
 #include "hooklib/path.h"
 #include "hooklib/reg.h"
 
 #include "platform/vfs.h"
+#include "platform/vfspack.h"
 
 #include "util/dprintf.h"
 
+/* Per-directory listings of overlay layers, used to work out which layer a
+   path lives in without probing each layer's file system. Names are stored
+   case-folded and sorted. Lower layers never change underneath us; upper
+   layer listings are patched or invalidated as the overlay's own write and
+   delete operations go through. Every change bumps the listing's generation,
+   so a directory read that raced with one is not installed. */
+
+enum {
+    VFS_LISTING_BUCKETS = 256,
+};
+
+struct vfs_listing {
+    struct vfs_listing *next;
+    uint32_t hash;
+    wchar_t *dir;
+    wchar_t **names;
+    size_t nnames;
+    uint32_t generation;
+    bool stale;
+};
+
+static HRESULT vfs_mount(const wchar_t *src, const wchar_t *dest, bool cache);
+static HRESULT vfs_mount_overlay(struct vfs_overlay *ov);
+static HRESULT vfs_overlay_resolve(
+        void *ctx,
+        const wchar_t *rel,
+        enum path_access access,
+        wchar_t **out);
+static HRESULT vfs_overlay_locate(
+        const struct vfs_overlay *ov,
+        const wchar_t *rel,
+        const wchar_t **layer);
+static HRESULT vfs_overlay_copy_up(
+        const struct vfs_overlay *ov,
+        const wchar_t *rel,
+        const wchar_t *lower);
+static HRESULT vfs_overlay_list(
+        const struct vfs_overlay *ov,
+        const wchar_t *rel,
+        wchar_t **out);
+static HRESULT vfs_join(
+        wchar_t *out,
+        size_t max_count,
+        const wchar_t *root,
+        const wchar_t *rel);
+static HRESULT vfs_listing_split(
+        const wchar_t *path,
+        wchar_t *dir,
+        wchar_t *name,
+        uint32_t *hash);
+static uint32_t vfs_listing_hash(const wchar_t *dir);
+static struct vfs_listing *vfs_listing_find_locked(
+        uint32_t hash,
+        const wchar_t *dir);
+static bool vfs_listing_has_locked(
+        const struct vfs_listing *listing,
+        const wchar_t *name);
+static HRESULT vfs_listing_contains(const wchar_t *path, bool *found);
+static HRESULT vfs_listing_load(const wchar_t *dir, struct vfs_listing *out);
+static void vfs_listing_free_names(struct vfs_listing *listing);
+static void vfs_listing_add(const wchar_t *path);
+static void vfs_listing_invalidate(const wchar_t *path);
+static int vfs_name_cmp(const void *lhs, const void *rhs);
 static void vfs_fixup_path(wchar_t *path, size_t max_count);
+static void vfs_strip_separators(wchar_t *path);
 static HRESULT vfs_mkdir_rec(const wchar_t *path);
-static HRESULT vfs_path_hook(const wchar_t *src, wchar_t *dest, size_t *count);
-static HRESULT vfs_path_hook_nthome(
-        const wchar_t *src,
-        wchar_t *dest,
-        size_t *count);
-static HRESULT vfs_path_hook_option(
-        const wchar_t *src,
-        wchar_t *dest,
-        size_t *count);
 static HRESULT vfs_reg_read_amfs(void *bytes, uint32_t *nbytes);
 static HRESULT vfs_reg_read_appdata(void *bytes, uint32_t *nbytes);
 
 static wchar_t vfs_nthome_real[MAX_PATH];
 static const wchar_t vfs_nthome[] = L"C:\\Documents and Settings\\AppUser";
-static const size_t vfs_nthome_len = _countof(vfs_nthome) - 1;
-
 static const wchar_t vfs_option[] = L"C:\\Mount\\Option";
-static const size_t vfs_option_len = _countof(vfs_option) - 1;
 
 static const struct reg_hook_val vfs_reg_vals[] = {
     {
@@ -47,13 +102,18 @@ static const struct reg_hook_val vfs_reg_vals[] = {
 };
 
 static struct vfs_config vfs_config;
+static SRWLOCK vfs_listing_lock = SRWLOCK_INIT;
+static struct vfs_listing *vfs_listings[VFS_LISTING_BUCKETS];
 
 HRESULT vfs_hook_init(const struct vfs_config *config)
 {
     wchar_t temp[MAX_PATH];
     size_t nthome_len;
     DWORD home_ok;
+    bool option_replaced;
     HRESULT hr;
+    size_t i;
+    size_t j;
 
     assert(config != NULL);
 
@@ -73,10 +133,6 @@ HRESULT vfs_hook_init(const struct vfs_config *config)
         return E_FAIL;
     }
 
-    if (config->option[0] == L'\0') {
-        dprintf("Vfs: WARNING: OPTION path not specified in INI file\n");
-    }
-
     home_ok = GetEnvironmentVariableW(
             L"USERPROFILE",
             vfs_nthome_real,
@@ -92,6 +148,46 @@ HRESULT vfs_hook_init(const struct vfs_config *config)
 
     memcpy(&vfs_config, config, sizeof(*config));
 
+    /* Mount points are compared against each other below and matched as
+       path prefixes later on, so a trailing separator must not make one look
+       different from the same path without it. */
+
+    for (i = 0 ; i < vfs_config.nmounts ; i++) {
+        vfs_strip_separators(vfs_config.mounts[i].src);
+    }
+
+    for (i = 0 ; i < vfs_config.noverlays ; i++) {
+        vfs_strip_separators(vfs_config.overlays[i].src);
+    }
+
+    for (i = 0 ; i < vfs_config.narchives ; i++) {
+        vfs_strip_separators(vfs_config.archives[i].src);
+    }
+
+    option_replaced = false;
+
+    for (i = 0 ; i < vfs_config.noverlays ; i++) {
+        if (path_compare_w(
+                vfs_config.overlays[i].src,
+                vfs_option,
+                MAX_PATH) == 0) {
+            option_replaced = true;
+        }
+    }
+
+    for (i = 0 ; i < vfs_config.narchives ; i++) {
+        if (path_compare_w(
+                vfs_config.archives[i].src,
+                vfs_option,
+                MAX_PATH) == 0) {
+            option_replaced = true;
+        }
+    }
+
+    if (vfs_config.option[0] == L'\0' && !option_replaced) {
+        dprintf("Vfs: WARNING: OPTION path not specified in INI file\n");
+    }
+
     vfs_fixup_path(vfs_nthome_real, _countof(vfs_nthome_real));
     vfs_fixup_path(vfs_config.amfs, _countof(vfs_config.amfs));
     vfs_fixup_path(vfs_config.appdata, _countof(vfs_config.appdata));
@@ -100,6 +196,24 @@ HRESULT vfs_hook_init(const struct vfs_config *config)
         vfs_fixup_path(vfs_config.option, _countof(vfs_config.option));
     }
 
+    for (i = 0 ; i < vfs_config.nmounts ; i++) {
+        vfs_fixup_path(
+                vfs_config.mounts[i].dest,
+                _countof(vfs_config.mounts[i].dest));
+    }
+
+    for (i = 0 ; i < vfs_config.noverlays ; i++) {
+        vfs_fixup_path(
+                vfs_config.overlays[i].upper,
+                _countof(vfs_config.overlays[i].upper));
+
+        for (j = 0 ; j < vfs_config.overlays[i].nlowers ; j++) {
+            vfs_fixup_path(
+                    vfs_config.overlays[i].lowers[j],
+                    _countof(vfs_config.overlays[i].lowers[j]));
+        }
+    }
+
     hr = vfs_mkdir_rec(vfs_config.amfs);
 
     if (FAILED(hr)) {
@@ -130,22 +244,65 @@ HRESULT vfs_hook_init(const struct vfs_config *config)
         dprintf("Vfs: Failed to create %S: %x\n", temp, (int) hr);
     }
 
-    /* Not auto-creating option directory as it is normally a read-only mount */
+    /* Not auto-creating option directory as it is normally a read-only mount,
+       same goes for any additional mounts. All of these end up in the same
+       longest-prefix index, so it doesn't matter how many there are. */
 
-    hr = path_hook_push(vfs_path_hook);
+    hr = vfs_mount(L"E:", vfs_config.amfs, vfs_config.amfs_cache);
 
     if (FAILED(hr)) {
         return hr;
     }
 
-    hr = path_hook_push(vfs_path_hook_nthome);
+    hr = vfs_mount(L"Y:", vfs_config.appdata, vfs_config.appdata_cache);
 
     if (FAILED(hr)) {
         return hr;
     }
 
-    if (vfs_config.option[0] != L'\0') {
-        hr = path_hook_push(vfs_path_hook_option);
+    hr = vfs_mount(vfs_nthome, vfs_nthome_real, false);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* An overlay or archive at the option mount point replaces the plain
+       mount */
+
+    if (vfs_config.option[0] != L'\0' && !option_replaced) {
+        hr = vfs_mount(
+                vfs_option,
+                vfs_config.option,
+                vfs_config.option_cache);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    for (i = 0 ; i < vfs_config.nmounts ; i++) {
+        hr = vfs_mount(
+                vfs_config.mounts[i].src,
+                vfs_config.mounts[i].dest,
+                vfs_config.mounts[i].cache);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    for (i = 0 ; i < vfs_config.noverlays ; i++) {
+        hr = vfs_mount_overlay(&vfs_config.overlays[i]);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+    }
+
+    for (i = 0 ; i < vfs_config.narchives ; i++) {
+        hr = vfspack_mount(
+                vfs_config.archives[i].src,
+                vfs_config.archives[i].path);
 
         if (FAILED(hr)) {
             return hr;
@@ -165,243 +322,904 @@ HRESULT vfs_hook_init(const struct vfs_config *config)
     return S_OK;
 }
 
-static void vfs_fixup_path(wchar_t *path, size_t max_count)
+static HRESULT vfs_mount(const wchar_t *src, const wchar_t *dest, bool cache)
 {
-    size_t count;
-    wchar_t abspath[MAX_PATH];
-
-    assert(path != NULL);
-    /* Requirement for PathIsRelativeW */
-    assert(max_count <= MAX_PATH);
-
-    if (PathIsRelativeW(path)) {
-        count = GetFullPathNameW(path, _countof(abspath), abspath, NULL);
+    HRESULT hr;
 
-        /* GetFullPathName's length return value is tricky, because it includes
-           the NUL terminator on failure, but doesn't on success.
-           Check if it fits the temp buf (else it's a failure and includes NUL
-           anyway), then if it fits the target buf, NUL included. */
-        if (count == 0 || count > _countof(abspath) || count >= max_count) {
-            goto fail;
-        }
+    dprintf("Vfs: Mount %S -> %S%s\n", src, dest, cache ? " (cached)" : "");
 
-        wcscpy_s(path, max_count, abspath);
+    if (cache) {
+        hr = path_hook_push_cached_prefix(src, dest);
     } else {
-        count = wcslen(path);
+        hr = path_hook_push_prefix(src, dest);
     }
 
-    if (path_is_separator_w(path[count - 1])) {
-        return;
+    if (FAILED(hr)) {
+        dprintf("Vfs: Failed to mount %S: %x\n", src, (int) hr);
     }
 
-    if (count + 2 > max_count) {
-        goto fail;
+    return hr;
+}
+
+static HRESULT vfs_mount_overlay(struct vfs_overlay *ov)
+{
+    HRESULT hr;
+    size_t i;
+
+    dprintf("Vfs: Overlay %S -> %S (writable)\n", ov->src, ov->upper);
+
+    for (i = 0 ; i < ov->nlowers ; i++) {
+        dprintf("Vfs:     over %S\n", ov->lowers[i]);
     }
 
-    path[count + 0] = L'\\';
-    path[count + 1] = L'\0';
-    return;
+    /* Unlike a plain mount the upper layer is where new files go, so it has
+       to exist. */
 
-fail:
-    dprintf("Vfs: FATAL: Path too long: %S\n", path);
-    abort();
+    hr = vfs_mkdir_rec(ov->upper);
+
+    if (FAILED(hr)) {
+        dprintf("Vfs: Failed to create overlay dir %S: %x\n",
+                ov->upper,
+                (int) hr);
+
+        return hr;
+    }
+
+    hr = path_hook_push_resolver(ov->src, vfs_overlay_resolve, ov);
+
+    if (FAILED(hr)) {
+        dprintf("Vfs: Failed to mount %S: %x\n", ov->src, (int) hr);
+    }
+
+    return hr;
 }
 
-static HRESULT vfs_mkdir_rec(const wchar_t *path)
+static HRESULT vfs_overlay_resolve(
+        void *ctx,
+        const wchar_t *rel,
+        enum path_access access,
+        wchar_t **out)
 {
-    wchar_t *copy;
-    wchar_t *pos;
-    wchar_t wc;
+    const struct vfs_overlay *ov;
+    const wchar_t *layer;
+    wchar_t trimmed[MAX_PATH];
+    wchar_t path[MAX_PATH];
+    size_t len;
     HRESULT hr;
-    DWORD attr;
-    BOOL ok;
 
-    assert(path != NULL);
+    ov = ctx;
+    *out = NULL;
 
-    copy = _wcsdup(path);
+    if (access == PATH_ACCESS_LIST) {
+        return vfs_overlay_list(ov, rel, out);
+    }
 
-    if (copy == NULL) {
-        hr = HRESULT_FROM_WIN32(ERROR_OUTOFMEMORY);
+    /* Lookups are done on the path without any trailing separators, but the
+       caller's path is passed on to the chosen layer verbatim. */
 
-        goto end;
+    len = wcslen(rel);
+
+    if (len >= _countof(trimmed)) {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
     }
 
-    pos = copy;
+    while (len > 0 && path_is_separator_w(rel[len - 1])) {
+        len--;
+    }
 
-    do {
-        wc = *pos;
+    memcpy(trimmed, rel, len * sizeof(wchar_t));
+    trimmed[len] = L'\0';
 
-        if (wc == L'\0' || wc == L'/' || wc == L'\\') {
-            *pos = L'\0';
-            attr = GetFileAttributesW(copy);
+    hr = vfs_overlay_locate(ov, trimmed, &layer);
 
-            if (attr == INVALID_FILE_ATTRIBUTES) {
-                ok = CreateDirectoryW(copy, NULL);
+    if (FAILED(hr)) {
+        return hr;
+    }
 
-                if (!ok) {
-                    hr = HRESULT_FROM_WIN32(GetLastError());
+    switch (access) {
+    case PATH_ACCESS_WRITE:
+        /* Modifying anything that isn't in the upper layer yet (including
+           creating something that isn't anywhere) copies it up first. */
 
-                    goto end;
-                }
+        if (layer != ov->upper) {
+            hr = vfs_overlay_copy_up(ov, trimmed, layer);
+
+            if (FAILED(hr)) {
+                return hr;
             }
+        }
 
-            *pos = wc;
+        layer = ov->upper;
+
+        break;
+
+    case PATH_ACCESS_DELETE:
+        /* Only the upper layer can be deleted from. There are no whiteouts,
+           so deleting something that only a lower layer has would quietly
+           do nothing: refuse it instead. The listing is patched up lazily
+           because we don't know if the deletion will succeed. */
+
+        if (layer != NULL && layer != ov->upper) {
+            return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
         }
 
-        pos++;
-    } while (wc != L'\0');
+        hr = vfs_join(path, _countof(path), ov->upper, trimmed);
 
-    hr = S_OK;
+        if (FAILED(hr)) {
+            return hr;
+        }
 
-end:
-    free(copy);
+        vfs_listing_invalidate(path);
+        layer = ov->upper;
 
-    return hr;
+        break;
+
+    default:
+        if (layer == NULL) {
+            layer = ov->upper;
+        }
+
+        break;
+    }
+
+    hr = vfs_join(path, _countof(path), layer, rel);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    *out = _wcsdup(path);
+
+    if (*out == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    return S_OK;
 }
 
-static HRESULT vfs_path_hook(const wchar_t *src, wchar_t *dest, size_t *count)
+static HRESULT vfs_overlay_locate(
+        const struct vfs_overlay *ov,
+        const wchar_t *rel,
+        const wchar_t **layer)
 {
-    const wchar_t *redir;
-    size_t required;
-    size_t redir_len;
+    wchar_t path[MAX_PATH];
+    bool found;
+    HRESULT hr;
+    size_t i;
 
-    assert(src != NULL);
-    assert(count != NULL);
+    *layer = NULL;
 
-    if (src[0] == L'\0' || src[1] != L':' || !path_is_separator_w(src[2])) {
-        return S_FALSE;
+    /* The root of the overlay always exists, at least in the upper layer */
+
+    if (rel[0] == L'\0') {
+        *layer = ov->upper;
+
+        return S_OK;
     }
 
-    switch (src[0]) {
-    case L'e':
-    case L'E':
-        redir = vfs_config.amfs;
+    hr = vfs_join(path, _countof(path), ov->upper, rel);
 
-        break;
+    if (FAILED(hr)) {
+        return hr;
+    }
 
-    case L'y':
-    case L'Y':
-        redir = vfs_config.appdata;
+    hr = vfs_listing_contains(path, &found);
 
-        break;
+    if (FAILED(hr)) {
+        return hr;
+    }
 
-    default:
-        return S_FALSE;
+    if (found) {
+        *layer = ov->upper;
+
+        return S_OK;
     }
 
-    /* Cut off <prefix>\, replace with redir path, count NUL terminator */
+    for (i = 0 ; i < ov->nlowers ; i++) {
+        hr = vfs_join(path, _countof(path), ov->lowers[i], rel);
 
-    redir_len = wcslen(redir);
-    required = wcslen(src) - 3 + redir_len + 1;
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        hr = vfs_listing_contains(path, &found);
 
-    if (dest != NULL) {
-        if (required > *count) {
-            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        if (FAILED(hr)) {
+            return hr;
         }
 
-        wcscpy_s(dest, *count, redir);
-        wcscpy_s(dest + redir_len, *count - redir_len, src + 3);
-    }
+        if (found) {
+            *layer = ov->lowers[i];
 
-    *count = required;
+            return S_OK;
+        }
+    }
 
     return S_OK;
 }
 
-static HRESULT vfs_path_hook_nthome(
-        const wchar_t *src,
-        wchar_t *dest,
-        size_t *count)
+static HRESULT vfs_overlay_copy_up(
+        const struct vfs_overlay *ov,
+        const wchar_t *rel,
+        const wchar_t *lower)
 {
-    size_t required;
-    size_t redir_len;
-    size_t shift;
-
-    assert(src != NULL);
-    assert(count != NULL);
+    const wchar_t *parent_layer;
+    wchar_t parent[MAX_PATH];
+    wchar_t dest[MAX_PATH];
+    wchar_t src[MAX_PATH];
+    wchar_t *sep;
+    DWORD attr;
+    HRESULT hr;
+    size_t i;
+    BOOL ok;
 
-    /* Case-insensitive check to see if src starts with vfs_nthome */
+    hr = vfs_join(dest, _countof(dest), ov->upper, rel);
 
-    if (path_compare_w(src, vfs_nthome, vfs_nthome_len) != 0) {
-        return S_FALSE;
+    if (FAILED(hr)) {
+        return hr;
     }
 
-    /* Check if the character after vfs_nthome is a separator or the end of
-       the string */
+    /* Recreate the parent directory in the upper layer, but only if it exists
+       in some layer: creating a file in a directory that doesn't exist has to
+       keep failing the way it normally would. */
 
-    if (!path_is_separator_w(src[vfs_nthome_len]) &&
-            src[vfs_nthome_len] != L'\0')
-    {
-        return S_FALSE;
+    wcscpy_s(parent, _countof(parent), rel);
+    sep = NULL;
+
+    for (i = 0 ; parent[i] != L'\0' ; i++) {
+        if (path_is_separator_w(parent[i])) {
+            sep = &parent[i];
+        }
     }
 
-    /* Cut off the matched <prefix>\, add the replaced prefix, count NUL */
+    if (sep != NULL) {
+        *sep = L'\0';
+        hr = vfs_overlay_locate(ov, parent, &parent_layer);
 
-    shift = path_is_separator_w(src[vfs_nthome_len]) ? 1 : 0;
-    redir_len = wcslen(vfs_nthome_real);
-    required = wcslen(src) - vfs_nthome_len - shift + redir_len + 1;
+        if (FAILED(hr)) {
+            return hr;
+        }
 
-    if (dest != NULL) {
-        if (required > *count) {
-            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        if (parent_layer == NULL) {
+            return S_OK;
         }
 
-        wcscpy_s(dest, *count, vfs_nthome_real);
-        wcscpy_s(dest + redir_len, *count - redir_len, src + vfs_nthome_len + shift);
+        if (parent_layer != ov->upper) {
+            hr = vfs_join(src, _countof(src), ov->upper, parent);
+
+            if (FAILED(hr)) {
+                return hr;
+            }
+
+            hr = vfs_mkdir_rec(src);
+
+            if (FAILED(hr)) {
+                dprintf("Vfs: Failed to create %S: %x\n", src, (int) hr);
+
+                return hr;
+            }
+
+            /* Every directory along the way may be new to the upper layer */
+
+            for (i = 0 ; parent[i] != L'\0' ; i++) {
+                if (path_is_separator_w(parent[i])) {
+                    parent[i] = L'\0';
+                    vfs_join(src, _countof(src), ov->upper, parent);
+                    vfs_listing_add(src);
+                    parent[i] = L'\\';
+                }
+            }
+
+            vfs_join(src, _countof(src), ov->upper, parent);
+            vfs_listing_add(src);
+        }
     }
 
-    *count = required;
+    if (lower != NULL) {
+        hr = vfs_join(src, _countof(src), lower, rel);
+
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        attr = GetFileAttributesW(src);
+
+        if (attr != INVALID_FILE_ATTRIBUTES &&
+                (attr & FILE_ATTRIBUTE_DIRECTORY)) {
+            ok = CreateDirectoryW(dest, NULL);
+        } else {
+            ok = CopyFileW(src, dest, TRUE);
+        }
+
+        if (!ok && GetLastError() != ERROR_ALREADY_EXISTS &&
+                GetLastError() != ERROR_FILE_EXISTS) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            dprintf("Vfs: Failed to copy up %S: %x\n", src, (int) hr);
+
+            return hr;
+        }
+
+        dprintf("Vfs: Copied up %S\n", dest);
+        vfs_listing_add(dest);
+    } else {
+        /* A brand new name: the caller's own CreateFile or CreateDirectory
+           call creates it, and that can still fail. Just have the directory
+           listed again once it's done. (Until then the name is missing from
+           every layer, and such names resolve to the upper layer anyway.) */
+
+        vfs_listing_invalidate(dest);
+    }
 
     return S_OK;
 }
 
-static HRESULT vfs_path_hook_option(
-        const wchar_t *src,
-        wchar_t *dest,
-        size_t *count)
+static HRESULT vfs_overlay_list(
+        const struct vfs_overlay *ov,
+        const wchar_t *rel,
+        wchar_t **out)
 {
-    size_t required;
-    size_t redir_len;
-    size_t shift;
+    const wchar_t *layer;
+    wchar_t *list;
+    wchar_t *pos;
+    size_t rel_len;
+    size_t nchars;
+    size_t len;
+    size_t i;
+
+    /* Layer paths end in a separator, and a pattern that ends in one matches
+       nothing, so a search for the overlay root lists its contents. */
 
-    assert(src != NULL);
-    assert(count != NULL);
+    if (rel[0] == L'\0') {
+        rel = L"*";
+    }
 
-    /* Case-insensitive check to see if src starts with vfs_option */
+    /* One pattern per layer, upper first, then an empty terminator */
 
-    if (path_compare_w(src, vfs_option, vfs_option_len) != 0) {
-        return S_FALSE;
+    rel_len = wcslen(rel);
+    nchars = wcslen(ov->upper) + rel_len + 2;
+
+    for (i = 0 ; i < ov->nlowers ; i++) {
+        nchars += wcslen(ov->lowers[i]) + rel_len + 1;
     }
 
-    /* Check if the character after vfs_nthome is a separator or the end of
-       the string */
+    list = malloc(nchars * sizeof(wchar_t));
 
-    if (!path_is_separator_w(src[vfs_option_len]) &&
-            src[vfs_option_len] != L'\0')
-    {
-        return S_FALSE;
+    if (list == NULL) {
+        return E_OUTOFMEMORY;
     }
 
-    /* Cut off the matched <prefix>\, add the replaced prefix, count NUL */
+    pos = list;
 
-    shift = path_is_separator_w(src[vfs_option_len]) ? 1 : 0;
-    redir_len = wcslen(vfs_config.option);
-    required = wcslen(src) - vfs_option_len - shift + redir_len + 1;
+    for (i = 0 ; i <= ov->nlowers ; i++) {
+        layer = i == 0 ? ov->upper : ov->lowers[i - 1];
+        len = wcslen(layer);
 
-    if (dest != NULL) {
-        if (required > *count) {
-            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
-        }
+        memcpy(pos, layer, len * sizeof(wchar_t));
+        pos += len;
+        memcpy(pos, rel, (rel_len + 1) * sizeof(wchar_t));
+        pos += rel_len + 1;
+    }
+
+    *pos = L'\0';
+    *out = list;
+
+    return S_OK;
+}
+
+static HRESULT vfs_join(
+        wchar_t *out,
+        size_t max_count,
+        const wchar_t *root,
+        const wchar_t *rel)
+{
+    size_t root_len;
+    size_t rel_len;
+
+    /* Roots have been through vfs_fixup_path, so they end in a separator */
 
-        wcscpy_s(dest, *count, vfs_config.option);
-        wcscpy_s(dest + redir_len, *count - redir_len, src + vfs_option_len + shift);
+    root_len = wcslen(root);
+    rel_len = wcslen(rel);
+
+    if (root_len + rel_len + 1 > max_count) {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
     }
 
-    *count = required;
+    memcpy(out, root, root_len * sizeof(wchar_t));
+    memcpy(out + root_len, rel, (rel_len + 1) * sizeof(wchar_t));
 
     return S_OK;
 }
 
+static HRESULT vfs_listing_split(
+        const wchar_t *path,
+        wchar_t *dir,
+        wchar_t *name,
+        uint32_t *hash)
+{
+    size_t dir_len;
+    size_t len;
+    size_t i;
+    wchar_t c;
+
+    /* Fold the whole path, cut it after the last separator and hash the
+       directory part. Both buffers are MAX_PATH long. */
+
+    len = wcslen(path);
+
+    if (len >= MAX_PATH) {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+
+    dir_len = 0;
+
+    for (i = 0 ; i < len ; i++) {
+        c = path[i] == L'/' ? L'\\' : towlower(path[i]);
+        dir[i] = c;
+
+        if (c == L'\\') {
+            dir_len = i + 1;
+        }
+    }
+
+    dir[len] = L'\0';
+    wcscpy_s(name, MAX_PATH, dir + dir_len);
+    dir[dir_len] = L'\0';
+    *hash = vfs_listing_hash(dir);
+
+    return S_OK;
+}
+
+static uint32_t vfs_listing_hash(const wchar_t *dir)
+{
+    uint32_t hash;
+    size_t i;
+
+    /* FNV-1a, over an already folded path */
+
+    hash = 0x811C9DC5;
+
+    for (i = 0 ; dir[i] != L'\0' ; i++) {
+        hash = (hash ^ dir[i]) * 0x01000193;
+    }
+
+    return hash;
+}
+
+static struct vfs_listing *vfs_listing_find_locked(
+        uint32_t hash,
+        const wchar_t *dir)
+{
+    struct vfs_listing *listing;
+
+    for (listing = vfs_listings[hash % VFS_LISTING_BUCKETS] ;
+            listing != NULL ;
+            listing = listing->next) {
+        if (listing->hash == hash && wcscmp(listing->dir, dir) == 0) {
+            return listing;
+        }
+    }
+
+    return NULL;
+}
+
+static bool vfs_listing_has_locked(
+        const struct vfs_listing *listing,
+        const wchar_t *name)
+{
+    return bsearch(
+            &name,
+            listing->names,
+            listing->nnames,
+            sizeof(*listing->names),
+            vfs_name_cmp) != NULL;
+}
+
+static HRESULT vfs_listing_contains(const wchar_t *path, bool *found)
+{
+    struct vfs_listing *listing;
+    struct vfs_listing fresh;
+    wchar_t dir[MAX_PATH];
+    wchar_t name[MAX_PATH];
+    uint32_t generation;
+    uint32_t hash;
+    HRESULT hr;
+
+    *found = false;
+
+    hr = vfs_listing_split(path, dir, name, &hash);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    AcquireSRWLockShared(&vfs_listing_lock);
+    listing = vfs_listing_find_locked(hash, dir);
+
+    if (listing != NULL && !listing->stale) {
+        *found = vfs_listing_has_locked(listing, name);
+        ReleaseSRWLockShared(&vfs_listing_lock);
+
+        return S_OK;
+    }
+
+    ReleaseSRWLockShared(&vfs_listing_lock);
+
+    /* First look at this directory (or the first since it was invalidated).
+       Make sure it has an entry to hang a generation on, list it outside the
+       lock, then install the result unless the entry changed meanwhile. */
+
+    AcquireSRWLockExclusive(&vfs_listing_lock);
+    listing = vfs_listing_find_locked(hash, dir);
+
+    if (listing == NULL) {
+        listing = calloc(1, sizeof(*listing));
+
+        if (listing != NULL) {
+            listing->dir = _wcsdup(dir);
+        }
+
+        if (listing == NULL || listing->dir == NULL) {
+            ReleaseSRWLockExclusive(&vfs_listing_lock);
+            free(listing);
+
+            return E_OUTOFMEMORY;
+        }
+
+        listing->next = vfs_listings[hash % VFS_LISTING_BUCKETS];
+        listing->hash = hash;
+        listing->stale = true;
+        vfs_listings[hash % VFS_LISTING_BUCKETS] = listing;
+    }
+
+    generation = listing->generation;
+    ReleaseSRWLockExclusive(&vfs_listing_lock);
+
+    memset(&fresh, 0, sizeof(fresh));
+    hr = vfs_listing_load(dir, &fresh);
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    /* Listings are never freed, so the entry is still there */
+
+    AcquireSRWLockExclusive(&vfs_listing_lock);
+
+    if (listing->generation != generation) {
+        /* Our read may have missed that change, so don't keep it. It is still
+           good enough to answer this one lookup. */
+
+        ReleaseSRWLockExclusive(&vfs_listing_lock);
+        *found = vfs_listing_has_locked(&fresh, name);
+        vfs_listing_free_names(&fresh);
+
+        return S_OK;
+    }
+
+    vfs_listing_free_names(listing);
+    listing->names = fresh.names;
+    listing->nnames = fresh.nnames;
+    listing->stale = false;
+    listing->generation++;
+    *found = vfs_listing_has_locked(listing, name);
+
+    ReleaseSRWLockExclusive(&vfs_listing_lock);
+
+    return S_OK;
+}
+
+static HRESULT vfs_listing_load(const wchar_t *dir, struct vfs_listing *out)
+{
+    WIN32_FIND_DATAW data;
+    wchar_t pattern[MAX_PATH];
+    wchar_t **new_mem;
+    wchar_t *name;
+    HANDLE find;
+    size_t cap;
+    size_t i;
+    HRESULT hr;
+
+    hr = vfs_join(pattern, _countof(pattern), dir, L"*");
+
+    if (FAILED(hr)) {
+        return hr;
+    }
+
+    find = FindFirstFileW(pattern, &data);
+
+    /* A missing directory is remembered as an empty one */
+
+    if (find == INVALID_HANDLE_VALUE) {
+        if (    GetLastError() == ERROR_FILE_NOT_FOUND ||
+                GetLastError() == ERROR_PATH_NOT_FOUND) {
+            return S_OK;
+        }
+
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    cap = 0;
+
+    do {
+        if (wcscmp(data.cFileName, L".") == 0 ||
+                wcscmp(data.cFileName, L"..") == 0) {
+            continue;
+        }
+
+        if (out->nnames == cap) {
+            cap = cap ? 2 * cap : 32;
+            new_mem = realloc(out->names, cap * sizeof(*new_mem));
+
+            if (new_mem == NULL) {
+                hr = E_OUTOFMEMORY;
+
+                goto fail;
+            }
+
+            out->names = new_mem;
+        }
+
+        name = _wcsdup(data.cFileName);
+
+        if (name == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto fail;
+        }
+
+        for (i = 0 ; name[i] != L'\0' ; i++) {
+            name[i] = towlower(name[i]);
+        }
+
+        out->names[out->nnames++] = name;
+    } while (FindNextFileW(find, &data));
+
+    FindClose(find);
+
+    qsort(out->names, out->nnames, sizeof(*out->names), vfs_name_cmp);
+
+    return S_OK;
+
+fail:
+    FindClose(find);
+    vfs_listing_free_names(out);
+
+    return hr;
+}
+
+static void vfs_listing_free_names(struct vfs_listing *listing)
+{
+    size_t i;
+
+    for (i = 0 ; i < listing->nnames ; i++) {
+        free(listing->names[i]);
+    }
+
+    free(listing->names);
+    listing->names = NULL;
+    listing->nnames = 0;
+}
+
+static void vfs_listing_add(const wchar_t *path)
+{
+    struct vfs_listing *listing;
+    wchar_t dir[MAX_PATH];
+    wchar_t name[MAX_PATH];
+    wchar_t **new_mem;
+    wchar_t *copy;
+    uint32_t hash;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+
+    if (FAILED(vfs_listing_split(path, dir, name, &hash))) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&vfs_listing_lock);
+    listing = vfs_listing_find_locked(hash, dir);
+
+    /* Directories that haven't been listed yet will pick the name up when
+       they are. */
+
+    if (listing == NULL) {
+        goto end;
+    }
+
+    listing->generation++;
+
+    if (listing->stale) {
+        goto end;
+    }
+
+    lo = 0;
+    hi = listing->nnames;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if (wcscmp(listing->names[mid], name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo < listing->nnames && wcscmp(listing->names[lo], name) == 0) {
+        goto end;
+    }
+
+    copy = _wcsdup(name);
+    new_mem = realloc(
+            listing->names,
+            (listing->nnames + 1) * sizeof(*new_mem));
+
+    if (copy == NULL || new_mem == NULL) {
+        free(copy);
+        listing->stale = true;
+
+        goto end;
+    }
+
+    memmove(&new_mem[lo + 1],
+            &new_mem[lo],
+            (listing->nnames - lo) * sizeof(*new_mem));
+    new_mem[lo] = copy;
+    listing->names = new_mem;
+    listing->nnames++;
+
+end:
+    ReleaseSRWLockExclusive(&vfs_listing_lock);
+}
+
+static void vfs_listing_invalidate(const wchar_t *path)
+{
+    struct vfs_listing *listing;
+    wchar_t dir[MAX_PATH];
+    wchar_t name[MAX_PATH];
+    uint32_t hash;
+
+    /* Drop both the listing that contains the path and, in case it is a
+       directory, the path's own listing. */
+
+    if (FAILED(vfs_listing_split(path, dir, name, &hash))) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&vfs_listing_lock);
+    listing = vfs_listing_find_locked(hash, dir);
+
+    if (listing != NULL) {
+        listing->stale = true;
+        listing->generation++;
+    }
+
+    if (wcslen(dir) + wcslen(name) + 2 <= _countof(dir)) {
+        wcscat_s(dir, _countof(dir), name);
+        wcscat_s(dir, _countof(dir), L"\\");
+        listing = vfs_listing_find_locked(vfs_listing_hash(dir), dir);
+
+        if (listing != NULL) {
+            listing->stale = true;
+            listing->generation++;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&vfs_listing_lock);
+}
+
+static int vfs_name_cmp(const void *lhs, const void *rhs)
+{
+    return wcscmp(*(const wchar_t **) lhs, *(const wchar_t **) rhs);
+}
+
+static void vfs_fixup_path(wchar_t *path, size_t max_count)
+{
+    size_t count;
+    wchar_t abspath[MAX_PATH];
+
+    assert(path != NULL);
+    /* Requirement for PathIsRelativeW */
+    assert(max_count <= MAX_PATH);
+
+    if (PathIsRelativeW(path)) {
+        count = GetFullPathNameW(path, _countof(abspath), abspath, NULL);
+
+        /* GetFullPathName's length return value is tricky, because it includes
+           the NUL terminator on failure, but doesn't on success.
+           Check if it fits the temp buf (else it's a failure and includes NUL
+           anyway), then if it fits the target buf, NUL included. */
+        if (count == 0 || count > _countof(abspath) || count >= max_count) {
+            goto fail;
+        }
+
+        wcscpy_s(path, max_count, abspath);
+    } else {
+        count = wcslen(path);
+    }
+
+    if (path_is_separator_w(path[count - 1])) {
+        return;
+    }
+
+    if (count + 2 > max_count) {
+        goto fail;
+    }
+
+    path[count + 0] = L'\\';
+    path[count + 1] = L'\0';
+    return;
+
+fail:
+    dprintf("Vfs: FATAL: Path too long: %S\n", path);
+    abort();
+}
+
+static void vfs_strip_separators(wchar_t *path)
+{
+    size_t count;
+
+    assert(path != NULL);
+
+    count = wcslen(path);
+
+    while (count > 0 && path_is_separator_w(path[count - 1])) {
+        path[--count] = L'\0';
+    }
+}
+
+static HRESULT vfs_mkdir_rec(const wchar_t *path)
+{
+    wchar_t *copy;
+    wchar_t *pos;
+    wchar_t wc;
+    HRESULT hr;
+    DWORD attr;
+    BOOL ok;
+
+    assert(path != NULL);
+
+    copy = _wcsdup(path);
+
+    if (copy == NULL) {
+        hr = HRESULT_FROM_WIN32(ERROR_OUTOFMEMORY);
+
+        goto end;
+    }
+
+    pos = copy;
+
+    do {
+        wc = *pos;
+
+        if (wc == L'\0' || wc == L'/' || wc == L'\\') {
+            *pos = L'\0';
+            attr = GetFileAttributesW(copy);
+
+            if (attr == INVALID_FILE_ATTRIBUTES) {
+                ok = CreateDirectoryW(copy, NULL);
+
+                if (!ok) {
+                    hr = HRESULT_FROM_WIN32(GetLastError());
+
+                    goto end;
+                }
+            }
+
+            *pos = wc;
+        }
+
+        pos++;
+    } while (wc != L'\0');
+
+    hr = S_OK;
+
+end:
+    free(copy);
+
+    return hr;
+}
+
 static HRESULT vfs_reg_read_amfs(void *bytes, uint32_t *nbytes)
 {
     return reg_hook_read_wstr(bytes, nbytes, vfs_config.amfs);
@@ -5,11 +5,48 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#define VFS_MAX_MOUNTS 32
+#define VFS_MAX_OVERLAYS 8
+#define VFS_MAX_LOWERS 4
+#define VFS_MAX_ARCHIVES 8
+
+struct vfs_mount {
+    wchar_t src[MAX_PATH];
+    wchar_t dest[MAX_PATH];
+    bool cache;
+};
+
+/* A union of a writable upper directory over read-only lower directories,
+   which are listed in order of precedence. */
+
+struct vfs_overlay {
+    wchar_t src[MAX_PATH];
+    wchar_t upper[MAX_PATH];
+    wchar_t lowers[VFS_MAX_LOWERS][MAX_PATH];
+    size_t nlowers;
+};
+
+/* A read-only tree served from a single archive file, see vfspack.h */
+
+struct vfs_archive {
+    wchar_t src[MAX_PATH];
+    wchar_t path[MAX_PATH];
+};
+
 struct vfs_config {
     bool enable;
     wchar_t amfs[MAX_PATH];
     wchar_t appdata[MAX_PATH];
     wchar_t option[MAX_PATH];
+    bool amfs_cache;
+    bool appdata_cache;
+    bool option_cache;
+    struct vfs_mount mounts[VFS_MAX_MOUNTS];
+    size_t nmounts;
+    struct vfs_overlay overlays[VFS_MAX_OVERLAYS];
+    size_t noverlays;
+    struct vfs_archive archives[VFS_MAX_ARCHIVES];
+    size_t narchives;
 };
 
 HRESULT vfs_hook_init(const struct vfs_config *config);
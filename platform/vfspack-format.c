@@ -0,0 +1,71 @@
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "platform/vfspack-format.h"
+
+static size_t vfspack_run_len(const wchar_t *str, size_t len);
+
+int vfspack_name_cmp(
+        const wchar_t *lhs,
+        size_t lhs_len,
+        const wchar_t *rhs,
+        size_t rhs_len)
+{
+    size_t lhs_run;
+    size_t rhs_run;
+    size_t n;
+    int result;
+
+    /* Compares one code unit at a time after upper-casing both sides, with
+       / read as \, but leaves the upper-casing to CompareStringOrdinal: it
+       uses the same table as the file system, whatever the C runtime's
+       locale. The runs between separators are compared in one go. */
+
+    for (;;) {
+        lhs_run = vfspack_run_len(lhs, lhs_len);
+        rhs_run = vfspack_run_len(rhs, rhs_len);
+        n = lhs_run < rhs_run ? lhs_run : rhs_run;
+
+        result = CompareStringOrdinal(lhs, (int) n, rhs, (int) n, TRUE);
+
+        if (result != CSTR_EQUAL) {
+            return result - CSTR_EQUAL;
+        }
+
+        /* One side ran out: it sorts first unless both did */
+
+        if (n == lhs_len || n == rhs_len) {
+            if (lhs_len == rhs_len) {
+                return 0;
+            }
+
+            return lhs_len < rhs_len ? -1 : 1;
+        }
+
+        /* The shorter run stopped at a separator, the longer one didn't */
+
+        if (lhs_run < rhs_run) {
+            return CompareStringOrdinal(L"\\", 1, &rhs[n], 1, TRUE)
+                    - CSTR_EQUAL;
+        } else if (lhs_run > rhs_run) {
+            return CompareStringOrdinal(&lhs[n], 1, L"\\", 1, TRUE)
+                    - CSTR_EQUAL;
+        }
+
+        lhs += n + 1;
+        lhs_len -= n + 1;
+        rhs += n + 1;
+        rhs_len -= n + 1;
+    }
+}
+
+static size_t vfspack_run_len(const wchar_t *str, size_t len)
+{
+    size_t i;
+
+    for (i = 0 ; i < len && str[i] != L'\\' && str[i] != L'/' ; i++);
+
+    return i;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* On-disk layout of a VPAK archive, shared by the mount code and the
+   vfspack-pack tool. See vfspack.h for how the pieces fit together. */
+
+#define VFSPACK_MAGIC 0x4B415056 /* "VPAK" */
+#define VFSPACK_VERSION 2
+
+#pragma pack(push, 1)
+
+struct vfspack_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nentries;
+    uint32_t names_size;
+};
+
+struct vfspack_entry {
+    uint32_t name_offset;   /* In UTF-16 code units, from the start of names */
+    uint32_t name_len;
+    uint64_t offset;        /* From the start of the archive */
+    uint64_t size;
+    uint64_t mtime;         /* FILETIME */
+    uint32_t attributes;
+    uint32_t reserved;
+};
+
+#pragma pack(pop)
+
+/* Orders archive paths the way the index has to be sorted, see vfspack.h.
+   Returns less than, equal to or greater than zero like wcscmp. */
+
+int vfspack_name_cmp(
+        const wchar_t *lhs,
+        size_t lhs_len,
+        const wchar_t *rhs,
+        size_t rhs_len);
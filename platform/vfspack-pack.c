@@ -0,0 +1,527 @@
+/* Packs a directory tree into a VPAK archive for the archive.N setting.
+
+   Usage: vfspack-pack <directory> <archive>
+
+   Every file and directory under <directory> goes into the archive, named
+   relative to it, with its size, last write time and attributes. The index
+   is sorted with the same comparison that the mount code checks it with, so
+   anything this tool writes is accepted by vfspack_mount. File contents
+   follow the index in index order, uncompressed and unpadded. */
+
+#include <windows.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "platform/vfspack-format.h"
+
+struct pack_item {
+    wchar_t *name;
+    size_t name_len;
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t attributes;
+};
+
+struct pack_list {
+    struct pack_item *items;
+    size_t nitems;
+    size_t cap;
+};
+
+static HRESULT pack_scan(
+        struct pack_list *list,
+        const wchar_t *root,
+        const wchar_t *rel);
+static HRESULT pack_add(
+        struct pack_list *list,
+        const wchar_t *rel,
+        const WIN32_FIND_DATAW *data);
+static int pack_item_cmp(const void *lhs, const void *rhs);
+static HRESULT pack_write(
+        const struct pack_list *list,
+        const wchar_t *root,
+        HANDLE out);
+static HRESULT pack_copy(HANDLE out, const wchar_t *path, uint64_t size);
+static HRESULT pack_write_all(HANDLE file, const void *bytes, size_t nbytes);
+static HRESULT pack_join(
+        wchar_t *out,
+        size_t max_count,
+        const wchar_t *root,
+        const wchar_t *rel);
+static bool pack_widen(wchar_t *out, size_t max_count, const char *src);
+
+int main(int argc, char **argv)
+{
+    struct pack_list list;
+    wchar_t root[MAX_PATH];
+    wchar_t path[MAX_PATH];
+    uint64_t nbytes;
+    size_t ndirs;
+    size_t i;
+    HANDLE out;
+    HRESULT hr;
+
+    memset(&list, 0, sizeof(list));
+    out = INVALID_HANDLE_VALUE;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <directory> <archive>\n", argv[0]);
+
+        return 2;
+    }
+
+    if (    !pack_widen(root, _countof(root), argv[1]) ||
+            !pack_widen(path, _countof(path), argv[2])) {
+        fprintf(stderr, "Path is too long\n");
+
+        return 2;
+    }
+
+    hr = pack_scan(&list, root, L"");
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    qsort(list.items, list.nitems, sizeof(*list.items), pack_item_cmp);
+
+    /* The index can't hold two names that the game can't tell apart */
+
+    for (i = 1 ; i < list.nitems ; i++) {
+        if (pack_item_cmp(&list.items[i - 1], &list.items[i]) == 0) {
+            fprintf(stderr, "%S and %S differ only in case\n",
+                    list.items[i - 1].name,
+                    list.items[i].name);
+            hr = HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+
+            goto end;
+        }
+    }
+
+    out = CreateFileW(
+            path,
+            GENERIC_WRITE,
+            0,
+            NULL,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL);
+
+    if (out == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        fprintf(stderr, "Error creating %S: %x\n", path, (int) hr);
+
+        goto end;
+    }
+
+    hr = pack_write(&list, root, out);
+
+    CloseHandle(out);
+
+    if (FAILED(hr)) {
+        DeleteFileW(path);
+
+        goto end;
+    }
+
+    ndirs = 0;
+    nbytes = 0;
+
+    for (i = 0 ; i < list.nitems ; i++) {
+        if (list.items[i].attributes & FILE_ATTRIBUTE_DIRECTORY) {
+            ndirs++;
+        } else {
+            nbytes += list.items[i].size;
+        }
+    }
+
+    printf("Packed %u files and %u directories, %llu bytes of data\n",
+            (unsigned int) (list.nitems - ndirs),
+            (unsigned int) ndirs,
+            (unsigned long long) nbytes);
+
+end:
+    for (i = 0 ; i < list.nitems ; i++) {
+        free(list.items[i].name);
+    }
+
+    free(list.items);
+
+    return FAILED(hr) ? 1 : 0;
+}
+
+static HRESULT pack_scan(
+        struct pack_list *list,
+        const wchar_t *root,
+        const wchar_t *rel)
+{
+    WIN32_FIND_DATAW data;
+    wchar_t pattern[MAX_PATH];
+    wchar_t dir[MAX_PATH];
+    wchar_t child[MAX_PATH];
+    HANDLE find;
+    HRESULT hr;
+
+    hr = pack_join(dir, _countof(dir), root, rel);
+
+    if (SUCCEEDED(hr)) {
+        hr = pack_join(pattern, _countof(pattern), dir, L"*");
+    }
+
+    if (FAILED(hr)) {
+        fprintf(stderr, "Path is too long: %S\\%S\n", root, rel);
+
+        return hr;
+    }
+
+    find = FindFirstFileW(pattern, &data);
+
+    if (find == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        fprintf(stderr, "Error listing %S: %x\n", dir, (int) hr);
+
+        return hr;
+    }
+
+    do {
+        if (    wcscmp(data.cFileName, L".") == 0 ||
+                wcscmp(data.cFileName, L"..") == 0) {
+            continue;
+        }
+
+        if (rel[0] == L'\0') {
+            hr = wcscpy_s(child, _countof(child), data.cFileName) == 0
+                    ? S_OK
+                    : HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+        } else {
+            hr = pack_join(child, _countof(child), rel, data.cFileName);
+        }
+
+        if (FAILED(hr)) {
+            fprintf(stderr, "Path is too long: %S\\%S\n", rel, data.cFileName);
+
+            break;
+        }
+
+        hr = pack_add(list, child, &data);
+
+        if (FAILED(hr)) {
+            break;
+        }
+
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            hr = pack_scan(list, root, child);
+
+            if (FAILED(hr)) {
+                break;
+            }
+        }
+    } while (FindNextFileW(find, &data));
+
+    if (SUCCEEDED(hr) && GetLastError() != ERROR_NO_MORE_FILES) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        fprintf(stderr, "Error listing %S: %x\n", dir, (int) hr);
+    }
+
+    FindClose(find);
+
+    return hr;
+}
+
+static HRESULT pack_add(
+        struct pack_list *list,
+        const wchar_t *rel,
+        const WIN32_FIND_DATAW *data)
+{
+    struct pack_item *new_mem;
+    struct pack_item *item;
+    size_t new_cap;
+
+    if (list->nitems == list->cap) {
+        new_cap = list->cap ? 2 * list->cap : 256;
+        new_mem = realloc(list->items, new_cap * sizeof(*new_mem));
+
+        if (new_mem == NULL) {
+            return E_OUTOFMEMORY;
+        }
+
+        list->items = new_mem;
+        list->cap = new_cap;
+    }
+
+    item = &list->items[list->nitems];
+    item->name = _wcsdup(rel);
+
+    if (item->name == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    item->name_len = wcslen(rel);
+    item->attributes = data->dwFileAttributes & (
+            FILE_ATTRIBUTE_READONLY |
+            FILE_ATTRIBUTE_HIDDEN |
+            FILE_ATTRIBUTE_SYSTEM |
+            FILE_ATTRIBUTE_DIRECTORY |
+            FILE_ATTRIBUTE_ARCHIVE);
+    item->mtime = ((uint64_t) data->ftLastWriteTime.dwHighDateTime << 32) |
+            data->ftLastWriteTime.dwLowDateTime;
+
+    if (item->attributes & FILE_ATTRIBUTE_DIRECTORY) {
+        item->size = 0;
+    } else {
+        item->size = ((uint64_t) data->nFileSizeHigh << 32) |
+                data->nFileSizeLow;
+    }
+
+    list->nitems++;
+
+    return S_OK;
+}
+
+static int pack_item_cmp(const void *lhs, const void *rhs)
+{
+    const struct pack_item *l;
+    const struct pack_item *r;
+
+    l = lhs;
+    r = rhs;
+
+    return vfspack_name_cmp(l->name, l->name_len, r->name, r->name_len);
+}
+
+static HRESULT pack_write(
+        const struct pack_list *list,
+        const wchar_t *root,
+        HANDLE out)
+{
+    struct vfspack_header header;
+    struct vfspack_entry *entries;
+    wchar_t path[MAX_PATH];
+    uint64_t names_len;
+    uint64_t offset;
+    size_t i;
+    HRESULT hr;
+
+    entries = NULL;
+    names_len = 0;
+
+    for (i = 0 ; i < list->nitems ; i++) {
+        names_len += list->items[i].name_len;
+    }
+
+    if (    list->nitems > UINT32_MAX / sizeof(*entries) ||
+            names_len > UINT32_MAX / sizeof(wchar_t)) {
+        fprintf(stderr, "Too many files\n");
+
+        return HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+    }
+
+    header.magic = VFSPACK_MAGIC;
+    header.version = VFSPACK_VERSION;
+    header.nentries = (uint32_t) list->nitems;
+    header.names_size = (uint32_t) (names_len * sizeof(wchar_t));
+
+    entries = calloc(list->nitems + 1, sizeof(*entries));
+
+    if (entries == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    /* File contents start right after the names */
+
+    offset = sizeof(header) + list->nitems * sizeof(*entries) +
+            header.names_size;
+    names_len = 0;
+
+    for (i = 0 ; i < list->nitems ; i++) {
+        entries[i].name_offset = (uint32_t) names_len;
+        entries[i].name_len = (uint32_t) list->items[i].name_len;
+        entries[i].size = list->items[i].size;
+        entries[i].mtime = list->items[i].mtime;
+        entries[i].attributes = list->items[i].attributes;
+
+        if (!(entries[i].attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            entries[i].offset = offset;
+            offset += entries[i].size;
+        }
+
+        names_len += list->items[i].name_len;
+    }
+
+    hr = pack_write_all(out, &header, sizeof(header));
+
+    if (SUCCEEDED(hr)) {
+        hr = pack_write_all(
+                out,
+                entries,
+                list->nitems * sizeof(*entries));
+    }
+
+    for (i = 0 ; SUCCEEDED(hr) && i < list->nitems ; i++) {
+        hr = pack_write_all(
+                out,
+                list->items[i].name,
+                list->items[i].name_len * sizeof(wchar_t));
+    }
+
+    if (FAILED(hr)) {
+        fprintf(stderr, "Error writing index: %x\n", (int) hr);
+
+        goto end;
+    }
+
+    for (i = 0 ; i < list->nitems ; i++) {
+        if (entries[i].attributes & FILE_ATTRIBUTE_DIRECTORY) {
+            continue;
+        }
+
+        hr = pack_join(path, _countof(path), root, list->items[i].name);
+
+        if (SUCCEEDED(hr)) {
+            hr = pack_copy(out, path, list->items[i].size);
+        }
+
+        if (FAILED(hr)) {
+            fprintf(stderr, "Error packing %S: %x\n",
+                    list->items[i].name,
+                    (int) hr);
+
+            goto end;
+        }
+    }
+
+end:
+    free(entries);
+
+    return hr;
+}
+
+static HRESULT pack_copy(HANDLE out, const wchar_t *path, uint64_t size)
+{
+    static uint8_t buf[65536];
+    HANDLE file;
+    DWORD nread;
+    DWORD chunk;
+    HRESULT hr;
+
+    file = CreateFileW(
+            path,
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    /* The offsets in the index are already written, so the file has to
+       still be exactly the size it was listed with. */
+
+    hr = S_OK;
+
+    while (size > 0) {
+        chunk = size < sizeof(buf) ? (DWORD) size : sizeof(buf);
+
+        if (!ReadFile(file, buf, chunk, &nread, NULL)) {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+
+            goto end;
+        }
+
+        if (nread == 0) {
+            hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+
+            goto end;
+        }
+
+        hr = pack_write_all(out, buf, nread);
+
+        if (FAILED(hr)) {
+            goto end;
+        }
+
+        size -= nread;
+    }
+
+    if (!ReadFile(file, buf, 1, &nread, NULL)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    } else if (nread != 0) {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+end:
+    CloseHandle(file);
+
+    return hr;
+}
+
+static HRESULT pack_write_all(HANDLE file, const void *bytes, size_t nbytes)
+{
+    const uint8_t *src;
+    DWORD nwritten;
+    DWORD chunk;
+
+    src = bytes;
+
+    while (nbytes > 0) {
+        chunk = nbytes < 0x10000000 ? (DWORD) nbytes : 0x10000000;
+
+        if (!WriteFile(file, src, chunk, &nwritten, NULL)) {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        src += nwritten;
+        nbytes -= nwritten;
+    }
+
+    return S_OK;
+}
+
+static HRESULT pack_join(
+        wchar_t *out,
+        size_t max_count,
+        const wchar_t *root,
+        const wchar_t *rel)
+{
+    size_t root_len;
+    size_t rel_len;
+
+    root_len = wcslen(root);
+    rel_len = wcslen(rel);
+
+    while (root_len > 0 && (root[root_len - 1] == L'\\' ||
+            root[root_len - 1] == L'/')) {
+        root_len--;
+    }
+
+    if (root_len + rel_len + 2 > max_count) {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+
+    memcpy(out, root, root_len * sizeof(wchar_t));
+
+    if (rel_len == 0) {
+        out[root_len] = L'\0';
+
+        return S_OK;
+    }
+
+    out[root_len] = L'\\';
+    memcpy(&out[root_len + 1], rel, (rel_len + 1) * sizeof(wchar_t));
+
+    return S_OK;
+}
+
+static bool pack_widen(wchar_t *out, size_t max_count, const char *src)
+{
+    return MultiByteToWideChar(CP_ACP, 0, src, -1, out, (int) max_count) > 0;
+}
@@ -0,0 +1,856 @@
+#include <windows.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "hook/iohook.h"
+#include "hook/table.h"
+
+#include "hooklib/iat.h"
+#include "hooklib/path.h"
+
+#include "platform/vfspack.h"
+#include "platform/vfspack-format.h"
+
+#include "util/dprintf.h"
+
+struct vfspack {
+    struct vfspack *next;
+    wchar_t src[MAX_PATH];
+    size_t src_len;
+    const uint8_t *bytes;
+    uint64_t nbytes;
+    const struct vfspack_entry *entries;
+    uint32_t nentries;
+    const wchar_t *names;
+};
+
+/* An open file, found by the NUL handle that the game was given for it */
+
+enum {
+    VFSPACK_FILE_BUCKETS = 64,
+};
+
+struct vfspack_file {
+    struct vfspack_file *next;
+    HANDLE fd;
+    const uint8_t *bytes;
+    uint64_t nbytes;
+    uint64_t pos;
+    SRWLOCK lock;
+};
+
+static HRESULT vfspack_map(struct vfspack *pack, const wchar_t *path);
+static HRESULT vfspack_check(const struct vfspack *pack);
+static size_t vfspack_lower_bound(
+        const struct vfspack *pack,
+        const wchar_t *key,
+        size_t key_len);
+static const struct vfspack_entry *vfspack_lookup(
+        const struct vfspack *pack,
+        const wchar_t *key,
+        size_t key_len);
+static const struct vfspack *vfspack_match(
+        const wchar_t *path,
+        const wchar_t **rel);
+static HRESULT vfspack_list(
+        void *ctx,
+        const wchar_t *rel,
+        WIN32_FIND_DATAW **entries,
+        size_t *nentries);
+static void vfspack_fill(
+        WIN32_FIND_DATAW *out,
+        const struct vfspack *pack,
+        const struct vfspack_entry *entry,
+        size_t dir_len);
+static struct vfspack_file *vfspack_file_acquire(HANDLE fd);
+static HRESULT vfspack_handle_irp(struct irp *irp);
+static HRESULT vfspack_handle_open(struct irp *irp);
+static HRESULT vfspack_handle_close(struct irp *irp);
+static HRESULT vfspack_handle_read(
+        struct vfspack_file *file,
+        struct irp *irp);
+static HRESULT vfspack_handle_seek(
+        struct vfspack_file *file,
+        struct irp *irp);
+
+/* API hooks */
+
+static DWORD WINAPI hook_GetFileSize(HANDLE hFile, DWORD *lpFileSizeHigh);
+
+static BOOL WINAPI hook_GetFileSizeEx(
+        HANDLE hFile,
+        LARGE_INTEGER *lpFileSize);
+
+static DWORD WINAPI hook_GetFileType(HANDLE hFile);
+
+/* Link pointers */
+
+static DWORD (WINAPI *next_GetFileSize)(HANDLE hFile, DWORD *lpFileSizeHigh);
+
+static BOOL (WINAPI *next_GetFileSizeEx)(
+        HANDLE hFile,
+        LARGE_INTEGER *lpFileSize);
+
+static DWORD (WINAPI *next_GetFileType)(HANDLE hFile);
+
+/* NUL handles would otherwise report a size of zero and a character device
+   type, which makes C runtimes refuse to seek in them. */
+
+static const struct hook_symbol vfspack_syms[] = {
+    {
+        .name   = "GetFileSize",
+        .patch  = hook_GetFileSize,
+        .link   = (void **) &next_GetFileSize,
+    }, {
+        .name   = "GetFileSizeEx",
+        .patch  = hook_GetFileSizeEx,
+        .link   = (void **) &next_GetFileSizeEx,
+    }, {
+        .name   = "GetFileType",
+        .patch  = hook_GetFileType,
+        .link   = (void **) &next_GetFileType,
+    },
+};
+
+static bool vfspack_hook_initted;
+static struct vfspack *vfspack_packs;
+static SRWLOCK vfspack_files_lock = SRWLOCK_INIT;
+static struct vfspack_file *vfspack_files[VFSPACK_FILE_BUCKETS];
+
+HRESULT vfspack_mount(const wchar_t *src, const wchar_t *path)
+{
+    struct vfspack *pack;
+    size_t len;
+    HRESULT hr;
+
+    assert(src != NULL);
+    assert(path != NULL);
+
+    dprintf("Vfs: Mount %S -> %S (archive)\n", src, path);
+
+    pack = calloc(1, sizeof(*pack));
+
+    if (pack == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto fail;
+    }
+
+    /* Opened paths are matched against the mount point without its trailing
+       separators, the same way the path hooks match prefixes. */
+
+    len = wcslen(src);
+
+    while (len > 0 && path_is_separator_w(src[len - 1])) {
+        len--;
+    }
+
+    if (len == 0 || len >= _countof(pack->src)) {
+        hr = E_INVALIDARG;
+
+        goto fail;
+    }
+
+    memcpy(pack->src, src, len * sizeof(wchar_t));
+    pack->src[len] = L'\0';
+    pack->src_len = len;
+
+    hr = vfspack_map(pack, path);
+
+    if (FAILED(hr)) {
+        goto fail;
+    }
+
+    dprintf("Vfs: Archive %S: %u entries\n", path, pack->nentries);
+
+    if (!vfspack_hook_initted) {
+        hr = iohook_push_handler(vfspack_handle_irp);
+
+        if (FAILED(hr)) {
+            goto fail;
+        }
+
+        iat_hook_push(
+                NULL,
+                "kernel32.dll",
+                vfspack_syms,
+                _countof(vfspack_syms));
+        vfspack_hook_initted = true;
+    }
+
+    /* Mounts only happen while the hook DLL is starting up, so the list of
+       archives never changes while it is being searched. */
+
+    pack->next = vfspack_packs;
+    vfspack_packs = pack;
+
+    hr = path_hook_push_listed_prefix(pack->src, vfspack_list, pack);
+
+    if (FAILED(hr)) {
+        vfspack_packs = pack->next;
+
+        goto fail;
+    }
+
+    return S_OK;
+
+fail:
+    dprintf("Vfs: Failed to mount %S: %x\n", src, (int) hr);
+
+    if (pack != NULL && pack->bytes != NULL) {
+        UnmapViewOfFile(pack->bytes);
+    }
+
+    free(pack);
+
+    return hr;
+}
+
+static HRESULT vfspack_map(struct vfspack *pack, const wchar_t *path)
+{
+    const struct vfspack_header *header;
+    LARGE_INTEGER size;
+    HANDLE mapping;
+    HANDLE file;
+    uint64_t index_size;
+    HRESULT hr;
+
+    mapping = NULL;
+    file = CreateFileW(
+            path,
+            GENERIC_READ,
+            FILE_SHARE_READ,
+            NULL,
+            OPEN_EXISTING,
+            FILE_FLAG_RANDOM_ACCESS,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    if (!GetFileSizeEx(file, &size)) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    if ((uint64_t) size.QuadPart < sizeof(*header)) {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+
+        goto end;
+    }
+
+    if ((uint64_t) size.QuadPart > SIZE_MAX) {
+        hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+
+        goto end;
+    }
+
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mapping == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    /* The view keeps the mapping alive once both handles are closed */
+
+    pack->bytes = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (pack->bytes == NULL) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    pack->nbytes = (uint64_t) size.QuadPart;
+    header = (const struct vfspack_header *) pack->bytes;
+
+    if (header->magic != VFSPACK_MAGIC || header->version != VFSPACK_VERSION) {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+
+        goto end;
+    }
+
+    index_size = sizeof(*header) +
+            (uint64_t) header->nentries * sizeof(struct vfspack_entry) +
+            header->names_size;
+
+    if (index_size > pack->nbytes || header->names_size % 2 != 0) {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+
+        goto end;
+    }
+
+    pack->entries = (const struct vfspack_entry *) (header + 1);
+    pack->nentries = header->nentries;
+    pack->names = (const wchar_t *) (pack->entries + pack->nentries);
+
+    hr = vfspack_check(pack);
+
+end:
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
+static HRESULT vfspack_check(const struct vfspack *pack)
+{
+    const struct vfspack_header *header;
+    const struct vfspack_entry *entry;
+    const struct vfspack_entry *prev;
+    uint32_t names_len;
+    uint32_t i;
+
+    /* Everything is checked once up front, so that lookups can trust the
+       index. Lookups are binary searches, which quietly miss entries if the
+       order is wrong, so that gets checked too. */
+
+    header = (const struct vfspack_header *) pack->bytes;
+    names_len = header->names_size / sizeof(wchar_t);
+    prev = NULL;
+
+    for (i = 0 ; i < pack->nentries ; i++) {
+        entry = &pack->entries[i];
+
+        if (    entry->name_len == 0 ||
+                entry->name_len >= MAX_PATH ||
+                entry->name_offset > names_len ||
+                entry->name_len > names_len - entry->name_offset) {
+            dprintf("Vfs: Archive entry %u has a bad name\n", i);
+
+            return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+        }
+
+        if (    !(entry->attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                (entry->offset > pack->nbytes ||
+                 entry->size > pack->nbytes - entry->offset)) {
+            dprintf("Vfs: Archive entry %u is out of bounds\n", i);
+
+            return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+        }
+
+        if (prev != NULL && vfspack_name_cmp(
+                pack->names + prev->name_offset,
+                prev->name_len,
+                pack->names + entry->name_offset,
+                entry->name_len) >= 0) {
+            dprintf("Vfs: Archive entry %u is out of order\n", i);
+
+            return HRESULT_FROM_WIN32(ERROR_BAD_FORMAT);
+        }
+
+        prev = entry;
+    }
+
+    return S_OK;
+}
+
+static size_t vfspack_lower_bound(
+        const struct vfspack *pack,
+        const wchar_t *key,
+        size_t key_len)
+{
+    const struct vfspack_entry *entry;
+    size_t lo;
+    size_t hi;
+    size_t mid;
+
+    /* Index of the first entry that doesn't sort before `key` */
+
+    lo = 0;
+    hi = pack->nentries;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        entry = &pack->entries[mid];
+
+        if (vfspack_name_cmp(
+                pack->names + entry->name_offset,
+                entry->name_len,
+                key,
+                key_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static const struct vfspack_entry *vfspack_lookup(
+        const struct vfspack *pack,
+        const wchar_t *key,
+        size_t key_len)
+{
+    const struct vfspack_entry *entry;
+    size_t i;
+
+    i = vfspack_lower_bound(pack, key, key_len);
+
+    if (i == pack->nentries) {
+        return NULL;
+    }
+
+    entry = &pack->entries[i];
+
+    if (vfspack_name_cmp(
+            pack->names + entry->name_offset,
+            entry->name_len,
+            key,
+            key_len) != 0) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+static const struct vfspack *vfspack_match(
+        const wchar_t *path,
+        const wchar_t **rel)
+{
+    const struct vfspack *pack;
+    const wchar_t *pos;
+
+    for (pack = vfspack_packs ; pack != NULL ; pack = pack->next) {
+        if (path_compare_w(path, pack->src, pack->src_len) != 0) {
+            continue;
+        }
+
+        pos = path + pack->src_len;
+
+        if (*pos != L'\0' && !path_is_separator_w(*pos)) {
+            continue;
+        }
+
+        while (path_is_separator_w(*pos)) {
+            pos++;
+        }
+
+        *rel = pos;
+
+        return pack;
+    }
+
+    return NULL;
+}
+
+static HRESULT vfspack_list(
+        void *ctx,
+        const wchar_t *rel,
+        WIN32_FIND_DATAW **entries,
+        size_t *nentries)
+{
+    const struct vfspack_entry *entry;
+    const struct vfspack *pack;
+    WIN32_FIND_DATAW *out;
+    size_t rel_len;
+    size_t first;
+    size_t count;
+    size_t i;
+
+    pack = ctx;
+    *entries = NULL;
+    *nentries = 0;
+    rel_len = wcslen(rel);
+
+    if (rel_len > 0) {
+        entry = vfspack_lookup(pack, rel, rel_len - 1);
+
+        if (entry == NULL || !(entry->attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            return HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND);
+        }
+    }
+
+    /* Everything under the directory sorts into one run starting at its path
+       plus a separator. Its children are the ones with no separator past
+       that point. */
+
+    first = vfspack_lower_bound(pack, rel, rel_len);
+    count = 0;
+
+    for (i = first ; i < pack->nentries ; i++) {
+        entry = &pack->entries[i];
+
+        if (    entry->name_len <= rel_len ||
+                vfspack_name_cmp(
+                    pack->names + entry->name_offset,
+                    rel_len,
+                    rel,
+                    rel_len) != 0) {
+            break;
+        }
+
+        if (wmemchr(
+                pack->names + entry->name_offset + rel_len,
+                L'\\',
+                entry->name_len - rel_len) == NULL) {
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        return S_OK;
+    }
+
+    out = calloc(count, sizeof(*out));
+
+    if (out == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    for (i = first ; *nentries < count ; i++) {
+        entry = &pack->entries[i];
+
+        if (wmemchr(
+                pack->names + entry->name_offset + rel_len,
+                L'\\',
+                entry->name_len - rel_len) == NULL) {
+            vfspack_fill(&out[(*nentries)++], pack, entry, rel_len);
+        }
+    }
+
+    *entries = out;
+
+    return S_OK;
+}
+
+static void vfspack_fill(
+        WIN32_FIND_DATAW *out,
+        const struct vfspack *pack,
+        const struct vfspack_entry *entry,
+        size_t dir_len)
+{
+    FILETIME mtime;
+
+    mtime.dwLowDateTime = (DWORD) entry->mtime;
+    mtime.dwHighDateTime = (DWORD) (entry->mtime >> 32);
+
+    out->dwFileAttributes = entry->attributes != 0
+            ? entry->attributes
+            : FILE_ATTRIBUTE_NORMAL;
+    out->ftCreationTime = mtime;
+    out->ftLastAccessTime = mtime;
+    out->ftLastWriteTime = mtime;
+
+    if (!(entry->attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        out->nFileSizeHigh = (DWORD) (entry->size >> 32);
+        out->nFileSizeLow = (DWORD) entry->size;
+    }
+
+    memcpy(out->cFileName,
+            pack->names + entry->name_offset + dir_len,
+            (entry->name_len - dir_len) * sizeof(wchar_t));
+}
+
+static struct vfspack_file *vfspack_file_acquire(HANDLE fd)
+{
+    struct vfspack_file *file;
+
+    /* Returns with vfspack_files_lock held shared if the handle is ours */
+
+    AcquireSRWLockShared(&vfspack_files_lock);
+
+    file = vfspack_files[((uintptr_t) fd >> 2) % VFSPACK_FILE_BUCKETS];
+
+    for ( ; file != NULL ; file = file->next) {
+        if (file->fd == fd) {
+            return file;
+        }
+    }
+
+    ReleaseSRWLockShared(&vfspack_files_lock);
+
+    return NULL;
+}
+
+static HRESULT vfspack_handle_irp(struct irp *irp)
+{
+    struct vfspack_file *file;
+    HRESULT hr;
+
+    assert(irp != NULL);
+
+    if (irp->op == IRP_OP_OPEN) {
+        return vfspack_handle_open(irp);
+    }
+
+    file = vfspack_file_acquire(irp->fd);
+
+    if (file == NULL) {
+        return iohook_invoke_next(irp);
+    }
+
+    if (irp->op == IRP_OP_CLOSE) {
+        ReleaseSRWLockShared(&vfspack_files_lock);
+
+        return vfspack_handle_close(irp);
+    }
+
+    switch (irp->op) {
+    case IRP_OP_READ:   hr = vfspack_handle_read(file, irp); break;
+    case IRP_OP_SEEK:   hr = vfspack_handle_seek(file, irp); break;
+    case IRP_OP_FSYNC:  hr = S_OK; break;
+    case IRP_OP_WRITE:  hr = HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED); break;
+    default:            hr = HRESULT_FROM_WIN32(ERROR_INVALID_FUNCTION); break;
+    }
+
+    ReleaseSRWLockShared(&vfspack_files_lock);
+
+    return hr;
+}
+
+static HRESULT vfspack_handle_open(struct irp *irp)
+{
+    const struct vfspack_entry *entry;
+    const struct vfspack *pack;
+    struct vfspack_file *file;
+    const wchar_t *sep;
+    const wchar_t *rel;
+    size_t rel_len;
+    size_t i;
+    HRESULT hr;
+
+    pack = vfspack_match(irp->open_filename, &rel);
+
+    if (pack == NULL) {
+        return iohook_invoke_next(irp);
+    }
+
+    rel_len = wcslen(rel);
+
+    while (rel_len > 0 && path_is_separator_w(rel[rel_len - 1])) {
+        rel_len--;
+    }
+
+    /* Only files can be opened, and the path hooks have already refused
+       anything that would write to the archive. */
+
+    entry = rel_len > 0 ? vfspack_lookup(pack, rel, rel_len) : NULL;
+
+    if (entry == NULL && rel_len > 0) {
+        sep = NULL;
+
+        for (i = 0 ; i < rel_len ; i++) {
+            if (path_is_separator_w(rel[i])) {
+                sep = &rel[i];
+            }
+        }
+
+        if (sep != NULL && vfspack_lookup(pack, rel, sep - rel) == NULL) {
+            return HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND);
+        }
+
+        return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+    }
+
+    if (entry == NULL || (entry->attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        return HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+    }
+
+    file = calloc(1, sizeof(*file));
+
+    if (file == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    hr = iohook_open_nul_fd(&file->fd);
+
+    if (FAILED(hr)) {
+        free(file);
+
+        return hr;
+    }
+
+    file->bytes = pack->bytes + (size_t) entry->offset;
+    file->nbytes = entry->size;
+    InitializeSRWLock(&file->lock);
+
+    i = ((uintptr_t) file->fd >> 2) % VFSPACK_FILE_BUCKETS;
+
+    AcquireSRWLockExclusive(&vfspack_files_lock);
+    file->next = vfspack_files[i];
+    vfspack_files[i] = file;
+    ReleaseSRWLockExclusive(&vfspack_files_lock);
+
+    irp->fd = file->fd;
+
+    return S_OK;
+}
+
+static HRESULT vfspack_handle_close(struct irp *irp)
+{
+    struct vfspack_file **link;
+    struct vfspack_file *file;
+
+    AcquireSRWLockExclusive(&vfspack_files_lock);
+
+    link = &vfspack_files[((uintptr_t) irp->fd >> 2) % VFSPACK_FILE_BUCKETS];
+
+    for (file = *link ; file != NULL ; link = &file->next, file = *link) {
+        if (file->fd == irp->fd) {
+            *link = file->next;
+
+            break;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&vfspack_files_lock);
+
+    free(file);
+
+    /* Let the NUL handle itself be closed further down the chain */
+
+    return iohook_invoke_next(irp);
+}
+
+static HRESULT vfspack_handle_read(
+        struct vfspack_file *file,
+        struct irp *irp)
+{
+    uint64_t offset;
+    size_t nbytes;
+    HRESULT hr;
+
+    AcquireSRWLockExclusive(&file->lock);
+
+    /* Overlapped IO carries its own offset, everything else uses the
+       handle's file pointer. */
+
+    if (irp->ovl != NULL) {
+        offset = ((uint64_t) irp->ovl->OffsetHigh << 32) | irp->ovl->Offset;
+    } else {
+        offset = file->pos;
+    }
+
+    nbytes = irp->read.nbytes - irp->read.pos;
+
+    /* Reads past the end come up short, same as they would for a file */
+
+    if (offset >= file->nbytes) {
+        nbytes = 0;
+    } else if (nbytes > file->nbytes - offset) {
+        nbytes = (size_t) (file->nbytes - offset);
+    }
+
+    hr = iobuf_write(&irp->read, file->bytes + (size_t) offset, nbytes);
+
+    if (SUCCEEDED(hr) && irp->ovl == NULL) {
+        file->pos = offset + nbytes;
+    }
+
+    ReleaseSRWLockExclusive(&file->lock);
+
+    return hr;
+}
+
+static HRESULT vfspack_handle_seek(
+        struct vfspack_file *file,
+        struct irp *irp)
+{
+    int64_t base;
+    int64_t pos;
+    HRESULT hr;
+
+    AcquireSRWLockExclusive(&file->lock);
+
+    switch (irp->seek_origin) {
+    case FILE_BEGIN:    base = 0; break;
+    case FILE_CURRENT:  base = (int64_t) file->pos; break;
+    case FILE_END:      base = (int64_t) file->nbytes; break;
+    default:
+        hr = E_INVALIDARG;
+
+        goto end;
+    }
+
+    pos = base + irp->seek_offset;
+
+    if (pos < 0) {
+        hr = HRESULT_FROM_WIN32(ERROR_NEGATIVE_SEEK);
+
+        goto end;
+    }
+
+    file->pos = (uint64_t) pos;
+    irp->seek_pos = (uint64_t) pos;
+    hr = S_OK;
+
+end:
+    ReleaseSRWLockExclusive(&file->lock);
+
+    return hr;
+}
+
+static DWORD WINAPI hook_GetFileSize(HANDLE hFile, DWORD *lpFileSizeHigh)
+{
+    struct vfspack_file *file;
+    uint64_t nbytes;
+
+    file = vfspack_file_acquire(hFile);
+
+    if (file == NULL) {
+        return next_GetFileSize(hFile, lpFileSizeHigh);
+    }
+
+    nbytes = file->nbytes;
+    ReleaseSRWLockShared(&vfspack_files_lock);
+
+    if (lpFileSizeHigh != NULL) {
+        *lpFileSizeHigh = (DWORD) (nbytes >> 32);
+    }
+
+    SetLastError(ERROR_SUCCESS);
+
+    return (DWORD) nbytes;
+}
+
+static BOOL WINAPI hook_GetFileSizeEx(
+        HANDLE hFile,
+        LARGE_INTEGER *lpFileSize)
+{
+    struct vfspack_file *file;
+
+    file = vfspack_file_acquire(hFile);
+
+    if (file == NULL) {
+        return next_GetFileSizeEx(hFile, lpFileSize);
+    }
+
+    lpFileSize->QuadPart = (LONGLONG) file->nbytes;
+    ReleaseSRWLockShared(&vfspack_files_lock);
+
+    return TRUE;
+}
+
+static DWORD WINAPI hook_GetFileType(HANDLE hFile)
+{
+    struct vfspack_file *file;
+
+    file = vfspack_file_acquire(hFile);
+
+    if (file == NULL) {
+        return next_GetFileType(hFile);
+    }
+
+    ReleaseSRWLockShared(&vfspack_files_lock);
+
+    return FILE_TYPE_DISK;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <windows.h>
+
+/* Read-only directory trees served straight out of a single archive file, so
+   that large data sets such as option packages don't have to be extracted
+   onto the disk to be mounted.
+
+   The archive is mapped into memory when it is mounted and its index, sorted
+   by path, is searched in place; nothing is unpacked and no other file is
+   touched. The game's file handles are NUL device handles whose reads are
+   copied out of the mapping, and GetFileAttributes* and FindFirstFile* calls
+   are answered from the index. The archive must fit into the game's address
+   space.
+
+   Layout, all integers little-endian:
+
+     header     magic "VPAK", version (2), entry count, names size in bytes
+     entries    one 40 byte record per file or directory, see vfspack-format.h
+     names      UTF-16 paths, not terminated, referenced by the entries
+     data       file contents, stored uncompressed, anywhere after the names
+
+   Each entry's path is relative to the root of the archive, uses \ as its
+   separator and has no leading or trailing separator. Every directory on the
+   way to a file needs an entry of its own, with FILE_ATTRIBUTE_DIRECTORY set.
+   Entries are sorted by path, comparing one UTF-16 code unit at a time after
+   converting both to upper case the way CompareStringOrdinal does when told
+   to ignore case, which is also how NTFS folds case. Version 1 archives were
+   sorted by lower case and have to be rebuilt. */
+
+HRESULT vfspack_mount(const wchar_t *src, const wchar_t *path);
@@ -0,0 +1,1003 @@
+#include <windows.h>
+#include <process.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "util/dprintf.h"
+#include "util/ini.h"
+
+struct ini_entry {
+    const wchar_t *section;
+    const wchar_t *key;
+    const wchar_t *value;
+};
+
+/* A parsed file. Entry strings point into text, which is the decoded file
+   contents with terminators written over the delimiters. The index is an
+   open-addressed table of (entry index + 1), at most half full. */
+
+struct ini_doc {
+    wchar_t *text;
+    struct ini_entry *entries;
+    size_t nentries;
+    uint32_t *index;
+    size_t index_size;
+};
+
+struct ini_file {
+    wchar_t *name;
+    wchar_t path[MAX_PATH];
+    struct ini_doc *doc;
+};
+
+/* Max number of ini_watch() registrations per module. The watcher thread
+   waits on all of them at once, plus a wakeup event. */
+
+#define INI_MAX_WATCHES 16
+
+/* Editors tend to write a file out in several steps, so wait this long (ms)
+   after a change notification before re-reading it. */
+
+#define INI_WATCH_SETTLE_MS 250
+
+struct ini_watch {
+    wchar_t path[MAX_PATH];
+    FILETIME mtime;
+    HANDLE change;
+    ini_watch_t callback;
+    void *ctx;
+};
+
+static const struct ini_doc *ini_doc_get_locked(const wchar_t *filename);
+static struct ini_file *ini_file_find_locked(
+        const wchar_t *filename,
+        const wchar_t *path);
+static HRESULT ini_resolve_path(
+        const wchar_t *filename,
+        wchar_t *path,
+        size_t path_count);
+static HRESULT ini_doc_load(const wchar_t *path, struct ini_doc **out);
+static HRESULT ini_read_text(const wchar_t *path, wchar_t **out);
+static HRESULT ini_doc_parse(struct ini_doc *doc);
+static HRESULT ini_doc_index(struct ini_doc *doc);
+static void ini_doc_free(struct ini_doc *doc);
+static wchar_t *ini_trim(wchar_t *begin, wchar_t *end);
+static uint32_t ini_hash(const wchar_t *section, const wchar_t *key);
+static const wchar_t *ini_doc_lookup(
+        const struct ini_doc *doc,
+        const wchar_t *section,
+        const wchar_t *key);
+static UINT ini_parse_int(const wchar_t *str, INT def);
+static HRESULT ini_watch_start(void);
+static unsigned int __stdcall ini_watch_thread_proc(void *ctx);
+static void ini_watch_check(struct ini_watch *watch);
+static void ini_reload(const wchar_t *path);
+static bool ini_get_mtime(const wchar_t *path, FILETIME *mtime);
+
+static SRWLOCK ini_lock = SRWLOCK_INIT;
+static struct ini_file *ini_files;
+static size_t ini_nfiles;
+static struct ini_watch ini_watches[INI_MAX_WATCHES];
+static LONG ini_nwatches;
+static HANDLE ini_watch_wake;
+static HANDLE ini_watch_thread;
+
+UINT ini_get_int(
+        const wchar_t *section,
+        const wchar_t *key,
+        INT def,
+        const wchar_t *filename)
+{
+    const struct ini_doc *doc;
+    const wchar_t *value;
+    UINT result;
+
+    assert(section != NULL);
+    assert(key != NULL);
+    assert(filename != NULL);
+
+    AcquireSRWLockShared(&ini_lock);
+
+    doc = ini_doc_get_locked(filename);
+    value = doc != NULL ? ini_doc_lookup(doc, section, key) : NULL;
+    result = value != NULL ? ini_parse_int(value, def) : (UINT) def;
+
+    ReleaseSRWLockShared(&ini_lock);
+
+    return result;
+}
+
+DWORD ini_get_string(
+        const wchar_t *section,
+        const wchar_t *key,
+        const wchar_t *def,
+        wchar_t *out,
+        DWORD nchars,
+        const wchar_t *filename)
+{
+    const struct ini_doc *doc;
+    const wchar_t *value;
+    size_t len;
+
+    assert(section != NULL);
+    assert(key != NULL);
+    assert(out != NULL);
+    assert(filename != NULL);
+
+    if (nchars == 0) {
+        return 0;
+    }
+
+    AcquireSRWLockShared(&ini_lock);
+
+    doc = ini_doc_get_locked(filename);
+    value = doc != NULL ? ini_doc_lookup(doc, section, key) : NULL;
+
+    if (value == NULL) {
+        value = def != NULL ? def : L"";
+    }
+
+    /* Truncate like GetPrivateProfileStringW does */
+
+    len = wcslen(value);
+
+    if (len > nchars - 1) {
+        len = nchars - 1;
+    }
+
+    memcpy(out, value, len * sizeof(wchar_t));
+    out[len] = L'\0';
+
+    ReleaseSRWLockShared(&ini_lock);
+
+    return (DWORD) len;
+}
+
+HRESULT ini_watch(const wchar_t *filename, ini_watch_t callback, void *ctx)
+{
+    struct ini_watch *watch;
+    wchar_t dir[MAX_PATH];
+    wchar_t *pos;
+    HRESULT hr;
+
+    assert(filename != NULL);
+    assert(callback != NULL);
+
+    /* Make sure the file is in the cache, so that there is something to
+       replace when it changes. */
+
+    AcquireSRWLockShared(&ini_lock);
+    ini_doc_get_locked(filename);
+    ReleaseSRWLockShared(&ini_lock);
+
+    AcquireSRWLockExclusive(&ini_lock);
+
+    if (ini_nwatches >= INI_MAX_WATCHES) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    hr = ini_watch_start();
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    watch = &ini_watches[ini_nwatches];
+    hr = ini_resolve_path(filename, watch->path, _countof(watch->path));
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    wcscpy_s(dir, _countof(dir), watch->path);
+    pos = wcsrchr(dir, L'\\');
+
+    if (pos != NULL) {
+        *pos = L'\0';
+    }
+
+    watch->change = FindFirstChangeNotificationW(
+            dir,
+            FALSE,
+            FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+
+    if (watch->change == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        dprintf("Config: %S: Cannot watch directory: %x\n", dir, (int) hr);
+
+        goto end;
+    }
+
+    if (!ini_get_mtime(watch->path, &watch->mtime)) {
+        memset(&watch->mtime, 0, sizeof(watch->mtime));
+    }
+
+    watch->callback = callback;
+    watch->ctx = ctx;
+
+    /* Publish the new slot, then kick the watcher so it re-reads the list */
+
+    InterlockedIncrement(&ini_nwatches);
+    SetEvent(ini_watch_wake);
+
+    dprintf("Config: Watching %S for changes\n", watch->path);
+    hr = S_OK;
+
+end:
+    ReleaseSRWLockExclusive(&ini_lock);
+
+    return hr;
+}
+
+static const struct ini_doc *ini_doc_get_locked(const wchar_t *filename)
+{
+    struct ini_file *new_mem;
+    struct ini_file *file;
+    struct ini_doc *doc;
+    wchar_t path[MAX_PATH];
+    HRESULT hr;
+
+    /* Called with the lock held shared. The common case is a file we have
+       already seen under exactly this name. */
+
+    file = ini_file_find_locked(filename, NULL);
+
+    if (file != NULL) {
+        return file->doc;
+    }
+
+    hr = ini_resolve_path(filename, path, _countof(path));
+
+    if (FAILED(hr)) {
+        return NULL;
+    }
+
+    /* Upgrade to an exclusive lock to load the file. Somebody else might have
+       loaded it in the meantime, so check again once we have it. */
+
+    ReleaseSRWLockShared(&ini_lock);
+    AcquireSRWLockExclusive(&ini_lock);
+
+    file = ini_file_find_locked(filename, path);
+
+    if (file != NULL) {
+        goto end;
+    }
+
+    hr = ini_doc_load(path, &doc);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    new_mem = realloc(ini_files, (ini_nfiles + 1) * sizeof(struct ini_file));
+
+    if (new_mem == NULL) {
+        ini_doc_free(doc);
+
+        goto end;
+    }
+
+    ini_files = new_mem;
+    file = &ini_files[ini_nfiles];
+    file->name = _wcsdup(filename);
+
+    if (file->name == NULL) {
+        ini_doc_free(doc);
+        file = NULL;
+
+        goto end;
+    }
+
+    wcscpy_s(file->path, _countof(file->path), path);
+    file->doc = doc;
+    ini_nfiles++;
+
+end:
+    ReleaseSRWLockExclusive(&ini_lock);
+    AcquireSRWLockShared(&ini_lock);
+
+    /* Look the file up again: ini_files might have moved while we weren't
+       holding the lock, but files are never removed from it. */
+
+    file = ini_file_find_locked(filename, path);
+
+    return file != NULL ? file->doc : NULL;
+}
+
+static struct ini_file *ini_file_find_locked(
+        const wchar_t *filename,
+        const wchar_t *path)
+{
+    size_t i;
+
+    for (i = 0 ; i < ini_nfiles ; i++) {
+        if (_wcsicmp(ini_files[i].name, filename) == 0) {
+            return &ini_files[i];
+        }
+
+        if (path != NULL && _wcsicmp(ini_files[i].path, path) == 0) {
+            return &ini_files[i];
+        }
+    }
+
+    return NULL;
+}
+
+static HRESULT ini_resolve_path(
+        const wchar_t *filename,
+        wchar_t *path,
+        size_t path_count)
+{
+    wchar_t windir[MAX_PATH];
+    DWORD len;
+
+    /* Like the profile APIs, a bare file name refers to the Windows
+       directory rather than the current directory. */
+
+    if (wcschr(filename, L'\\') == NULL && wcschr(filename, L'/') == NULL) {
+        len = GetWindowsDirectoryW(windir, _countof(windir));
+
+        if (len == 0 || len >= _countof(windir)) {
+            return E_FAIL;
+        }
+
+        if (swprintf_s(path, path_count, L"%s\\%s", windir, filename) < 0) {
+            return E_INVALIDARG;
+        }
+
+        return S_OK;
+    }
+
+    len = GetFullPathNameW(filename, (DWORD) path_count, path, NULL);
+
+    if (len == 0) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (len >= path_count) {
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    return S_OK;
+}
+
+static HRESULT ini_doc_load(const wchar_t *path, struct ini_doc **out)
+{
+    struct ini_doc *doc;
+    HRESULT hr;
+
+    *out = NULL;
+    doc = calloc(1, sizeof(*doc));
+
+    if (doc == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    hr = ini_read_text(path, &doc->text);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    hr = ini_doc_parse(doc);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    hr = ini_doc_index(doc);
+
+    if (FAILED(hr)) {
+        goto end;
+    }
+
+    *out = doc;
+    doc = NULL;
+
+end:
+    if (FAILED(hr)) {
+        dprintf("Config: %S: Error loading file: %x\n", path, (int) hr);
+    }
+
+    ini_doc_free(doc);
+
+    return hr;
+}
+
+static HRESULT ini_read_text(const wchar_t *path, wchar_t **out)
+{
+    LARGE_INTEGER size;
+    uint8_t *bytes;
+    wchar_t *text;
+    HANDLE file;
+    DWORD nread;
+    size_t nbytes;
+    size_t nchars;
+    size_t skip;
+    UINT code_page;
+    int result;
+    HRESULT hr;
+    BOOL ok;
+
+    *out = NULL;
+    bytes = NULL;
+    text = NULL;
+
+    file = CreateFileW(
+            path,
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            NULL,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        /* A missing file is just an empty one; every key takes its default */
+
+        if (    hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) ||
+                hr == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND)) {
+            nbytes = 0;
+
+            goto decode;
+        }
+
+        goto end;
+    }
+
+    ok = GetFileSizeEx(file, &size);
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    if (size.QuadPart > 0x1000000) {
+        hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+
+        goto end;
+    }
+
+    nbytes = (size_t) size.QuadPart;
+    bytes = malloc(nbytes + 1);
+
+    if (bytes == NULL) {
+        hr = E_OUTOFMEMORY;
+
+        goto end;
+    }
+
+    ok = ReadFile(file, bytes, (DWORD) nbytes, &nread, NULL);
+
+    if (!ok) {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+
+        goto end;
+    }
+
+    nbytes = nread;
+
+decode:
+    if (nbytes >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        nchars = (nbytes - 2) / sizeof(wchar_t);
+        text = malloc((nchars + 1) * sizeof(wchar_t));
+
+        if (text == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        memcpy(text, bytes + 2, nchars * sizeof(wchar_t));
+    } else {
+        /* As with the profile APIs, anything without a UTF-16 byte order mark
+           is read in the ANSI code page, unless it has a UTF-8 one. */
+
+        if (    nbytes >= 3 &&
+                bytes[0] == 0xEF &&
+                bytes[1] == 0xBB &&
+                bytes[2] == 0xBF) {
+            code_page = CP_UTF8;
+            skip = 3;
+        } else {
+            code_page = CP_ACP;
+            skip = 0;
+        }
+
+        nchars = 0;
+
+        if (nbytes > skip) {
+            result = MultiByteToWideChar(
+                    code_page,
+                    0,
+                    (const char *) bytes + skip,
+                    (int) (nbytes - skip),
+                    NULL,
+                    0);
+
+            if (result <= 0) {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+
+                goto end;
+            }
+
+            nchars = result;
+        }
+
+        text = malloc((nchars + 1) * sizeof(wchar_t));
+
+        if (text == NULL) {
+            hr = E_OUTOFMEMORY;
+
+            goto end;
+        }
+
+        if (nchars > 0) {
+            MultiByteToWideChar(
+                    code_page,
+                    0,
+                    (const char *) bytes + skip,
+                    (int) (nbytes - skip),
+                    text,
+                    (int) nchars);
+        }
+    }
+
+    text[nchars] = L'\0';
+    *out = text;
+    text = NULL;
+    hr = S_OK;
+
+end:
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+
+    free(text);
+    free(bytes);
+
+    return hr;
+}
+
+static HRESULT ini_doc_parse(struct ini_doc *doc)
+{
+    struct ini_entry *new_mem;
+    struct ini_entry *entry;
+    const wchar_t *section;
+    wchar_t *line;
+    wchar_t *next;
+    wchar_t *eol;
+    wchar_t *pos;
+    wchar_t *key;
+    wchar_t *value;
+    size_t capacity;
+
+    section = NULL;
+    capacity = 0;
+
+    for (line = doc->text ; *line != L'\0' ; line = next) {
+        eol = line;
+
+        while (*eol != L'\0' && *eol != L'\n') {
+            eol++;
+        }
+
+        next = *eol != L'\0' ? eol + 1 : eol;
+
+        if (eol > line && eol[-1] == L'\r') {
+            eol--;
+        }
+
+        line = ini_trim(line, eol);
+
+        if (*line == L'\0' || *line == L';') {
+            continue;
+        }
+
+        if (*line == L'[') {
+            pos = wcschr(line, L']');
+
+            if (pos == NULL) {
+                continue;
+            }
+
+            section = ini_trim(line + 1, pos);
+
+            continue;
+        }
+
+        pos = wcschr(line, L'=');
+
+        if (pos == NULL || section == NULL) {
+            continue;
+        }
+
+        key = ini_trim(line, pos);
+        value = ini_trim(pos + 1, pos + 1 + wcslen(pos + 1));
+
+        if (*key == L'\0') {
+            continue;
+        }
+
+        /* Strip one pair of matching quotes */
+
+        pos = value + wcslen(value);
+
+        if (    pos - value >= 2 &&
+                (*value == L'"' || *value == L'\'') &&
+                pos[-1] == *value) {
+            pos[-1] = L'\0';
+            value++;
+        }
+
+        if (doc->nentries == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            new_mem = realloc(doc->entries, capacity * sizeof(*new_mem));
+
+            if (new_mem == NULL) {
+                return E_OUTOFMEMORY;
+            }
+
+            doc->entries = new_mem;
+        }
+
+        entry = &doc->entries[doc->nentries++];
+        entry->section = section;
+        entry->key = key;
+        entry->value = value;
+    }
+
+    return S_OK;
+}
+
+static HRESULT ini_doc_index(struct ini_doc *doc)
+{
+    const struct ini_entry *entry;
+    const struct ini_entry *other;
+    uint32_t pos;
+    size_t mask;
+    size_t i;
+    size_t j;
+
+    doc->index_size = 16;
+
+    while (doc->index_size < doc->nentries * 2) {
+        doc->index_size *= 2;
+    }
+
+    doc->index = calloc(doc->index_size, sizeof(uint32_t));
+
+    if (doc->index == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    mask = doc->index_size - 1;
+
+    for (i = 0 ; i < doc->nentries ; i++) {
+        entry = &doc->entries[i];
+        j = ini_hash(entry->section, entry->key) & mask;
+
+        /* First occurrence of a key wins, as with the profile APIs */
+
+        while ((pos = doc->index[j]) != 0) {
+            other = &doc->entries[pos - 1];
+
+            if (    _wcsicmp(other->section, entry->section) == 0 &&
+                    _wcsicmp(other->key, entry->key) == 0) {
+                break;
+            }
+
+            j = (j + 1) & mask;
+        }
+
+        if (pos == 0) {
+            doc->index[j] = (uint32_t) (i + 1);
+        }
+    }
+
+    return S_OK;
+}
+
+static void ini_doc_free(struct ini_doc *doc)
+{
+    if (doc == NULL) {
+        return;
+    }
+
+    free(doc->index);
+    free(doc->entries);
+    free(doc->text);
+    free(doc);
+}
+
+static wchar_t *ini_trim(wchar_t *begin, wchar_t *end)
+{
+    while (begin < end && iswspace(*begin)) {
+        begin++;
+    }
+
+    while (end > begin && iswspace(end[-1])) {
+        end--;
+    }
+
+    *end = L'\0';
+
+    return begin;
+}
+
+static uint32_t ini_hash(const wchar_t *section, const wchar_t *key)
+{
+    uint32_t hash;
+
+    /* FNV-1a over the case-folded section and key, with a separator */
+
+    hash = 0x811C9DC5;
+
+    for ( ; *section != L'\0' ; section++) {
+        hash ^= (uint32_t) towlower(*section);
+        hash *= 0x01000193;
+    }
+
+    hash ^= L'=';
+    hash *= 0x01000193;
+
+    for ( ; *key != L'\0' ; key++) {
+        hash ^= (uint32_t) towlower(*key);
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static const wchar_t *ini_doc_lookup(
+        const struct ini_doc *doc,
+        const wchar_t *section,
+        const wchar_t *key)
+{
+    const struct ini_entry *entry;
+    uint32_t pos;
+    size_t mask;
+    size_t j;
+
+    mask = doc->index_size - 1;
+    j = ini_hash(section, key) & mask;
+
+    while ((pos = doc->index[j]) != 0) {
+        entry = &doc->entries[pos - 1];
+
+        if (    _wcsicmp(entry->section, section) == 0 &&
+                _wcsicmp(entry->key, key) == 0) {
+            return entry->value;
+        }
+
+        j = (j + 1) & mask;
+    }
+
+    return NULL;
+}
+
+static UINT ini_parse_int(const wchar_t *str, INT def)
+{
+    unsigned int base;
+    unsigned int digit;
+    UINT result;
+    bool neg;
+
+    /* Same rules as GetPrivateProfileIntW: an optional sign, an optional 0x,
+       0o or 0b radix prefix, then digits up to the first one that doesn't
+       fit. An empty value means the default. */
+
+    if (*str == L'\0') {
+        return (UINT) def;
+    }
+
+    neg = false;
+
+    if (*str == L'-' || *str == L'+') {
+        neg = *str == L'-';
+        str++;
+    }
+
+    base = 10;
+
+    if (str[0] == L'0') {
+        switch (towlower(str[1])) {
+        case L'x':
+            base = 16;
+            str += 2;
+
+            break;
+
+        case L'o':
+            base = 8;
+            str += 2;
+
+            break;
+
+        case L'b':
+            base = 2;
+            str += 2;
+
+            break;
+        }
+    }
+
+    for (result = 0 ; ; str++) {
+        if (*str >= L'0' && *str <= L'9') {
+            digit = *str - L'0';
+        } else if (*str >= L'a' && *str <= L'f') {
+            digit = *str - L'a' + 10;
+        } else if (*str >= L'A' && *str <= L'F') {
+            digit = *str - L'A' + 10;
+        } else {
+            break;
+        }
+
+        if (digit >= base) {
+            break;
+        }
+
+        result = result * base + digit;
+    }
+
+    return neg ? (UINT) -(INT) result : result;
+}
+
+static HRESULT ini_watch_start(void)
+{
+    /* Called with the lock held exclusively */
+
+    if (ini_watch_thread != NULL) {
+        return S_OK;
+    }
+
+    ini_watch_wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+    if (ini_watch_wake == NULL) {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    ini_watch_thread = (HANDLE) _beginthreadex(
+            NULL,
+            0,
+            ini_watch_thread_proc,
+            NULL,
+            0,
+            NULL);
+
+    if (ini_watch_thread == NULL) {
+        CloseHandle(ini_watch_wake);
+        ini_watch_wake = NULL;
+
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+static unsigned int __stdcall ini_watch_thread_proc(void *ctx)
+{
+    HANDLE handles[INI_MAX_WATCHES + 1];
+    struct ini_watch *watch;
+    DWORD result;
+    LONG nwatches;
+    LONG i;
+
+    for (;;) {
+        /* Slots are filled in before ini_nwatches is bumped and never change
+           afterwards, so the first nwatches entries are safe to read. */
+
+        nwatches = ini_nwatches;
+        handles[0] = ini_watch_wake;
+
+        for (i = 0 ; i < nwatches ; i++) {
+            handles[i + 1] = ini_watches[i].change;
+        }
+
+        result = WaitForMultipleObjects(
+                (DWORD) nwatches + 1,
+                handles,
+                FALSE,
+                INFINITE);
+
+        if (result == WAIT_OBJECT_0) {
+            continue;
+        }
+
+        if (result > WAIT_OBJECT_0 + (DWORD) nwatches) {
+            dprintf("Config: Watcher wait failed: %x\n",
+                    (int) GetLastError());
+
+            break;
+        }
+
+        watch = &ini_watches[result - WAIT_OBJECT_0 - 1];
+        Sleep(INI_WATCH_SETTLE_MS);
+        FindNextChangeNotification(watch->change);
+        ini_watch_check(watch);
+    }
+
+    return 0;
+}
+
+static void ini_watch_check(struct ini_watch *watch)
+{
+    FILETIME mtime;
+
+    /* The notification covers the whole directory, so check that it was
+       actually our file that changed. */
+
+    if (!ini_get_mtime(watch->path, &mtime)) {
+        return;
+    }
+
+    if (CompareFileTime(&mtime, &watch->mtime) == 0) {
+        return;
+    }
+
+    watch->mtime = mtime;
+
+    dprintf("Config: %S changed, reloading\n", watch->path);
+    ini_reload(watch->path);
+    watch->callback(watch->ctx);
+}
+
+static void ini_reload(const wchar_t *path)
+{
+    struct ini_file *file;
+    struct ini_doc *doc;
+    struct ini_doc *old;
+    HRESULT hr;
+
+    /* Parse outside the lock so that lookups carry on in the meantime. A
+       file that fails to parse leaves the previous contents in place. */
+
+    hr = ini_doc_load(path, &doc);
+
+    if (FAILED(hr)) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&ini_lock);
+
+    file = ini_file_find_locked(path, path);
+
+    if (file != NULL) {
+        old = file->doc;
+        file->doc = doc;
+        doc = old;
+    }
+
+    ReleaseSRWLockExclusive(&ini_lock);
+
+    /* Lookups copy values out while holding the lock, so nobody can still be
+       looking at the old contents. */
+
+    ini_doc_free(doc);
+}
+
+static bool ini_get_mtime(const wchar_t *path, FILETIME *mtime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &attrs)) {
+        return false;
+    }
+
+    *mtime = attrs.ftLastWriteTime;
+
+    return true;
+}
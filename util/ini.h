@@ -0,0 +1,51 @@
+#pragma once
+
+#include <windows.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Cached replacements for GetPrivateProfileIntW/GetPrivateProfileStringW.
+
+   Each INI file is read and parsed once, on first use, into an in-memory
+   table indexed by (section, key); later lookups against the same file never
+   touch the disk. Argument order and lookup semantics follow the Win32
+   functions they replace: section and key names are case-insensitive, the
+   first occurrence of a key wins, values are trimmed and lose one pair of
+   enclosing quotes, and integer values may be written in hex with a 0x
+   prefix. Lines starting with ; are comments.
+
+   The cache lives in whichever image links util, so a hook DLL and the IO
+   libraries linked into it share a single parse of segatools.ini. */
+
+UINT ini_get_int(
+        const wchar_t *section,
+        const wchar_t *key,
+        INT def,
+        const wchar_t *filename);
+
+DWORD ini_get_string(
+        const wchar_t *section,
+        const wchar_t *key,
+        const wchar_t *def,
+        wchar_t *out,
+        DWORD nchars,
+        const wchar_t *filename);
+
+/* Called on the watcher thread after a watched file has been re-read. By the
+   time this runs, lookups against the file already return its new contents;
+   a typical callback loads its config into a fresh struct and publishes that
+   with a pointer swap.
+
+   Pollers read the published pointer without taking a lock, so there is no
+   point at which the struct it replaced is known to be unused. Callbacks
+   therefore never free the old struct. The leak is bounded by how often the
+   file gets edited by hand. */
+
+typedef void (*ini_watch_t)(void *ctx);
+
+/* Watch an INI file for changes. Whenever its modification time changes the
+   file is parsed again and the cached copy is replaced, then the callback
+   runs. Files that are never watched are only read once. */
+
+HRESULT ini_watch(const wchar_t *filename, ini_watch_t callback, void *ctx);